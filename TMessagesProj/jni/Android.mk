@@ -103,9 +103,11 @@ LOCAL_SRC_FILES := \
 ./libtgvoip/BufferOutputStream.cpp \
 ./libtgvoip/BlockingQueue.cpp \
 ./libtgvoip/audio/AudioInput.cpp \
+./libtgvoip/audio/AudioInputFile.cpp \
 ./libtgvoip/os/android/AudioInputOpenSLES.cpp \
 ./libtgvoip/MediaStreamItf.cpp \
 ./libtgvoip/audio/AudioOutput.cpp \
+./libtgvoip/audio/AudioOutputFile.cpp \
 ./libtgvoip/OpusEncoder.cpp \
 ./libtgvoip/os/android/AudioOutputOpenSLES.cpp \
 ./libtgvoip/JitterBuffer.cpp \
@@ -258,7 +260,7 @@ include $(BUILD_STATIC_LIBRARY)
 
 include $(CLEAR_VARS)
 
-LOCAL_CFLAGS := -Wall -DANDROID -DHAVE_MALLOC_H -DHAVE_PTHREAD -DWEBP_USE_THREAD -finline-functions -ffast-math -ffunction-sections -fdata-sections -O0
+LOCAL_CFLAGS := -Wall -DANDROID -DHAVE_MALLOC_H -DHAVE_PTHREAD -DWEBP_USE_THREAD -finline-functions -ffast-math -ffunction-sections -fdata-sections -O2
 LOCAL_C_INCLUDES += ./jni/libwebp/src
 LOCAL_ARM_MODE := arm
 LOCAL_STATIC_LIBRARIES := cpufeatures
@@ -6,8 +6,23 @@
 #include <time.h>
 #include <opusfile.h>
 #include <math.h>
+#include <string.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
 #include "utils.h"
 
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define WAVEFORM_NEON
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define WAVEFORM_SSE2
+#endif
+
 typedef struct {
     int version;
     int channels; /* Number of channels: 1..255 */
@@ -213,10 +228,160 @@ static void comment_pad(char **comments, int* length, int amount) {
     }
 }
 
-static int writeOggPage(ogg_page *page, FILE *os) {
-    int written = fwrite(page->header, sizeof(unsigned char), page->header_len, os);
-    written += fwrite(page->body, sizeof(unsigned char), page->body_len, os);
-    return written;
+// Waveforms are 100 peaks packed as 5-bit values. The builder is fed PCM in pieces: with a known
+// length it reproduces the fixed windows of the old two-pass code, without one (while recording)
+// it keeps twice as many buckets and merges neighbours each time they fill up.
+#define WAVEFORM_SAMPLES 100
+#define WAVEFORM_BUCKETS (WAVEFORM_SAMPLES * 2)
+#define WAVEFORM_BYTES ((WAVEFORM_SAMPLES * 5 + 7) / 8)
+
+typedef struct {
+    int64_t totalSamples;
+    int64_t windowSize;
+    int64_t sampleIndex;
+    uint16_t peakSample;
+    int index;
+    uint16_t samples[WAVEFORM_BUCKETS];
+} WaveformBuilder;
+
+static void waveformInit(WaveformBuilder *w, int64_t totalSamples) {
+    memset(w, 0, sizeof(WaveformBuilder));
+    w->totalSamples = totalSamples;
+    w->windowSize = totalSamples > 0 ? max(1, totalSamples / WAVEFORM_SAMPLES) : 1;
+}
+
+static uint16_t absMax(const int16_t *pcm, int count) {
+    uint16_t peak = 0;
+    int i = 0;
+#if defined(WAVEFORM_NEON)
+    if (count >= 8) {
+        uint16x8_t m = vdupq_n_u16(0);
+        for (; i + 8 <= count; i += 8) {
+            m = vmaxq_u16(m, vreinterpretq_u16_s16(vabsq_s16(vld1q_s16(pcm + i))));
+        }
+        uint16x4_t m4 = vmax_u16(vget_low_u16(m), vget_high_u16(m));
+        m4 = vpmax_u16(m4, m4);
+        m4 = vpmax_u16(m4, m4);
+        peak = vget_lane_u16(m4, 0);
+    }
+#elif defined(WAVEFORM_SSE2)
+    if (count >= 8) {
+        // SSE2 only has a signed 16-bit max, so the unsigned magnitudes are biased by 0x8000
+        const __m128i bias = _mm_set1_epi16((short) 0x8000);
+        __m128i m = bias;
+        for (; i + 8 <= count; i += 8) {
+            __m128i x = _mm_loadu_si128((const __m128i *) (pcm + i));
+            __m128i sign = _mm_srai_epi16(x, 15);
+            __m128i a = _mm_sub_epi16(_mm_xor_si128(x, sign), sign);
+            m = _mm_max_epi16(m, _mm_xor_si128(a, bias));
+        }
+        m = _mm_max_epi16(m, _mm_srli_si128(m, 8));
+        m = _mm_max_epi16(m, _mm_srli_si128(m, 4));
+        m = _mm_max_epi16(m, _mm_srli_si128(m, 2));
+        peak = (uint16_t) (_mm_cvtsi128_si32(m) ^ 0x8000);
+    }
+#endif
+    for (; i < count; i++) {
+        uint16_t sample = (uint16_t) abs(pcm[i]);
+        if (sample > peak) {
+            peak = sample;
+        }
+    }
+    return peak;
+}
+
+static void waveformFeed(WaveformBuilder *w, const int16_t *pcm, int count) {
+    while (count > 0) {
+        // the sample that closes the current window, inclusive
+        int64_t windowEnd;
+        if (w->totalSamples > 0) {
+            windowEnd = (w->sampleIndex + w->windowSize - 1) / w->windowSize * w->windowSize;
+        } else {
+            windowEnd = (w->index + 1) * w->windowSize - 1;
+        }
+        int span = (int) min((int64_t) count, windowEnd - w->sampleIndex + 1);
+        uint16_t peak = absMax(pcm, span);
+        if (peak > w->peakSample) {
+            w->peakSample = peak;
+        }
+        w->sampleIndex += span;
+        pcm += span;
+        count -= span;
+        if (w->sampleIndex != windowEnd + 1) {
+            continue;
+        }
+        
+        if (w->totalSamples > 0) {
+            if (w->index < WAVEFORM_SAMPLES) {
+                w->samples[w->index++] = w->peakSample;
+            }
+        } else {
+            w->samples[w->index++] = w->peakSample;
+            if (w->index == WAVEFORM_BUCKETS) {
+                for (int i = 0; i < WAVEFORM_BUCKETS / 2; i++) {
+                    w->samples[i] = max(w->samples[i * 2], w->samples[i * 2 + 1]);
+                }
+                w->index = WAVEFORM_BUCKETS / 2;
+                w->windowSize *= 2;
+            }
+        }
+        w->peakSample = 0;
+    }
+}
+
+static inline void set_bits(uint8_t *bytes, int32_t bitOffset, int32_t value) {
+    bytes += bitOffset / 8;
+    bitOffset %= 8;
+    bytes[0] |= (uint8_t) (value << bitOffset);
+    if (bitOffset > 3) {
+        bytes[1] |= (uint8_t) (value >> (8 - bitOffset));
+    }
+}
+
+static void waveformFinish(WaveformBuilder *w, uint8_t *bytes) {
+    uint16_t samples[WAVEFORM_SAMPLES];
+    if (w->totalSamples > 0) {
+        memcpy(samples, w->samples, sizeof(samples));
+    } else {
+        int count = w->index;
+        if (w->sampleIndex > (int64_t) count * w->windowSize) {
+            w->samples[count++] = w->peakSample;
+        }
+        for (int i = 0; i < WAVEFORM_SAMPLES; i++) {
+            int from = i * count / WAVEFORM_SAMPLES;
+            int to = max(from + 1, (i + 1) * count / WAVEFORM_SAMPLES);
+            uint16_t peak = 0;
+            for (int j = from; j < to && j < count; j++) {
+                peak = max(peak, w->samples[j]);
+            }
+            samples[i] = peak;
+        }
+    }
+    
+    int64_t sumSamples = 0;
+    for (int i = 0; i < WAVEFORM_SAMPLES; i++) {
+        sumSamples += samples[i];
+    }
+    uint16_t peak = (uint16_t) (sumSamples * 1.8f / WAVEFORM_SAMPLES);
+    if (peak < 2500) {
+        peak = 2500;
+    }
+    
+    memset(bytes, 0, WAVEFORM_BYTES);
+    for (int i = 0; i < WAVEFORM_SAMPLES; i++) {
+        // min() from utils.h is not parenthesized, so it can not be nested inside an expression
+        uint16_t sample = samples[i] > peak ? peak : samples[i];
+        int32_t value = min(31, sample * 31 / peak);
+        set_bits(bytes, i * 5, value & 31);
+    }
+}
+
+static jbyteArray waveformToArray(JNIEnv *env, const uint8_t *bytes) {
+    jbyteArray result = (*env)->NewByteArray(env, WAVEFORM_BYTES);
+    if (result != 0) {
+        (*env)->SetByteArrayRegion(env, result, 0, WAVEFORM_BYTES, (const jbyte *) bytes);
+    }
+    return result;
 }
 
 const opus_int32 bitrate = 16000;
@@ -226,428 +391,729 @@ const int with_cvbr = 1;
 const int max_ogg_delay = 0;
 const int comment_padding = 512;
 
-opus_int32 coding_rate = 16000;
-ogg_int32_t _packetId;
-OpusEncoder *_encoder = 0;
-uint8_t *_packet = 0;
-ogg_stream_state os;
-FILE *_fileOs = 0;
-oe_enc_opt inopt;
-OpusHeader header;
-opus_int32 min_bytes;
-int max_frame_bytes;
-ogg_packet op;
-ogg_page og;
-opus_int64 bytes_written;
-opus_int64 pages_out;
-opus_int64 total_samples;
-ogg_int64_t enc_granulepos;
-ogg_int64_t last_granulepos;
-int size_segments;
-int last_segments;
-
-void cleanupRecorder() {
-    
-    ogg_stream_flush(&os, &og);
-    
-    if (_encoder) {
-        opus_encoder_destroy(_encoder);
-        _encoder = 0;
-    }
-    
-    ogg_stream_clear(&os);
-    
-    if (_packet) {
-        free(_packet);
-        _packet = 0;
-    }
-    
-    if (_fileOs) {
-        fclose(_fileOs);
-        _fileOs = 0;
-    }
-    
-    _packetId = -1;
-    bytes_written = 0;
-    pages_out = 0;
-    total_samples = 0;
-    enc_granulepos = 0;
-    size_segments = 0;
-    last_segments = 0;
-    last_granulepos = 0;
-    memset(&os, 0, sizeof(ogg_stream_state));
-    memset(&inopt, 0, sizeof(oe_enc_opt));
-    memset(&header, 0, sizeof(OpusHeader));
-    memset(&op, 0, sizeof(ogg_packet));
-    memset(&og, 0, sizeof(ogg_page));
-}
-
-int initRecorder(const char *path) {
-    cleanupRecorder();
+// Frames from the capture side are copied into a preallocated arena and handed to an encoder
+// thread through a single-producer ring, so writeFrame never encodes or touches the file.
+// With max_ogg_delay at 0 every frame ends its own page, which is written out as soon as it's
+// finished, so a crash of the app loses at most the frame being encoded. fdatasync only runs
+// every RECORDER_SYNC_FRAMES frames (3 s of 60 ms frames), which bounds what a power loss can take.
+#define RECORDER_RING_FRAMES 64
+#define RECORDER_SYNC_FRAMES 50
+
+// Recorders and players are independent instances, so several voice messages can be recorded,
+// played or preloaded at the same time.
+typedef struct {
+    opus_int32 coding_rate;
+    ogg_int32_t packetId;
+    OpusEncoder *encoder;
+    uint8_t *packet;
+    uint8_t *paddedFrame;
+    ogg_stream_state os;
+    int fd;
+    int framesSinceSync;
+    oe_enc_opt inopt;
+    OpusHeader header;
+    opus_int32 min_bytes;
+    int max_frame_bytes;
+    ogg_packet op;
+    ogg_page og;
+    opus_int64 bytes_written;
+    opus_int64 pages_out;
+    opus_int64 total_samples;
+    ogg_int64_t enc_granulepos;
+    ogg_int64_t last_granulepos;
+    int size_segments;
+    int last_segments;
+    WaveformBuilder waveform;
+    uint8_t *frameArena;
+    int frameLengths[RECORDER_RING_FRAMES];
+    int ringHead;
+    int ringTail;
+    sem_t framesReady;
+    sem_t slotsFree;
+    int semaphoresReady;
+    pthread_t thread;
+    int threadStarted;
+    int failed;
+} OpusRecorder;
+
+// Writes a whole page with as few syscalls as possible. Returns its size or -1.
+static int writeOggPage(OpusRecorder *r, ogg_page *page) {
+    struct iovec parts[2] = {{page->header, (size_t) page->header_len}, {page->body, (size_t) page->body_len}};
+    struct iovec *part = parts;
+    int count = 2;
+    while (count > 0) {
+        ssize_t written = writev(r->fd, part, count);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LOGE("Error: failed writing to output stream: %s", strerror(errno));
+            return -1;
+        }
+        while (count > 0 && (size_t) written >= part->iov_len) {
+            written -= part->iov_len;
+            part++;
+            count--;
+        }
+        if (count > 0) {
+            part->iov_base = (uint8_t *) part->iov_base + written;
+            part->iov_len -= written;
+        }
+    }
+    return page->header_len + page->body_len;
+}
+
+static inline void semWait(sem_t *sem) {
+    while (sem_wait(sem) != 0 && errno == EINTR) {
+    }
+}
+
+static int encodeFrame(OpusRecorder *r, uint8_t *framePcmBytes, unsigned int frameByteCount);
+
+static void *recorderEncodeThread(void *arg) {
+    OpusRecorder *r = (OpusRecorder *) arg;
+    while (1) {
+        semWait(&r->framesReady);
+        int tail = r->ringTail;
+        if (tail == __atomic_load_n(&r->ringHead, __ATOMIC_ACQUIRE)) {
+            // destroyRecorder posts once more after the last frame
+            break;
+        }
+        int slot = tail % RECORDER_RING_FRAMES;
+        if (!__atomic_load_n(&r->failed, __ATOMIC_RELAXED) && !encodeFrame(r, r->frameArena + slot * frame_size * 2, r->frameLengths[slot])) {
+            __atomic_store_n(&r->failed, 1, __ATOMIC_RELEASE);
+        }
+        __atomic_store_n(&r->ringTail, tail + 1, __ATOMIC_RELEASE);
+        sem_post(&r->slotsFree);
+    }
+    return 0;
+}
+
+void destroyRecorder(OpusRecorder *r) {
+    if (!r) {
+        return;
+    }
+    
+    if (r->threadStarted) {
+        sem_post(&r->framesReady);
+        pthread_join(r->thread, NULL);
+    }
+    
+    if (r->encoder) {
+        while (ogg_stream_flush(&r->os, &r->og)) {
+            writeOggPage(r, &r->og);
+        }
+        opus_encoder_destroy(r->encoder);
+    }
+    
+    ogg_stream_clear(&r->os);
+    
+    if (r->fd >= 0) {
+        fdatasync(r->fd);
+        close(r->fd);
+    }
+    
+    if (r->semaphoresReady) {
+        sem_destroy(&r->framesReady);
+        sem_destroy(&r->slotsFree);
+    }
     
+    free(r->packet);
+    free(r->paddedFrame);
+    free(r->frameArena);
+    free(r);
+}
+
+OpusRecorder *createRecorder(const char *path) {
     if (!path) {
         return 0;
     }
     
-    _fileOs = fopen(path, "wb");
-    if (!_fileOs) {
+    OpusRecorder *r = calloc(1, sizeof(OpusRecorder));
+    if (!r) {
         return 0;
     }
+    r->packetId = -1;
+    r->coding_rate = 16000;
+    r->fd = -1;
+    waveformInit(&r->waveform, 0);
     
-    inopt.rate = rate;
-    inopt.gain = 0;
-    inopt.endianness = 0;
-    inopt.copy_comments = 0;
-    inopt.rawmode = 1;
-    inopt.ignorelength = 1;
-    inopt.samplesize = 16;
-    inopt.channels = 1;
-    inopt.skip = 0;
+    if (sem_init(&r->framesReady, 0, 0) != 0) {
+        destroyRecorder(r);
+        return 0;
+    }
+    if (sem_init(&r->slotsFree, 0, RECORDER_RING_FRAMES) != 0) {
+        sem_destroy(&r->framesReady);
+        destroyRecorder(r);
+        return 0;
+    }
+    r->semaphoresReady = 1;
     
-    comment_init(&inopt.comments, &inopt.comments_length, opus_get_version_string());
+    r->frameArena = malloc(RECORDER_RING_FRAMES * frame_size * 2);
+    if (!r->frameArena) {
+        destroyRecorder(r);
+        return 0;
+    }
+    
+    r->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (r->fd < 0) {
+        destroyRecorder(r);
+        return 0;
+    }
+    
+    r->inopt.rate = rate;
+    r->inopt.gain = 0;
+    r->inopt.endianness = 0;
+    r->inopt.copy_comments = 0;
+    r->inopt.rawmode = 1;
+    r->inopt.ignorelength = 1;
+    r->inopt.samplesize = 16;
+    r->inopt.channels = 1;
+    r->inopt.skip = 0;
+    
+    comment_init(&r->inopt.comments, &r->inopt.comments_length, opus_get_version_string());
     
     if (rate > 24000) {
-        coding_rate = 48000;
+        r->coding_rate = 48000;
     } else if (rate > 16000) {
-        coding_rate = 24000;
+        r->coding_rate = 24000;
     } else if (rate > 12000) {
-        coding_rate = 16000;
+        r->coding_rate = 16000;
     } else if (rate > 8000) {
-        coding_rate = 12000;
+        r->coding_rate = 12000;
     } else {
-        coding_rate = 8000;
+        r->coding_rate = 8000;
     }
     
-    if (rate != coding_rate) {
+    if (rate != r->coding_rate) {
         LOGE("Invalid rate");
+        free(r->inopt.comments);
+        destroyRecorder(r);
         return 0;
     }
     
-    header.channels = 1;
-    header.channel_mapping = 0;
-    header.input_sample_rate = rate;
-    header.gain = inopt.gain;
-    header.nb_streams = 1;
+    r->header.channels = 1;
+    r->header.channel_mapping = 0;
+    r->header.input_sample_rate = rate;
+    r->header.gain = r->inopt.gain;
+    r->header.nb_streams = 1;
     
     int result = OPUS_OK;
-    _encoder = opus_encoder_create(coding_rate, 1, OPUS_APPLICATION_AUDIO, &result);
+    r->encoder = opus_encoder_create(r->coding_rate, 1, OPUS_APPLICATION_AUDIO, &result);
     if (result != OPUS_OK) {
         LOGE("Error cannot create encoder: %s", opus_strerror(result));
+        r->encoder = 0;
+        free(r->inopt.comments);
+        destroyRecorder(r);
         return 0;
     }
     
-    min_bytes = max_frame_bytes = (1275 * 3 + 7) * header.nb_streams;
-    _packet = malloc(max_frame_bytes);
+    r->min_bytes = r->max_frame_bytes = (1275 * 3 + 7) * r->header.nb_streams;
+    r->packet = malloc(r->max_frame_bytes);
+    r->paddedFrame = malloc(frame_size * 2);
     
-    result = opus_encoder_ctl(_encoder, OPUS_SET_BITRATE(bitrate));
+    result = opus_encoder_ctl(r->encoder, OPUS_SET_BITRATE(bitrate));
     if (result != OPUS_OK) {
         LOGE("Error OPUS_SET_BITRATE returned: %s", opus_strerror(result));
+        free(r->inopt.comments);
+        destroyRecorder(r);
         return 0;
     }
     
 #ifdef OPUS_SET_LSB_DEPTH
-    result = opus_encoder_ctl(_encoder, OPUS_SET_LSB_DEPTH(max(8, min(24, inopt.samplesize))));
+    result = opus_encoder_ctl(r->encoder, OPUS_SET_LSB_DEPTH(max(8, min(24, r->inopt.samplesize))));
     if (result != OPUS_OK) {
         LOGE("Warning OPUS_SET_LSB_DEPTH returned: %s", opus_strerror(result));
     }
 #endif
     
     opus_int32 lookahead;
-    result = opus_encoder_ctl(_encoder, OPUS_GET_LOOKAHEAD(&lookahead));
+    result = opus_encoder_ctl(r->encoder, OPUS_GET_LOOKAHEAD(&lookahead));
     if (result != OPUS_OK) {
         LOGE("Error OPUS_GET_LOOKAHEAD returned: %s", opus_strerror(result));
+        free(r->inopt.comments);
+        destroyRecorder(r);
         return 0;
     }
     
-    inopt.skip += lookahead;
-    header.preskip = (int)(inopt.skip * (48000.0 / coding_rate));
-    inopt.extraout = (int)(header.preskip * (rate / 48000.0));
+    r->inopt.skip += lookahead;
+    r->header.preskip = (int)(r->inopt.skip * (48000.0 / r->coding_rate));
+    r->inopt.extraout = (int)(r->header.preskip * (rate / 48000.0));
     
-    if (ogg_stream_init(&os, rand()) == -1) {
+    if (ogg_stream_init(&r->os, rand()) == -1) {
         LOGE("Error: stream init failed");
+        free(r->inopt.comments);
+        destroyRecorder(r);
         return 0;
     }
     
     unsigned char header_data[100];
-    int packet_size = opus_header_to_packet(&header, header_data, 100);
-    op.packet = header_data;
-    op.bytes = packet_size;
-    op.b_o_s = 1;
-    op.e_o_s = 0;
-    op.granulepos = 0;
-    op.packetno = 0;
-    ogg_stream_packetin(&os, &op);
-    
-    while ((result = ogg_stream_flush(&os, &og))) {
+    int packet_size = opus_header_to_packet(&r->header, header_data, 100);
+    r->op.packet = header_data;
+    r->op.bytes = packet_size;
+    r->op.b_o_s = 1;
+    r->op.e_o_s = 0;
+    r->op.granulepos = 0;
+    r->op.packetno = 0;
+    ogg_stream_packetin(&r->os, &r->op);
+    
+    while ((result = ogg_stream_flush(&r->os, &r->og))) {
         if (!result) {
             break;
         }
         
-        int pageBytesWritten = writeOggPage(&og, _fileOs);
-        if (pageBytesWritten != og.header_len + og.body_len) {
+        int pageBytesWritten = writeOggPage(r, &r->og);
+        if (pageBytesWritten != r->og.header_len + r->og.body_len) {
             LOGE("Error: failed writing header to output stream");
+            free(r->inopt.comments);
+            destroyRecorder(r);
             return 0;
         }
-        bytes_written += pageBytesWritten;
-        pages_out++;
+        r->bytes_written += pageBytesWritten;
+        r->pages_out++;
     }
     
-    comment_pad(&inopt.comments, &inopt.comments_length, comment_padding);
-    op.packet = (unsigned char *)inopt.comments;
-    op.bytes = inopt.comments_length;
-    op.b_o_s = 0;
-    op.e_o_s = 0;
-    op.granulepos = 0;
-    op.packetno = 1;
-    ogg_stream_packetin(&os, &op);
+    comment_pad(&r->inopt.comments, &r->inopt.comments_length, comment_padding);
+    r->op.packet = (unsigned char *)r->inopt.comments;
+    r->op.bytes = r->inopt.comments_length;
+    r->op.b_o_s = 0;
+    r->op.e_o_s = 0;
+    r->op.granulepos = 0;
+    r->op.packetno = 1;
+    ogg_stream_packetin(&r->os, &r->op);
     
-    while ((result = ogg_stream_flush(&os, &og))) {
+    while ((result = ogg_stream_flush(&r->os, &r->og))) {
         if (result == 0) {
             break;
         }
         
-        int writtenPageBytes = writeOggPage(&og, _fileOs);
-        if (writtenPageBytes != og.header_len + og.body_len) {
+        int writtenPageBytes = writeOggPage(r, &r->og);
+        if (writtenPageBytes != r->og.header_len + r->og.body_len) {
             LOGE("Error: failed writing header to output stream");
+            free(r->inopt.comments);
+            destroyRecorder(r);
             return 0;
         }
         
-        bytes_written += writtenPageBytes;
-        pages_out++;
+        r->bytes_written += writtenPageBytes;
+        r->pages_out++;
     }
     
-    free(inopt.comments);
+    free(r->inopt.comments);
+    r->inopt.comments = 0;
     
-    return 1;
+    // without the thread frames are encoded by the caller
+    r->threadStarted = pthread_create(&r->thread, NULL, recorderEncodeThread, r) == 0;
+    
+    return r;
 }
 
-int writeFrame(uint8_t *framePcmBytes, unsigned int frameByteCount) {
+static int encodeFrame(OpusRecorder *r, uint8_t *framePcmBytes, unsigned int frameByteCount) {
     int cur_frame_size = frame_size;
-    _packetId++;
+    r->packetId++;
     
     opus_int32 nb_samples = frameByteCount / 2;
-    total_samples += nb_samples;
+    r->total_samples += nb_samples;
     if (nb_samples < frame_size) {
-        op.e_o_s = 1;
+        r->op.e_o_s = 1;
     } else {
-        op.e_o_s = 0;
+        r->op.e_o_s = 0;
     }
     
     int nbBytes = 0;
     
     if (nb_samples != 0) {
         uint8_t *paddedFrameBytes = framePcmBytes;
-        int freePaddedFrameBytes = 0;
         
         if (nb_samples < cur_frame_size) {
-            paddedFrameBytes = malloc(cur_frame_size * 2);
-            freePaddedFrameBytes = 1;
+            paddedFrameBytes = r->paddedFrame;
             memcpy(paddedFrameBytes, framePcmBytes, frameByteCount);
             memset(paddedFrameBytes + nb_samples * 2, 0, cur_frame_size * 2 - nb_samples * 2);
         }
         
-        nbBytes = opus_encode(_encoder, (opus_int16 *)paddedFrameBytes, cur_frame_size, _packet, max_frame_bytes / 10);
-        if (freePaddedFrameBytes) {
-            free(paddedFrameBytes);
-            paddedFrameBytes = NULL;
-        }
+        nbBytes = opus_encode(r->encoder, (opus_int16 *)paddedFrameBytes, cur_frame_size, r->packet, r->max_frame_bytes / 10);
         
         if (nbBytes < 0) {
             LOGE("Encoding failed: %s. Aborting.", opus_strerror(nbBytes));
             return 0;
         }
         
-        enc_granulepos += cur_frame_size * 48000 / coding_rate;
-        size_segments = (nbBytes + 255) / 255;
-        min_bytes = min(nbBytes, min_bytes);
+        r->enc_granulepos += cur_frame_size * 48000 / r->coding_rate;
+        r->size_segments = (nbBytes + 255) / 255;
+        r->min_bytes = min(nbBytes, r->min_bytes);
     }
     
-    while ((((size_segments <= 255) && (last_segments + size_segments > 255)) || (enc_granulepos - last_granulepos > max_ogg_delay)) && ogg_stream_flush_fill(&os, &og, 255 * 255)) {
-        if (ogg_page_packets(&og) != 0) {
-            last_granulepos = ogg_page_granulepos(&og);
+    while ((((r->size_segments <= 255) && (r->last_segments + r->size_segments > 255)) || (r->enc_granulepos - r->last_granulepos > max_ogg_delay)) && ogg_stream_flush_fill(&r->os, &r->og, 255 * 255)) {
+        if (ogg_page_packets(&r->og) != 0) {
+            r->last_granulepos = ogg_page_granulepos(&r->og);
         }
         
-        last_segments -= og.header[26];
-        int writtenPageBytes = writeOggPage(&og, _fileOs);
-        if (writtenPageBytes != og.header_len + og.body_len) {
+        r->last_segments -= r->og.header[26];
+        int writtenPageBytes = writeOggPage(r, &r->og);
+        if (writtenPageBytes != r->og.header_len + r->og.body_len) {
             LOGE("Error: failed writing data to output stream");
             return 0;
         }
-        bytes_written += writtenPageBytes;
-        pages_out++;
+        r->bytes_written += writtenPageBytes;
+        r->pages_out++;
     }
     
-    op.packet = (unsigned char *)_packet;
-    op.bytes = nbBytes;
-    op.b_o_s = 0;
-    op.granulepos = enc_granulepos;
-    if (op.e_o_s) {
-        op.granulepos = ((total_samples * 48000 + rate - 1) / rate) + header.preskip;
+    r->op.packet = (unsigned char *)r->packet;
+    r->op.bytes = nbBytes;
+    r->op.b_o_s = 0;
+    r->op.granulepos = r->enc_granulepos;
+    if (r->op.e_o_s) {
+        r->op.granulepos = ((r->total_samples * 48000 + rate - 1) / rate) + r->header.preskip;
     }
-    op.packetno = 2 + _packetId;
-    ogg_stream_packetin(&os, &op);
-    last_segments += size_segments;
+    r->op.packetno = 2 + r->packetId;
+    ogg_stream_packetin(&r->os, &r->op);
+    r->last_segments += r->size_segments;
     
-    while ((op.e_o_s || (enc_granulepos + (frame_size * 48000 / coding_rate) - last_granulepos > max_ogg_delay) || (last_segments >= 255)) ? ogg_stream_flush_fill(&os, &og, 255 * 255) : ogg_stream_pageout_fill(&os, &og, 255 * 255)) {
-        if (ogg_page_packets(&og) != 0) {
-            last_granulepos = ogg_page_granulepos(&og);
+    while ((r->op.e_o_s || (r->enc_granulepos + (frame_size * 48000 / r->coding_rate) - r->last_granulepos > max_ogg_delay) || (r->last_segments >= 255)) ? ogg_stream_flush_fill(&r->os, &r->og, 255 * 255) : ogg_stream_pageout_fill(&r->os, &r->og, 255 * 255)) {
+        if (ogg_page_packets(&r->og) != 0) {
+            r->last_granulepos = ogg_page_granulepos(&r->og);
         }
-        last_segments -= og.header[26];
-        int writtenPageBytes = writeOggPage(&og, _fileOs);
-        if (writtenPageBytes != og.header_len + og.body_len) {
+        r->last_segments -= r->og.header[26];
+        int writtenPageBytes = writeOggPage(r, &r->og);
+        if (writtenPageBytes != r->og.header_len + r->og.body_len) {
             LOGE("Error: failed writing data to output stream");
             return 0;
         }
-        bytes_written += writtenPageBytes;
-        pages_out++;
+        r->bytes_written += writtenPageBytes;
+        r->pages_out++;
+    }
+    
+    if (++r->framesSinceSync >= RECORDER_SYNC_FRAMES || r->op.e_o_s) {
+        fdatasync(r->fd);
+        r->framesSinceSync = 0;
+    }
+    
+    return 1;
+}
+
+int writeFrame(OpusRecorder *r, uint8_t *framePcmBytes, unsigned int frameByteCount) {
+    if (!r || !r->encoder || __atomic_load_n(&r->failed, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+    frameByteCount = min(frameByteCount, frame_size * 2);
+    waveformFeed(&r->waveform, (const int16_t *) framePcmBytes, frameByteCount / 2);
+    if (!r->threadStarted) {
+        return encodeFrame(r, framePcmBytes, frameByteCount);
     }
     
+    if (sem_trywait(&r->slotsFree) != 0) {
+        LOGE("recorder queue is full, waiting for the encoder");
+        semWait(&r->slotsFree);
+    }
+    int head = r->ringHead;
+    int slot = head % RECORDER_RING_FRAMES;
+    memcpy(r->frameArena + slot * frame_size * 2, framePcmBytes, frameByteCount);
+    r->frameLengths[slot] = frameByteCount;
+    __atomic_store_n(&r->ringHead, head + 1, __ATOMIC_RELEASE);
+    sem_post(&r->framesReady);
     return 1;
 }
 
-JNIEXPORT int Java_org_telegram_messenger_MediaController_startRecord(JNIEnv *env, jclass class, jstring path) {
+JNIEXPORT jlong Java_org_telegram_messenger_MediaController_createOpusRecorder(JNIEnv *env, jclass class, jstring path) {
     const char *pathStr = (*env)->GetStringUTFChars(env, path, 0);
     
-    int result = initRecorder(pathStr);
+    OpusRecorder *recorder = createRecorder(pathStr);
     
     if (pathStr != 0) {
         (*env)->ReleaseStringUTFChars(env, path, pathStr);
     }
     
-    return result;
+    return (jlong) (intptr_t) recorder;
 }
 
-JNIEXPORT int Java_org_telegram_messenger_MediaController_writeFrame(JNIEnv *env, jclass class, jobject frame, jint len) {
+JNIEXPORT int Java_org_telegram_messenger_MediaController_writeOpusRecorderFrame(JNIEnv *env, jclass class, jlong recorder, jobject frame, jint len) {
     jbyte *frameBytes = (*env)->GetDirectBufferAddress(env, frame);
-    return writeFrame(frameBytes, len);
+    return writeFrame((OpusRecorder *) (intptr_t) recorder, frameBytes, len);
 }
 
-JNIEXPORT void Java_org_telegram_messenger_MediaController_stopRecord(JNIEnv *env, jclass class) {
-    cleanupRecorder();
+JNIEXPORT jbyteArray Java_org_telegram_messenger_MediaController_getOpusRecorderWaveform(JNIEnv *env, jclass class, jlong recorder) {
+    OpusRecorder *r = (OpusRecorder *) (intptr_t) recorder;
+    if (!r) {
+        return 0;
+    }
+    WaveformBuilder waveform = r->waveform;
+    uint8_t bytes[WAVEFORM_BYTES];
+    waveformFinish(&waveform, bytes);
+    return waveformToArray(env, bytes);
+}
+
+JNIEXPORT void Java_org_telegram_messenger_MediaController_destroyOpusRecorder(JNIEnv *env, jclass class, jlong recorder) {
+    destroyRecorder((OpusRecorder *) (intptr_t) recorder);
 }
 
 //player
-OggOpusFile *_opusFile;
-int _isSeekable = 0;
-int64_t _totalPcmDuration = 0;
-int64_t _currentPcmOffset = 0;
-int _finished = 0;
 static const int playerBuffersCount = 3;
 static const int playerSampleRate = 48000;
+// PCM decoded ahead of playback when a player has a decoder thread: 4 chunks of 80 ms at 48 kHz
+#define PLAYER_RING_CHUNKS 4
+#define PLAYER_CHUNK_BYTES (48 * 80 * 2)
+
+typedef struct {
+    uint8_t data[PLAYER_CHUNK_BYTES];
+    int size;
+    int offset;
+    int64_t pcmOffset;
+    int endOfFile;
+} PlayerChunk;
 
-void cleanupPlayer() {
-    if (_opusFile) {
-        op_free(_opusFile);
-        _opusFile = 0;
+typedef struct {
+    OggOpusFile *opusFile;
+    int isSeekable;
+    int64_t totalPcmDuration;
+    int64_t currentPcmOffset;
+    int finished;
+    
+    // file is held by whoever calls into opusfile: the decoder thread or a seek
+    pthread_mutex_t fileLock;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    int decodeAhead;
+    int stopping;
+    PlayerChunk *ring;
+    int ringHead;
+    int ringCount;
+} OpusPlayer;
+
+// Decodes PCM until buffer is full or the file ends. Returns the number of bytes written.
+static int readPcm(OpusPlayer *p, uint8_t *buffer, int capacity, int *endOfFile) {
+    int writtenOutputBytes = 0;
+    *endOfFile = 0;
+    while (writtenOutputBytes < capacity) {
+        int readSamples = op_read(p->opusFile, (opus_int16 *)(buffer + writtenOutputBytes), (capacity - writtenOutputBytes) / 2, NULL);
+        
+        if (readSamples > 0) {
+            writtenOutputBytes += readSamples * 2;
+        } else {
+            if (readSamples < 0) {
+                LOGE("op_read failed: %d", readSamples);
+            }
+            *endOfFile = 1;
+            break;
+        }
     }
-    _isSeekable = 0;
-    _totalPcmDuration = 0;
-    _currentPcmOffset = 0;
-    _finished = 0;
+    return writtenOutputBytes;
 }
 
-int seekPlayer(float position) {
-    if (!_opusFile || !_isSeekable || position < 0) {
+static void *playerDecodeThread(void *arg) {
+    OpusPlayer *p = (OpusPlayer *) arg;
+    while (1) {
+        pthread_mutex_lock(&p->lock);
+        while (!p->stopping && p->ringCount == PLAYER_RING_CHUNKS) {
+            pthread_cond_wait(&p->cond, &p->lock);
+        }
+        if (p->stopping) {
+            pthread_mutex_unlock(&p->lock);
+            break;
+        }
+        int eofQueued = p->ringCount > 0 && p->ring[(p->ringHead + p->ringCount - 1) % PLAYER_RING_CHUNKS].endOfFile;
+        pthread_mutex_unlock(&p->lock);
+        
+        pthread_mutex_lock(&p->fileLock);
+        if (eofQueued) {
+            // nothing to decode until the chunk with the end of file is played or a seek flushes the ring
+            pthread_mutex_unlock(&p->fileLock);
+            pthread_mutex_lock(&p->lock);
+            while (!p->stopping && p->ringCount > 0 && p->ring[(p->ringHead + p->ringCount - 1) % PLAYER_RING_CHUNKS].endOfFile) {
+                pthread_cond_wait(&p->cond, &p->lock);
+            }
+            pthread_mutex_unlock(&p->lock);
+            continue;
+        }
+        pthread_mutex_lock(&p->lock);
+        PlayerChunk *chunk = &p->ring[(p->ringHead + p->ringCount) % PLAYER_RING_CHUNKS];
+        pthread_mutex_unlock(&p->lock);
+        
+        chunk->pcmOffset = max(0, op_pcm_tell(p->opusFile));
+        chunk->size = readPcm(p, chunk->data, PLAYER_CHUNK_BYTES, &chunk->endOfFile);
+        chunk->offset = 0;
+        if (chunk->pcmOffset + chunk->size / 2 == p->totalPcmDuration) {
+            chunk->endOfFile = 1;
+        }
+        
+        pthread_mutex_lock(&p->lock);
+        p->ringCount++;
+        pthread_cond_broadcast(&p->cond);
+        pthread_mutex_unlock(&p->lock);
+        pthread_mutex_unlock(&p->fileLock);
+    }
+    return 0;
+}
+
+void destroyPlayer(OpusPlayer *p) {
+    if (!p) {
+        return;
+    }
+    if (p->decodeAhead) {
+        pthread_mutex_lock(&p->lock);
+        p->stopping = 1;
+        pthread_cond_broadcast(&p->cond);
+        pthread_mutex_unlock(&p->lock);
+        pthread_join(p->thread, NULL);
+    }
+    if (p->opusFile) {
+        op_free(p->opusFile);
+    }
+    pthread_cond_destroy(&p->cond);
+    pthread_mutex_destroy(&p->lock);
+    pthread_mutex_destroy(&p->fileLock);
+    free(p->ring);
+    free(p);
+}
+
+int seekPlayer(OpusPlayer *p, float position) {
+    if (!p || !p->opusFile || !p->isSeekable || position < 0) {
         return 0;
     }
-    int result = op_pcm_seek(_opusFile, (ogg_int64_t)(position * _totalPcmDuration));
+    pthread_mutex_lock(&p->fileLock);
+    int result = op_pcm_seek(p->opusFile, (ogg_int64_t)(position * p->totalPcmDuration));
     if (result != OPUS_OK) {
         LOGE("op_pcm_seek failed: %d", result);
     }
-    ogg_int64_t pcmPosition = op_pcm_tell(_opusFile);
-    _currentPcmOffset = pcmPosition;
+    ogg_int64_t pcmPosition = op_pcm_tell(p->opusFile);
+    pthread_mutex_lock(&p->lock);
+    p->currentPcmOffset = pcmPosition;
+    p->finished = 0;
+    p->ringHead = 0;
+    p->ringCount = 0;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    pthread_mutex_unlock(&p->fileLock);
     return result == OPUS_OK;
 }
 
-int initPlayer(const char *path) {
-    cleanupPlayer();
+OpusPlayer *createPlayer(const char *path, int decodeAhead) {
+    OpusPlayer *p = calloc(1, sizeof(OpusPlayer));
+    if (!p) {
+        return 0;
+    }
+    pthread_mutex_init(&p->fileLock, NULL);
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
     
     int openError = OPUS_OK;
-    _opusFile = op_open_file(path, &openError);
-    if (!_opusFile || openError != OPUS_OK) {
+    p->opusFile = op_open_file(path, &openError);
+    if (!p->opusFile || openError != OPUS_OK) {
         LOGE("op_open_file failed: %d", openError);
-        cleanupPlayer();
+        destroyPlayer(p);
         return 0;
     }
     
-    _isSeekable = op_seekable(_opusFile);
-    _totalPcmDuration = op_pcm_total(_opusFile, -1);
-        
-    return 1;
+    p->isSeekable = op_seekable(p->opusFile);
+    p->totalPcmDuration = op_pcm_total(p->opusFile, -1);
+    
+    if (decodeAhead) {
+        p->ring = malloc(sizeof(PlayerChunk) * PLAYER_RING_CHUNKS);
+        p->decodeAhead = p->ring != 0 && pthread_create(&p->thread, NULL, playerDecodeThread, p) == 0;
+    }
+    
+    return p;
 }
 
-void fillBuffer(uint8_t *buffer, int capacity, int *args) {
-    if (_opusFile) {
-        args[1] = max(0, op_pcm_tell(_opusFile));
-        
-        if (_finished) {
+void fillBuffer(OpusPlayer *p, uint8_t *buffer, int capacity, int *args) {
+    if (p && p->opusFile) {
+        // finished is reset by seekPlayer from another thread, so it is only touched under lock
+        pthread_mutex_lock(&p->lock);
+        int finished = p->finished;
+        pthread_mutex_unlock(&p->lock);
+        if (finished) {
             args[0] = 0;
             args[1] = 0;
             args[2] = 1;
             return;
-        } else {
-            int writtenOutputBytes = 0;
-            int endOfFileReached = 0;
-            
-            while (writtenOutputBytes < capacity) {
-                int readSamples = op_read(_opusFile, (opus_int16 *)(buffer + writtenOutputBytes), (capacity - writtenOutputBytes) / 2, NULL);
-                
-                if (readSamples > 0) {
-                    writtenOutputBytes += readSamples * 2;
-                } else {
-                    if (readSamples < 0) {
-                        LOGE("op_read failed: %d", readSamples);
-                    }
-                    endOfFileReached = 1;
-                    break;
-                }
-            }
-            
-            args[0] = writtenOutputBytes;
+        }
+        
+        if (!p->decodeAhead) {
+            int endOfFileReached;
+            pthread_mutex_lock(&p->fileLock);
+            args[1] = max(0, op_pcm_tell(p->opusFile));
+            args[0] = readPcm(p, buffer, capacity, &endOfFileReached);
+            pthread_mutex_unlock(&p->fileLock);
             
-            if (endOfFileReached || args[1] + args[0] == _totalPcmDuration) {
-                _finished = 1;
+            if (endOfFileReached || args[1] + args[0] == p->totalPcmDuration) {
+                pthread_mutex_lock(&p->lock);
+                p->finished = 1;
+                pthread_mutex_unlock(&p->lock);
                 args[2] = 1;
             } else {
                 args[2] = 0;
             }
+            return;
         }
+        
+        int writtenOutputBytes = 0;
+        int endOfFileReached = 0;
+        pthread_mutex_lock(&p->lock);
+        while (p->ringCount == 0) {
+            pthread_cond_wait(&p->cond, &p->lock);
+        }
+        args[1] = (int) (p->ring[p->ringHead].pcmOffset + p->ring[p->ringHead].offset / 2);
+        while (writtenOutputBytes < capacity && !endOfFileReached) {
+            if (p->ringCount == 0) {
+                pthread_cond_wait(&p->cond, &p->lock);
+                continue;
+            }
+            PlayerChunk *chunk = &p->ring[p->ringHead];
+            int count = min(capacity - writtenOutputBytes, chunk->size - chunk->offset);
+            memcpy(buffer + writtenOutputBytes, chunk->data + chunk->offset, count);
+            writtenOutputBytes += count;
+            chunk->offset += count;
+            if (chunk->offset == chunk->size) {
+                endOfFileReached = chunk->endOfFile;
+                p->ringHead = (p->ringHead + 1) % PLAYER_RING_CHUNKS;
+                p->ringCount--;
+                pthread_cond_broadcast(&p->cond);
+            }
+        }
+        if (endOfFileReached) {
+            p->finished = 1;
+        }
+        pthread_mutex_unlock(&p->lock);
+        
+        args[0] = writtenOutputBytes;
+        args[2] = endOfFileReached;
     } else {
         memset(buffer, 0, capacity);
         args[0] = capacity;
-        args[1] = _totalPcmDuration;
+        args[1] = p ? p->totalPcmDuration : 0;
     }
 }
 
-JNIEXPORT jlong Java_org_telegram_messenger_MediaController_getTotalPcmDuration(JNIEnv *env, jclass class) {
-    return _totalPcmDuration;
+JNIEXPORT jlong Java_org_telegram_messenger_MediaController_createOpusPlayer(JNIEnv *env, jclass class, jstring path, jboolean decodeAhead) {
+    const char *pathStr = (*env)->GetStringUTFChars(env, path, 0);
+    
+    OpusPlayer *player = createPlayer(pathStr, decodeAhead);
+    
+    if (pathStr != 0) {
+        (*env)->ReleaseStringUTFChars(env, path, pathStr);
+    }
+    
+    return (jlong) (intptr_t) player;
 }
 
-JNIEXPORT void Java_org_telegram_messenger_MediaController_readOpusFile(JNIEnv *env, jclass class, jobject buffer, jint capacity, jintArray args) {
+JNIEXPORT void Java_org_telegram_messenger_MediaController_readOpusPlayer(JNIEnv *env, jclass class, jlong player, jobject buffer, jint capacity, jintArray args) {
     jint *argsArr = (*env)->GetIntArrayElements(env, args, 0);
     jbyte *bufferBytes = (*env)->GetDirectBufferAddress(env, buffer);
-    fillBuffer(bufferBytes, capacity, argsArr);
+    fillBuffer((OpusPlayer *) (intptr_t) player, bufferBytes, capacity, argsArr);
     (*env)->ReleaseIntArrayElements(env, args, argsArr, 0);
 }
 
-JNIEXPORT int Java_org_telegram_messenger_MediaController_seekOpusFile(JNIEnv *env, jclass class, jfloat position) {
-    return seekPlayer(position);
+JNIEXPORT int Java_org_telegram_messenger_MediaController_seekOpusPlayer(JNIEnv *env, jclass class, jlong player, jfloat position) {
+    return seekPlayer((OpusPlayer *) (intptr_t) player, position);
 }
 
-JNIEXPORT int Java_org_telegram_messenger_MediaController_openOpusFile(JNIEnv *env, jclass class, jstring path) {
-    const char *pathStr = (*env)->GetStringUTFChars(env, path, 0);
-    
-    int result = initPlayer(pathStr);
-    
-    if (pathStr != 0) {
-        (*env)->ReleaseStringUTFChars(env, path, pathStr);
-    }
-    
-    return result;
+JNIEXPORT jlong Java_org_telegram_messenger_MediaController_getOpusPlayerPcmDuration(JNIEnv *env, jclass class, jlong player) {
+    OpusPlayer *p = (OpusPlayer *) (intptr_t) player;
+    return p ? p->totalPcmDuration : 0;
 }
 
-JNIEXPORT void Java_org_telegram_messenger_MediaController_closeOpusFile(JNIEnv *env, jclass class) {
-    cleanupPlayer();
+JNIEXPORT void Java_org_telegram_messenger_MediaController_destroyOpusPlayer(JNIEnv *env, jclass class, jlong player) {
+    destroyPlayer((OpusPlayer *) (intptr_t) player);
 }
 
 JNIEXPORT int Java_org_telegram_messenger_MediaController_isOpusFile(JNIEnv *env, jclass class, jstring path) {
@@ -671,73 +1137,20 @@ JNIEXPORT int Java_org_telegram_messenger_MediaController_isOpusFile(JNIEnv *env
     return result;
 }
 
-static inline void set_bits(uint8_t *bytes, int32_t bitOffset, int32_t value) {
-    bytes += bitOffset / 8;
-    bitOffset %= 8;
-    *((int32_t *) bytes) |= (value << bitOffset);
-}
-
 JNIEXPORT jbyteArray Java_org_telegram_messenger_MediaController_getWaveform2(JNIEnv *env, jclass class, jshortArray array, jint length) {
-    
     jshort *sampleBuffer = (*env)->GetShortArrayElements(env, array, 0);
     
-    jbyteArray result = 0;
-    int32_t resultSamples = 100;
-    uint16_t *samples = malloc(100 * 2);
-    uint64_t sampleIndex = 0;
-    uint16_t peakSample = 0;
-    int32_t sampleRate = (int32_t) max(1, length / resultSamples);
-    int index = 0;
-
-    for (int i = 0; i < length; i++) {
-        uint16_t sample = (uint16_t) abs(sampleBuffer[i]);
-        if (sample > peakSample) {
-            peakSample = sample;
-        }
-        if (sampleIndex++ % sampleRate == 0) {
-            if (index < resultSamples) {
-                samples[index++] = peakSample;
-            }
-            peakSample = 0;
-        }
-    }
-    
-    int64_t sumSamples = 0;
-    for (int i = 0; i < resultSamples; i++) {
-        sumSamples += samples[i];
-    }
-    uint16_t peak = (uint16_t) (sumSamples * 1.8f / resultSamples);
-    if (peak < 2500) {
-        peak = 2500;
-    }
+    WaveformBuilder waveform;
+    waveformInit(&waveform, length);
+    waveformFeed(&waveform, sampleBuffer, length);
     
-    for (int i = 0; i < resultSamples; i++) {
-        uint16_t sample = (uint16_t) ((int64_t) samples[i]);
-        if (sample > peak) {
-            samples[i] = peak;
-        }
-    }
+    (*env)->ReleaseShortArrayElements(env, array, sampleBuffer, JNI_ABORT);
     
-    (*env)->ReleaseShortArrayElements(env, array, sampleBuffer, 0);
-    
-    int bitstreamLength = (resultSamples * 5) / 8 + (((resultSamples * 5) % 8) == 0 ? 0 : 1);
-    result = (*env)->NewByteArray(env, bitstreamLength);
-    jbyte *bytes = (*env)->GetByteArrayElements(env, result, NULL);
-    
-    for (int i = 0; i < resultSamples; i++) {
-        int32_t value = min(31, abs((int32_t) samples[i]) * 31 / peak);
-        set_bits(bytes, i * 5, value & 31);
-    }
-    
-    (*env)->ReleaseByteArrayElements(env, result, bytes, JNI_COMMIT);
-    free(samples);
-    
-    return result;
+    uint8_t bytes[WAVEFORM_BYTES];
+    waveformFinish(&waveform, bytes);
+    return waveformToArray(env, bytes);
 }
 
-int16_t *sampleBuffer = NULL;
-
-
 JNIEXPORT jbyteArray Java_org_telegram_messenger_MediaController_getWaveform(JNIEnv *env, jclass class, jstring path) {
     const char *pathStr = (*env)->GetStringUTFChars(env, path, 0);
     jbyteArray result = 0;
@@ -745,74 +1158,27 @@ JNIEXPORT jbyteArray Java_org_telegram_messenger_MediaController_getWaveform(JNI
     int error = OPUS_OK;
     OggOpusFile *opusFile = op_open_file(pathStr, &error);
     if (opusFile != NULL && error == OPUS_OK) {
-        int64_t totalSamples = op_pcm_total(opusFile, -1);
-        int32_t resultSamples = 100;
-        int32_t sampleRate = (int32_t) max(1, totalSamples / resultSamples);
-        
-        uint16_t *samples = malloc(100 * 2);
+        WaveformBuilder waveform;
+        waveformInit(&waveform, op_pcm_total(opusFile, -1));
         
         int bufferSize = 1024 * 128;
-        if (sampleBuffer == NULL) {
-            sampleBuffer = malloc(bufferSize);
-        }
-        uint64_t sampleIndex = 0;
-        uint16_t peakSample = 0;
-        
-        int index = 0;
-        
-        while (1) {
+        int16_t *sampleBuffer = malloc(bufferSize);
+        while (sampleBuffer != NULL) {
             int readSamples = op_read(opusFile, sampleBuffer, bufferSize / 2, NULL);
-            for (int i = 0; i < readSamples; i++) {
-                uint16_t sample = (uint16_t) abs(sampleBuffer[i]);
-                if (sample > peakSample) {
-                    peakSample = sample;
-                }
-                if (sampleIndex++ % sampleRate == 0) {
-                    if (index < resultSamples) {
-                        samples[index++] = peakSample;
-                    }
-                    peakSample = 0;
-                }
-            }
-            if (readSamples == 0) {
+            if (readSamples > 0) {
+                waveformFeed(&waveform, sampleBuffer, readSamples);
+            } else if (readSamples != OP_HOLE) {
                 break;
             }
         }
-        
-        int64_t sumSamples = 0;
-        for (int i = 0; i < resultSamples; i++) {
-            sumSamples += samples[i];
-        }
-        uint16_t peak = (uint16_t) (sumSamples * 1.8f / resultSamples);
-        if (peak < 2500) {
-            peak = 2500;
-        }
-        
-        for (int i = 0; i < resultSamples; i++) {
-            uint16_t sample = (uint16_t) ((int64_t) samples[i]);
-            if (sample > peak) {
-                samples[i] = peak;
-            }
-        }
-        
-        //free(sampleBuffer);
+        free(sampleBuffer);
         op_free(opusFile);
         
-        int bitstreamLength = (resultSamples * 5) / 8 + (((resultSamples * 5) % 8) == 0 ? 0 : 1);
-        result = (*env)->NewByteArray(env, bitstreamLength);
-        jbyte *bytes = (*env)->GetByteArrayElements(env, result, NULL);
-        
-        for (int i = 0; i < resultSamples; i++) {
-            int32_t value = min(31, abs((int32_t) samples[i]) * 31 / peak);
-            set_bits(bytes, i * 5, value & 31);
-        }
-
-        (*env)->ReleaseByteArrayElements(env, result, bytes, JNI_COMMIT);
-        free(samples);
+        uint8_t bytes[WAVEFORM_BYTES];
+        waveformFinish(&waveform, bytes);
+        result = waveformToArray(env, bytes);
     }
     
-    
-    
     if (pathStr != 0) {
         (*env)->ReleaseStringUTFChars(env, path, pathStr);
     }
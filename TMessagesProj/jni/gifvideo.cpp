@@ -2,9 +2,15 @@
 #include <utils.h>
 #include <libyuv.h>
 #include <android/bitmap.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
 #include <cstdint>
 #include <limits>
 #include <string>
+#include <vector>
 
 extern "C" {
 #include <libavformat/avformat.h>
@@ -19,8 +25,93 @@ static const std::string av_make_error_str(int errnum) {
 #undef av_err2str
 #define av_err2str(errnum) av_make_error_str(errnum).c_str()
 
+// Frames decoded ahead of the caller, two for frames larger than FRAME_RING_LARGE_FRAME_BYTES
+// (about 512x512) so a big video doesn't hold three full-size copies. A short loop is kept decoded
+// if it fits in the per-loop limit, and all cached loops of the process together stay within one
+// shared budget.
+#define FRAME_RING_SIZE 3
+#define FRAME_RING_LARGE_FRAME_BYTES (1024 * 1024)
+#define FRAME_CACHE_LOOP_MAX_BYTES (8 * 1024 * 1024)
+#define FRAME_CACHE_MAX_BYTES (16 * 1024 * 1024)
+
+// All decoders share one pool of worker threads, at most one per core
+#define DECODER_POOL_MAX_THREADS 4
+// A drawable that hasn't asked for a frame for this long is off screen and keeps only one frame ready
+#define DECODER_IDLE_MS 1000
+#define DECODER_DEFAULT_FRAME_MS 40
+// Frame buffers of closed decoders kept for the next one of the same size, a frame too large for
+// the byte limit is freed right away
+#define FREE_BUFFERS_MAX 8
+#define FREE_BUFFERS_MAX_BYTES (4 * 1024 * 1024)
+
+struct DecodedFrame {
+    uint8_t *pixels;
+    int timestamp;
+};
+
+struct FreeBuffer {
+    uint8_t *pixels;
+    size_t size;
+};
+
+// Guards the decoder list, the free buffers and the frame ring of every decoder
+static pthread_mutex_t decoders_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t decoders_cond = PTHREAD_COND_INITIALIZER;
+static std::vector<struct VideoInfo *> decoders;
+static std::vector<FreeBuffer> free_buffers;
+static size_t free_buffers_bytes = 0;
+static int decoder_threads = -1;
+static std::atomic<size_t> cache_bytes_total(0);
+
+static bool reserve_cache_bytes(size_t size) {
+    if (cache_bytes_total.fetch_add(size) + size > FRAME_CACHE_MAX_BYTES) {
+        cache_bytes_total.fetch_sub(size);
+        return false;
+    }
+    return true;
+}
+
+static uint8_t *obtain_buffer(size_t size) {
+    pthread_mutex_lock(&decoders_mutex);
+    for (size_t a = 0; a < free_buffers.size(); a++) {
+        if (free_buffers[a].size == size) {
+            uint8_t *pixels = free_buffers[a].pixels;
+            free_buffers_bytes -= size;
+            free_buffers.erase(free_buffers.begin() + a);
+            pthread_mutex_unlock(&decoders_mutex);
+            return pixels;
+        }
+    }
+    pthread_mutex_unlock(&decoders_mutex);
+    return new uint8_t[size]();
+}
+
+static void release_buffer(uint8_t *pixels, size_t size) {
+    if (pixels == nullptr) {
+        return;
+    }
+    pthread_mutex_lock(&decoders_mutex);
+    if (free_buffers.size() < FREE_BUFFERS_MAX && free_buffers_bytes + size <= FREE_BUFFERS_MAX_BYTES) {
+        FreeBuffer buffer;
+        buffer.pixels = pixels;
+        buffer.size = size;
+        free_buffers.push_back(buffer);
+        free_buffers_bytes += size;
+        pixels = nullptr;
+    }
+    pthread_mutex_unlock(&decoders_mutex);
+    delete [] pixels;
+}
+
 typedef struct VideoInfo {
     
+    VideoInfo() {
+        pthread_cond_init(&cond, NULL);
+        for (int a = 0; a < FRAME_RING_SIZE; a++) {
+            pool[a] = nullptr;
+        }
+    }
+    
     ~VideoInfo() {
         if (video_dec_ctx) {
             avcodec_close(video_dec_ctx);
@@ -40,6 +131,22 @@ typedef struct VideoInfo {
         }
         av_free_packet(&orig_pkt);
         
+        size_t frameBytes = (size_t) dst_width * dst_height * 4;
+        for (int a = 0; a < FRAME_RING_SIZE; a++) {
+            release_buffer(pool[a], frameBytes);
+            pool[a] = nullptr;
+        }
+        for (size_t a = 0; a < cache.size(); a++) {
+            release_buffer(cache[a].pixels, frameBytes);
+        }
+        cache_bytes_total.fetch_sub(cache.size() * frameBytes);
+        cache.clear();
+        if (scale_buffer) {
+            delete [] scale_buffer;
+            scale_buffer = nullptr;
+        }
+        pthread_cond_destroy(&cond);
+        
         video_stream_idx = -1;
         video_stream = nullptr;
     }
@@ -51,8 +158,34 @@ typedef struct VideoInfo {
     AVCodecContext *video_dec_ctx = nullptr;
     AVFrame *frame = nullptr;
     bool has_decoded_frames = false;
+    bool looped = false;
     AVPacket pkt;
     AVPacket orig_pkt;
+    
+    int dst_width = 0;
+    int dst_height = 0;
+    uint8_t *scale_buffer = nullptr;
+    
+    pthread_cond_t cond;
+    bool scheduled = false;
+    bool busy = false;
+    int64_t last_request_ms = 0;
+    int frame_interval_ms = 0;
+    int last_timestamp = -1;
+    bool decode_failed = false;
+    uint8_t *pool[FRAME_RING_SIZE];
+    DecodedFrame ring[FRAME_RING_SIZE];
+    int ring_size = FRAME_RING_SIZE;
+    int ring_head = 0;
+    int ring_count = 0;
+    
+    bool caching = false;
+    bool cache_complete = false;
+    size_t cache_index = 0;
+    std::vector<DecodedFrame> cache;
+    
+    bool returned_frames = false;
+    int late_frames = 0;
 };
 
 jobject makeGlobarRef(JNIEnv *env, jobject object) {
@@ -114,7 +247,260 @@ int decode_packet(VideoInfo *info, int *got_frame) {
     return decoded;
 }
 
-jint Java_org_telegram_ui_Components_AnimatedFileDrawable_createDecoder(JNIEnv *env, jclass clazz, jstring src, jintArray data) {
+// Decodes the next frame into info->frame, going back to the start of the file at its end.
+// Returns 1 when a frame was decoded and 0 on failure.
+int decode_next_frame(VideoInfo *info) {
+    int ret = 0;
+    int got_frame = 0;
+    
+    while (true) {
+        if (info->pkt.size == 0) {
+            ret = av_read_frame(info->fmt_ctx, &info->pkt);
+            //LOGD("got packet with size %d", info->pkt.size);
+            if (ret >= 0) {
+                info->orig_pkt = info->pkt;
+            }
+        }
+        
+        if (info->pkt.size > 0) {
+            ret = decode_packet(info, &got_frame);
+            if (ret < 0) {
+                if (info->has_decoded_frames) {
+                    ret = 0;
+                }
+                info->pkt.size = 0;
+            } else {
+                //LOGD("read size %d from packet", ret);
+                info->pkt.data += ret;
+                info->pkt.size -= ret;
+            }
+            
+            if (info->pkt.size == 0) {
+                av_free_packet(&info->orig_pkt);
+            }
+        } else {
+            info->pkt.data = NULL;
+            info->pkt.size = 0;
+            ret = decode_packet(info, &got_frame);
+            if (ret < 0) {
+                LOGE("can't decode packet flushed %s", info->src);
+                return 0;
+            }
+            if (got_frame == 0) {
+                if (!info->has_decoded_frames) {
+                    LOGE("no frames decoded before the end of file %s", info->src);
+                    return 0;
+                }
+                //LOGD("file end reached %s", info->src);
+                if ((ret = avformat_seek_file(info->fmt_ctx, -1, std::numeric_limits<int64_t>::min(), 0, std::numeric_limits<int64_t>::max(), 0)) < 0) {
+                    LOGE("can't seek to begin of file %s, %s", info->src, av_err2str(ret));
+                    return 0;
+                } else {
+                    avcodec_flush_buffers(info->video_dec_ctx);
+                    info->looped = true;
+                }
+            }
+        }
+        if (ret < 0) {
+            return 0;
+        }
+        if (got_frame) {
+            info->has_decoded_frames = true;
+            return 1;
+        }
+    }
+}
+
+// Converts info->frame to RGBA at the output size. I420 is scaled before conversion, when needed,
+// so only dst_width * dst_height pixels go through the color conversion.
+void convert_frame(VideoInfo *info, uint8_t *pixels) {
+    AVFrame *frame = info->frame;
+    int dstStride = info->dst_width * 4;
+    bool scaled = frame->width != info->dst_width || frame->height != info->dst_height;
+    if (frame->format == AV_PIX_FMT_YUV420P || frame->format == AV_PIX_FMT_YUVJ420P) {
+        //LOGD("y %d, u %d, v %d, width %d, height %d", frame->linesize[0], frame->linesize[2], frame->linesize[1], frame->width, frame->height);
+        if (!scaled) {
+            libyuv::I420ToARGB(frame->data[0], frame->linesize[0], frame->data[2], frame->linesize[2], frame->data[1], frame->linesize[1], pixels, dstStride, frame->width, frame->height);
+        } else {
+            int halfWidth = (info->dst_width + 1) / 2;
+            int halfHeight = (info->dst_height + 1) / 2;
+            if (info->scale_buffer == nullptr) {
+                info->scale_buffer = new uint8_t[info->dst_width * info->dst_height + halfWidth * halfHeight * 2];
+            }
+            uint8_t *y = info->scale_buffer;
+            uint8_t *u = y + info->dst_width * info->dst_height;
+            uint8_t *v = u + halfWidth * halfHeight;
+            libyuv::I420Scale(frame->data[0], frame->linesize[0], frame->data[1], frame->linesize[1], frame->data[2], frame->linesize[2], frame->width, frame->height, y, info->dst_width, u, halfWidth, v, halfWidth, info->dst_width, info->dst_height, libyuv::kFilterBilinear);
+            libyuv::I420ToARGB(y, info->dst_width, v, halfWidth, u, halfWidth, pixels, dstStride, info->dst_width, info->dst_height);
+        }
+    } else if (frame->format == AV_PIX_FMT_BGRA) {
+        if (!scaled) {
+            libyuv::ABGRToARGB(frame->data[0], frame->linesize[0], pixels, dstStride, frame->width, frame->height);
+        } else {
+            libyuv::ARGBScale(frame->data[0], frame->linesize[0], frame->width, frame->height, pixels, dstStride, info->dst_width, info->dst_height, libyuv::kFilterBilinear);
+            libyuv::ABGRToARGB(pixels, dstStride, pixels, dstStride, info->dst_width, info->dst_height);
+        }
+    }
+}
+
+// Gives up on caching the loop: frames still waiting in the ring move to the ring's own buffers,
+// the rest of the partial cache is freed and its bytes go back to the shared budget.
+static void stop_caching(VideoInfo *info, size_t frameBytes) {
+    std::vector<uint8_t *> unused;
+    pthread_mutex_lock(&decoders_mutex);
+    info->caching = false;
+    for (size_t a = 0; a < info->cache.size(); a++) {
+        uint8_t *pixels = info->cache[a].pixels;
+        bool queued = false;
+        for (int b = 0; b < info->ring_count; b++) {
+            int slot = (info->ring_head + b) % info->ring_size;
+            if (info->ring[slot].pixels == pixels && info->pool[slot] == nullptr) {
+                info->pool[slot] = pixels;
+                queued = true;
+                break;
+            }
+        }
+        if (!queued) {
+            unused.push_back(pixels);
+        }
+    }
+    cache_bytes_total.fetch_sub(info->cache.size() * frameBytes);
+    info->cache.clear();
+    pthread_mutex_unlock(&decoders_mutex);
+    
+    for (size_t a = 0; a < unused.size(); a++) {
+        release_buffer(unused[a], frameBytes);
+    }
+}
+
+// Decodes one frame into the free ring slot. Returns false when the decoder has nothing more to do:
+// the file is broken, or the whole loop is in the frame cache and replays without decoding.
+bool decode_ahead_step(VideoInfo *info) {
+    if (!decode_next_frame(info)) {
+        pthread_mutex_lock(&decoders_mutex);
+        info->decode_failed = true;
+        pthread_cond_broadcast(&info->cond);
+        pthread_mutex_unlock(&decoders_mutex);
+        return false;
+    }
+    if (info->looped && info->caching) {
+        av_frame_unref(info->frame);
+        pthread_mutex_lock(&decoders_mutex);
+        info->cache_complete = !info->cache.empty();
+        info->decode_failed = info->cache.empty();
+        pthread_cond_broadcast(&info->cond);
+        pthread_mutex_unlock(&decoders_mutex);
+        return false;
+    }
+    info->looped = false;
+    
+    size_t frameBytes = (size_t) info->dst_width * info->dst_height * 4;
+    pthread_mutex_lock(&decoders_mutex);
+    int slot = (info->ring_head + info->ring_count) % info->ring_size;
+    pthread_mutex_unlock(&decoders_mutex);
+    
+    uint8_t *pixels;
+    if (info->caching && ((info->cache.size() + 1) * frameBytes > FRAME_CACHE_LOOP_MAX_BYTES || !reserve_cache_bytes(frameBytes))) {
+        LOGD("frame cache budget exceeded, decoding every loop %s", info->src);
+        stop_caching(info, frameBytes);
+    }
+    if (info->caching) {
+        pixels = obtain_buffer(frameBytes);
+    } else {
+        if (info->pool[slot] == nullptr) {
+            info->pool[slot] = obtain_buffer(frameBytes);
+        }
+        pixels = info->pool[slot];
+    }
+    convert_frame(info, pixels);
+    
+    DecodedFrame decoded;
+    decoded.pixels = pixels;
+    decoded.timestamp = (int) (1000 * info->frame->pkt_pts * av_q2d(info->video_stream->time_base));
+    av_frame_unref(info->frame);
+    
+    pthread_mutex_lock(&decoders_mutex);
+    if (info->caching) {
+        info->cache.push_back(decoded);
+    }
+    info->ring[slot] = decoded;
+    info->ring_count++;
+    pthread_cond_broadcast(&info->cond);
+    pthread_mutex_unlock(&decoders_mutex);
+    return true;
+}
+
+int64_t current_time_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Earliest deadline first: a decoder's deadline is the moment its drawable runs out of ready frames.
+// Must be called with decoders_mutex held.
+VideoInfo *pick_decoder(int64_t now) {
+    VideoInfo *best = nullptr;
+    int64_t bestDeadline = 0;
+    for (size_t a = 0; a < decoders.size(); a++) {
+        VideoInfo *info = decoders[a];
+        if (info->busy || info->decode_failed || info->cache_complete) {
+            continue;
+        }
+        bool idle = now - info->last_request_ms > DECODER_IDLE_MS;
+        if (info->ring_count >= (idle ? 1 : info->ring_size)) {
+            continue;
+        }
+        // an idle decoder queues behind everything that is on screen now
+        int interval = info->frame_interval_ms > 0 ? info->frame_interval_ms : DECODER_DEFAULT_FRAME_MS;
+        int64_t deadline = (idle ? now + DECODER_IDLE_MS : info->last_request_ms) + (int64_t) interval * (info->ring_count + 1);
+        if (best == nullptr || deadline < bestDeadline) {
+            best = info;
+            bestDeadline = deadline;
+        }
+    }
+    return best;
+}
+
+void *decoder_thread(void *arg) {
+    pthread_mutex_lock(&decoders_mutex);
+    while (true) {
+        VideoInfo *info = pick_decoder(current_time_ms());
+        if (info == nullptr) {
+            // decoders only become eligible on a frame request, which signals the pool
+            pthread_cond_wait(&decoders_cond, &decoders_mutex);
+            continue;
+        }
+        info->busy = true;
+        pthread_mutex_unlock(&decoders_mutex);
+        decode_ahead_step(info);
+        pthread_mutex_lock(&decoders_mutex);
+        info->busy = false;
+        pthread_cond_broadcast(&info->cond);
+    }
+    return nullptr;
+}
+
+// Must be called with decoders_mutex held. Without any thread, frames are decoded on the caller.
+void start_decoder_pool() {
+    if (decoder_threads >= 0) {
+        return;
+    }
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int count = cores < 1 ? 1 : (cores > DECODER_POOL_MAX_THREADS ? DECODER_POOL_MAX_THREADS : (int) cores);
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    decoder_threads = 0;
+    for (int a = 0; a < count; a++) {
+        pthread_t thread;
+        if (pthread_create(&thread, &attr, decoder_thread, nullptr) == 0) {
+            decoder_threads++;
+        }
+    }
+    pthread_attr_destroy(&attr);
+}
+
+jint Java_org_telegram_ui_Components_AnimatedFileDrawable_createDecoder(JNIEnv *env, jclass clazz, jstring src, jintArray data, jint maxSide) {
     VideoInfo *info = new VideoInfo();
     
     char const *srcString = env->GetStringUTFChars(src, 0);
@@ -161,10 +547,28 @@ jint Java_org_telegram_ui_Components_AnimatedFileDrawable_createDecoder(JNIEnv *
     info->pkt.data = NULL;
     info->pkt.size = 0;
     
+    info->dst_width = info->video_dec_ctx->width;
+    info->dst_height = info->video_dec_ctx->height;
+    int side = info->dst_width > info->dst_height ? info->dst_width : info->dst_height;
+    if (maxSide > 0 && side > maxSide) {
+        info->dst_width = std::max(1, info->dst_width * maxSide / side);
+        info->dst_height = std::max(1, info->dst_height * maxSide / side);
+    }
+    
+    if ((size_t) info->dst_width * info->dst_height * 4 > FRAME_RING_LARGE_FRAME_BYTES) {
+        info->ring_size = 2;
+    }
+    
+    int64_t frameCount = info->video_stream->nb_frames;
+    if (frameCount <= 0 && info->fmt_ctx->duration > 0 && info->video_stream->avg_frame_rate.den > 0) {
+        frameCount = (int64_t) (info->fmt_ctx->duration / (double) AV_TIME_BASE * av_q2d(info->video_stream->avg_frame_rate)) + 1;
+    }
+    info->caching = frameCount > 0 && frameCount * info->dst_width * info->dst_height * 4 <= FRAME_CACHE_LOOP_MAX_BYTES;
+    
     jint *dataArr = env->GetIntArrayElements(data, 0);
     if (dataArr != nullptr) {
-        dataArr[0] = info->video_dec_ctx->width;
-        dataArr[1] = info->video_dec_ctx->height;
+        dataArr[0] = info->dst_width;
+        dataArr[1] = info->dst_height;
         AVDictionaryEntry *rotate_tag = av_dict_get(info->video_stream->metadata, "rotate", NULL, 0);
         if (rotate_tag && *rotate_tag->value && strcmp(rotate_tag->value, "0")) {
             char *tail;
@@ -188,6 +592,12 @@ void Java_org_telegram_ui_Components_AnimatedFileDrawable_destroyDecoder(JNIEnv
         return;
     }
     VideoInfo *info = (VideoInfo *) ptr;
+    pthread_mutex_lock(&decoders_mutex);
+    decoders.erase(std::remove(decoders.begin(), decoders.end(), info), decoders.end());
+    while (info->busy) {
+        pthread_cond_wait(&info->cond, &decoders_mutex);
+    }
+    pthread_mutex_unlock(&decoders_mutex);
     delete info;
 }
 
@@ -197,92 +607,80 @@ jint Java_org_telegram_ui_Components_AnimatedFileDrawable_getVideoFrame(JNIEnv *
         return 0;
     }
     VideoInfo *info = (VideoInfo *) ptr;
-    int ret = 0;
-    int got_frame = 0;
     
-    while (true) {
-        if (info->pkt.size == 0) {
-            ret = av_read_frame(info->fmt_ctx, &info->pkt);
-            //LOGD("got packet with size %d", info->pkt.size);
-            if (ret >= 0) {
-                info->orig_pkt = info->pkt;
-            }
+    pthread_mutex_lock(&decoders_mutex);
+    if (!info->scheduled) {
+        start_decoder_pool();
+        if (decoder_threads > 0) {
+            decoders.push_back(info);
         }
-        
-        if (info->pkt.size > 0) {
-            ret = decode_packet(info, &got_frame);
-            if (ret < 0) {
-                if (info->has_decoded_frames) {
-                    ret = 0;
-                }
-                info->pkt.size = 0;
-            } else {
-                //LOGD("read size %d from packet", ret);
-                info->pkt.data += ret;
-                info->pkt.size -= ret;
-            }
-            
-            if (info->pkt.size == 0) {
-                av_free_packet(&info->orig_pkt);
-            }
-        } else {
-            info->pkt.data = NULL;
-            info->pkt.size = 0;
-            ret = decode_packet(info, &got_frame);
-            if (ret < 0) {
-                LOGE("can't decode packet flushed %s", info->src);
-                return 0;
-            }
-            if (got_frame == 0) {
-                if (info->has_decoded_frames) {
-                    //LOGD("file end reached %s", info->src);
-                    if ((ret = avformat_seek_file(info->fmt_ctx, -1, std::numeric_limits<int64_t>::min(), 0, std::numeric_limits<int64_t>::max(), 0)) < 0) {
-                        LOGE("can't seek to begin of file %s, %s", info->src, av_err2str(ret));
-                        return 0;
-                    } else {
-                        avcodec_flush_buffers(info->video_dec_ctx);
-                    }
-                }
-            }
+        info->scheduled = true;
+    }
+    info->last_request_ms = current_time_ms();
+    bool pooled = decoder_threads > 0;
+    if (!pooled && info->ring_count == 0 && !info->cache_complete && !info->decode_failed) {
+        pthread_mutex_unlock(&decoders_mutex);
+        decode_ahead_step(info);
+        pthread_mutex_lock(&decoders_mutex);
+    }
+    if (info->ring_count == 0 && !info->cache_complete && !info->decode_failed) {
+        if (info->returned_frames) {
+            info->late_frames++;
         }
-        if (ret < 0) {
-            return 0;
+        pthread_cond_broadcast(&decoders_cond);
+        while (info->ring_count == 0 && !info->cache_complete && !info->decode_failed) {
+            pthread_cond_wait(&info->cond, &decoders_mutex);
         }
-        if (got_frame) {
-            //LOGD("decoded frame with w = %d, h = %d, format = %d", info->frame->width, info->frame->height, info->frame->format);
-            if (info->frame->format == AV_PIX_FMT_YUV420P || info->frame->format == AV_PIX_FMT_BGRA || info->frame->format == AV_PIX_FMT_YUVJ420P) {
-                jint *dataArr = env->GetIntArrayElements(data, 0);
-                int wantedWidth;
-                int wantedHeight;
-                if (dataArr != nullptr) {
-                    wantedWidth = dataArr[0];
-                    wantedHeight = dataArr[1];
-                    dataArr[3] = (int) (1000 * info->frame->pkt_pts * av_q2d(info->video_stream->time_base));
-                    env->ReleaseIntArrayElements(data, dataArr, 0);
-                } else {
-                    AndroidBitmapInfo bitmapInfo;
-                    AndroidBitmap_getInfo(env, bitmap, &bitmapInfo);
-                    wantedWidth = bitmapInfo.width;
-                    wantedHeight = bitmapInfo.height;
-                }
-                
-                void *pixels;
-                if (AndroidBitmap_lockPixels(env, bitmap, &pixels) >= 0) {
-                    if (info->frame->format == AV_PIX_FMT_YUV420P || info->frame->format == AV_PIX_FMT_YUVJ420P) {
-                        //LOGD("y %d, u %d, v %d, width %d, height %d", info->frame->linesize[0], info->frame->linesize[2], info->frame->linesize[1], info->frame->width, info->frame->height);
-                        if (wantedWidth == info->frame->width && wantedHeight == info->frame->height || wantedWidth == info->frame->height && wantedHeight == info->frame->width) {
-                            libyuv::I420ToARGB(info->frame->data[0], info->frame->linesize[0], info->frame->data[2], info->frame->linesize[2], info->frame->data[1], info->frame->linesize[1], (uint8_t *) pixels, info->frame->width * 4, info->frame->width, info->frame->height);
-                        }
-                    } else if (info->frame->format == AV_PIX_FMT_BGRA) {
-                        libyuv::ABGRToARGB(info->frame->data[0], info->frame->linesize[0], (uint8_t *) pixels, info->frame->width * 4, info->frame->width, info->frame->height);
-                    }
-                    AndroidBitmap_unlockPixels(env, bitmap);
-                }
+    }
+    DecodedFrame frame;
+    bool fromRing = info->ring_count > 0;
+    if (fromRing) {
+        frame = info->ring[info->ring_head];
+    } else if (info->cache_complete) {
+        frame = info->cache[info->cache_index % info->cache.size()];
+        info->cache_index++;
+    } else {
+        pthread_mutex_unlock(&decoders_mutex);
+        return 0;
+    }
+    if (info->last_timestamp >= 0 && frame.timestamp > info->last_timestamp) {
+        info->frame_interval_ms = frame.timestamp - info->last_timestamp;
+    }
+    info->last_timestamp = frame.timestamp;
+    pthread_mutex_unlock(&decoders_mutex);
+    
+    jint *dataArr = env->GetIntArrayElements(data, 0);
+    if (dataArr != nullptr) {
+        dataArr[3] = frame.timestamp;
+        if (env->GetArrayLength(data) > 4) {
+            dataArr[4] = info->late_frames;
+        }
+        env->ReleaseIntArrayElements(data, dataArr, 0);
+    }
+    
+    AndroidBitmapInfo bitmapInfo;
+    void *pixels;
+    if (AndroidBitmap_getInfo(env, bitmap, &bitmapInfo) >= 0 && bitmapInfo.width == (uint32_t) info->dst_width && bitmapInfo.height == (uint32_t) info->dst_height && AndroidBitmap_lockPixels(env, bitmap, &pixels) >= 0) {
+        if (bitmapInfo.stride == bitmapInfo.width * 4) {
+            memcpy(pixels, frame.pixels, (size_t) info->dst_width * info->dst_height * 4);
+        } else {
+            for (int y = 0; y < info->dst_height; y++) {
+                memcpy((uint8_t *) pixels + y * bitmapInfo.stride, frame.pixels + y * info->dst_width * 4, (size_t) info->dst_width * 4);
             }
-            info->has_decoded_frames = true;
-            av_frame_unref(info->frame);
-            return 1;
+        }
+        AndroidBitmap_unlockPixels(env, bitmap);
+    }
+    
+    pthread_mutex_lock(&decoders_mutex);
+    if (fromRing) {
+        info->ring_head = (info->ring_head + 1) % info->ring_size;
+        info->ring_count--;
+        if (pooled) {
+            pthread_cond_broadcast(&decoders_cond);
         }
     }
+    info->returned_frames = true;
+    pthread_mutex_unlock(&decoders_mutex);
+    return 1;
 }
 }
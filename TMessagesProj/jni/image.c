@@ -1,12 +1,24 @@
 #include <jni.h>
 #include <stdio.h>
 #include <setjmp.h>
+#include <math.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
 #include <android/bitmap.h>
 #include <libwebp/webp/decode.h>
 #include <libwebp/webp/encode.h>
 #include "utils.h"
 #include "image.h"
 
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define STACK_BLUR_NEON
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define STACK_BLUR_SSE2
+#endif
+
 jclass jclass_NullPointerException;
 jclass jclass_RuntimeException;
 
@@ -15,8 +27,8 @@ jfieldID jclass_Options_inJustDecodeBounds;
 jfieldID jclass_Options_outHeight;
 jfieldID jclass_Options_outWidth;
 
-const uint32_t PGPhotoEnhanceHistogramBins = 256;
-const uint32_t PGPhotoEnhanceSegments = 4;
+#define PGPhotoEnhanceHistogramBins 256
+#define PGPhotoEnhanceSegments 4
 
 jclass createGlobarRef(JNIEnv *env, jclass class) {
     if (class) {
@@ -59,7 +71,7 @@ static inline uint64_t get_colors (const uint8_t *p) {
     return p[0] + (p[1] << 16) + ((uint64_t)p[2] << 32);
 }
 
-static void fastBlurMore(int imageWidth, int imageHeight, int imageStride, void *pixels, int radius) {
+static int fastBlurMore(int imageWidth, int imageHeight, int imageStride, void *pixels, int radius) {
     uint8_t *pix = (uint8_t *)pixels;
     const int w = imageWidth;
     const int h = imageHeight;
@@ -68,12 +80,12 @@ static void fastBlurMore(int imageWidth, int imageHeight, int imageStride, void
     const int div = radius * 2 + 1;
     
     if (radius > 15 || div >= w || div >= h || w * h > 150 * 150 || imageStride > imageWidth * 4) {
-        return;
+        return 0;
     }
     
     uint64_t *rgb = malloc(imageWidth * imageHeight * sizeof(uint64_t));
     if (rgb == NULL) {
-        return;
+        return 0;
     }
     
     int x, y, i;
@@ -146,12 +158,15 @@ static void fastBlurMore(int imageWidth, int imageHeight, int imageStride, void
         }
     #undef update
     }
+    
+    free(rgb);
+    return 1;
 }
 
-static void fastBlur(int imageWidth, int imageHeight, int imageStride, void *pixels, int radius) {
+static int fastBlur(int imageWidth, int imageHeight, int imageStride, void *pixels, int radius) {
     uint8_t *pix = (uint8_t *)pixels;
     if (pix == NULL) {
-        return;
+        return 0;
     }
     const int w = imageWidth;
     const int h = imageHeight;
@@ -168,16 +183,16 @@ static void fastBlur(int imageWidth, int imageHeight, int imageStride, void *pix
     } else if (radius == 15) {
         shift = 8;
     } else {
-        return;
+        return 0;
     }
     
     if (radius > 15 || div >= w || div >= h || w * h > 150 * 150 || imageStride > imageWidth * 4) {
-        return;
+        return 0;
     }
     
     uint64_t *rgb = malloc(imageWidth * imageHeight * sizeof(uint64_t));
     if (rgb == NULL) {
-        return;
+        return 0;
     }
     
     int x, y, i;
@@ -253,6 +268,340 @@ static void fastBlur(int imageWidth, int imageHeight, int imageStride, void *pix
     }
     
     free(rgb);
+    return 1;
+}
+
+// Stack blur for RGBA_8888 pixels of any size and stride. Each pixel is kept as four 32-bit
+// channel sums, so one vector register holds a whole pixel on NEON and SSE2. Rows are blurred
+// in place one after another; columns are blurred in tiles of STACK_BLUR_TILE_WIDTH pixels
+// walked row by row, which keeps memory access sequential instead of striding down the image.
+
+// keeps (r + 1)^2 * 255 * mul within 32 bits while mul still divides exactly
+#define STACK_BLUR_MAX_RADIUS 254
+#define STACK_BLUR_TILE_WIDTH 64
+#define STACK_BLUR_MAX_THREADS 4
+#define STACK_BLUR_MIN_THREADED_PIXELS (512 * 512)
+
+#if defined(STACK_BLUR_NEON)
+
+typedef uint32x4_t blur_px;
+
+static inline blur_px blur_zero(void) {
+    return vdupq_n_u32(0);
+}
+
+static inline blur_px blur_unpack(uint32_t px) {
+    return vmovl_u16(vget_low_u16(vmovl_u8(vcreate_u8(px))));
+}
+
+static inline blur_px blur_add(blur_px a, blur_px b) {
+    return vaddq_u32(a, b);
+}
+
+static inline blur_px blur_sub(blur_px a, blur_px b) {
+    return vsubq_u32(a, b);
+}
+
+static inline blur_px blur_mul(blur_px a, uint32_t n) {
+    return vmulq_n_u32(a, n);
+}
+
+static inline uint32_t blur_pack(blur_px sum, uint32_t mul) {
+    uint16x4_t v = vmovn_u32(vshrq_n_u32(vmulq_n_u32(sum, mul), 24));
+    return vget_lane_u32(vreinterpret_u32_u8(vmovn_u16(vcombine_u16(v, v))), 0);
+}
+
+#elif defined(STACK_BLUR_SSE2)
+
+typedef __m128i blur_px;
+
+static inline blur_px blur_zero(void) {
+    return _mm_setzero_si128();
+}
+
+static inline blur_px blur_unpack(uint32_t px) {
+    __m128i zero = _mm_setzero_si128();
+    return _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128((int) px), zero), zero);
+}
+
+static inline blur_px blur_add(blur_px a, blur_px b) {
+    return _mm_add_epi32(a, b);
+}
+
+static inline blur_px blur_sub(blur_px a, blur_px b) {
+    return _mm_sub_epi32(a, b);
+}
+
+static inline blur_px blur_mul(blur_px a, uint32_t n) {
+    __m128i b = _mm_set1_epi32((int) n);
+    __m128i even = _mm_mul_epu32(a, b);
+    __m128i odd = _mm_mul_epu32(_mm_srli_si128(a, 4), b);
+    return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)), _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+static inline uint32_t blur_pack(blur_px sum, uint32_t mul) {
+    __m128i v = _mm_srli_epi32(blur_mul(sum, mul), 24);
+    v = _mm_packs_epi32(v, v);
+    return (uint32_t) _mm_cvtsi128_si32(_mm_packus_epi16(v, v));
+}
+
+#else
+
+typedef struct {
+    uint32_t c[4];
+} blur_px;
+
+static inline blur_px blur_zero(void) {
+    blur_px r = {{0, 0, 0, 0}};
+    return r;
+}
+
+static inline blur_px blur_unpack(uint32_t px) {
+    uint8_t *p = (uint8_t *) &px;
+    blur_px r = {{p[0], p[1], p[2], p[3]}};
+    return r;
+}
+
+static inline blur_px blur_add(blur_px a, blur_px b) {
+    blur_px r = {{a.c[0] + b.c[0], a.c[1] + b.c[1], a.c[2] + b.c[2], a.c[3] + b.c[3]}};
+    return r;
+}
+
+static inline blur_px blur_sub(blur_px a, blur_px b) {
+    blur_px r = {{a.c[0] - b.c[0], a.c[1] - b.c[1], a.c[2] - b.c[2], a.c[3] - b.c[3]}};
+    return r;
+}
+
+static inline blur_px blur_mul(blur_px a, uint32_t n) {
+    blur_px r = {{a.c[0] * n, a.c[1] * n, a.c[2] * n, a.c[3] * n}};
+    return r;
+}
+
+static inline uint32_t blur_pack(blur_px sum, uint32_t mul) {
+    uint32_t px;
+    uint8_t *p = (uint8_t *) &px;
+    p[0] = (uint8_t) ((sum.c[0] * mul) >> 24);
+    p[1] = (uint8_t) ((sum.c[1] * mul) >> 24);
+    p[2] = (uint8_t) ((sum.c[2] * mul) >> 24);
+    p[3] = (uint8_t) ((sum.c[3] * mul) >> 24);
+    return px;
+}
+
+#endif
+
+static inline uint32_t blur_load(const uint8_t *p) {
+    uint32_t px;
+    memcpy(&px, p, 4);
+    return px;
+}
+
+static inline void blur_store(uint8_t *p, uint32_t px) {
+    memcpy(p, &px, 4);
+}
+
+static void stackBlurRow(uint8_t *row, int width, int radius, uint32_t mul, uint32_t *stack) {
+    const int div = radius * 2 + 1;
+    blur_px sum = blur_zero();
+    blur_px sumIn = blur_zero();
+    blur_px sumOut = blur_zero();
+    int i, x;
+    
+    for (i = -radius; i <= radius; i++) {
+        int src = i < 0 ? 0 : (i >= width ? width - 1 : i);
+        uint32_t px = blur_load(row + src * 4);
+        blur_px v = blur_unpack(px);
+        stack[i + radius] = px;
+        sum = blur_add(sum, blur_mul(v, (uint32_t) (radius + 1 - (i < 0 ? -i : i))));
+        if (i > 0) {
+            sumIn = blur_add(sumIn, v);
+        } else {
+            sumOut = blur_add(sumOut, v);
+        }
+    }
+    
+    int sp = radius;
+    for (x = 0; x < width; x++) {
+        blur_store(row + x * 4, blur_pack(sum, mul));
+        sum = blur_sub(sum, sumOut);
+        
+        int oldest = sp + radius + 1;
+        if (oldest >= div) {
+            oldest -= div;
+        }
+        sumOut = blur_sub(sumOut, blur_unpack(stack[oldest]));
+        
+        int src = x + radius + 1;
+        uint32_t px = blur_load(row + (src < width ? src : width - 1) * 4);
+        stack[oldest] = px;
+        sumIn = blur_add(sumIn, blur_unpack(px));
+        sum = blur_add(sum, sumIn);
+        
+        if (++sp >= div) {
+            sp = 0;
+        }
+        blur_px v = blur_unpack(stack[sp]);
+        sumOut = blur_add(sumOut, v);
+        sumIn = blur_sub(sumIn, v);
+    }
+}
+
+// stack holds div rows of cols pixels, state holds the sum, sumIn and sumOut of every column
+static void stackBlurColumns(uint8_t *pixels, int height, int stride, int cols, int radius, uint32_t mul, uint32_t *stack, blur_px *state) {
+    const int div = radius * 2 + 1;
+    blur_px *sum = state;
+    blur_px *sumIn = state + cols;
+    blur_px *sumOut = state + cols * 2;
+    int i, c, y;
+    
+    for (c = 0; c < cols; c++) {
+        sum[c] = sumIn[c] = sumOut[c] = blur_zero();
+    }
+    for (i = -radius; i <= radius; i++) {
+        int src = i < 0 ? 0 : (i >= height ? height - 1 : i);
+        const uint8_t *in = pixels + src * stride;
+        uint32_t *slot = stack + (i + radius) * cols;
+        uint32_t weight = (uint32_t) (radius + 1 - (i < 0 ? -i : i));
+        for (c = 0; c < cols; c++) {
+            uint32_t px = blur_load(in + c * 4);
+            blur_px v = blur_unpack(px);
+            slot[c] = px;
+            sum[c] = blur_add(sum[c], blur_mul(v, weight));
+            if (i > 0) {
+                sumIn[c] = blur_add(sumIn[c], v);
+            } else {
+                sumOut[c] = blur_add(sumOut[c], v);
+            }
+        }
+    }
+    
+    int sp = radius;
+    for (y = 0; y < height; y++) {
+        uint8_t *out = pixels + y * stride;
+        int src = y + radius + 1;
+        const uint8_t *in = pixels + (src < height ? src : height - 1) * stride;
+        int oldest = sp + radius + 1;
+        if (oldest >= div) {
+            oldest -= div;
+        }
+        if (++sp >= div) {
+            sp = 0;
+        }
+        uint32_t *oldestSlot = stack + oldest * cols;
+        uint32_t *centerSlot = stack + sp * cols;
+        
+        for (c = 0; c < cols; c++) {
+            blur_store(out + c * 4, blur_pack(sum[c], mul));
+            blur_px s = blur_sub(sum[c], sumOut[c]);
+            blur_px so = blur_sub(sumOut[c], blur_unpack(oldestSlot[c]));
+            uint32_t px = blur_load(in + c * 4);
+            oldestSlot[c] = px;
+            blur_px si = blur_add(sumIn[c], blur_unpack(px));
+            s = blur_add(s, si);
+            blur_px v = blur_unpack(centerSlot[c]);
+            sum[c] = s;
+            sumOut[c] = blur_add(so, v);
+            sumIn[c] = blur_sub(si, v);
+        }
+    }
+}
+
+typedef struct {
+    uint8_t *pixels;
+    int width;
+    int height;
+    int stride;
+    int radius;
+    uint32_t mul;
+    int vertical;
+    int start;
+    int end;
+} StackBlurJob;
+
+// rows [start, end) in the horizontal pass, column tiles [start, end) in the vertical one
+static void *stackBlurRun(void *arg) {
+    StackBlurJob *job = (StackBlurJob *) arg;
+    const int div = job->radius * 2 + 1;
+    const int cols = job->vertical ? STACK_BLUR_TILE_WIDTH : 1;
+    uint8_t *scratch = malloc(div * cols * sizeof(uint32_t) + 3 * cols * sizeof(blur_px) + 16);
+    if (scratch == NULL) {
+        return NULL;
+    }
+    uint32_t *stack = (uint32_t *) scratch;
+    int i;
+    
+    if (!job->vertical) {
+        for (i = job->start; i < job->end; i++) {
+            stackBlurRow(job->pixels + i * job->stride, job->width, job->radius, job->mul, stack);
+        }
+    } else {
+        uintptr_t statePtr = (uintptr_t) (stack + div * cols);
+        blur_px *state = (blur_px *) ((statePtr + 15) & ~(uintptr_t) 15);
+        for (i = job->start; i < job->end; i++) {
+            int x = i * STACK_BLUR_TILE_WIDTH;
+            int tileWidth = job->width - x < STACK_BLUR_TILE_WIDTH ? job->width - x : STACK_BLUR_TILE_WIDTH;
+            stackBlurColumns(job->pixels + x * 4, job->height, job->stride, tileWidth, job->radius, job->mul, stack, state);
+        }
+    }
+    
+    free(scratch);
+    return NULL;
+}
+
+static void stackBlurPass(StackBlurJob *base, int vertical, int count, int threads) {
+    StackBlurJob jobs[STACK_BLUR_MAX_THREADS];
+    pthread_t workers[STACK_BLUR_MAX_THREADS];
+    int started[STACK_BLUR_MAX_THREADS];
+    int i;
+    
+    if (threads > count) {
+        threads = count;
+    }
+    for (i = 0; i < threads; i++) {
+        jobs[i] = *base;
+        jobs[i].vertical = vertical;
+        jobs[i].start = count * i / threads;
+        jobs[i].end = count * (i + 1) / threads;
+        started[i] = 0;
+    }
+    // the calling thread takes the first band itself, a worker that fails to start runs inline too
+    for (i = 1; i < threads; i++) {
+        started[i] = pthread_create(&workers[i], NULL, stackBlurRun, &jobs[i]) == 0;
+    }
+    stackBlurRun(&jobs[0]);
+    for (i = 1; i < threads; i++) {
+        if (started[i]) {
+            pthread_join(workers[i], NULL);
+        } else {
+            stackBlurRun(&jobs[i]);
+        }
+    }
+}
+
+static void stackBlur(uint8_t *pixels, int width, int height, int stride, int radius, int maxThreads) {
+    if (pixels == NULL || width <= 0 || height <= 0 || stride < width * 4 || radius <= 0) {
+        return;
+    }
+    if (radius > STACK_BLUR_MAX_RADIUS) {
+        radius = STACK_BLUR_MAX_RADIUS;
+    }
+    
+    StackBlurJob job;
+    job.pixels = pixels;
+    job.width = width;
+    job.height = height;
+    job.stride = stride;
+    job.radius = radius;
+    uint32_t weights = (uint32_t) ((radius + 1) * (radius + 1));
+    job.mul = ((1 << 24) + weights - 1) / weights;
+    
+    int threads = 1;
+    if (maxThreads > 1 && width * height >= STACK_BLUR_MIN_THREADED_PIXELS) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus < 1 ? 1 : (cpus > maxThreads ? maxThreads : (int) cpus);
+    }
+    
+    stackBlurPass(&job, 0, height, threads);
+    stackBlurPass(&job, 1, (width + STACK_BLUR_TILE_WIDTH - 1) / STACK_BLUR_TILE_WIDTH, threads);
 }
 
 JNIEXPORT void Java_org_telegram_messenger_Utilities_blurBitmap(JNIEnv *env, jclass class, jobject bitmap, int radius, int unpin, int width, int height, int stride) {
@@ -268,118 +617,166 @@ JNIEXPORT void Java_org_telegram_messenger_Utilities_blurBitmap(JNIEnv *env, jcl
     if (AndroidBitmap_lockPixels(env, bitmap, &pixels) < 0) {
         return;
     }
+    int blurred;
     if (radius <= 3) {
-        fastBlur(width, height, stride, pixels, radius);
+        blurred = fastBlur(width, height, stride, pixels, radius);
     } else {
-        fastBlurMore(width, height, stride, pixels, radius);
+        blurred = fastBlurMore(width, height, stride, pixels, radius);
+    }
+    if (!blurred) {
+        stackBlur(pixels, width, height, stride, radius, STACK_BLUR_MAX_THREADS);
     }
     if (unpin) {
         AndroidBitmap_unlockPixels(env, bitmap);
     }
 }
 
-JNIEXPORT void Java_org_telegram_messenger_Utilities_calcCDT(JNIEnv *env, jclass class, jobject hsvBuffer, int width, int height, jobject buffer) {
-    float imageWidth = width;
-    float imageHeight = height;
-    float _clipLimit = 1.25f;
-
-    uint32_t totalSegments = PGPhotoEnhanceSegments * PGPhotoEnhanceSegments;
-    uint32_t tileArea = (uint32_t)(floorf(imageWidth / PGPhotoEnhanceSegments) * floorf(imageHeight / PGPhotoEnhanceSegments));
-    uint32_t clipLimit = (uint32_t)max(1, _clipLimit * tileArea / (float) PGPhotoEnhanceHistogramBins);
-    float scale = 255.0f / (float) tileArea;
-
-
-    unsigned char *bytes = (*env)->GetDirectBufferAddress(env, hsvBuffer);
-
-    uint32_t **hist = calloc(totalSegments, sizeof(uint32_t *));
-    uint32_t **cdfs = calloc(totalSegments, sizeof(uint32_t *));
-    uint32_t *cdfsMin = calloc(totalSegments, sizeof(uint32_t));
-    uint32_t *cdfsMax = calloc(totalSegments, sizeof(uint32_t));
+JNIEXPORT void Java_org_telegram_messenger_Utilities_stackBlurBitmap(JNIEnv *env, jclass class, jobject bitmap, int radius) {
+    if (!bitmap) {
+        return;
+    }
     
-    for (uint32_t a = 0; a < totalSegments; a++) {
-        hist[a] = calloc(PGPhotoEnhanceHistogramBins, sizeof(uint32_t));
-        cdfs[a] = calloc(PGPhotoEnhanceHistogramBins, sizeof(uint32_t));
+    AndroidBitmapInfo info;
+    if (AndroidBitmap_getInfo(env, bitmap, &info) < 0 || info.format != ANDROID_BITMAP_FORMAT_RGBA_8888) {
+        return;
     }
     
-    float xMul = PGPhotoEnhanceSegments / imageWidth;
-    float yMul = PGPhotoEnhanceSegments / imageHeight;
+    void *pixels = 0;
+    if (AndroidBitmap_lockPixels(env, bitmap, &pixels) < 0) {
+        return;
+    }
+    stackBlur(pixels, info.width, info.height, info.stride, radius, STACK_BLUR_MAX_THREADS);
+    AndroidBitmap_unlockPixels(env, bitmap);
+}
+
+#define ENHANCE_MIN_THREADED_PIXELS (256 * 256)
+
+typedef struct {
+    const unsigned char *bytes;
+    unsigned char *result;
+    int width;
+    const uint32_t *tileX;
+    const uint32_t *tileY;
+    uint32_t clipLimit;
+    float scale;
+    uint32_t segmentRow;
+} EnhanceJob;
+
+// Builds the histograms of one row of tiles and turns them into clipped CDFs. Rows of tiles
+// are independent, so each job owns its histograms and its part of the result buffer.
+static void *calcCDTRow(void *arg) {
+    EnhanceJob *job = (EnhanceJob *) arg;
+    uint32_t hist[PGPhotoEnhanceSegments][PGPhotoEnhanceHistogramBins];
+    uint32_t tx, j, x, y;
     
-    for (uint32_t y = 0; y < imageHeight; y++) {
-        uint32_t yOffset = y * width * 4;
-        for (uint32_t x = 0; x < imageWidth; x++) {
-            uint32_t index = x * 4 + yOffset;
-            
-            uint32_t tx = (uint32_t)(x * xMul);
-            uint32_t ty = (uint32_t)(y * yMul);
-            uint32_t t = ty * PGPhotoEnhanceSegments + tx;
-            
-            hist[t][bytes[index + 2]]++;
+    memset(hist, 0, sizeof(hist));
+    for (y = job->tileY[job->segmentRow]; y < job->tileY[job->segmentRow + 1]; y++) {
+        const unsigned char *row = job->bytes + y * job->width * 4 + 2;
+        for (tx = 0; tx < PGPhotoEnhanceSegments; tx++) {
+            uint32_t *h = hist[tx];
+            for (x = job->tileX[tx]; x < job->tileX[tx + 1]; x++) {
+                h[row[x * 4]]++;
+            }
         }
     }
     
-    for (uint32_t i = 0; i < totalSegments; i++) {
-        if (clipLimit > 0) {
+    for (tx = 0; tx < PGPhotoEnhanceSegments; tx++) {
+        uint32_t *h = hist[tx];
+        if (job->clipLimit > 0) {
             uint32_t clipped = 0;
-            for (uint32_t j = 0; j < PGPhotoEnhanceHistogramBins; ++j) {
-                if (hist[i][j] > clipLimit) {
-                    clipped += hist[i][j] - clipLimit;
-                    hist[i][j] = clipLimit;
+            for (j = 0; j < PGPhotoEnhanceHistogramBins; ++j) {
+                if (h[j] > job->clipLimit) {
+                    clipped += h[j] - job->clipLimit;
+                    h[j] = job->clipLimit;
                 }
             }
             
             uint32_t redistBatch = clipped / PGPhotoEnhanceHistogramBins;
             uint32_t residual = clipped - redistBatch * PGPhotoEnhanceHistogramBins;
             
-            for (uint32_t j = 0; j < PGPhotoEnhanceHistogramBins; ++j) {
-                hist[i][j] += redistBatch;
+            for (j = 0; j < PGPhotoEnhanceHistogramBins; ++j) {
+                h[j] += redistBatch;
             }
             
-            for (uint32_t j = 0; j < residual; ++j) {
-                hist[i][j]++;
+            for (j = 0; j < residual; ++j) {
+                h[j]++;
             }
         }
-        memcpy(cdfs[i], hist[i], PGPhotoEnhanceHistogramBins * sizeof(uint32_t));
         
         uint32_t hMin = PGPhotoEnhanceHistogramBins - 1;
-        for (uint32_t j = 0; j < hMin; ++j) {
-            if (cdfs[j] != 0) {
+        for (j = 0; j < hMin; ++j) {
+            if (h[j] != 0) {
                 hMin = j;
+                break;
             }
         }
         
         uint32_t cdf = 0;
-        for (uint32_t j = hMin; j < PGPhotoEnhanceHistogramBins; ++j) {
-            cdf += cdfs[i][j];
-            cdfs[i][j] = (uint8_t) min(255, cdf * scale);
+        for (j = hMin; j < PGPhotoEnhanceHistogramBins; ++j) {
+            cdf += h[j];
+            h[j] = (uint8_t) min(255, cdf * job->scale);
         }
         
-        cdfsMin[i] = cdfs[i][hMin];
-        cdfsMax[i] = cdfs[i][PGPhotoEnhanceHistogramBins - 1];
+        uint8_t cdfMin = (uint8_t) h[hMin];
+        uint8_t cdfMax = (uint8_t) h[PGPhotoEnhanceHistogramBins - 1];
+        unsigned char *out = job->result + (job->segmentRow * PGPhotoEnhanceSegments + tx) * 4 * PGPhotoEnhanceHistogramBins;
+        for (j = 0; j < PGPhotoEnhanceHistogramBins; j++) {
+            out[j * 4] = (uint8_t) h[j];
+            out[j * 4 + 1] = cdfMin;
+            out[j * 4 + 2] = cdfMax;
+            out[j * 4 + 3] = 255;
+        }
+    }
+    return NULL;
+}
+
+JNIEXPORT void Java_org_telegram_messenger_Utilities_calcCDT(JNIEnv *env, jclass class, jobject hsvBuffer, int width, int height, jobject buffer) {
+    float imageWidth = width;
+    float imageHeight = height;
+    float _clipLimit = 1.25f;
+
+    uint32_t tileArea = (uint32_t)(floorf(imageWidth / PGPhotoEnhanceSegments) * floorf(imageHeight / PGPhotoEnhanceSegments));
+    uint32_t clipLimit = (uint32_t)max(1, _clipLimit * tileArea / (float) PGPhotoEnhanceHistogramBins);
+    float scale = 255.0f / (float) tileArea;
+
+    unsigned char *bytes = (*env)->GetDirectBufferAddress(env, hsvBuffer);
+    unsigned char *result = (*env)->GetDirectBufferAddress(env, buffer);
+    if (bytes == NULL || result == NULL || width <= 0 || height <= 0) {
+        return;
     }
     
-    uint32_t resultSize = 4 * PGPhotoEnhanceHistogramBins * totalSegments;
-    uint32_t resultBytesPerRow = 4 * PGPhotoEnhanceHistogramBins;
+    // pixel x belongs to tile x * segments / width, so tile t starts at ceil(t * width / segments)
+    uint32_t tileX[PGPhotoEnhanceSegments + 1];
+    uint32_t tileY[PGPhotoEnhanceSegments + 1];
+    uint32_t t;
+    for (t = 0; t <= PGPhotoEnhanceSegments; t++) {
+        tileX[t] = (t * width + PGPhotoEnhanceSegments - 1) / PGPhotoEnhanceSegments;
+        tileY[t] = (t * height + PGPhotoEnhanceSegments - 1) / PGPhotoEnhanceSegments;
+    }
     
-    unsigned char *result = (*env)->GetDirectBufferAddress(env, buffer);
-    for (uint32_t tile = 0; tile < totalSegments; tile++) {
-        uint32_t yOffset = tile * resultBytesPerRow;
-        for (uint32_t i = 0; i < PGPhotoEnhanceHistogramBins; i++) {
-            uint32_t index = i * 4 + yOffset;
-            result[index] = (uint8_t)cdfs[tile][i];
-            result[index + 1] = (uint8_t)cdfsMin[tile];
-            result[index + 2] = (uint8_t)cdfsMax[tile];
-            result[index + 3] = 255;
-        }
+    EnhanceJob jobs[PGPhotoEnhanceSegments];
+    pthread_t workers[PGPhotoEnhanceSegments];
+    int started[PGPhotoEnhanceSegments];
+    int threaded = width * height >= ENHANCE_MIN_THREADED_PIXELS && sysconf(_SC_NPROCESSORS_ONLN) > 1;
+    for (t = 0; t < PGPhotoEnhanceSegments; t++) {
+        jobs[t].bytes = bytes;
+        jobs[t].result = result;
+        jobs[t].width = width;
+        jobs[t].tileX = tileX;
+        jobs[t].tileY = tileY;
+        jobs[t].clipLimit = clipLimit;
+        jobs[t].scale = scale;
+        jobs[t].segmentRow = t;
+        started[t] = t > 0 && threaded && pthread_create(&workers[t], NULL, calcCDTRow, &jobs[t]) == 0;
     }
-
-    for (uint32_t a = 0; a < totalSegments; a++) {
-        free(hist[a]);
-        free(cdfs[a]);
+    calcCDTRow(&jobs[0]);
+    for (t = 1; t < PGPhotoEnhanceSegments; t++) {
+        if (started[t]) {
+            pthread_join(workers[t], NULL);
+        } else {
+            calcCDTRow(&jobs[t]);
+        }
     }
-    free(hist);
-    free(cdfs);
-    free(cdfsMax);
-    free(cdfsMin);
 }
 
 JNIEXPORT int Java_org_telegram_messenger_Utilities_pinBitmap(JNIEnv *env, jclass class, jobject bitmap) {
@@ -397,6 +794,73 @@ JNIEXPORT void Java_org_telegram_messenger_Utilities_unpinBitmap(JNIEnv *env, jc
     AndroidBitmap_unlockPixels(env, bitmap);
 }
 
+#define WEBP_HEADER_CACHE_BYTES 64
+
+// The callers ask for the bounds first and then decode the same mapped file, so the features of
+// the last parsed header are kept and reused while pointer, length and leading bytes match.
+static pthread_mutex_t webpHeaderCacheLock = PTHREAD_MUTEX_INITIALIZER;
+static const uint8_t *webpHeaderCacheData = NULL;
+static size_t webpHeaderCacheLength = 0;
+static uint8_t webpHeaderCacheBytes[WEBP_HEADER_CACHE_BYTES];
+static WebPBitstreamFeatures webpHeaderCacheFeatures;
+
+static VP8StatusCode getWebpFeatures(const uint8_t *data, size_t len, WebPBitstreamFeatures *features) {
+    size_t headerLength = len < WEBP_HEADER_CACHE_BYTES ? len : WEBP_HEADER_CACHE_BYTES;
+    pthread_mutex_lock(&webpHeaderCacheLock);
+    if (webpHeaderCacheData == data && webpHeaderCacheLength == len && memcmp(webpHeaderCacheBytes, data, headerLength) == 0) {
+        *features = webpHeaderCacheFeatures;
+        pthread_mutex_unlock(&webpHeaderCacheLock);
+        return VP8_STATUS_OK;
+    }
+    pthread_mutex_unlock(&webpHeaderCacheLock);
+    
+    VP8StatusCode status = WebPGetFeatures(data, len, features);
+    if (status == VP8_STATUS_OK) {
+        pthread_mutex_lock(&webpHeaderCacheLock);
+        webpHeaderCacheData = data;
+        webpHeaderCacheLength = len;
+        memcpy(webpHeaderCacheBytes, data, headerLength);
+        webpHeaderCacheFeatures = *features;
+        pthread_mutex_unlock(&webpHeaderCacheLock);
+    }
+    return status;
+}
+
+// Decodes straight to the bitmap size: the source is center-cropped to the bitmap aspect ratio
+// and scaled inside libwebp, so a small sticker never goes through a full resolution buffer.
+static void setupWebpOptions(WebPDecoderConfig *config, int width, int height) {
+    int srcWidth = config->input.width;
+    int srcHeight = config->input.height;
+    config->options.use_threads = 1;
+    if (width == srcWidth && height == srcHeight) {
+        return;
+    }
+    
+    int cropWidth = srcWidth;
+    int cropHeight = srcHeight;
+    if ((int64_t) srcWidth * height > (int64_t) srcHeight * width) {
+        cropWidth = (int) ((int64_t) srcHeight * width / height);
+    } else {
+        cropHeight = (int) ((int64_t) srcWidth * height / width);
+    }
+    if (cropWidth < 1) {
+        cropWidth = 1;
+    }
+    if (cropHeight < 1) {
+        cropHeight = 1;
+    }
+    if (cropWidth != srcWidth || cropHeight != srcHeight) {
+        config->options.use_cropping = 1;
+        config->options.crop_left = (srcWidth - cropWidth) / 2;
+        config->options.crop_top = (srcHeight - cropHeight) / 2;
+        config->options.crop_width = cropWidth;
+        config->options.crop_height = cropHeight;
+    }
+    config->options.use_scaling = 1;
+    config->options.scaled_width = width;
+    config->options.scaled_height = height;
+}
+
 JNIEXPORT jboolean Java_org_telegram_messenger_Utilities_loadWebpImage(JNIEnv *env, jclass class, jobject outputBitmap, jobject buffer, jint len, jobject options, jboolean unpin) {
     if (!buffer) {
         (*env)->ThrowNew(env, jclass_NullPointerException, "Input buffer can not be null");
@@ -405,16 +869,15 @@ JNIEXPORT jboolean Java_org_telegram_messenger_Utilities_loadWebpImage(JNIEnv *e
     
     jbyte *inputBuffer = (*env)->GetDirectBufferAddress(env, buffer);
     
-    int bitmapWidth = 0;
-    int bitmapHeight = 0;
-    if (!WebPGetInfo((uint8_t*)inputBuffer, len, &bitmapWidth, &bitmapHeight)) {
+    WebPDecoderConfig config;
+    if (!WebPInitDecoderConfig(&config) || getWebpFeatures((uint8_t*)inputBuffer, len, &config.input) != VP8_STATUS_OK) {
         (*env)->ThrowNew(env, jclass_RuntimeException, "Invalid WebP format");
         return 0;
     }
     
     if (options && (*env)->GetBooleanField(env, options, jclass_Options_inJustDecodeBounds) == JNI_TRUE) {
-        (*env)->SetIntField(env, options, jclass_Options_outWidth, bitmapWidth);
-        (*env)->SetIntField(env, options, jclass_Options_outHeight, bitmapHeight);
+        (*env)->SetIntField(env, options, jclass_Options_outWidth, config.input.width);
+        (*env)->SetIntField(env, options, jclass_Options_outHeight, config.input.height);
         return 1;
     }
     
@@ -435,7 +898,14 @@ JNIEXPORT jboolean Java_org_telegram_messenger_Utilities_loadWebpImage(JNIEnv *e
         return 0;
     }
     
-    if (!WebPDecodeRGBAInto((uint8_t*)inputBuffer, len, (uint8_t*)bitmapPixels, bitmapInfo.height * bitmapInfo.stride, bitmapInfo.stride)) {
+    setupWebpOptions(&config, bitmapInfo.width, bitmapInfo.height);
+    config.output.colorspace = MODE_RGBA;
+    config.output.is_external_memory = 1;
+    config.output.u.RGBA.rgba = (uint8_t*)bitmapPixels;
+    config.output.u.RGBA.stride = bitmapInfo.stride;
+    config.output.u.RGBA.size = bitmapInfo.height * bitmapInfo.stride;
+    
+    if (WebPDecode((uint8_t*)inputBuffer, len, &config) != VP8_STATUS_OK) {
         AndroidBitmap_unlockPixels(env, outputBitmap);
         (*env)->ThrowNew(env, jclass_RuntimeException, "Failed to decode webp image");
         return 0;
@@ -448,3 +918,201 @@ JNIEXPORT jboolean Java_org_telegram_messenger_Utilities_loadWebpImage(JNIEnv *e
     
     return 1;
 }
+
+typedef struct {
+    WebPDecoderConfig config;
+    WebPIDecoder *idec;
+    int width;
+    int height;
+    int copiedRows;
+} WebpIncrementalDecoder;
+
+JNIEXPORT jlong Java_org_telegram_messenger_Utilities_createWebpDecoder(JNIEnv *env, jclass class, jobject bitmap) {
+    if (!bitmap) {
+        return 0;
+    }
+    AndroidBitmapInfo info;
+    if (AndroidBitmap_getInfo(env, bitmap, &info) != ANDROID_BITMAP_RESUT_SUCCESS || info.format != ANDROID_BITMAP_FORMAT_RGBA_8888) {
+        return 0;
+    }
+    WebpIncrementalDecoder *decoder = calloc(1, sizeof(WebpIncrementalDecoder));
+    if (decoder == NULL) {
+        return 0;
+    }
+    if (!WebPInitDecoderConfig(&decoder->config)) {
+        free(decoder);
+        return 0;
+    }
+    decoder->width = info.width;
+    decoder->height = info.height;
+    return (jlong) (intptr_t) decoder;
+}
+
+// Feeds everything downloaded so far (the buffer may be remapped between calls) and copies the
+// newly decoded rows into the bitmap. Returns the number of rows ready, or -1 on a broken file.
+JNIEXPORT jint Java_org_telegram_messenger_Utilities_updateWebpDecoder(JNIEnv *env, jclass class, jlong ptr, jobject bitmap, jobject buffer, jint len) {
+    WebpIncrementalDecoder *decoder = (WebpIncrementalDecoder *) (intptr_t) ptr;
+    if (decoder == NULL || !bitmap || !buffer) {
+        return -1;
+    }
+    uint8_t *data = (*env)->GetDirectBufferAddress(env, buffer);
+    if (data == NULL) {
+        return -1;
+    }
+    
+    if (decoder->idec == NULL) {
+        VP8StatusCode status = getWebpFeatures(data, len, &decoder->config.input);
+        if (status == VP8_STATUS_NOT_ENOUGH_DATA) {
+            return 0;
+        } else if (status != VP8_STATUS_OK) {
+            return -1;
+        }
+        setupWebpOptions(&decoder->config, decoder->width, decoder->height);
+        decoder->config.output.colorspace = MODE_RGBA;
+        decoder->idec = WebPIDecode(data, len, &decoder->config);
+        if (decoder->idec == NULL) {
+            return -1;
+        }
+    }
+    
+    VP8StatusCode status = WebPIUpdate(decoder->idec, data, len);
+    if (status != VP8_STATUS_OK && status != VP8_STATUS_SUSPENDED) {
+        return -1;
+    }
+    
+    int lastY = 0, width = 0, height = 0, stride = 0;
+    uint8_t *rgba = WebPIDecGetRGB(decoder->idec, &lastY, &width, &height, &stride);
+    if (rgba == NULL || lastY <= decoder->copiedRows) {
+        return decoder->copiedRows;
+    }
+    if (lastY > decoder->height) {
+        lastY = decoder->height;
+    }
+    
+    void *pixels = 0;
+    if (AndroidBitmap_lockPixels(env, bitmap, &pixels) != ANDROID_BITMAP_RESUT_SUCCESS) {
+        return decoder->copiedRows;
+    }
+    AndroidBitmapInfo info;
+    if (AndroidBitmap_getInfo(env, bitmap, &info) == ANDROID_BITMAP_RESUT_SUCCESS) {
+        size_t rowBytes = (size_t) (width < (int) info.width ? width : (int) info.width) * 4;
+        for (int y = decoder->copiedRows; y < lastY; y++) {
+            memcpy((uint8_t *) pixels + y * info.stride, rgba + y * stride, rowBytes);
+        }
+        decoder->copiedRows = lastY;
+    }
+    AndroidBitmap_unlockPixels(env, bitmap);
+    return decoder->copiedRows;
+}
+
+JNIEXPORT void Java_org_telegram_messenger_Utilities_destroyWebpDecoder(JNIEnv *env, jclass class, jlong ptr) {
+    WebpIncrementalDecoder *decoder = (WebpIncrementalDecoder *) (intptr_t) ptr;
+    if (decoder == NULL) {
+        return;
+    }
+    if (decoder->idec != NULL) {
+        WebPIDelete(decoder->idec);
+    }
+    free(decoder);
+}
+
+// A preview is decoded straight at the size of the target bitmap, then blurred and rounded in place,
+// so there is never a full resolution copy of the image. The output is premultiplied like every
+// Android bitmap, which also keeps the blur and the rounded edges free of dark fringes.
+typedef struct {
+    const uint8_t *data;
+    size_t length;
+    uint8_t *pixels;
+    int width;
+    int height;
+    int stride;
+    int blurRadius;
+    int roundRadius;
+} PreviewJob;
+
+static void roundCorners(uint8_t *pixels, int width, int height, int stride, int radius) {
+    if (radius * 2 > width) {
+        radius = width / 2;
+    }
+    if (radius * 2 > height) {
+        radius = height / 2;
+    }
+    for (int y = 0; y < radius; y++) {
+        float dy = radius - y - 0.5f;
+        uint8_t *top = pixels + y * stride;
+        uint8_t *bottom = pixels + (height - 1 - y) * stride;
+        for (int x = 0; x < radius; x++) {
+            float dx = radius - x - 0.5f;
+            float coverage = radius + 0.5f - sqrtf(dx * dx + dy * dy);
+            if (coverage >= 1.0f) {
+                break;
+            }
+            int alpha = coverage <= 0.0f ? 0 : (int) (coverage * 256.0f);
+            int right = (width - 1 - x) * 4;
+            for (int c = 0; c < 4; c++) {
+                top[x * 4 + c] = (uint8_t) ((top[x * 4 + c] * alpha) >> 8);
+                top[right + c] = (uint8_t) ((top[right + c] * alpha) >> 8);
+                bottom[x * 4 + c] = (uint8_t) ((bottom[x * 4 + c] * alpha) >> 8);
+                bottom[right + c] = (uint8_t) ((bottom[right + c] * alpha) >> 8);
+            }
+        }
+    }
+}
+
+static int decodePreview(PreviewJob *job) {
+    WebPDecoderConfig config;
+    if (!WebPInitDecoderConfig(&config) || getWebpFeatures(job->data, job->length, &config.input) != VP8_STATUS_OK) {
+        return 0;
+    }
+    setupWebpOptions(&config, job->width, job->height);
+    config.output.colorspace = MODE_rgbA;
+    config.output.is_external_memory = 1;
+    config.output.u.RGBA.rgba = job->pixels;
+    config.output.u.RGBA.stride = job->stride;
+    config.output.u.RGBA.size = (size_t) job->height * job->stride;
+    if (WebPDecode(job->data, job->length, &config) != VP8_STATUS_OK) {
+        return 0;
+    }
+    
+    if (job->blurRadius > 0) {
+        stackBlur(job->pixels, job->width, job->height, job->stride, job->blurRadius, STACK_BLUR_MAX_THREADS);
+    }
+    if (job->roundRadius > 0) {
+        roundCorners(job->pixels, job->width, job->height, job->stride, job->roundRadius);
+    }
+    return 1;
+}
+
+static int lockPreviewBitmap(JNIEnv *env, jobject bitmap, PreviewJob *job) {
+    AndroidBitmapInfo info;
+    if (!bitmap || AndroidBitmap_getInfo(env, bitmap, &info) != ANDROID_BITMAP_RESUT_SUCCESS || info.format != ANDROID_BITMAP_FORMAT_RGBA_8888) {
+        return 0;
+    }
+    void *pixels = 0;
+    if (AndroidBitmap_lockPixels(env, bitmap, &pixels) != ANDROID_BITMAP_RESUT_SUCCESS) {
+        return 0;
+    }
+    job->pixels = pixels;
+    job->width = info.width;
+    job->height = info.height;
+    job->stride = info.stride;
+    return 1;
+}
+
+JNIEXPORT jboolean Java_org_telegram_messenger_Utilities_decodePreview(JNIEnv *env, jclass class, jobject buffer, jint len, jobject bitmap, jint blurRadius, jint roundRadius) {
+    if (!buffer) {
+        return 0;
+    }
+    PreviewJob job;
+    memset(&job, 0, sizeof(PreviewJob));
+    job.data = (*env)->GetDirectBufferAddress(env, buffer);
+    job.length = (size_t) len;
+    job.blurRadius = blurRadius;
+    job.roundRadius = roundRadius;
+    if (job.data == NULL || !lockPreviewBitmap(env, bitmap, &job)) {
+        return 0;
+    }
+    int result = decodePreview(&job);
+    AndroidBitmap_unlockPixels(env, bitmap);
+    return result ? JNI_TRUE : JNI_FALSE;
+}
@@ -37,9 +37,11 @@ LOCAL_SRC_FILES := \
 ./libtgvoip/BufferOutputStream.cpp \
 ./libtgvoip/BlockingQueue.cpp \
 ./libtgvoip/audio/AudioInput.cpp \
+./libtgvoip/audio/AudioInputFile.cpp \
 ./libtgvoip/os/android/AudioInputOpenSLES.cpp \
 ./libtgvoip/MediaStreamItf.cpp \
 ./libtgvoip/audio/AudioOutput.cpp \
+./libtgvoip/audio/AudioOutputFile.cpp \
 ./libtgvoip/OpusEncoder.cpp \
 ./libtgvoip/os/android/AudioOutputOpenSLES.cpp \
 ./libtgvoip/JitterBuffer.cpp \
@@ -8,48 +8,81 @@
 #include "logging.h"
 #include <stdlib.h>
 #include <assert.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 
 using namespace tgvoip;
 
+static inline unsigned int ctz32(uint32_t x){
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward(&index, x);
+	return (unsigned int)index;
+#else
+	return (unsigned int)__builtin_ctz(x);
+#endif
+}
+
 BufferPool::BufferPool(unsigned int size, unsigned int count){
-	assert(count<=64);
-	buffers[0]=(unsigned char*) malloc(size*count);
+	assert(count>0);
+	buffers=(unsigned char*) malloc(size*count);
 	bufferCount=count;
+	wordCount=(count+31)/32;
+	usedBuffers=new std::atomic<uint32_t>[wordCount];
 	unsigned int i;
-	for(i=1;i<count;i++){
-		buffers[i]=buffers[0]+i*size;
+	for(i=0;i<wordCount;i++){
+		// Bits past the end of the pool are permanently marked as used so Get() never hands them out
+		unsigned int inWord=count-i*32;
+		usedBuffers[i].store(inWord>=32 ? 0 : (0xFFFFFFFF << inWord));
 	}
-	usedBuffers=0;
+	usedCount.store(0);
+	highWaterMark.store(0);
+	exhaustionCount.store(0);
 	this->size=size;
 }
 
 BufferPool::~BufferPool(){
-	free(buffers[0]);
+	if(exhaustionCount.load()>0)
+		LOGW("BufferPool(%u x %u) was exhausted %u times, high-water mark %u", (unsigned int)size, bufferCount, exhaustionCount.load(), highWaterMark.load());
+	delete[] usedBuffers;
+	free(buffers);
 }
 
 unsigned char* BufferPool::Get(){
-	MutexGuard m(mutex);
-	int i;
-	for(i=0;i<bufferCount;i++){
-		if(!((usedBuffers >> i) & 1)){
-			usedBuffers|=(1LL << i);
-			return buffers[i];
+	unsigned int i;
+	for(i=0;i<wordCount;i++){
+		uint32_t used=usedBuffers[i].load(std::memory_order_relaxed);
+		while(used!=0xFFFFFFFF){
+			unsigned int bit=ctz32(~used);
+			if(usedBuffers[i].compare_exchange_weak(used, used | (1U << bit), std::memory_order_acquire, std::memory_order_relaxed)){
+				unsigned int inUse=usedCount.fetch_add(1, std::memory_order_relaxed)+1;
+				unsigned int prevMax=highWaterMark.load(std::memory_order_relaxed);
+				while(inUse>prevMax && !highWaterMark.compare_exchange_weak(prevMax, inUse, std::memory_order_relaxed)){}
+				return buffers+(i*32+bit)*size;
+			}
+			// on failure compare_exchange_weak reloads used, just try again
 		}
 	}
+	exhaustionCount.fetch_add(1, std::memory_order_relaxed);
 	return NULL;
 }
 
 void BufferPool::Reuse(unsigned char* buffer){
-	MutexGuard m(mutex);
-	int i;
-	for(i=0;i<bufferCount;i++){
-		if(buffers[i]==buffer){
-			usedBuffers&= ~(1LL << i);
-			return;
-		}
+	size_t offset=(size_t)(buffer-buffers);
+	if(buffer<buffers || offset>=size*bufferCount || offset%size!=0){
+		LOGE("pointer passed isn't a valid buffer from this pool");
+		abort();
+	}
+	unsigned int index=(unsigned int)(offset/size);
+	uint32_t mask=1U << (index%32);
+	// Decrement before the bit is released so that usedCount never exceeds the real number of used buffers
+	usedCount.fetch_sub(1, std::memory_order_relaxed);
+	uint32_t prev=usedBuffers[index/32].fetch_and(~mask, std::memory_order_release);
+	if(!(prev & mask)){
+		LOGE("buffer %u returned to the pool twice", index);
+		abort();
 	}
-	LOGE("pointer passed isn't a valid buffer from this pool");
-	abort();
 }
 
 size_t BufferPool::GetSingleBufferSize(){
@@ -59,3 +92,15 @@ size_t BufferPool::GetSingleBufferSize(){
 size_t BufferPool::GetBufferCount(){
 	return (size_t) bufferCount;
 }
+
+unsigned int BufferPool::GetUsedBufferCount(){
+	return usedCount.load(std::memory_order_relaxed);
+}
+
+unsigned int BufferPool::GetHighWaterMark(){
+	return highWaterMark.load(std::memory_order_relaxed);
+}
+
+unsigned int BufferPool::GetExhaustionCount(){
+	return exhaustionCount.load(std::memory_order_relaxed);
+}
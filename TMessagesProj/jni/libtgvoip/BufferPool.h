@@ -8,24 +8,44 @@
 #define LIBTGVOIP_BUFFERPOOL_H
 
 #include <stdint.h>
-#include "threading.h"
+#include <stddef.h>
+#include <atomic>
 
 namespace tgvoip{
+/**
+ * Fixed-size buffer pool that is safe to use from real-time threads: Get() and Reuse() never lock,
+ * they only do atomic operations on a bitmap of used buffers (one bit per buffer, 32 buffers per word).
+ */
 class BufferPool{
 public:
 	BufferPool(unsigned int size, unsigned int count);
 	~BufferPool();
+	/**
+	 * @return a free buffer or NULL if all of them are in use
+	 */
 	unsigned char* Get();
 	void Reuse(unsigned char* buffer);
 	size_t GetSingleBufferSize();
 	size_t GetBufferCount();
+	unsigned int GetUsedBufferCount();
+	/**
+	 * @return the maximum number of buffers that were in use at the same time
+	 */
+	unsigned int GetHighWaterMark();
+	/**
+	 * @return how many times Get() failed because the pool was exhausted
+	 */
+	unsigned int GetExhaustionCount();
 
 private:
-	uint64_t usedBuffers;
-	int bufferCount;
+	std::atomic<uint32_t>* usedBuffers;
+	unsigned int wordCount;
+	unsigned int bufferCount;
 	size_t size;
-	unsigned char* buffers[64];
-	Mutex mutex;
+	unsigned char* buffers;
+	std::atomic<unsigned int> usedCount;
+	std::atomic<unsigned int> highWaterMark;
+	std::atomic<unsigned int> exhaustionCount;
 };
 }
 
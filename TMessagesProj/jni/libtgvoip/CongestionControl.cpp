@@ -13,7 +13,7 @@
 
 using namespace tgvoip;
 
-CongestionControl::CongestionControl(){
+CongestionControl::CongestionControl() : minRttFilter(10, false), deliveryRateFilter(1, true){
 	memset(rttHistory, 0, sizeof(rttHistory));
 	memset(inflightPackets, 0, sizeof(inflightPackets));
 	memset(inflightHistory, 0, sizeof(inflightHistory));
@@ -23,6 +23,7 @@ CongestionControl::CongestionControl(){
 	rttHistoryTop=0;
 	lastSentSeq=0;
 	inflightHistoryTop=0;
+	tickCount=0;
 	state=TGVOIP_CONCTL_STARTUP;
 	lastActionTime=0;
 	lastActionRtt=0;
@@ -30,6 +31,21 @@ CongestionControl::CongestionControl(){
 	inflightDataSize=0;
 	lossCount=0;
 	cwnd=(size_t) ServerConfig::GetSharedInstance()->GetInt("audio_congestion_window", 1024);
+
+	delayBased=ServerConfig::GetSharedInstance()->GetBoolean("audio_delay_based_conctl", false);
+	delayThreshold=ServerConfig::GetSharedInstance()->GetDouble("audio_conctl_delay_threshold", 0.06);
+	smoothedRtt=0;
+	sendRate=0;
+	lossRate=0;
+	lastTickTime=0;
+	lastDecreaseTime=0;
+	targetBitrate=0;
+	minBitrate=8000;
+	maxBitrate=20000;
+	sentBytes=0;
+	ackedBytes=0;
+	sentCount=0;
+	lossCountAtLastTick=0;
 }
 
 CongestionControl::~CongestionControl(){
@@ -67,26 +83,19 @@ size_t CongestionControl::GetCongestionWindow(){
 }
 
 double CongestionControl::GetMinimumRTT(){
-	int i;
-	double min=INFINITY;
-	for(i=0;i<100;i++){
-		if(rttHistory[i]>0 && rttHistory[i]<min)
-			min=rttHistory[i];
-	}
-	return min;
+	MutexGuard sync(mutex);
+	return minRttFilter.IsEmpty() ? 0 : minRttFilter.Get();
 }
 
 void CongestionControl::PacketAcknowledged(uint32_t seq){
 	MutexGuard sync(mutex);
-	int i;
-	for(i=0;i<100;i++){
-		if(inflightPackets[i].seq==seq && inflightPackets[i].sendTime>0){
-			tmpRtt+=(VoIPController::GetCurrentTime()-inflightPackets[i].sendTime);
-			tmpRttCount++;
-			inflightPackets[i].sendTime=0;
-			inflightDataSize-=inflightPackets[i].size;
-			break;
-		}
+	tgvoip_congestionctl_packet_t* slot=&inflightPackets[seq%TGVOIP_CONCTL_INFLIGHT_SLOTS];
+	if(slot->seq==seq && slot->sendTime>0){
+		tmpRtt+=(VoIPController::GetCurrentTime()-slot->sendTime);
+		tmpRttCount++;
+		slot->sendTime=0;
+		inflightDataSize-=slot->size;
+		ackedBytes+=slot->size;
 	}
 }
 
@@ -97,20 +106,8 @@ void CongestionControl::PacketSent(uint32_t seq, size_t size){
 	}
 	lastSentSeq=seq;
 	MutexGuard sync(mutex);
-	double smallestSendTime=INFINITY;
-	tgvoip_congestionctl_packet_t* slot=NULL;
-	int i;
-	for(i=0;i<100;i++){
-		if(inflightPackets[i].sendTime==0){
-			slot=&inflightPackets[i];
-			break;
-		}
-		if(smallestSendTime>inflightPackets[i].sendTime){
-			slot=&inflightPackets[i];
-			smallestSendTime=slot->sendTime;
-		}
-	}
-	assert(slot!=NULL);
+	// Slots are indexed by seq, so the one we're about to reuse holds a packet sent TGVOIP_CONCTL_INFLIGHT_SLOTS seqs ago
+	tgvoip_congestionctl_packet_t* slot=&inflightPackets[seq%TGVOIP_CONCTL_INFLIGHT_SLOTS];
 	if(slot->sendTime>0){
 		inflightDataSize-=slot->size;
 		lossCount++;
@@ -120,23 +117,29 @@ void CongestionControl::PacketSent(uint32_t seq, size_t size){
 	slot->size=size;
 	slot->sendTime=VoIPController::GetCurrentTime();
 	inflightDataSize+=size;
+	sentBytes+=size;
+	sentCount++;
 }
 
 
 void CongestionControl::Tick(){
 	tickCount++;
 	MutexGuard sync(mutex);
+	double currentTime=VoIPController::GetCurrentTime();
+	double rtt=0;
 	if(tmpRttCount>0){
-		rttHistory[rttHistoryTop]=tmpRtt/tmpRttCount;
+		rtt=tmpRtt/tmpRttCount;
+		rttHistory[rttHistoryTop]=rtt;
 		rttHistoryTop=(rttHistoryTop+1)%100;
 		if(rttHistorySize<100)
 			rttHistorySize++;
+		minRttFilter.Update(rtt, currentTime);
 		tmpRtt=0;
 		tmpRttCount=0;
 	}
 	int i;
-	for(i=0;i<100;i++){
-		if(inflightPackets[i].sendTime!=0 && VoIPController::GetCurrentTime()-inflightPackets[i].sendTime>2){
+	for(i=0;i<TGVOIP_CONCTL_INFLIGHT_SLOTS;i++){
+		if(inflightPackets[i].sendTime!=0 && currentTime-inflightPackets[i].sendTime>2){
 			inflightPackets[i].sendTime=0;
 			inflightDataSize-=inflightPackets[i].size;
 			lossCount++;
@@ -145,6 +148,55 @@ void CongestionControl::Tick(){
 	}
 	inflightHistory[inflightHistoryTop]=inflightDataSize;
 	inflightHistoryTop=(inflightHistoryTop+1)%30;
+	if(delayBased)
+		UpdateTargetBitrate(rtt, currentTime);
+}
+
+void CongestionControl::UpdateTargetBitrate(double rtt, double time){
+	double dt=time-lastTickTime;
+	if(lastTickTime==0 || dt<=0){
+		lastTickTime=time;
+		sentBytes=ackedBytes=0;
+		sentCount=0;
+		lossCountAtLastTick=lossCount;
+		return;
+	}
+	lastTickTime=time;
+	if(rtt>0)
+		smoothedRtt=smoothedRtt==0 ? rtt : (smoothedRtt*0.875+rtt*0.125);
+	sendRate=sendRate*0.8+(sentBytes/dt)*0.2;
+	if(ackedBytes>0)
+		deliveryRateFilter.Update(ackedBytes/dt, time);
+	if(sentCount>0)
+		lossRate=lossRate*0.9+((double)(lossCount-lossCountAtLastTick)/sentCount)*0.1;
+	sentBytes=ackedBytes=0;
+	sentCount=0;
+	lossCountAtLastTick=lossCount;
+	if(smoothedRtt==0 || minRttFilter.IsEmpty() || targetBitrate==0)
+		return;
+
+	double queuingDelay=smoothedRtt-minRttFilter.Get();
+	if(queuingDelay>delayThreshold || lossRate>0.1){
+		// React once per round trip, the delay we're seeing now may be caused by what we sent before the last decrease
+		if(time-lastDecreaseTime>smoothedRtt+0.1){
+			// If the link delivers less than we send, back off to what it delivers, otherwise by a fixed 15%
+			double factor=0.85;
+			if(!deliveryRateFilter.IsEmpty() && sendRate>0){
+				double deliveryRatio=deliveryRateFilter.Get()/sendRate*0.9;
+				if(deliveryRatio<factor)
+					factor=deliveryRatio<0.5 ? 0.5 : deliveryRatio;
+			}
+			targetBitrate*=factor;
+			lastDecreaseTime=time;
+			LOGV("conctl: queuing delay %.0f ms, loss %.1f%%, target bitrate down to %.0f", queuingDelay*1000, lossRate*100, targetBitrate);
+		}
+	}else if(queuingDelay<delayThreshold/2 && time-lastDecreaseTime>1){
+		targetBitrate*=1.0+0.08*dt;
+	}
+	if(targetBitrate<minBitrate)
+		targetBitrate=minBitrate;
+	if(targetBitrate>maxBitrate)
+		targetBitrate=maxBitrate;
 }
 
 
@@ -169,3 +221,79 @@ int CongestionControl::GetBandwidthControlAction(){
 uint32_t CongestionControl::GetSendLossCount(){
 	return lossCount;
 }
+
+bool CongestionControl::IsDelayBased(){
+	return delayBased;
+}
+
+void CongestionControl::SetBitrateLimits(uint32_t min, uint32_t max){
+	MutexGuard sync(mutex);
+	minBitrate=min;
+	maxBitrate=max;
+}
+
+void CongestionControl::ResetTargetBitrate(uint32_t bitrate){
+	MutexGuard sync(mutex);
+	targetBitrate=bitrate;
+	lastDecreaseTime=VoIPController::GetCurrentTime();
+}
+
+uint32_t CongestionControl::GetTargetBitrate(){
+	MutexGuard sync(mutex);
+	return (uint32_t)targetBitrate;
+}
+
+WindowedFilter::WindowedFilter(double window, bool max){
+	this->window=window;
+	this->max=max;
+	Reset();
+}
+
+void WindowedFilter::Reset(){
+	memset(samples, 0, sizeof(samples));
+	empty=true;
+}
+
+bool WindowedFilter::IsEmpty(){
+	return empty;
+}
+
+double WindowedFilter::Get(){
+	return samples[0].value;
+}
+
+bool WindowedFilter::IsBetter(double a, double b){
+	return max ? a>=b : a<=b;
+}
+
+void WindowedFilter::Update(double value, double time){
+	Sample sample={value, time};
+	if(empty || IsBetter(value, samples[0].value) || time-samples[2].time>window){
+		samples[0]=samples[1]=samples[2]=sample;
+		empty=false;
+		return;
+	}
+	if(IsBetter(value, samples[1].value)){
+		samples[1]=samples[2]=sample;
+	}else if(IsBetter(value, samples[2].value)){
+		samples[2]=sample;
+	}
+
+	double dt=time-samples[0].time;
+	if(dt>window){
+		// the best sample has expired, promote the second and third best
+		samples[0]=samples[1];
+		samples[1]=samples[2];
+		samples[2]=sample;
+		if(time-samples[0].time>window){
+			samples[0]=samples[1];
+			samples[1]=samples[2];
+			samples[2]=sample;
+		}
+	}else if(samples[1].time==samples[0].time && dt>window/4){
+		// a quarter of the window has passed without a second best, take one from the second quarter
+		samples[1]=samples[2]=sample;
+	}else if(samples[2].time==samples[1].time && dt>window/2){
+		samples[2]=sample;
+	}
+}
@@ -20,6 +20,8 @@
 #define TGVOIP_CONCTL_ACT_DECREASE 2
 #define TGVOIP_CONCTL_ACT_NONE 0
 
+#define TGVOIP_CONCTL_INFLIGHT_SLOTS 128
+
 namespace tgvoip{
 
 struct tgvoip_congestionctl_packet_t{
@@ -29,6 +31,30 @@ struct tgvoip_congestionctl_packet_t{
 };
 typedef struct tgvoip_congestionctl_packet_t tgvoip_congestionctl_packet_t;
 
+/**
+ * Running minimum or maximum of a time series over a sliding time window, O(1) per update.
+ * Keeps the best, second best and third best samples from successive subwindows, like Linux' win_minmax.
+ */
+class WindowedFilter{
+public:
+	WindowedFilter(double window, bool max);
+	void Update(double value, double time);
+	double Get();
+	bool IsEmpty();
+	void Reset();
+
+private:
+	struct Sample{
+		double value;
+		double time;
+	};
+	bool IsBetter(double a, double b);
+	Sample samples[3];
+	double window;
+	bool max;
+	bool empty;
+};
+
 class CongestionControl{
 public:
 	CongestionControl();
@@ -46,9 +72,20 @@ public:
 	int GetBandwidthControlAction();
 	uint32_t GetSendLossCount();
 
+	/**
+	 * @return true if this controller computes a continuous target bitrate from queuing delay and delivery rate
+	 * instead of increase/decrease actions from the congestion window
+	 */
+	bool IsDelayBased();
+	void SetBitrateLimits(uint32_t min, uint32_t max);
+	void ResetTargetBitrate(uint32_t bitrate);
+	uint32_t GetTargetBitrate();
+
 private:
+	void UpdateTargetBitrate(double rtt, double time);
+
 	double rttHistory[100];
-	tgvoip_congestionctl_packet_t inflightPackets[100];
+	tgvoip_congestionctl_packet_t inflightPackets[TGVOIP_CONCTL_INFLIGHT_SLOTS];
 	size_t inflightHistory[30];
 	int state;
 	uint32_t lossCount;
@@ -65,6 +102,23 @@ private:
 	size_t inflightDataSize;
 	size_t cwnd;
 	Mutex mutex;
+	WindowedFilter minRttFilter;
+
+	bool delayBased;
+	WindowedFilter deliveryRateFilter;
+	double smoothedRtt;
+	double sendRate;
+	double lossRate;
+	double lastTickTime;
+	double lastDecreaseTime;
+	double targetBitrate;
+	double delayThreshold;
+	uint32_t minBitrate;
+	uint32_t maxBitrate;
+	size_t sentBytes;
+	size_t ackedBytes;
+	uint32_t sentCount;
+	uint32_t lossCountAtLastTick;
 };
 }
 
@@ -8,8 +8,10 @@
 #include "audio/AudioOutput.h"
 #include "audio/AudioInput.h"
 #include "logging.h"
+#include "VoIPController.h"
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #ifndef TGVOIP_NO_DSP
 #ifndef TGVOIP_USE_DESKTOP_DSP
@@ -39,10 +41,14 @@ namespace webrtc{
 }
 #endif
 
-EchoCanceller::EchoCanceller(bool enableAEC, bool enableNS, bool enableAGC){
+EchoCanceller::EchoCanceller(bool enableAEC, bool enableNS, bool enableAGC, bool fusedCapture){
 	this->enableAEC=enableAEC;
 	this->enableAGC=enableAGC;
 	this->enableNS=enableNS;
+	this->fusedCapture=fusedCapture;
+	for(int i=0;i<TGVOIP_DSP_STAGE_COUNT;i++)
+		stageTimes[i].store(0);
+	processedFrames.store(0);
 	
 #ifndef TGVOIP_NO_DSP
 
@@ -54,6 +60,11 @@ EchoCanceller::EchoCanceller(bool enableAEC, bool enableNS, bool enableAGC){
 	splittingFilterOut=new webrtc::IFChannelBuffer(960, 1, 3);
 	splittingFilterFarendOut=new webrtc::IFChannelBuffer(960, 1, 3);
 
+	// One allocation for all per-frame scratch memory, aligned to the cache line so the DSP code gets aligned SIMD loads
+	workspaceAlloc=malloc(sizeof(Workspace)+63);
+	workspace=(Workspace*)(((uintptr_t)workspaceAlloc+63) & ~(uintptr_t)63);
+	memset(workspace, 0, sizeof(Workspace));
+
 	if(enableAEC){
 #ifndef TGVOIP_USE_DESKTOP_DSP
 		aec=WebRtcAecm_Create();
@@ -74,12 +85,19 @@ EchoCanceller::EchoCanceller(bool enableAEC, bool enableNS, bool enableAGC){
 		webrtc::WebRtcAec_set_config(aec, config);
 #endif
 
-		farendQueue=new BlockingQueue<int16_t*>(11);
 		farendBufferPool=new BufferPool(960*2, 10);
 		running=true;
 
-		bufferFarendThread=new Thread(new MethodPointer<EchoCanceller>(&EchoCanceller::RunBufferFarendThread, this), NULL);
-		bufferFarendThread->Start();
+		if(fusedCapture){
+			farendQueue=NULL;
+			bufferFarendThread=NULL;
+			fusedFarendQueue=new SPSCQueue<int16_t*>(10);
+		}else{
+			fusedFarendQueue=NULL;
+			farendQueue=new BlockingQueue<int16_t*>(11);
+			bufferFarendThread=new Thread(new MethodPointer<EchoCanceller>(&EchoCanceller::RunBufferFarendThread, this), NULL);
+			bufferFarendThread->Start();
+		}
 	}else{
 		aec=NULL;
 	}
@@ -116,10 +134,18 @@ EchoCanceller::EchoCanceller(bool enableAEC, bool enableNS, bool enableAGC){
 EchoCanceller::~EchoCanceller(){
 	if(enableAEC){
 		running=false;
-		farendQueue->Put(NULL);
-		bufferFarendThread->Join();
-		delete bufferFarendThread;
-		delete farendQueue;
+		if(bufferFarendThread){
+			farendQueue->Put(NULL);
+			bufferFarendThread->Join();
+			delete bufferFarendThread;
+			delete farendQueue;
+		}
+		if(fusedFarendQueue){
+			int16_t* buf;
+			while(fusedFarendQueue->Get(&buf))
+				farendBufferPool->Reuse((unsigned char *) buf);
+			delete fusedFarendQueue;
+		}
 		delete farendBufferPool;
 #ifndef TGVOIP_USE_DESKTOP_DSP
 		WebRtcAecm_Free(aec);
@@ -146,6 +172,7 @@ EchoCanceller::~EchoCanceller(){
 	delete (webrtc::IFChannelBuffer*)splittingFilterOut;
 	delete (webrtc::IFChannelBuffer*)splittingFilterFarendIn;
 	delete (webrtc::IFChannelBuffer*)splittingFilterFarendOut;
+	free(workspaceAlloc);
 }
 
 void EchoCanceller::Start(){
@@ -168,7 +195,13 @@ void EchoCanceller::SpeakerOutCallback(unsigned char* data, size_t len){
 	int16_t* buf=(int16_t*)farendBufferPool->Get();
 	if(buf){
 		memcpy(buf, data, 960*2);
-		farendQueue->Put(buf);
+		if(fusedCapture){
+			// the capture thread is behind, drop this frame rather than block the playback thread
+			if(!fusedFarendQueue->Put(buf))
+				farendBufferPool->Reuse((unsigned char *) buf);
+		}else{
+			farendQueue->Put(buf);
+		}
 	}
 }
 
@@ -176,23 +209,29 @@ void EchoCanceller::RunBufferFarendThread(void* arg){
 	while(running){
 		int16_t* samplesIn=farendQueue->GetBlocking();
 		if(samplesIn){
-			webrtc::IFChannelBuffer* bufIn=(webrtc::IFChannelBuffer*) splittingFilterFarendIn;
-			webrtc::IFChannelBuffer* bufOut=(webrtc::IFChannelBuffer*) splittingFilterFarendOut;
-			memcpy(bufIn->ibuf()->bands(0)[0], samplesIn, 960*2);
-			farendBufferPool->Reuse((unsigned char *) samplesIn);
-			((webrtc::SplittingFilter*)splittingFilterFarend)->Analysis(bufIn, bufOut);
-			aecMutex.Lock();
+			BufferFarend(samplesIn);
+		}
+	}
+}
+
+void EchoCanceller::BufferFarend(int16_t* samples){
+	double stageStart=VoIPController::GetCurrentTime();
+	webrtc::IFChannelBuffer* bufIn=(webrtc::IFChannelBuffer*) splittingFilterFarendIn;
+	webrtc::IFChannelBuffer* bufOut=(webrtc::IFChannelBuffer*) splittingFilterFarendOut;
+	memcpy(bufIn->ibuf()->bands(0)[0], samples, 960*2);
+	farendBufferPool->Reuse((unsigned char *) samples);
+	((webrtc::SplittingFilter*)splittingFilterFarend)->Analysis(bufIn, bufOut);
+	aecMutex.Lock();
 #ifndef TGVOIP_USE_DESKTOP_DSP
-			WebRtcAecm_BufferFarend(aec, bufOut->ibuf_const()->bands(0)[0], 160);
-			WebRtcAecm_BufferFarend(aec, bufOut->ibuf_const()->bands(0)[0]+160, 160);
+	WebRtcAecm_BufferFarend(aec, bufOut->ibuf_const()->bands(0)[0], 160);
+	WebRtcAecm_BufferFarend(aec, bufOut->ibuf_const()->bands(0)[0]+160, 160);
 #else
-			webrtc::WebRtcAec_BufferFarend(aec, bufOut->fbuf_const()->bands(0)[0], 160);
-			webrtc::WebRtcAec_BufferFarend(aec, bufOut->fbuf_const()->bands(0)[0]+160, 160);
+	webrtc::WebRtcAec_BufferFarend(aec, bufOut->fbuf_const()->bands(0)[0], 160);
+	webrtc::WebRtcAec_BufferFarend(aec, bufOut->fbuf_const()->bands(0)[0]+160, 160);
 #endif
-			aecMutex.Unlock();
-			didBufferFarend=true;
-		}
-	}
+	aecMutex.Unlock();
+	didBufferFarend=true;
+	AddStageTime(TGVOIP_DSP_STAGE_FAREND, stageStart);
 }
 
 void EchoCanceller::Enable(bool enabled){
@@ -205,151 +244,103 @@ void EchoCanceller::ProcessInput(unsigned char* data, unsigned char* out, size_t
 		memcpy(out, data, len);
 		return;
 	}
-	int16_t* samplesIn=(int16_t*)data;
+	if(fusedCapture && enableAEC){
+		int16_t* farend;
+		while(fusedFarendQueue->Get(&farend))
+			BufferFarend(farend);
+	}
+	double stageStart=VoIPController::GetCurrentTime();
 	int16_t* samplesOut=(int16_t*)out;
-	
+
 	webrtc::IFChannelBuffer* bufIn=(webrtc::IFChannelBuffer*) splittingFilterIn;
 	webrtc::IFChannelBuffer* bufOut=(webrtc::IFChannelBuffer*) splittingFilterOut;
-	
-	memcpy(bufIn->ibuf()->bands(0)[0], samplesIn, 960*2);
+
+	memcpy(bufIn->ibuf()->bands(0)[0], data, 960*2);
 
 	((webrtc::SplittingFilter*)splittingFilter)->Analysis(bufIn, bufOut);
+	AddStageTime(TGVOIP_DSP_STAGE_ANALYSIS, stageStart);
+
+	// All stages below work in place on the three 16 kHz bands of bufOut, 160 samples (10 ms) at a time
+	int16_t* const* bands=bufOut->ibuf()->bands(0);
+	int16_t** bandPtrs=workspace->bands;
 
 #ifndef TGVOIP_USE_DESKTOP_DSP
 	if(enableAEC && enableNS){
-		int16_t _nsOut[3][320];
-		int16_t* nsIn[3];
-		int16_t* nsOut[3];
-		for(i=0;i<3;i++){
-			nsIn[i]=(int16_t*)bufOut->ibuf_const()->bands(0)[i];
-			nsOut[i]=_nsOut[i];
-		}
-		WebRtcNsx_Process((NsxHandle*)ns, (const short *const *) nsIn, 3, nsOut);
-		for(i=0;i<3;i++){
-			nsOut[i]+=160;
-			nsIn[i]+=160;
-		}
-		WebRtcNsx_Process((NsxHandle*)ns, (const short *const *) nsIn, 3, nsOut);
+		// AECM wants the low band both before and after noise suppression
+		memcpy(workspace->nearendNoisy, bands[0], 320*2);
+	}
+#endif
 
-		memcpy(bufOut->ibuf()->bands(0)[1], _nsOut[1], 320*2*2);
+	if(enableNS){
+		for(i=0;i<3;i++)
+			bandPtrs[i]=bands[i];
+		WebRtcNsx_Process((NsxHandle*)ns, (const short *const *) bandPtrs, 3, bandPtrs);
+		for(i=0;i<3;i++)
+			bandPtrs[i]+=160;
+		WebRtcNsx_Process((NsxHandle*)ns, (const short *const *) bandPtrs, 3, bandPtrs);
+		AddStageTime(TGVOIP_DSP_STAGE_NS, stageStart);
+	}
 
+	if(enableAEC){
+#ifndef TGVOIP_USE_DESKTOP_DSP
+		int16_t* nearendNoisy=enableNS ? workspace->nearendNoisy : bands[0];
+		int16_t* nearendClean=enableNS ? bands[0] : NULL;
 		aecMutex.Lock();
-		WebRtcAecm_Process(aec, bufOut->ibuf()->bands(0)[0], _nsOut[0], samplesOut, AEC_FRAME_SIZE, (int16_t) tgvoip::audio::AudioOutput::GetEstimatedDelay());
-		WebRtcAecm_Process(aec, bufOut->ibuf()->bands(0)[0]+160, _nsOut[0]+160, samplesOut+160, AEC_FRAME_SIZE, (int16_t) (tgvoip::audio::AudioOutput::GetEstimatedDelay()+audio::AudioInput::GetEstimatedDelay()));
+		WebRtcAecm_Process(aec, nearendNoisy, nearendClean, bands[0], AEC_FRAME_SIZE, (int16_t) tgvoip::audio::AudioOutput::GetEstimatedDelay());
+		WebRtcAecm_Process(aec, nearendNoisy+160, nearendClean ? (nearendClean+160) : NULL, bands[0]+160, AEC_FRAME_SIZE, (int16_t) (tgvoip::audio::AudioOutput::GetEstimatedDelay()+audio::AudioInput::GetEstimatedDelay()));
 		aecMutex.Unlock();
-		memcpy(bufOut->ibuf()->bands(0)[0], samplesOut, 320*2);
-	}else if(enableAEC){
+#else
+		// the full-band AEC works on floats, this converts the bands and invalidates the int16 ones
+		float* const* fbands=bufOut->fbuf()->bands(0);
+		float** aecPtrs=workspace->floatBands;
+		for(i=0;i<3;i++)
+			aecPtrs[i]=fbands[i];
 		aecMutex.Lock();
-		WebRtcAecm_Process(aec, bufOut->ibuf()->bands(0)[0], NULL, samplesOut, AEC_FRAME_SIZE, (int16_t) tgvoip::audio::AudioOutput::GetEstimatedDelay());
-		WebRtcAecm_Process(aec, bufOut->ibuf()->bands(0)[0]+160, NULL, samplesOut+160, AEC_FRAME_SIZE, (int16_t) (tgvoip::audio::AudioOutput::GetEstimatedDelay()+audio::AudioInput::GetEstimatedDelay()));
+		webrtc::WebRtcAec_Process(aec, (const float *const *) aecPtrs, 3, aecPtrs, AEC_FRAME_SIZE, audio::AudioOutput::GetEstimatedDelay()+audio::AudioInput::GetEstimatedDelay(), 0);
+		for(i=0;i<3;i++)
+			aecPtrs[i]+=160;
+		webrtc::WebRtcAec_Process(aec, (const float *const *) aecPtrs, 3, aecPtrs, AEC_FRAME_SIZE, audio::AudioOutput::GetEstimatedDelay()+audio::AudioInput::GetEstimatedDelay(), 0);
 		aecMutex.Unlock();
-		memcpy(bufOut->ibuf()->bands(0)[0], samplesOut, 320*2);
-	}else if(enableNS){
-		int16_t _nsOut[3][320];
-		int16_t* nsIn[3];
-		int16_t* nsOut[3];
-		for(i=0;i<3;i++){
-			nsIn[i]=(int16_t*)bufOut->ibuf_const()->bands(0)[i];
-			nsOut[i]=_nsOut[i];
-		}
-		WebRtcNsx_Process((NsxHandle*)ns, (const short *const *) nsIn, 3, nsOut);
-		for(i=0;i<3;i++){
-			nsOut[i]+=160;
-			nsIn[i]+=160;
-		}
-		WebRtcNsx_Process((NsxHandle*)ns, (const short *const *) nsIn, 3, nsOut);
-
-		memcpy(bufOut->ibuf()->bands(0)[0], _nsOut[0], 320*2);
-		memcpy(bufOut->ibuf()->bands(0)[1], _nsOut[1], 320*2);
-		memcpy(bufOut->ibuf()->bands(0)[2], _nsOut[2], 320*2);
-	}
-#else
-	/*if(enableNS){
-		float _nsOut[3][320];
-		const float* nsIn[3];
-		float* nsOut[3];
-		for(i=0;i<3;i++){
-			nsIn[i]=bufOut->fbuf_const()->bands(0)[i];
-			nsOut[i]=_nsOut[i];
-		}
-		WebRtcNs_Process((NsHandle*)ns, nsIn, 3, nsOut);
-		for(i=0;i<3;i++){
-			nsOut[i]+=160;
-			nsIn[i]+=160;
-		}
-		WebRtcNs_Process((NsHandle*)ns, nsIn, 3, nsOut);
-
-		memcpy(bufOut->fbuf()->bands(0)[0], _nsOut[0], 320*4);
-		memcpy(bufOut->fbuf()->bands(0)[1], _nsOut[1], 320*4);
-		memcpy(bufOut->fbuf()->bands(0)[2], _nsOut[2], 320*4);
-	}*/
-	if(enableNS){
-		int16_t _nsOut[3][320];
-		int16_t* nsIn[3];
-		int16_t* nsOut[3];
-		for(i=0;i<3;i++){
-			nsIn[i]=(int16_t*)bufOut->ibuf_const()->bands(0)[i];
-			nsOut[i]=_nsOut[i];
-		}
-		WebRtcNsx_Process((NsxHandle*)ns, (const short *const *)nsIn, 3, nsOut);
-		for(i=0;i<3;i++){
-			nsOut[i]+=160;
-			nsIn[i]+=160;
-		}
-		WebRtcNsx_Process((NsxHandle*)ns, (const short *const *)nsIn, 3, nsOut);
-
-		memcpy(bufOut->ibuf()->bands(0)[0], _nsOut[0], 320*2);
-		memcpy(bufOut->ibuf()->bands(0)[1], _nsOut[1], 320*2);
-		memcpy(bufOut->ibuf()->bands(0)[2], _nsOut[2], 320*2);
+		if(enableAGC)
+			bands=bufOut->ibuf()->bands(0);
+#endif
+		AddStageTime(TGVOIP_DSP_STAGE_AEC, stageStart);
 	}
 
-	if(enableAEC){
-		const float* aecIn[3];
-		float* aecOut[3];
-		float _aecOut[3][320];
-		for(i=0;i<3;i++){
-			aecIn[i]=bufOut->fbuf_const()->bands(0)[i];
-			aecOut[i]=_aecOut[i];
-		}
-		webrtc::WebRtcAec_Process(aec, aecIn, 3, aecOut, AEC_FRAME_SIZE, audio::AudioOutput::GetEstimatedDelay()+audio::AudioInput::GetEstimatedDelay(), 0);
-		for(i=0;i<3;i++){
-			aecOut[i]+=160;
-			aecIn[i]+=160;
-		}
-		webrtc::WebRtcAec_Process(aec, aecIn, 3, aecOut, AEC_FRAME_SIZE, audio::AudioOutput::GetEstimatedDelay()+audio::AudioInput::GetEstimatedDelay(), 0);
-		
-		memcpy(bufOut->fbuf()->bands(0)[0], _aecOut[0], 320*4);
-		memcpy(bufOut->fbuf()->bands(0)[1], _aecOut[1], 320*4);
-		memcpy(bufOut->fbuf()->bands(0)[2], _aecOut[2], 320*4);
-	}
-#endif
-	
 	if(enableAGC){
-		int16_t _agcOut[3][320];
-		int16_t* agcIn[3];
-		int16_t* agcOut[3];
-		for(i=0;i<3;i++){
-			agcIn[i]=(int16_t*)bufOut->ibuf_const()->bands(0)[i];
-			agcOut[i]=_agcOut[i];
-		}
 		uint8_t saturation;
-		WebRtcAgc_AddMic(agc, agcIn, 3, 160);
-		WebRtcAgc_Process(agc, (const int16_t *const *) agcIn, 3, 160, agcOut, agcMicLevel, &agcMicLevel, 0, &saturation);
-		for(i=0;i<3;i++){
-			agcOut[i]+=160;
-			agcIn[i]+=160;
-		}
-		WebRtcAgc_AddMic(agc, agcIn, 3, 160);
-		WebRtcAgc_Process(agc, (const int16_t *const *) agcIn, 3, 160, agcOut, agcMicLevel, &agcMicLevel, 0, &saturation);
+		for(i=0;i<3;i++)
+			bandPtrs[i]=bands[i];
+		WebRtcAgc_AddMic(agc, bandPtrs, 3, 160);
+		WebRtcAgc_Process(agc, (const int16_t *const *) bandPtrs, 3, 160, bandPtrs, agcMicLevel, &agcMicLevel, 0, &saturation);
+		for(i=0;i<3;i++)
+			bandPtrs[i]+=160;
+		WebRtcAgc_AddMic(agc, bandPtrs, 3, 160);
+		WebRtcAgc_Process(agc, (const int16_t *const *) bandPtrs, 3, 160, bandPtrs, agcMicLevel, &agcMicLevel, 0, &saturation);
 		//LOGV("AGC mic level %d", agcMicLevel);
-		memcpy(bufOut->ibuf()->bands(0)[0], _agcOut[0], 320*2);
-		memcpy(bufOut->ibuf()->bands(0)[1], _agcOut[1], 320*2);
-		memcpy(bufOut->ibuf()->bands(0)[2], _agcOut[2], 320*2);
+		AddStageTime(TGVOIP_DSP_STAGE_AGC, stageStart);
 	}
 
 	((webrtc::SplittingFilter*)splittingFilter)->Synthesis(bufOut, bufIn);
-	
+
 	memcpy(samplesOut, bufIn->ibuf_const()->bands(0)[0], 960*2);
+	AddStageTime(TGVOIP_DSP_STAGE_SYNTHESIS, stageStart);
+	processedFrames.store(processedFrames.load(std::memory_order_relaxed)+1, std::memory_order_relaxed);
+}
+
+void EchoCanceller::AddStageTime(int stage, double& stageStart){
+	// Only ever written from the thread that runs this stage, so there's no need for an atomic read-modify-write
+	double now=VoIPController::GetCurrentTime();
+	uint32_t us=(uint32_t)((now-stageStart)*1000000.0);
+	stageTimes[stage].store(stageTimes[stage].load(std::memory_order_relaxed)+us, std::memory_order_relaxed);
+	stageStart=now;
+}
+
+void EchoCanceller::GetStageTimings(uint32_t* timings, uint32_t* frameCount){
+	int i;
+	for(i=0;i<TGVOIP_DSP_STAGE_COUNT;i++)
+		timings[i]=stageTimes[i].load(std::memory_order_relaxed);
+	*frameCount=processedFrames.load(std::memory_order_relaxed);
 }
 
 void EchoCanceller::SetAECStrength(int strength){
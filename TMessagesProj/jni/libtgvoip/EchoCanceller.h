@@ -10,13 +10,27 @@
 #include "threading.h"
 #include "BufferPool.h"
 #include "BlockingQueue.h"
+#include "SPSCQueue.h"
 #include "MediaStreamItf.h"
+#include <atomic>
+
+#define TGVOIP_DSP_STAGE_ANALYSIS 0
+#define TGVOIP_DSP_STAGE_NS 1
+#define TGVOIP_DSP_STAGE_AEC 2
+#define TGVOIP_DSP_STAGE_AGC 3
+#define TGVOIP_DSP_STAGE_SYNTHESIS 4
+#define TGVOIP_DSP_STAGE_FAREND 5
+#define TGVOIP_DSP_STAGE_COUNT 6
 
 namespace tgvoip{
 class EchoCanceller{
 
 public:
-	EchoCanceller(bool enableAEC, bool enableNS, bool enableAGC);
+	/**
+	 * @param fusedCapture if true, the far-end signal is buffered into the AEC from the capture thread (in ProcessInput)
+	 * instead of from a dedicated thread. ProcessInput must then always be called from the same thread.
+	 */
+	EchoCanceller(bool enableAEC, bool enableNS, bool enableAGC, bool fusedCapture);
 	virtual ~EchoCanceller();
 	virtual void Start();
 	virtual void Stop();
@@ -24,6 +38,13 @@ public:
 	void Enable(bool enabled);
 	void ProcessInput(unsigned char* data, unsigned char* out, size_t len);
 	void SetAECStrength(int strength);
+	/**
+	 * Total time spent in each processing stage since creation, in microseconds, indexed by TGVOIP_DSP_STAGE_*.
+	 * Stages that are disabled stay at zero. Safe to call from any thread.
+	 * @param timings array of TGVOIP_DSP_STAGE_COUNT elements
+	 * @param frameCount the number of 20 ms capture frames processed
+	 */
+	void GetStageTimings(uint32_t* timings, uint32_t* frameCount);
 
 private:
 	bool enableAEC;
@@ -31,6 +52,17 @@ private:
 	bool enableNS;
 #ifndef TGVOIP_NO_DSP
 	void RunBufferFarendThread(void* arg);
+	void BufferFarend(int16_t* samples);
+	void AddStageTime(int stage, double& stageStart);
+	struct Workspace{
+		int16_t nearendNoisy[320];
+		int16_t* bands[3];
+		float* floatBands[3];
+	};
+	Workspace* workspace;
+	void* workspaceAlloc;
+	std::atomic<uint32_t> stageTimes[TGVOIP_DSP_STAGE_COUNT];
+	std::atomic<uint32_t> processedFrames;
 	bool didBufferFarend;
 	Mutex aecMutex;
 	void* aec;
@@ -42,6 +74,8 @@ private:
 	void* splittingFilterFarendOut; // webrtc::IFChannelBuffer
 	Thread* bufferFarendThread;
 	BlockingQueue<int16_t*>* farendQueue;
+	SPSCQueue<int16_t*>* fusedFarendQueue;
+	bool fusedCapture;
 	BufferPool* farendBufferPool;
 	bool running;
 	void* ns; // NsxHandle
@@ -25,6 +25,7 @@ JitterBuffer::JitterBuffer(MediaStreamItf *out, uint32_t step):bufferPool(JITTER
 	dontDecMinDelay=0;
 	lostPackets=0;
 	outstandingDelayChange=0;
+	outputQueueDelay=0;
 	if(step<30){
 		minMinDelay=(uint32_t) ServerConfig::GetSharedInstance()->GetInt("jitter_min_delay_20", 6);
 		maxMinDelay=(uint32_t) ServerConfig::GetSharedInstance()->GetInt("jitter_max_delay_20", 25);
@@ -129,7 +130,7 @@ size_t JitterBuffer::HandleOutput(unsigned char *buffer, size_t len, int offsetI
 				outstandingDelayChange-=20;
 			}
 			//LOGV("outstanding delay change: %d", outstandingDelayChange);
-		}else if(advance && GetCurrentDelay()==0){
+		}else if(advance && GetTotalDelay()==0){
 			//LOGV("stretching packet because the next one is late");
 			*playbackScaledDuration=80;
 		}else{
@@ -144,6 +145,34 @@ size_t JitterBuffer::HandleOutput(unsigned char *buffer, size_t len, int offsetI
 }
 
 
+size_t JitterBuffer::PeekOutput(unsigned char *buffer, size_t len, int offsetInSteps){
+	MutexGuard m(mutex);
+	int64_t timestampToGet=nextTimestamp+offsetInSteps*(int32_t)step;
+	int i;
+	for(i=0;i<JITTER_SLOT_COUNT;i++){
+		if(slots[i].buffer!=NULL && slots[i].timestamp==timestampToGet){
+			if(slots[i].size>len)
+				return 0;
+			memcpy(buffer, slots[i].buffer, slots[i].size);
+			return slots[i].size;
+		}
+	}
+	return 0;
+}
+
+
+bool JitterBuffer::HasOutput(int offsetInSteps){
+	MutexGuard m(mutex);
+	int64_t timestampToGet=nextTimestamp+offsetInSteps*(int32_t)step;
+	int i;
+	for(i=0;i<JITTER_SLOT_COUNT;i++){
+		if(slots[i].buffer!=NULL && slots[i].timestamp==timestampToGet)
+			return true;
+	}
+	return false;
+}
+
+
 int JitterBuffer::GetInternal(jitter_packet_t* pkt, int offset, bool advance){
 	/*if(needBuffering && lastPutTimestamp<nextTimestamp){
 		LOGV("jitter: don't have timestamp %lld, buffering", (long long int)nextTimestamp);
@@ -311,6 +340,15 @@ unsigned int JitterBuffer::GetCurrentDelay(){
 	return delay;
 }
 
+unsigned int JitterBuffer::GetTotalDelay(){
+	// the packets that are still here plus the whole ones' worth the decoder is holding on to
+	return GetCurrentDelay()+outputQueueDelay.load(std::memory_order_relaxed)/step;
+}
+
+void JitterBuffer::SetOutputQueueDelay(unsigned int ms){
+	outputQueueDelay.store(ms, std::memory_order_relaxed);
+}
+
 void JitterBuffer::Tick(){
 	MutexGuard m(mutex);
 	int i;
@@ -345,7 +383,7 @@ void JitterBuffer::Tick(){
 	}
 
 	memmove(&delayHistory[1], delayHistory, 63*sizeof(int));
-	delayHistory[0]=GetCurrentDelay();
+	delayHistory[0]=GetTotalDelay();
 
 	avgDelay=0;
 	int min=100;
@@ -10,6 +10,7 @@
 #include <stdlib.h>
 #include <vector>
 #include <stdio.h>
+#include <atomic>
 #include "MediaStreamItf.h"
 #include "BlockingQueue.h"
 #include "BufferPool.h"
@@ -41,6 +42,22 @@ public:
 	void Reset();
 	void HandleInput(unsigned char* data, size_t len, uint32_t timestamp);
 	size_t HandleOutput(unsigned char* buffer, size_t len, int offsetInSteps, bool advance, int* playbackScaledDuration);
+	/**
+	 * Copies the packet offsetInSteps steps after the next one to be played, without removing it from the buffer
+	 * and without affecting loss statistics. Used to get at the in-band FEC data for a missing packet.
+	 * @return the size of the packet or 0 if it hasn't arrived yet
+	 */
+	size_t PeekOutput(unsigned char* buffer, size_t len, int offsetInSteps);
+	/**
+	 * @return true if the packet offsetInSteps steps after the next one to be played has already arrived
+	 */
+	bool HasOutput(int offsetInSteps);
+	/**
+	 * Tells the buffer how much audio the decoder has already taken out of it and is holding decoded, waiting to be
+	 * played. It counts towards the delay that the buffer adapts to the jitter, so decoding ahead doesn't add latency.
+	 * @param ms the duration of the decoded audio, in milliseconds
+	 */
+	void SetOutputQueueDelay(unsigned int ms);
 	void Tick();
 	void GetAverageLateCount(double* out);
 	int GetAndResetLostPacketCount();
@@ -53,6 +70,7 @@ private:
 	void PutInternal(jitter_packet_t* pkt);
 	int GetInternal(jitter_packet_t* pkt, int offset, bool advance);
 	void Advance();
+	unsigned int GetTotalDelay();
 
 	BufferPool bufferPool;
 	Mutex mutex;
@@ -88,6 +106,7 @@ private:
 	int outstandingDelayChange;
 	unsigned int dontChangeDelay;
 	double avgDelay;
+	std::atomic<unsigned int> outputQueueDelay;
 #ifdef TGVOIP_DUMP_JITTER_STATS
 	FILE* dump;
 #endif
@@ -7,8 +7,10 @@
 #include "logging.h"
 #include "MediaStreamItf.h"
 #include "EchoCanceller.h"
+#include "OpusDecoder.h"
 #include <stdint.h>
 #include <algorithm>
+#include <functional>
 #include <math.h>
 #include <assert.h>
 
@@ -23,12 +25,20 @@ size_t MediaStreamItf::InvokeCallback(unsigned char *data, size_t length){
 	return (*callback)(data, length, callbackParam);
 }
 
-AudioMixer::AudioMixer() : bufferPool(960*2, 16), processedQueue(16), semaphore(16, 0){
+AudioMixer::AudioMixer() : bufferPool(960*2, 16), processedQueue(16), semaphore(16, 0), decodeStartSemaphore(16, 0), decodeDoneSemaphore(16, 0){
 	output=NULL;
 	running=false;
+	decoderThreadCount=0;
+	decoderThreadsRunning=false;
+	nextInputToProcess.store(0);
+	maxActiveInputs=0;
+	frameCount=0;
 }
 
 AudioMixer::~AudioMixer(){
+	for(std::vector<MixerInput>::iterator i=inputs.begin();i!=inputs.end();++i){
+		delete[] i->frame;
+	}
 }
 
 void AudioMixer::SetOutput(MediaStreamItf *output){
@@ -41,6 +51,13 @@ void AudioMixer::SetOutput(MediaStreamItf *output){
 void AudioMixer::Start(){
 	assert(!running);
 	running=true;
+	decoderThreadsRunning=true;
+	for(unsigned int i=0;i<decoderThreadCount;i++){
+		Thread* t=new Thread(new MethodPointer<AudioMixer>(&AudioMixer::RunDecoderThread, this), NULL);
+		t->Start();
+		t->SetName("AudioMixerDecoder");
+		decoderThreads.push_back(t);
+	}
 	thread=new Thread(new MethodPointer<AudioMixer>(&AudioMixer::RunThread, this), NULL);
 	thread->Start();
 	thread->SetName("AudioMixer");
@@ -56,6 +73,15 @@ void AudioMixer::Stop(){
 	thread->Join();
 	delete thread;
 	thread=NULL;
+	// the mixer thread is gone, so none of these are in the middle of a frame
+	decoderThreadsRunning=false;
+	if(!decoderThreads.empty())
+		decodeStartSemaphore.Release((unsigned int)decoderThreads.size());
+	for(std::vector<Thread*>::iterator t=decoderThreads.begin();t!=decoderThreads.end();++t){
+		(*t)->Join();
+		delete *t;
+	}
+	decoderThreads.clear();
 }
 
 void AudioMixer::DoCallback(unsigned char *data, size_t length){
@@ -76,10 +102,18 @@ size_t AudioMixer::OutputCallback(unsigned char *data, size_t length, void *arg)
 }
 
 void AudioMixer::AddInput(MediaStreamItf *input){
+	AddInput(input, NULL);
+}
+
+void AudioMixer::AddInput(MediaStreamItf *input, OpusDecoder *decoder){
 	MutexGuard m(inputsMutex);
 	MixerInput in;
 	in.multiplier=1;
 	in.source=input;
+	in.decoder=decoder;
+	in.active=true;
+	in.result=0;
+	in.frame=new int16_t[960];
 	inputs.push_back(in);
 }
 
@@ -87,6 +121,7 @@ void AudioMixer::RemoveInput(MediaStreamItf *input){
 	MutexGuard m(inputsMutex);
 	for(std::vector<MixerInput>::iterator i=inputs.begin();i!=inputs.end();++i){
 		if(i->source==input){
+			delete[] i->frame;
 			inputs.erase(i);
 			return;
 		}
@@ -106,6 +141,68 @@ void AudioMixer::SetInputVolume(MediaStreamItf *input, float volumeDB){
 	}
 }
 
+void AudioMixer::SetMaxActiveInputs(unsigned int count){
+	MutexGuard m(inputsMutex);
+	maxActiveInputs=count;
+	frameCount=0;
+}
+
+void AudioMixer::SetDecoderThreadCount(unsigned int count){
+	assert(!running);
+	// the start/done semaphores are created with a maximum count of 16
+	decoderThreadCount=std::min(count, 8U);
+}
+
+void AudioMixer::SelectActiveInputs(){
+	std::vector<std::pair<float, MixerInput*> > candidates;
+	for(std::vector<MixerInput>::iterator in=inputs.begin();in!=inputs.end();++in){
+		if(!in->decoder){
+			in->active=true;
+			continue;
+		}
+		bool wasActive=in->active;
+		// muted inputs are never heard anyway
+		in->active=in->multiplier!=0 && maxActiveInputs==0;
+		if(in->multiplier!=0 && maxActiveInputs>0){
+			// prefer whoever is already being heard so that two equally loud speakers don't keep swapping
+			float activity=in->decoder->GetActivity();
+			if(wasActive)
+				activity*=1.2f;
+			candidates.push_back(std::make_pair(activity, &*in));
+		}
+	}
+	if(candidates.empty())
+		return;
+	size_t count=std::min(candidates.size(), (size_t)maxActiveInputs);
+	std::partial_sort(candidates.begin(), candidates.begin()+count, candidates.end(), std::greater<std::pair<float, MixerInput*> >());
+	for(size_t i=0;i<count;i++){
+		candidates[i].second->active=true;
+	}
+}
+
+void AudioMixer::ProcessInputs(){
+	unsigned int i;
+	while((i=nextInputToProcess.fetch_add(1))<inputs.size()){
+		MixerInput& in=inputs[i];
+		if(in.active){
+			in.result=in.source->InvokeCallback(reinterpret_cast<unsigned char*>(in.frame), 960*2);
+		}else{
+			in.decoder->SkipFrame();
+			in.result=0;
+		}
+	}
+}
+
+void AudioMixer::RunDecoderThread(void* arg){
+	while(true){
+		decodeStartSemaphore.Acquire();
+		if(!decoderThreadsRunning)
+			break;
+		ProcessInputs();
+		decodeDoneSemaphore.Release();
+	}
+}
+
 void AudioMixer::RunThread(void* arg){
 	LOGV("AudioMixer thread started");
 	while(running){
@@ -121,16 +218,28 @@ void AudioMixer::RunThread(void* arg){
 		}
 		MutexGuard m(inputsMutex);
 		int16_t* buf=reinterpret_cast<int16_t*>(data);
-		int16_t input[960];
 		float out[960];
 		memset(out, 0, 960*4);
 		int usedInputs=0;
+
+		// Re-rank every 200ms, activity estimates don't change faster than that
+		if(frameCount++%10==0)
+			SelectActiveInputs();
+		nextInputToProcess.store(0);
+		unsigned int helpers=(unsigned int)std::min(decoderThreads.size(), inputs.size()>0 ? inputs.size()-1 : 0);
+		if(helpers>0)
+			decodeStartSemaphore.Release(helpers);
+		ProcessInputs();
+		for(unsigned int i=0;i<helpers;i++){
+			decodeDoneSemaphore.Acquire();
+		}
+
 		for(std::vector<MixerInput>::iterator in=inputs.begin();in!=inputs.end();++in){
-			size_t res=in->source->InvokeCallback(reinterpret_cast<unsigned char*>(input), 960*2);
-			if(!res || in->multiplier==0){
+			if(!in->result || in->multiplier==0){
 				//LOGV("AudioMixer: skipping silent packet");
 				continue;
 			}
+			int16_t* input=in->frame;
 			usedInputs++;
 			float k=in->multiplier;
 			if(k!=1){
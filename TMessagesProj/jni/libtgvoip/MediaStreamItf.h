@@ -13,10 +13,12 @@
 #include "threading.h"
 #include "BlockingQueue.h"
 #include "BufferPool.h"
+#include <atomic>
 
 namespace tgvoip{
 
 	class EchoCanceller;
+	class OpusDecoder;
 
 class MediaStreamItf{
 public:
@@ -40,14 +42,34 @@ private:
 		virtual void Start();
 		virtual void Stop();
 		void AddInput(MediaStreamItf* input);
+		/**
+		 * Add an input whose frames come from decoder, in synchronous mode. Such inputs can be skipped without
+		 * being decoded when they're muted or not among the loudest, see SetMaxActiveInputs.
+		 */
+		void AddInput(MediaStreamItf* input, OpusDecoder* decoder);
 		void RemoveInput(MediaStreamItf* input);
 		void SetInputVolume(MediaStreamItf* input, float volumeDB);
 		void SetEchoCanceller(EchoCanceller* aec);
+		/**
+		 * Only decode and mix the count inputs with the highest activity, 0 to mix everything (the default)
+		 */
+		void SetMaxActiveInputs(unsigned int count);
+		/**
+		 * Number of extra threads that decode inputs in parallel with the mixer thread. Must be called before Start().
+		 */
+		void SetDecoderThreadCount(unsigned int count);
 	private:
 		void RunThread(void* arg);
+		void RunDecoderThread(void* arg);
+		void ProcessInputs();
+		void SelectActiveInputs();
 		struct MixerInput{
 			MediaStreamItf* source;
 			float multiplier;
+			OpusDecoder* decoder;
+			bool active;
+			size_t result;
+			int16_t* frame;
 		};
 		Mutex inputsMutex;
 		void DoCallback(unsigned char* data, size_t length);
@@ -60,6 +82,14 @@ private:
 		Semaphore semaphore;
 		EchoCanceller* echoCanceller;
 		bool running;
+		std::vector<Thread*> decoderThreads;
+		unsigned int decoderThreadCount;
+		bool decoderThreadsRunning;
+		Semaphore decodeStartSemaphore;
+		Semaphore decodeDoneSemaphore;
+		std::atomic<unsigned int> nextInputToProcess;
+		unsigned int maxActiveInputs;
+		unsigned int frameCount;
 	};
 
 	class CallbackWrapper : public MediaStreamItf{
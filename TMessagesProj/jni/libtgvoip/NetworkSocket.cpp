@@ -12,6 +12,7 @@
 #include <winsock2.h>
 #else
 #include "os/posix/NetworkSocketPosix.h"
+#include <unistd.h>
 #endif
 #include "logging.h"
 #include "VoIPServerConfig.h"
@@ -236,6 +237,10 @@ SocketSelectCanceller *SocketSelectCanceller::Create(){
 
 NetworkSocketTCPObfuscated::NetworkSocketTCPObfuscated(NetworkSocket *wrapped) : NetworkSocketWrapper(PROTO_TCP){
 	this->wrapped=wrapped;
+	sendBufferLength=0;
+	corked=false;
+	recvBufferLength=0;
+	recvBufferOffset=0;
 }
 
 NetworkSocketTCPObfuscated::~NetworkSocketTCPObfuscated(){
@@ -254,62 +259,115 @@ void NetworkSocketTCPObfuscated::InitConnection(){
 }
 
 void NetworkSocketTCPObfuscated::Send(NetworkPacket *packet){
-	BufferOutputStream os(packet->length+4);
 	size_t len=packet->length/4;
+	size_t headerLen=len<0x7F ? 1 : 4;
+	if(headerLen+packet->length>sizeof(sendBuffer)){
+		LOGW("packet too big to send over TCP (%u)", (unsigned int)packet->length);
+		return;
+	}
+	if(sendBufferLength+headerLen+packet->length>sizeof(sendBuffer))
+		Flush();
+	unsigned char* frame=sendBuffer+sendBufferLength;
 	if(len<0x7F){
-		os.WriteByte((unsigned char)len);
+		frame[0]=(unsigned char)len;
 	}else{
-		os.WriteByte(0x7F);
-		os.WriteByte((unsigned char)(len & 0xFF));
-		os.WriteByte((unsigned char)((len >> 8) & 0xFF));
-		os.WriteByte((unsigned char)((len >> 16) & 0xFF));
+		frame[0]=0x7F;
+		frame[1]=(unsigned char)(len & 0xFF);
+		frame[2]=(unsigned char)((len >> 8) & 0xFF);
+		frame[3]=(unsigned char)((len >> 16) & 0xFF);
 	}
-	os.WriteBytes(packet->data, packet->length);
-	EncryptForTCPO2(os.GetBuffer(), os.GetLength(), &sendState);
-	wrapped->Send(os.GetBuffer(), os.GetLength());
-	//LOGD("Sent %u bytes", os.GetLength());
+	memcpy(frame+headerLen, packet->data, packet->length);
+	// CTR is a stream cipher, so encrypting frames one after another is the same as encrypting the whole batch
+	EncryptForTCPO2(frame, headerLen+packet->length, &sendState);
+	sendBufferLength+=headerLen+packet->length;
+	if(!corked)
+		Flush();
 }
 
-void NetworkSocketTCPObfuscated::Receive(NetworkPacket *packet){
-	unsigned char len1;
-	size_t packetLen=0;
-	size_t offset=0;
-	size_t len;
-	wrapped->Receive(&len1, 1);
-	/*if(len<=0)
-		goto failed;*/
-	EncryptForTCPO2(&len1, 1, &recvState);
-
-	if(len1<0x7F){
-		packetLen=(size_t)len1*4;
+void NetworkSocketTCPObfuscated::SetCorked(bool corked){
+	this->corked=corked;
+	if(!corked)
+		Flush();
+}
+
+void NetworkSocketTCPObfuscated::Flush(){
+	if(!sendBufferLength)
+		return;
+	wrapped->Send(sendBuffer, sendBufferLength);
+	//LOGD("Sent %u bytes", sendBufferLength);
+	sendBufferLength=0;
+}
+
+size_t NetworkSocketTCPObfuscated::GetUnsentBytes(){
+	return sendBufferLength+wrapped->GetUnsentBytes();
+}
+
+bool NetworkSocketTCPObfuscated::TakeBufferedPacket(NetworkPacket *packet){
+	size_t avail=recvBufferLength-recvBufferOffset;
+	if(avail<1)
+		return false;
+	unsigned char* frame=recvBuffer+recvBufferOffset;
+	size_t headerLen, packetLen;
+	if(frame[0]<0x7F){
+		headerLen=1;
+		packetLen=(size_t)frame[0]*4;
 	}else{
-		unsigned char len2[3];
-		len=wrapped->Receive(len2, 3);
-		/*if(len<=0)
-			goto failed;*/
-		EncryptForTCPO2(len2, 3, &recvState);
-		packetLen=((size_t)len2[0] | ((size_t)len2[1] << 8) | ((size_t)len2[2] << 16))*4;
+		if(avail<4)
+			return false;
+		headerLen=4;
+		packetLen=((size_t)frame[1] | ((size_t)frame[2] << 8) | ((size_t)frame[3] << 16))*4;
 	}
-
+	if(headerLen+packetLen>sizeof(recvBuffer)){
+		LOGW("TCP frame too big (%u), dropping connection", (unsigned int)packetLen);
+		failed=true;
+		packet->length=0;
+		return true;
+	}
+	if(avail<headerLen+packetLen)
+		return false;
+	recvBufferOffset+=headerLen+packetLen;
 	if(packetLen>packet->length){
 		LOGW("packet too big to fit into buffer (%u vs %u)", (unsigned int)packetLen, (unsigned int)packet->length);
 		packet->length=0;
-		return;
-	}
-
-	while(offset<packetLen){
-		len=wrapped->Receive(packet->data+offset, packetLen-offset);
-		/*if(len<=0)
-			goto failed;*/
-		offset+=len;
+		return true;
 	}
-	EncryptForTCPO2(packet->data, packetLen, &recvState);
-	//packet->address=&itr->address;
+	memcpy(packet->data, frame+headerLen, packetLen);
 	packet->length=packetLen;
-	//packet->port=itr->port;
 	packet->protocol=PROTO_TCP;
 	packet->address=wrapped->GetConnectedAddress();
 	packet->port=wrapped->GetConnectedPort();
+	return true;
+}
+
+bool NetworkSocketTCPObfuscated::HasBufferedPackets(){
+	size_t avail=recvBufferLength-recvBufferOffset;
+	if(avail<1)
+		return false;
+	unsigned char* frame=recvBuffer+recvBufferOffset;
+	if(frame[0]<0x7F)
+		return avail>=1+(size_t)frame[0]*4;
+	if(avail<4)
+		return false;
+	return avail>=4+((size_t)frame[1] | ((size_t)frame[2] << 8) | ((size_t)frame[3] << 16))*4;
+}
+
+void NetworkSocketTCPObfuscated::Receive(NetworkPacket *packet){
+	// Read whatever the kernel has and decrypt it in one go, then hand out frames from the buffer.
+	// The receive thread checks HasBufferedPackets() before waiting in select again.
+	while(!TakeBufferedPacket(packet)){
+		if(recvBufferOffset>0){
+			memmove(recvBuffer, recvBuffer+recvBufferOffset, recvBufferLength-recvBufferOffset);
+			recvBufferLength-=recvBufferOffset;
+			recvBufferOffset=0;
+		}
+		size_t len=wrapped->Receive(recvBuffer+recvBufferLength, sizeof(recvBuffer)-recvBufferLength);
+		if(wrapped->IsFailed() || len==0){
+			packet->length=0;
+			return;
+		}
+		EncryptForTCPO2(recvBuffer+recvBufferLength, len, &recvState);
+		recvBufferLength+=len;
+	}
 }
 
 void NetworkSocketTCPObfuscated::Open(){
@@ -325,7 +383,7 @@ void NetworkSocketTCPObfuscated::Connect(NetworkAddress *address, uint16_t port)
 }
 
 bool NetworkSocketTCPObfuscated::IsFailed(){
-	return wrapped->IsFailed();
+	return NetworkSocket::IsFailed() || wrapped->IsFailed();
 }
 
 NetworkSocketSOCKS5Proxy::NetworkSocketSOCKS5Proxy(NetworkSocket *tcp, NetworkSocket *udp, std::string username, std::string password) : NetworkSocketWrapper(udp ? PROTO_UDP : PROTO_TCP){
@@ -607,3 +665,292 @@ NetworkAddress *NetworkSocketSOCKS5Proxy::GetConnectedAddress(){
 uint16_t NetworkSocketSOCKS5Proxy::GetConnectedPort(){
 	return connectedPort;
 }
+
+size_t NetworkSocketSOCKS5Proxy::GetUnsentBytes(){
+	return tcp ? tcp->GetUnsentBytes() : 0;
+}
+
+// incoming packets are passed to the loopback socket with their original source in front:
+// address family (4 or 6), 16 bytes of address and the port in network byte order
+#define SIMULATOR_HEADER_SIZE 19
+
+NetworkSocketSimulator::NetworkSocketSimulator(NetworkSocket *wrapped, int delay, int jitter, double lossProbability, double reorderProbability) : NetworkSocketWrapper(PROTO_UDP), loopbackAddress("127.0.0.1"){
+	this->wrapped=wrapped;
+	this->delay=delay/1000.0;
+	this->jitter=jitter/1000.0;
+	this->lossProbability=lossProbability;
+	this->reorderProbability=reorderProbability;
+	loopback=NetworkSocket::Create(PROTO_UDP);
+	receiveCanceller=SocketSelectCanceller::Create();
+	outgoing.lastScheduledTime=incoming.lastScheduledTime=0;
+	outgoing.passedCount=outgoing.droppedCount=outgoing.reorderedCount=0;
+	incoming.passedCount=incoming.droppedCount=incoming.reorderedCount=0;
+	randomState=(uint32_t)(VoIPController::GetCurrentTime()*1000000) | 1;
+	thread=NULL;
+	receiveThread=NULL;
+	running=false;
+	LOGI("Simulating network conditions each way: delay %d ms, jitter %d ms, loss %.1f%%, reordering %.1f%%", delay, jitter, lossProbability*100, reorderProbability*100);
+}
+
+NetworkSocketSimulator::~NetworkSocketSimulator(){
+	Close();
+	for(std::vector<DelayedPacket>::iterator p=outgoing.queue.begin();p!=outgoing.queue.end();++p){
+		free(p->data);
+		delete p->address;
+	}
+	for(std::vector<DelayedPacket>::iterator p=incoming.queue.begin();p!=incoming.queue.end();++p){
+		free(p->data);
+		delete p->address;
+	}
+	delete receiveCanceller;
+	delete loopback;
+	delete wrapped;
+}
+
+double NetworkSocketSimulator::NextRandom(){
+	// xorshift32, good enough for deciding the fate of packets and not shared with anything else
+	randomState^=randomState << 13;
+	randomState^=randomState >> 17;
+	randomState^=randomState << 5;
+	return randomState/4294967296.0;
+}
+
+void NetworkSocketSimulator::Schedule(Direction& direction, NetworkPacket *packet){
+	MutexGuard m(queueMutex);
+	if(NextRandom()<lossProbability){
+		direction.droppedCount++;
+		return;
+	}
+	double now=VoIPController::GetCurrentTime();
+	double sendTime=now+delay+jitter*NextRandom();
+	if(NextRandom()<reorderProbability){
+		// hold this one back long enough for the following packets to overtake it
+		sendTime+=jitter+0.02;
+		direction.reorderedCount++;
+	}else{
+		// otherwise jitter doesn't change the order, like on a real path
+		if(sendTime<direction.lastScheduledTime)
+			sendTime=direction.lastScheduledTime;
+		direction.lastScheduledTime=sendTime;
+	}
+	DelayedPacket p;
+	p.sendTime=sendTime;
+	p.data=(unsigned char*)malloc(packet->length);
+	memcpy(p.data, packet->data, packet->length);
+	p.length=packet->length;
+	p.port=packet->port;
+	p.protocol=packet->protocol;
+	p.address=NULL;
+	if(packet->address){
+		IPv4Address* v4=dynamic_cast<IPv4Address*>(packet->address);
+		IPv6Address* v6=dynamic_cast<IPv6Address*>(packet->address);
+		if(v4)
+			p.address=new IPv4Address(*v4);
+		else if(v6)
+			p.address=new IPv6Address(*v6);
+	}
+	direction.queue.push_back(p);
+}
+
+void NetworkSocketSimulator::Send(NetworkPacket *packet){
+	Schedule(outgoing, packet);
+}
+
+void NetworkSocketSimulator::RunSendThread(void *arg){
+	std::vector<DelayedPacket> dueOutgoing;
+	std::vector<DelayedPacket> dueIncoming;
+	while(running){
+#ifndef _WIN32
+		usleep(1000);
+#else
+		Sleep(1);
+#endif
+		double now=VoIPController::GetCurrentTime();
+		{
+			MutexGuard m(queueMutex);
+			for(std::vector<DelayedPacket>::iterator p=outgoing.queue.begin();p!=outgoing.queue.end();){
+				if(p->sendTime<=now){
+					dueOutgoing.push_back(*p);
+					p=outgoing.queue.erase(p);
+				}else{
+					++p;
+				}
+			}
+			for(std::vector<DelayedPacket>::iterator p=incoming.queue.begin();p!=incoming.queue.end();){
+				if(p->sendTime<=now){
+					dueIncoming.push_back(*p);
+					p=incoming.queue.erase(p);
+				}else{
+					++p;
+				}
+			}
+		}
+		for(std::vector<DelayedPacket>::iterator p=dueOutgoing.begin();p!=dueOutgoing.end();++p){
+			NetworkPacket pkt={0};
+			pkt.data=p->data;
+			pkt.length=p->length;
+			pkt.address=p->address;
+			pkt.port=p->port;
+			pkt.protocol=p->protocol;
+			wrapped->Send(&pkt);
+			outgoing.passedCount++;
+			free(p->data);
+			delete p->address;
+		}
+		for(std::vector<DelayedPacket>::iterator p=dueIncoming.begin();p!=dueIncoming.end();++p){
+			DeliverIncoming(*p);
+			incoming.passedCount++;
+			free(p->data);
+			delete p->address;
+		}
+		dueOutgoing.clear();
+		dueIncoming.clear();
+	}
+}
+
+void NetworkSocketSimulator::DeliverIncoming(DelayedPacket& packet){
+	unsigned char buf[1500+SIMULATOR_HEADER_SIZE];
+	if(!packet.address || packet.length>1500)
+		return;
+	memset(buf, 0, SIMULATOR_HEADER_SIZE);
+	IPv4Address* v4=dynamic_cast<IPv4Address*>(packet.address);
+	if(v4){
+		uint32_t addr=v4->GetAddress();
+		buf[0]=4;
+		memcpy(buf+1, &addr, 4);
+	}else{
+		buf[0]=6;
+		memcpy(buf+1, dynamic_cast<IPv6Address*>(packet.address)->GetAddress(), 16);
+	}
+	buf[17]=(unsigned char)(packet.port >> 8);
+	buf[18]=(unsigned char)packet.port;
+	memcpy(buf+SIMULATOR_HEADER_SIZE, packet.data, packet.length);
+	NetworkPacket pkt={0};
+	pkt.data=buf;
+	pkt.length=packet.length+SIMULATOR_HEADER_SIZE;
+	pkt.address=&loopbackAddress;
+	pkt.port=loopback->GetLocalPort();
+	pkt.protocol=PROTO_UDP;
+	loopback->Send(&pkt);
+}
+
+void NetworkSocketSimulator::RunReceiveThread(void *arg){
+	unsigned char buf[1500];
+	while(running){
+		std::vector<NetworkSocket*> readSockets;
+		std::vector<NetworkSocket*> errorSockets;
+		readSockets.push_back(wrapped);
+		errorSockets.push_back(wrapped);
+		if(!NetworkSocket::Select(readSockets, errorSockets, receiveCanceller) || !running)
+			continue;
+		if(!errorSockets.empty())
+			break;
+		if(readSockets.empty())
+			continue;
+		NetworkPacket pkt={0};
+		pkt.data=buf;
+		pkt.length=sizeof(buf);
+		wrapped->Receive(&pkt);
+		if(pkt.length && pkt.address)
+			Schedule(incoming, &pkt);
+	}
+}
+
+void NetworkSocketSimulator::Receive(NetworkPacket *packet){
+	unsigned char buf[1500+SIMULATOR_HEADER_SIZE];
+	NetworkPacket pkt={0};
+	pkt.data=buf;
+	pkt.length=sizeof(buf);
+	loopback->Receive(&pkt);
+	IPv4Address* from=dynamic_cast<IPv4Address*>(pkt.address);
+	if(pkt.length<SIMULATOR_HEADER_SIZE || !from || from->GetAddress()!=loopbackAddress.GetAddress() || pkt.port!=loopback->GetLocalPort()){
+		packet->length=0;
+		packet->address=NULL;
+		return;
+	}
+	if(buf[0]==4){
+		uint32_t addr;
+		memcpy(&addr, buf+1, 4);
+		lastRecvdV4=IPv4Address(addr);
+		packet->address=&lastRecvdV4;
+	}else{
+		lastRecvdV6=IPv6Address(buf+1);
+		packet->address=&lastRecvdV6;
+	}
+	packet->port=(uint16_t)((buf[17] << 8) | buf[18]);
+	packet->protocol=PROTO_UDP;
+	packet->length=std::min(packet->length, pkt.length-SIMULATOR_HEADER_SIZE);
+	memcpy(packet->data, buf+SIMULATOR_HEADER_SIZE, packet->length);
+}
+
+void NetworkSocketSimulator::Open(){
+	wrapped->Open();
+	loopback->Open();
+	if(running)
+		return;
+	running=true;
+	thread=new Thread(new MethodPointer<NetworkSocketSimulator>(&NetworkSocketSimulator::RunSendThread, this), NULL);
+	thread->SetName("NetworkSimulator");
+	thread->Start();
+	receiveThread=new Thread(new MethodPointer<NetworkSocketSimulator>(&NetworkSocketSimulator::RunReceiveThread, this), NULL);
+	receiveThread->SetName("NetworkSimulatorRecv");
+	receiveThread->Start();
+}
+
+void NetworkSocketSimulator::Close(){
+	if(running){
+		running=false;
+		receiveCanceller->CancelSelect();
+		receiveThread->Join();
+		delete receiveThread;
+		receiveThread=NULL;
+		thread->Join();
+		delete thread;
+		thread=NULL;
+		LOGI("Network simulator: outgoing sent %u, dropped %u, reordered %u; incoming passed %u, dropped %u, reordered %u",
+			 outgoing.passedCount, outgoing.droppedCount, outgoing.reorderedCount, incoming.passedCount, incoming.droppedCount, incoming.reorderedCount);
+	}
+	wrapped->Close();
+	loopback->Close();
+}
+
+void NetworkSocketSimulator::Connect(NetworkAddress *address, uint16_t port){
+	wrapped->Connect(address, port);
+}
+
+NetworkSocket *NetworkSocketSimulator::GetWrapped(){
+	// this is only used to find the descriptor to select on, and incoming packets become readable on the loopback socket
+	return loopback;
+}
+
+void NetworkSocketSimulator::InitConnection(){
+
+}
+
+bool NetworkSocketSimulator::IsFailed(){
+	return wrapped->IsFailed() || loopback->IsFailed();
+}
+
+uint16_t NetworkSocketSimulator::GetLocalPort(){
+	return wrapped->GetLocalPort();
+}
+
+std::string NetworkSocketSimulator::GetLocalInterfaceInfo(IPv4Address *inet4addr, IPv6Address *inet6addr){
+	return wrapped->GetLocalInterfaceInfo(inet4addr, inet6addr);
+}
+
+void NetworkSocketSimulator::OnActiveInterfaceChanged(){
+	wrapped->OnActiveInterfaceChanged();
+}
+
+NetworkAddress *NetworkSocketSimulator::GetConnectedAddress(){
+	return wrapped->GetConnectedAddress();
+}
+
+uint16_t NetworkSocketSimulator::GetConnectedPort(){
+	return wrapped->GetConnectedPort();
+}
+
+void NetworkSocketSimulator::SetTimeouts(int sendTimeout, int recvTimeout){
+	wrapped->SetTimeouts(sendTimeout, recvTimeout);
+}
@@ -8,6 +8,7 @@
 #include <stdint.h>
 #include <string>
 #include <vector>
+#include "threading.h"
 
 namespace tgvoip {
 
@@ -89,6 +90,8 @@ namespace tgvoip {
 		virtual NetworkAddress* GetConnectedAddress(){ return NULL; };
 		virtual uint16_t GetConnectedPort(){ return 0; };
 		virtual void SetTimeouts(int sendTimeout, int recvTimeout){};
+		virtual bool HasBufferedPackets(){ return false; };
+		virtual size_t GetUnsentBytes(){ return 0; };
 
 		virtual bool IsFailed();
 		void SetSocksProxy(IPv4Address* addr, uint16_t port, char* username, char* password);
@@ -132,13 +135,24 @@ namespace tgvoip {
 		virtual void Open();
 		virtual void Close();
 		virtual void Connect(NetworkAddress *address, uint16_t port);
+		virtual bool HasBufferedPackets();
+		virtual size_t GetUnsentBytes();
+		void SetCorked(bool corked);
 
 		virtual bool IsFailed();
 
 	private:
+		bool TakeBufferedPacket(NetworkPacket* packet);
+		void Flush();
 		NetworkSocket* wrapped;
 		TCPO2State recvState;
 		TCPO2State sendState;
+		unsigned char sendBuffer[8192];
+		size_t sendBufferLength;
+		bool corked;
+		unsigned char recvBuffer[8192];
+		size_t recvBufferLength;
+		size_t recvBufferOffset;
 	};
 
 	class NetworkSocketSOCKS5Proxy : public NetworkSocketWrapper{
@@ -155,6 +169,7 @@ namespace tgvoip {
 		virtual bool IsFailed();
 		virtual NetworkAddress *GetConnectedAddress();
 		virtual uint16_t GetConnectedPort();
+		virtual size_t GetUnsentBytes();
 
 	private:
 		NetworkSocket* tcp;
@@ -168,6 +183,72 @@ namespace tgvoip {
 		IPv6Address lastRecvdV6;
 	};
 
+	/**
+	 * Adds artificial delay, jitter, loss and reordering to the wrapped UDP socket, in both directions: every packet
+	 * sent or received goes through the same conditions once. The wrapped socket is owned by this object.
+	 * Incoming packets are read from the wrapped socket on a thread of their own and, when due, passed on through
+	 * a second socket bound to the loopback interface, which is what GetWrapped() returns for Select().
+	 * Only for testing under reproducible network conditions.
+	 */
+	class NetworkSocketSimulator : public NetworkSocketWrapper{
+	public:
+		NetworkSocketSimulator(NetworkSocket* wrapped, int delay, int jitter, double lossProbability, double reorderProbability);
+		virtual ~NetworkSocketSimulator();
+		virtual void Send(NetworkPacket *packet);
+		virtual void Receive(NetworkPacket *packet);
+		virtual void Open();
+		virtual void Close();
+		virtual void Connect(NetworkAddress *address, uint16_t port);
+		virtual NetworkSocket *GetWrapped();
+		virtual void InitConnection();
+		virtual bool IsFailed();
+		virtual uint16_t GetLocalPort();
+		virtual std::string GetLocalInterfaceInfo(IPv4Address* inet4addr, IPv6Address* inet6addr);
+		virtual void OnActiveInterfaceChanged();
+		virtual NetworkAddress *GetConnectedAddress();
+		virtual uint16_t GetConnectedPort();
+		virtual void SetTimeouts(int sendTimeout, int recvTimeout);
+
+	private:
+		struct DelayedPacket{
+			double sendTime;
+			unsigned char* data;
+			size_t length;
+			NetworkAddress* address;
+			uint16_t port;
+			NetworkProtocol protocol;
+		};
+		struct Direction{
+			std::vector<DelayedPacket> queue;
+			double lastScheduledTime;
+			unsigned int passedCount;
+			unsigned int droppedCount;
+			unsigned int reorderedCount;
+		};
+		void RunSendThread(void* arg);
+		void RunReceiveThread(void* arg);
+		void Schedule(Direction& direction, NetworkPacket* packet);
+		void DeliverIncoming(DelayedPacket& packet);
+		double NextRandom();
+		NetworkSocket* wrapped;
+		NetworkSocket* loopback;
+		IPv4Address loopbackAddress;
+		SocketSelectCanceller* receiveCanceller;
+		double delay;
+		double jitter;
+		double lossProbability;
+		double reorderProbability;
+		Direction outgoing;
+		Direction incoming;
+		uint32_t randomState;
+		Mutex queueMutex;
+		Thread* thread;
+		Thread* receiveThread;
+		bool running;
+		IPv4Address lastRecvdV4;
+		IPv6Address lastRecvdV6;
+	};
+
 }
 
 #endif //LIBTGVOIP_NETWORKSOCKET_H
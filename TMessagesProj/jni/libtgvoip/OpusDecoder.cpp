@@ -7,12 +7,16 @@
 #include "OpusDecoder.h"
 #include "audio/Resampler.h"
 #include "logging.h"
+#include "VoIPServerConfig.h"
 #include <assert.h>
 #include <algorithm>
 
 #include "VoIPController.h"
 
 #define PACKET_SIZE (960*2)
+#define DECODED_QUEUE_SIZE 32
+// one packet can be stretched to 80 ms
+#define MAX_FRAMES_PER_DECODE 4
 
 using namespace tgvoip;
 
@@ -20,9 +24,10 @@ tgvoip::OpusDecoder::OpusDecoder(MediaStreamItf *dst, bool isAsync){
 	async=isAsync;
 	dst->SetCallback(OpusDecoder::Callback, this);
 	if(async){
-		decodedQueue=new BlockingQueue<unsigned char*>(33);
-		bufferPool=new BufferPool(PACKET_SIZE, 32);
-		semaphore=new Semaphore(32, 0);
+		decodedQueue=new SPSCQueue<unsigned char*>(DECODED_QUEUE_SIZE);
+		// +1 for the frame the output callback holds on to for concealment
+		bufferPool=new BufferPool(PACKET_SIZE, DECODED_QUEUE_SIZE+1);
+		semaphore=new Semaphore(DECODED_QUEUE_SIZE, 0);
 	}else{
 		decodedQueue=NULL;
 		bufferPool=NULL;
@@ -42,6 +47,15 @@ tgvoip::OpusDecoder::OpusDecoder(MediaStreamItf *dst, bool isAsync){
 	running=false;
 	remainingDataLen=0;
 	processedBuffer=NULL;
+	fecRecoveredPackets=0;
+	cpuTime.store(0);
+	activity=0;
+	skippedPacket=false;
+	needsReset=false;
+	decodeAheadMin=0;
+	decodeAheadMax=0;
+	consecutiveUnderruns=0;
+	underrunCount=0;
 }
 
 tgvoip::OpusDecoder::~OpusDecoder(){
@@ -77,17 +91,48 @@ size_t tgvoip::OpusDecoder::HandleCallback(unsigned char *data, size_t len){
 				packetsNeeded=len/PACKET_SIZE;
 			else
 				packetsNeeded=1;
-			packetsNeeded*=2;
-			semaphore->Release(packetsNeeded);
+			decodeAheadMin=(size_t)packetsNeeded*2;
+			decodeAheadMax=decodeAheadMin+(size_t)ServerConfig::GetSharedInstance()->GetInt("audio_decode_ahead_frames", 3);
+			if(decodeAheadMax>DECODED_QUEUE_SIZE-MAX_FRAMES_PER_DECODE)
+				decodeAheadMax=DECODED_QUEUE_SIZE-MAX_FRAMES_PER_DECODE;
+			semaphore->Release();
 		}
 		assert(outputBufferSize==len && "output buffer size is supposed to be the same throughout callbacks");
 		if(len==PACKET_SIZE){
-			lastDecoded=(unsigned char *) decodedQueue->GetBlocking();
-			if(!lastDecoded)
-				return 0;
-			memcpy(data, lastDecoded, PACKET_SIZE);
-			bufferPool->Reuse(lastDecoded);
-			semaphore->Release();
+			unsigned char* frame;
+			if(!decodedQueue->Get(&frame)){
+				// The decoder thread fell behind. Never wait for it here, fade out what was played last instead
+				// and let the jitter buffer's own concealment take over from the next decoded frame.
+				underrunCount++;
+				jitterBuffer->SetOutputQueueDelay(0);
+				semaphore->Release();
+				if(lastDecoded && consecutiveUnderruns==0 && silentPacketCount==0){
+					int16_t* src=reinterpret_cast<int16_t*>(lastDecoded);
+					int16_t* dst=reinterpret_cast<int16_t*>(data);
+					for(int i=0;i<960;i++){
+						dst[i]=(int16_t)((int32_t)src[i]*(960-i)/960);
+					}
+					consecutiveUnderruns++;
+				}else{
+					consecutiveUnderruns++;
+					memset(data, 0, PACKET_SIZE);
+					if(levelMeter)
+						levelMeter->Update(reinterpret_cast<int16_t *>(data), 0);
+					return 0;
+				}
+			}else{
+				consecutiveUnderruns=0;
+				memcpy(data, frame, PACKET_SIZE);
+				// keep the previous frame around until this one is replaced, in case the next callback has to conceal
+				if(lastDecoded)
+					bufferPool->Reuse(lastDecoded);
+				lastDecoded=frame;
+				size_t queued=decodedQueue->Size();
+				jitterBuffer->SetOutputQueueDelay((unsigned int)queued*20);
+				// top the ring up as soon as it drops below the target instead of letting it drain to the minimum
+				if(queued<decodeAheadMax)
+					semaphore->Release();
+			}
 			if(silentPacketCount>0){
 				silentPacketCount--;
 				if(levelMeter)
@@ -106,9 +151,11 @@ size_t tgvoip::OpusDecoder::HandleCallback(unsigned char *data, size_t len){
 			int duration=DecodeNextFrame();
 			remainingDataLen=(size_t) (duration/20*960*2);
 		}
-		if(silentPacketCount>0 || remainingDataLen==0 || !processedBuffer){
+		if(silentPacketCount>0 || remainingDataLen==0 || !processedBuffer || skippedPacket){
 			if(silentPacketCount>0)
 				silentPacketCount--;
+			else if(skippedPacket && remainingDataLen>0)
+				remainingDataLen-=960*2;
 			memset(data, 0, 960*2);
 			if(levelMeter)
 				levelMeter->Update(reinterpret_cast<int16_t *>(data), 0);
@@ -143,36 +190,52 @@ void tgvoip::OpusDecoder::Stop(){
 	semaphore->Release();
 	thread->Join();
 	delete thread;
+	LOGI("decoder: %u output underruns", underrunCount);
 }
 
 void tgvoip::OpusDecoder::RunThread(void* param){
-	int i;
 	LOGI("decoder: packets per frame %d", packetsPerFrame);
 	while(running){
-		int playbackDuration=DecodeNextFrame();
-		for(i=0;i<playbackDuration/20;i++){
-			semaphore->Acquire();
-			if(!running){
-				LOGI("==== decoder exiting ====");
-				return;
-			}
-			unsigned char *buf=bufferPool->Get();
-			if(buf){
-				if(remainingDataLen>0){
-					for(std::vector<AudioEffect*>::iterator effect=postProcEffects.begin();effect!=postProcEffects.end();++effect){
-						(*effect)->Process(reinterpret_cast<int16_t*>(processedBuffer+(PACKET_SIZE*i)), 960);
-					}
-					memcpy(buf, processedBuffer+(PACKET_SIZE*i), PACKET_SIZE);
-				}else{
-					//LOGE("Error decoding, result=%d", size);
-					memset(buf, 0, PACKET_SIZE);
+		semaphore->Acquire();
+		// Refill in one batch. Below the minimum depth decode no matter what, the jitter buffer conceals what
+		// hasn't arrived. Above it, only go further ahead with packets that are already here, so that decoding
+		// early never turns a packet that's just a bit late into a lost one.
+		while(running){
+			size_t queued=decodedQueue->Size();
+			if(queued+MAX_FRAMES_PER_DECODE>DECODED_QUEUE_SIZE)
+				break;
+			// the limits are in 20 ms frames, a decode adds a whole packet of them, so the depth ends up
+			// between decodeAheadMax and decodeAheadMax+packetsPerFrame-1
+			if(queued>=decodeAheadMin && (queued>=decodeAheadMax || !jitterBuffer->HasOutput(0)))
+				break;
+			DecodeAndQueueFrames();
+		}
+	}
+	LOGI("==== decoder exiting ====");
+}
+
+void tgvoip::OpusDecoder::DecodeAndQueueFrames(){
+	int i;
+	int playbackDuration=DecodeNextFrame();
+	for(i=0;i<playbackDuration/20;i++){
+		unsigned char *buf=bufferPool->Get();
+		if(buf){
+			if(remainingDataLen>0){
+				for(std::vector<AudioEffect*>::iterator effect=postProcEffects.begin();effect!=postProcEffects.end();++effect){
+					(*effect)->Process(reinterpret_cast<int16_t*>(processedBuffer+(PACKET_SIZE*i)), 960);
 				}
-				decodedQueue->Put(buf);
+				memcpy(buf, processedBuffer+(PACKET_SIZE*i), PACKET_SIZE);
 			}else{
-				LOGW("decoder: no buffers left!");
+				//LOGE("Error decoding, result=%d", size);
+				memset(buf, 0, PACKET_SIZE);
 			}
+			if(!decodedQueue->Put(buf))
+				bufferPool->Reuse(buf);
+		}else{
+			LOGW("decoder: no buffers left!");
 		}
 	}
+	jitterBuffer->SetOutputQueueDelay((unsigned int)decodedQueue->Size()*20);
 }
 
 int tgvoip::OpusDecoder::DecodeNextFrame(){
@@ -190,14 +253,24 @@ int tgvoip::OpusDecoder::DecodeNextFrame(){
 		if(inLen)
 		LOGV("Decoding late packet");
 	}*/
+	if(needsReset){
+		// we skipped some packets, start over instead of continuing from stale state
+		opus_decoder_ctl(dec, OPUS_RESET_STATE);
+		needsReset=false;
+	}
+	skippedPacket=false;
 	int playbackDuration=0;
 	size_t len=jitterBuffer->HandleOutput(buffer, 8192, 0, true, &playbackDuration);
+	activity=activity*0.7f+(float)len*0.3f;
 	bool fec=false;
 	if(!len){
-		fec=true;
-		len=jitterBuffer->HandleOutput(buffer, 8192, 0, false, &playbackDuration);
-		if(len)
-			LOGV("Trying FEC...");
+		// The jitter buffer has already advanced past the missing packet. If the one after it is already here,
+		// reconstruct the lost frame from its in-band FEC data but leave it in the buffer to be played normally next time.
+		len=jitterBuffer->PeekOutput(buffer, 8192, 0);
+		if(len){
+			fec=true;
+			fecRecoveredPackets+=packetsPerFrame;
+		}
 	}
 	int size;
 	if(len){
@@ -225,6 +298,7 @@ int tgvoip::OpusDecoder::DecodeNextFrame(){
 	}else{
 		processedBuffer=decodeBuffer;
 	}
+	cpuTime.store((uint32_t)(VoIPController::GetCurrentThreadCPUTime()*1000), std::memory_order_relaxed);
 	return playbackDuration;
 }
 
@@ -251,6 +325,36 @@ void tgvoip::OpusDecoder::AddAudioEffect(AudioEffect *effect){
 	postProcEffects.push_back(effect);
 }
 
+unsigned int tgvoip::OpusDecoder::GetFECRecoveredPacketCount(){
+	return fecRecoveredPackets;
+}
+
+uint32_t tgvoip::OpusDecoder::GetCPUTime(){
+	return cpuTime.load(std::memory_order_relaxed);
+}
+
+void tgvoip::OpusDecoder::SkipFrame(){
+	assert(!async);
+	if(remainingDataLen==0 && silentPacketCount==0){
+		int playbackDuration=0;
+		size_t len=jitterBuffer->HandleOutput(buffer, 8192, 0, true, &playbackDuration);
+		activity=activity*0.7f+(float)len*0.3f;
+		remainingDataLen=(size_t) (playbackDuration/20*960*2);
+		skippedPacket=true;
+		needsReset=true;
+	}
+	if(silentPacketCount>0)
+		silentPacketCount--;
+	else if(remainingDataLen>0)
+		remainingDataLen-=960*2;
+	if(levelMeter)
+		levelMeter->Update(NULL, 0);
+}
+
+float tgvoip::OpusDecoder::GetActivity(){
+	return activity;
+}
+
 void tgvoip::OpusDecoder::RemoveAudioEffect(AudioEffect *effect){
 	std::vector<AudioEffect*>::iterator i=std::find(postProcEffects.begin(), postProcEffects.end(), effect);
 	if(i!=postProcEffects.end())
@@ -11,12 +11,13 @@
 #include "MediaStreamItf.h"
 #include "opus.h"
 #include "threading.h"
-#include "BlockingQueue.h"
+#include "SPSCQueue.h"
 #include "BufferPool.h"
 #include "EchoCanceller.h"
 #include "JitterBuffer.h"
 #include <stdio.h>
 #include <vector>
+#include <atomic>
 
 namespace tgvoip{
 class OpusDecoder {
@@ -35,13 +36,32 @@ public:
 	void SetLevelMeter(AudioLevelMeter* levelMeter);
 	void AddAudioEffect(AudioEffect* effect);
 	void RemoveAudioEffect(AudioEffect* effect);
+	/**
+	 * @return the number of 20ms frames that were reconstructed from in-band FEC instead of being concealed
+	 */
+	unsigned int GetFECRecoveredPacketCount();
+	/**
+	 * @return CPU time used so far by the thread that decodes, in milliseconds
+	 */
+	uint32_t GetCPUTime();
+	/**
+	 * Synchronous mode only. Consumes the next 20ms from the jitter buffer like HandleCallback would, but without
+	 * decoding anything. For streams that aren't being listened to at the moment.
+	 */
+	void SkipFrame();
+	/**
+	 * @return a moving average of received packet sizes in bytes. Silent streams send nothing, so it's a cheap
+	 * estimate of how much this stream is talking that doesn't require decoding it.
+	 */
+	float GetActivity();
 
 private:
 	static size_t Callback(unsigned char* data, size_t len, void* param);
 	void RunThread(void* param);
 	int DecodeNextFrame();
+	void DecodeAndQueueFrames();
 	::OpusDecoder* dec;
-	BlockingQueue<unsigned char*>* decodedQueue;
+	SPSCQueue<unsigned char*>* decodedQueue;
 	BufferPool* bufferPool;
 	unsigned char* buffer;
 	unsigned char* lastDecoded;
@@ -65,6 +85,15 @@ private:
 	size_t nextLen;
 	unsigned int packetsPerFrame;
 	ssize_t remainingDataLen;
+	unsigned int fecRecoveredPackets;
+	std::atomic<uint32_t> cpuTime;
+	float activity;
+	bool skippedPacket;
+	bool needsReset;
+	size_t decodeAheadMin;
+	size_t decodeAheadMax;
+	unsigned int consecutiveUnderruns;
+	unsigned int underrunCount;
 };
 }
 
@@ -8,6 +8,7 @@
 #include <assert.h>
 #include "logging.h"
 #include "VoIPServerConfig.h"
+#include "VoIPController.h"
 
 tgvoip::OpusEncoder::OpusEncoder(MediaStreamItf *source):queue(11), bufferPool(960*2, 10){
 	this->source=source;
@@ -25,6 +26,11 @@ tgvoip::OpusEncoder::OpusEncoder(MediaStreamItf *source):queue(11), bufferPool(9
 	complexity=10;
 	frameDuration=20;
 	levelMeter=NULL;
+	cpuTime.store(0);
+	fusedCapture=false;
+	frame=NULL;
+	bufferedCount=0;
+	packetsPerFrame=1;
 	mediumCorrectionBitrate=ServerConfig::GetSharedInstance()->GetInt("audio_medium_fec_bitrate", 10000);
 	strongCorrectionBitrate=ServerConfig::GetSharedInstance()->GetInt("audio_strong_fec_bitrate", 8000);
 	mediumCorrectionMultiplier=ServerConfig::GetSharedInstance()->GetDouble("audio_medium_fec_multiplier", 1.5);
@@ -33,12 +39,25 @@ tgvoip::OpusEncoder::OpusEncoder(MediaStreamItf *source):queue(11), bufferPool(9
 
 tgvoip::OpusEncoder::~OpusEncoder(){
 	opus_encoder_destroy(enc);
+	if(frame)
+		free(frame);
 }
 
 void tgvoip::OpusEncoder::Start(){
 	if(running)
 		return;
+	packetsPerFrame=frameDuration/20;
+	bufferedCount=0;
+	LOGV("starting encoder, packets per frame=%d, fused capture=%d", packetsPerFrame, fusedCapture);
+	if(frame)
+		free(frame);
+	if(packetsPerFrame>1)
+		frame=(unsigned char *) malloc(960*2*packetsPerFrame);
+	else
+		frame=NULL;
 	running=true;
+	if(fusedCapture)
+		return;
 	thread=new Thread(new MethodPointer<tgvoip::OpusEncoder>(&tgvoip::OpusEncoder::RunThread, this), NULL);
 	thread->SetName("OpusEncoder");
 	thread->Start();
@@ -49,6 +68,12 @@ void tgvoip::OpusEncoder::Stop(){
 	if(!running)
 		return;
 	running=false;
+	if(fusedCapture){
+		// wait for a capture callback that's already encoding a frame, the encoder may be deleted right after this
+		fusedMutex.Lock();
+		fusedMutex.Unlock();
+		return;
+	}
 	queue.Put(NULL);
 	thread->Join();
 	delete thread;
@@ -80,6 +105,14 @@ void tgvoip::OpusEncoder::Encode(unsigned char *data, size_t len){
 
 size_t tgvoip::OpusEncoder::Callback(unsigned char *data, size_t len, void* param){
 	OpusEncoder* e=(OpusEncoder*)param;
+	if(e->fusedCapture){
+		MutexGuard m(e->fusedMutex);
+		if(e->running){
+			assert(len==960*2);
+			e->ProcessCapturedFrame(data);
+		}
+		return 0;
+	}
 	unsigned char* buf=e->bufferPool.Get();
 	if(buf){
 		assert(len==960*2);
@@ -105,37 +138,31 @@ void tgvoip::OpusEncoder::SetEchoCanceller(EchoCanceller* aec){
 }
 
 void tgvoip::OpusEncoder::RunThread(void* arg){
-	unsigned char buf[960*2];
-	uint32_t bufferedCount=0;
-	uint32_t packetsPerFrame=frameDuration/20;
-	LOGV("starting encoder, packets per frame=%d", packetsPerFrame);
-	unsigned char* frame;
-	if(packetsPerFrame>1)
-		frame=(unsigned char *) malloc(960*2*packetsPerFrame);
-	else
-		frame=NULL;
 	while(running){
 		unsigned char* packet=(unsigned char*)queue.GetBlocking();
 		if(packet){
-			if(echoCanceller)
-				echoCanceller->ProcessInput(packet, buf, 960*2);
-			else
-				memcpy(buf, packet, 960*2);
-			if(packetsPerFrame==1){
-				Encode(buf, 960*2);
-			}else{
-				memcpy(frame+(960*2*bufferedCount), buf, 960*2);
-				bufferedCount++;
-				if(bufferedCount==packetsPerFrame){
-					Encode(frame, 960*2*packetsPerFrame);
-					bufferedCount=0;
-				}
-			}
+			ProcessCapturedFrame(packet);
 			bufferPool.Reuse(packet);
 		}
 	}
-	if(frame)
-		free(frame);
+}
+
+void tgvoip::OpusEncoder::ProcessCapturedFrame(unsigned char *data){
+	if(echoCanceller)
+		echoCanceller->ProcessInput(data, processedBuffer, 960*2);
+	else
+		memcpy(processedBuffer, data, 960*2);
+	if(packetsPerFrame==1){
+		Encode(processedBuffer, 960*2);
+	}else{
+		memcpy(frame+(960*2*bufferedCount), processedBuffer, 960*2);
+		bufferedCount++;
+		if(bufferedCount==packetsPerFrame){
+			Encode(frame, 960*2*packetsPerFrame);
+			bufferedCount=0;
+		}
+	}
+	cpuTime.store((uint32_t)(VoIPController::GetCurrentThreadCPUTime()*1000), std::memory_order_relaxed);
 }
 
 
@@ -159,6 +186,14 @@ int tgvoip::OpusEncoder::GetPacketLoss(){
 	return packetLossPercent;
 }
 
+void tgvoip::OpusEncoder::SetFusedCapture(bool enabled){
+	fusedCapture=enabled;
+}
+
+uint32_t tgvoip::OpusEncoder::GetCPUTime(){
+	return cpuTime.load(std::memory_order_relaxed);
+}
+
 void tgvoip::OpusEncoder::SetDTX(bool enable){
 	opus_encoder_ctl(enc, OPUS_SET_DTX(enable ? 1 : 0));
 }
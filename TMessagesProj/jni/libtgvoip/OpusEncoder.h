@@ -16,6 +16,7 @@
 #include "EchoCanceller.h"
 
 #include <stdint.h>
+#include <atomic>
 
 namespace tgvoip{
 class OpusEncoder : public MediaStreamItf{
@@ -32,10 +33,20 @@ public:
 	uint32_t GetBitrate();
 	void SetDTX(bool enable);
 	void SetLevelMeter(AudioLevelMeter* levelMeter);
+	/**
+	 * @return CPU time used by the encoder thread (including echo cancellation) so far, in milliseconds
+	 */
+	uint32_t GetCPUTime();
+	/**
+	 * Process and encode captured audio directly on the capture thread instead of handing it over to a separate
+	 * encoder thread. Saves a queue hop, a copy and a context switch per frame. Must be called before Start().
+	 */
+	void SetFusedCapture(bool enabled);
 
 private:
 	static size_t Callback(unsigned char* data, size_t len, void* param);
 	void RunThread(void* arg);
+	void ProcessCapturedFrame(unsigned char* data);
 	void Encode(unsigned char* data, size_t len);
 	MediaStreamItf* source;
 	::OpusEncoder* enc;
@@ -47,7 +58,7 @@ private:
 	BufferPool bufferPool;
 	EchoCanceller* echoCanceller;
 	int complexity;
-	bool running;
+	std::atomic<bool> running;
 	uint32_t frameDuration;
 	int packetLossPercent;
 	uint32_t mediumCorrectionBitrate;
@@ -55,6 +66,13 @@ private:
 	double mediumCorrectionMultiplier;
 	double strongCorrectionMultiplier;
 	AudioLevelMeter* levelMeter;
+	std::atomic<uint32_t> cpuTime;
+	bool fusedCapture;
+	Mutex fusedMutex;
+	unsigned char processedBuffer[960*2];
+	unsigned char* frame;
+	uint32_t bufferedCount;
+	uint32_t packetsPerFrame;
 };
 }
 
@@ -0,0 +1,174 @@
+//
+// libtgvoip is free and unencumbered public domain software.
+// For more information, see http://unlicense.org or the UNLICENSE file
+// you should have received with this source code distribution.
+//
+
+#ifndef LIBTGVOIP_PACKETCODEC_H
+#define LIBTGVOIP_PACKETCODEC_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+// Fixed-size parts of the packet layouts are described as PacketLayout<...> typedefs.
+// Their total size is known at compile time, so a reader checks the length once per layout
+// and then decodes every field without further checks. Nothing here throws or allocates.
+
+namespace tgvoip{
+
+template<size_t N> struct PacketBytes{
+	unsigned char data[N];
+};
+
+template<typename T> struct PacketField;
+
+template<> struct PacketField<uint8_t>{
+	static const size_t size=1;
+	static void Read(const unsigned char* p, uint8_t& v){
+		v=p[0];
+	}
+	static void Write(unsigned char* p, uint8_t v){
+		p[0]=v;
+	}
+};
+
+template<> struct PacketField<uint16_t>{
+	static const size_t size=2;
+	static void Read(const unsigned char* p, uint16_t& v){
+		v=(uint16_t)(p[0] | (p[1] << 8));
+	}
+	static void Write(unsigned char* p, uint16_t v){
+		p[0]=(unsigned char)(v & 0xFF);
+		p[1]=(unsigned char)((v >> 8) & 0xFF);
+	}
+};
+
+template<> struct PacketField<uint32_t>{
+	static const size_t size=4;
+	static void Read(const unsigned char* p, uint32_t& v){
+		v=(uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+	}
+	static void Write(unsigned char* p, uint32_t v){
+		p[0]=(unsigned char)(v & 0xFF);
+		p[1]=(unsigned char)((v >> 8) & 0xFF);
+		p[2]=(unsigned char)((v >> 16) & 0xFF);
+		p[3]=(unsigned char)((v >> 24) & 0xFF);
+	}
+};
+
+template<> struct PacketField<uint64_t>{
+	static const size_t size=8;
+	static void Read(const unsigned char* p, uint64_t& v){
+		uint32_t lo, hi;
+		PacketField<uint32_t>::Read(p, lo);
+		PacketField<uint32_t>::Read(p+4, hi);
+		v=(uint64_t)lo | ((uint64_t)hi << 32);
+	}
+	static void Write(unsigned char* p, uint64_t v){
+		PacketField<uint32_t>::Write(p, (uint32_t)(v & 0xFFFFFFFF));
+		PacketField<uint32_t>::Write(p+4, (uint32_t)(v >> 32));
+	}
+};
+
+template<size_t N> struct PacketField<PacketBytes<N> >{
+	static const size_t size=N;
+	static void Read(const unsigned char* p, PacketBytes<N>& v){
+		memcpy(v.data, p, N);
+	}
+	static void Write(unsigned char* p, const PacketBytes<N>& v){
+		memcpy(p, v.data, N);
+	}
+};
+
+template<typename... Fields> struct PacketLayout;
+
+template<> struct PacketLayout<>{
+	static const size_t size=0;
+	static void ReadUnchecked(const unsigned char* p){}
+	static void WriteUnchecked(unsigned char* p){}
+};
+
+template<typename F, typename... Rest> struct PacketLayout<F, Rest...>{
+	static const size_t size=PacketField<F>::size+PacketLayout<Rest...>::size;
+	static void ReadUnchecked(const unsigned char* p, F& first, Rest&... rest){
+		PacketField<F>::Read(p, first);
+		PacketLayout<Rest...>::ReadUnchecked(p+PacketField<F>::size, rest...);
+	}
+	static void WriteUnchecked(unsigned char* p, const F& first, const Rest&... rest){
+		PacketField<F>::Write(p, first);
+		PacketLayout<Rest...>::WriteUnchecked(p+PacketField<F>::size, rest...);
+	}
+};
+
+class PacketReader{
+public:
+	PacketReader(const unsigned char* data, size_t length, size_t offset=0){
+		this->data=data;
+		this->length=length;
+		this->offset=offset<=length ? offset : length;
+		ok=offset<=length;
+	}
+
+	template<typename L, typename... Args> bool Read(Args&... args){
+		if(!ok || length-offset<L::size)
+			return ok=false;
+		L::ReadUnchecked(data+offset, args...);
+		offset+=L::size;
+		return true;
+	}
+
+	bool ReadTlLength(uint32_t& len){
+		if(!ok || offset>=length)
+			return ok=false;
+		unsigned char l=data[offset];
+		if(l<254){
+			len=l;
+			offset++;
+			return true;
+		}
+		if(length-offset<4)
+			return ok=false;
+		len=(uint32_t)data[offset+1] | ((uint32_t)data[offset+2] << 8) | ((uint32_t)data[offset+3] << 16);
+		offset+=4;
+		return true;
+	}
+
+	// skips a TL string including its padding to a multiple of 4
+	bool SkipTlString(){
+		size_t start=offset;
+		uint32_t len;
+		if(!ReadTlLength(len))
+			return false;
+		size_t total=offset-start+len;
+		return Skip(len+((total%4) ? 4-(total%4) : 0));
+	}
+
+	bool Skip(size_t count){
+		if(!ok || length-offset<count)
+			return ok=false;
+		offset+=count;
+		return true;
+	}
+
+	bool IsOk(){
+		return ok;
+	}
+
+	size_t GetOffset(){
+		return offset;
+	}
+
+	size_t Remaining(){
+		return length-offset;
+	}
+
+private:
+	const unsigned char* data;
+	size_t length;
+	size_t offset;
+	bool ok;
+};
+}
+
+#endif //LIBTGVOIP_PACKETCODEC_H
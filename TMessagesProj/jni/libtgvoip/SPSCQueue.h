@@ -0,0 +1,73 @@
+//
+// libtgvoip is free and unencumbered public domain software.
+// For more information, see http://unlicense.org or the UNLICENSE file
+// you should have received with this source code distribution.
+//
+
+#ifndef LIBTGVOIP_SPSCQUEUE_H
+#define LIBTGVOIP_SPSCQUEUE_H
+
+#include <stdlib.h>
+#include <atomic>
+
+namespace tgvoip{
+
+/**
+ * Bounded wait-free queue for exactly one producer thread and one consumer thread.
+ * Neither side ever blocks or allocates, so it can be used to hand data between real-time audio threads.
+ */
+template<typename T>
+class SPSCQueue{
+public:
+	SPSCQueue(size_t capacity){
+		// one slot is always kept empty to tell a full queue from an empty one
+		this->capacity=capacity+1;
+		items=new T[this->capacity];
+		head.store(0);
+		tail.store(0);
+	}
+
+	~SPSCQueue(){
+		delete[] items;
+	}
+
+	/**
+	 * @return false if the queue is full
+	 */
+	bool Put(T thing){
+		size_t t=tail.load(std::memory_order_relaxed);
+		size_t next=(t+1)%capacity;
+		if(next==head.load(std::memory_order_acquire))
+			return false;
+		items[t]=thing;
+		tail.store(next, std::memory_order_release);
+		return true;
+	}
+
+	/**
+	 * @return false if the queue is empty
+	 */
+	bool Get(T* thing){
+		size_t h=head.load(std::memory_order_relaxed);
+		if(h==tail.load(std::memory_order_acquire))
+			return false;
+		*thing=items[h];
+		head.store((h+1)%capacity, std::memory_order_release);
+		return true;
+	}
+
+	size_t Size(){
+		size_t h=head.load(std::memory_order_acquire);
+		size_t t=tail.load(std::memory_order_acquire);
+		return (t+capacity-h)%capacity;
+	}
+
+private:
+	T* items;
+	size_t capacity;
+	std::atomic<size_t> head;
+	std::atomic<size_t> tail;
+};
+}
+
+#endif //LIBTGVOIP_SPSCQUEUE_H
@@ -16,6 +16,7 @@
 #include "threading.h"
 #include "BufferOutputStream.h"
 #include "BufferInputStream.h"
+#include "PacketCodec.h"
 #include "OpusEncoder.h"
 #include "OpusDecoder.h"
 #include "VoIPServerConfig.h"
@@ -79,6 +80,7 @@
 #define INIT_FLAG_DATA_SAVING_ENABLED 1
 #define INIT_FLAG_GROUP_CALLS_SUPPORTED 2
 
+#define TCP_MAX_BATCH_PACKETS 8
 #define TLID_DECRYPTED_AUDIO_BLOCK 0xDBF948C1
 #define TLID_SIMPLE_AUDIO_BLOCK 0xCC0D0E76
 #define TLID_UDP_REFLECTOR_PEER_INFO 0x27D9371C
@@ -104,9 +106,24 @@ inline int pad4(int x){
 
 using namespace tgvoip;
 
+// fixed-size parts of decryptedAudioBlock and simpleAudioBlock
+typedef PacketLayout<uint32_t, uint64_t> AudioBlockPrefix; // tlid, random_id
+typedef PacketLayout<uint32_t, uint32_t, uint32_t> AudioBlockSeqs; // in_seq_no, out_seq_no, recent_received_mask
+typedef PacketLayout<uint8_t, uint32_t, uint32_t, uint32_t> SimpleAudioBlockHeader; // type, in_seq_no, out_seq_no, recent_received_mask
+// packet payloads
+typedef PacketLayout<uint32_t, uint32_t> VersionPayload; // version, min_version
+typedef PacketLayout<uint32_t, uint32_t, uint32_t> InitPayload; // version, min_version, flags
+typedef PacketLayout<uint8_t, uint8_t> StreamIdAndType; // id, type in init ack, id, enabled in stream state
+typedef PacketLayout<uint16_t, uint8_t> StreamDescriptionTail; // frame_duration, enabled
+typedef PacketLayout<uint32_t> PacketInt32;
+typedef PacketLayout<uint16_t> PacketInt16;
+typedef PacketLayout<uint8_t> PacketByte;
+typedef PacketLayout<uint32_t, uint32_t> LanEndpointPayload; // address, port
+
 #ifdef __APPLE__
 #include "os/darwin/AudioUnitIO.h"
 #include <mach/mach_time.h>
+#include <mach/mach.h>
 double VoIPController::machTimebase=0;
 uint64_t VoIPController::machTimestart=0;
 #endif
@@ -238,6 +255,12 @@ VoIPController::VoIPController() : activeNetItfName(""),
 	receivedInitAck=false;
 	peerPreferredRelay=NULL;
 	statsDump=NULL;
+	telemetryDump=NULL;
+	telemetryCount.store(0);
+	for(int i=0;i<TGVOIP_TELEMETRY_HISTORY_SIZE;i++){
+		telemetry[i].seq.store(0);
+		memset(&telemetry[i].snapshot, 0, sizeof(voip_telemetry_snapshot_t));
+	}
 	useTCP=false;
 	useUDP=true;
 	didAddTcpRelays=false;
@@ -254,6 +277,12 @@ VoIPController::VoIPController() : activeNetItfName(""),
 
 	selectCanceller=SocketSelectCanceller::Create();
 	udpSocket=NetworkSocket::Create(PROTO_UDP);
+#ifdef TGVOIP_NETWORK_SIMULATION
+	udpSocket=new NetworkSocketSimulator(udpSocket, ServerConfig::GetSharedInstance()->GetInt("sim_net_delay", 0),
+										 ServerConfig::GetSharedInstance()->GetInt("sim_net_jitter", 0),
+										 ServerConfig::GetSharedInstance()->GetDouble("sim_net_loss", 0.0),
+										 ServerConfig::GetSharedInstance()->GetDouble("sim_net_reorder", 0.0));
+#endif
 	realUdpSocket=udpSocket;
 	udpConnectivityState=UDP_UNKNOWN;
 	echoCancellationStrength=1;
@@ -291,6 +320,18 @@ VoIPController::VoIPController() : activeNetItfName(""),
 	p2pToRelaySwitchThreshold=ServerConfig::GetSharedInstance()->GetDouble("p2p_to_relay_switch_threshold", 0.6);
 	relayToP2pSwitchThreshold=ServerConfig::GetSharedInstance()->GetDouble("relay_to_p2p_switch_threshold", 0.8);
 	reconnectingTimeout=ServerConfig::GetSharedInstance()->GetDouble("reconnecting_state_timeout", 2.0);
+	multipathEnabled=ServerConfig::GetSharedInstance()->GetBoolean("audio_multipath", false);
+	multipathLossThreshold=ServerConfig::GetSharedInstance()->GetDouble("audio_multipath_loss_threshold", 0.05);
+	multipathJitterThreshold=ServerConfig::GetSharedInstance()->GetDouble("audio_multipath_jitter_threshold", 0.1);
+	multipathMaxRedundancy=(unsigned int) ServerConfig::GetSharedInstance()->GetInt("audio_multipath_max_redundancy", 100);
+	multipathRedundancy=0;
+	multipathCredit=0;
+	multipathPacketsSent=0;
+	lastTickEndpoint=NULL;
+	lastEndpointSwitchTime=0;
+	recvDuplicateCount=0;
+	tcpMaxUnsentBytes=(size_t) ServerConfig::GetSharedInstance()->GetInt("tcp_max_unsent_bytes", 3000);
+	tcpStaleDropCount=0;
 
 #ifdef __APPLE__
 	machTimestart=0;
@@ -318,9 +359,13 @@ VoIPController::VoIPController() : activeNetItfName(""),
 
 VoIPGroupController::VoIPGroupController(int32_t timeDifference){
 	audioMixer=new AudioMixer();
+	audioMixer->SetMaxActiveInputs((unsigned int) ServerConfig::GetSharedInstance()->GetInt("group_call_max_active_speakers", 3));
+	audioMixer->SetDecoderThreadCount((unsigned int) ServerConfig::GetSharedInstance()->GetInt("group_call_decoder_threads", 1));
 	memset(&callbacks, 0, sizeof(callbacks));
 	userSelfID=0;
 	this->timeDifference=timeDifference;
+	// everything goes through the one reflector
+	multipathEnabled=false;
 	LOGV("Created VoIPGroupController; timeDifference=%d", timeDifference);
 }
 
@@ -411,6 +456,8 @@ VoIPController::~VoIPController(){
 	}
 	if(statsDump)
 		fclose(statsDump);
+	if(telemetryDump)
+		fclose(telemetryDump);
 	if(resolvedProxyAddress)
 		delete resolvedProxyAddress;
 	delete selectCanceller;
@@ -639,7 +686,7 @@ void VoIPGroupController::AddGroupCallParticipant(int32_t userID, unsigned char
 			s->decoder->SetFrameDuration(s->frameDuration);
 			s->decoder->SetDTX(true);
 			s->decoder->SetLevelMeter(p.levelMeter);
-			audioMixer->AddInput(s->callbackWrapper);
+			audioMixer->AddInput(s->callbackWrapper, s->decoder);
 		}
 		incomingStreams.push_back(*s);
 	}
@@ -778,9 +825,9 @@ void VoIPController::WritePacketHeader(uint32_t pseq, BufferOutputStream *s, uns
 		if(pflags & PFLAG_HAS_CALL_ID){
 			s->WriteBytes(callID, 16);
 		}
-		s->WriteInt32(lastRemoteSeq);
-		s->WriteInt32(pseq);
-		s->WriteInt32(acks);
+		unsigned char seqs[AudioBlockSeqs::size];
+		AudioBlockSeqs::WriteUnchecked(seqs, lastRemoteSeq, pseq, acks);
+		s->WriteBytes(seqs, sizeof(seqs));
 		if(pflags & PFLAG_HAS_PROTO){
 			s->WriteInt32(PROTOCOL_NAME);
 		}
@@ -814,10 +861,9 @@ void VoIPController::WritePacketHeader(uint32_t pseq, BufferOutputStream *s, uns
 				s->WriteByte((unsigned char) ((lenWithHeader >> 16) & 0xFF));
 			}
 		}
-		s->WriteByte(type);
-		s->WriteInt32(lastRemoteSeq);
-		s->WriteInt32(pseq);
-		s->WriteInt32(acks);
+		unsigned char header[SimpleAudioBlockHeader::size];
+		SimpleAudioBlockHeader::WriteUnchecked(header, type, lastRemoteSeq, pseq, acks);
+		s->WriteBytes(header, sizeof(header));
 	}
 
 	if(type==PKT_STREAM_DATA || type==PKT_STREAM_DATA_X2 || type==PKT_STREAM_DATA_X3)
@@ -852,6 +898,10 @@ void VoIPController::UpdateAudioBitrate(){
 			maxBitrate=maxAudioBitrate;
 			encoder->SetBitrate(initAudioBitrate);
 		}
+		if(conctl->IsDelayBased()){
+			conctl->SetBitrateLimits(minAudioBitrate, maxBitrate);
+			conctl->ResetTargetBitrate(encoder->GetBitrate());
+		}
 	}
 }
 
@@ -947,21 +997,31 @@ void VoIPController::RunRecvThread(void* arg){
 		readSockets.push_back(realUdpSocket);
 		errorSockets.push_back(realUdpSocket);
 
+		NetworkSocket* bufferedSocket=NULL;
 		//if(useTCP){
 			for(std::vector<Endpoint*>::iterator itr=endpoints.begin();itr!=endpoints.end();++itr){
 				if((*itr)->type==Endpoint::TYPE_TCP_RELAY){
 					if((*itr)->socket){
 						readSockets.push_back((*itr)->socket);
 						errorSockets.push_back((*itr)->socket);
+						if(!bufferedSocket && (*itr)->socket->HasBufferedPackets())
+							bufferedSocket=(*itr)->socket;
 					}
 				}
 			}
 		//}
 
-		bool selRes=NetworkSocket::Select(readSockets, errorSockets, selectCanceller);
-		if(!selRes){
-			LOGV("Select canceled");
-			continue;
+		if(bufferedSocket){
+			// complete frames left over from the last TCP read, the socket itself won't become readable for them
+			readSockets.clear();
+			errorSockets.clear();
+			readSockets.push_back(bufferedSocket);
+		}else{
+			bool selRes=NetworkSocket::Select(readSockets, errorSockets, selectCanceller);
+			if(!selRes){
+				LOGV("Select canceled");
+				continue;
+			}
 		}
 		if(!runReceiver)
 			return;
@@ -1049,19 +1109,58 @@ void VoIPController::RunSendThread(void* arg){
 	unsigned char buf[1500];
 	while(runReceiver){
 		PendingOutgoingPacket pkt=sendQueue->GetBlocking();
-		if(pkt.data){
-			MutexGuard m(endpointsMutex);
+		if(!pkt.data){
+			LOGE("tried to send null packet");
+			continue;
+		}
+		MutexGuard m(endpointsMutex);
+		// Packets that are already waiting go out over TCP as one encrypted write instead of one send() each
+		Endpoint* corkedEndpoint=NULL;
+		NetworkSocketTCPObfuscated* corkedSocket=NULL;
+		int batchCount=0;
+		while(true){
 			Endpoint *endpoint=pkt.endpoint ? pkt.endpoint : currentEndpoint;
 			if((endpoint->type==Endpoint::TYPE_TCP_RELAY && useTCP) || (endpoint->type!=Endpoint::TYPE_TCP_RELAY && useUDP)){
-				BufferOutputStream p(buf, sizeof(buf));
-				WritePacketHeader(pkt.seq, &p, pkt.type, (uint32_t)pkt.len);
-				p.WriteBytes(pkt.data, pkt.len);
-				SendPacket(p.GetBuffer(), p.GetLength(), endpoint, pkt);
+				bool isAudio=pkt.type==PKT_STREAM_DATA || pkt.type==PKT_STREAM_DATA_X2 || pkt.type==PKT_STREAM_DATA_X3;
+				if(endpoint->type==Endpoint::TYPE_TCP_RELAY && endpoint->socket && !corkedSocket && sendQueue->Size()>0){
+					corkedSocket=dynamic_cast<NetworkSocketTCPObfuscated*>(endpoint->socket);
+					if(corkedSocket){
+						corkedEndpoint=endpoint;
+						corkedSocket->SetCorked(true);
+					}
+				}
+				if(isAudio && endpoint->type==Endpoint::TYPE_TCP_RELAY && endpoint->socket && endpoint->socket->GetUnsentBytes()>tcpMaxUnsentBytes){
+					// audio stuck behind a full send queue would only arrive too late to be played
+					tcpStaleDropCount++;
+				}else{
+					BufferOutputStream p(buf, sizeof(buf));
+					WritePacketHeader(pkt.seq, &p, pkt.type, (uint32_t)pkt.len);
+					p.WriteBytes(pkt.data, pkt.len);
+					SendPacket(p.GetBuffer(), p.GetLength(), endpoint, pkt);
+					if(multipathRedundancy>0 && !pkt.endpoint && isAudio){
+						multipathCredit+=multipathRedundancy;
+						if(multipathCredit>=100){
+							multipathCredit-=100;
+							// Same seq on both paths, the receiver keeps whichever copy arrives first and drops the other
+							Endpoint* secondary=GetMultipathEndpoint();
+							if(secondary){
+								SendPacket(p.GetBuffer(), p.GetLength(), secondary, pkt);
+								multipathPacketsSent++;
+							}
+						}
+					}
+				}
 			}
 			outgoingPacketsBufferPool.Reuse(pkt.data);
-		}else{
-			LOGE("tried to send null packet");
+			if(!corkedSocket || ++batchCount>=TCP_MAX_BATCH_PACKETS || sendQueue->Size()==0)
+				break;
+			pkt=sendQueue->Get();
+			if(!pkt.data)
+				break;
 		}
+		// the socket may have failed and been replaced while sending
+		if(corkedSocket && corkedEndpoint->socket==corkedSocket)
+			corkedSocket->SetCorked(false);
 	}
 	LOGI("=== send thread exiting ===");
 }
@@ -1211,12 +1310,8 @@ void VoIPController::ProcessIncomingPacket(NetworkPacket &packet, Endpoint* srcE
 		in=BufferInputStream(decrypted, decryptedLen);
 		//LOGD("received packet length: %d", in.ReadInt32());
 
-		BufferOutputStream buf(decryptedLen+32);
-		size_t x=isOutgoing ? 8 : 0;
-		buf.WriteBytes(encryptionKey+88+x, 32);
-		buf.WriteBytes(decrypted+4, decryptedLen-4);
 		unsigned char msgKeyLarge[32];
-		crypto.sha256(buf.GetBuffer(), buf.GetLength(), msgKeyLarge);
+		MsgKeyLarge(decrypted+4, decryptedLen-4, isOutgoing ? 8 : 0, msgKeyLarge);
 
 		if(memcmp(msgKey, msgKeyLarge+8, 16)!=0){
 			LOGW("Received packet has wrong hash");
@@ -1249,13 +1344,20 @@ simpleAudioBlock random_id:long random_bytes:string raw_data:string = DecryptedA
 */
 	uint32_t ackId, pseq, acks;
 	unsigned char type;
-	uint32_t tlid=(uint32_t) in.ReadInt32();
+	uint32_t tlid;
+	uint64_t randomID;
 	uint32_t packetInnerLen=0;
+	PacketReader reader(buffer, in.GetLength(), in.GetOffset());
+	if(!reader.Read<AudioBlockPrefix>(tlid, randomID) || !reader.SkipTlString()){
+		LOGW("Received packet is too short");
+		return;
+	}
 	if(tlid==TLID_DECRYPTED_AUDIO_BLOCK){
-		in.ReadInt64(); // random id
-		uint32_t randLen=(uint32_t) in.ReadTlLength();
-		in.Seek(in.GetOffset()+randLen+pad4(randLen));
-		uint32_t flags=(uint32_t) in.ReadInt32();
+		uint32_t flags;
+		if(!reader.Read<PacketLayout<uint32_t> >(flags)){
+			LOGW("Received packet is too short");
+			return;
+		}
 		type=(unsigned char) ((flags >> 24) & 0xFF);
 		if(!(flags & PFLAG_HAS_SEQ && flags & PFLAG_HAS_RECENT_RECV)){
 			LOGW("Received packet doesn't have PFLAG_HAS_SEQ, PFLAG_HAS_RECENT_RECV, or both");
@@ -1263,9 +1365,12 @@ simpleAudioBlock random_id:long random_bytes:string raw_data:string = DecryptedA
 			return;
 		}
 		if(flags & PFLAG_HAS_CALL_ID){
-			unsigned char pktCallID[16];
-			in.ReadBytes(pktCallID, 16);
-			if(memcmp(pktCallID, callID, 16)!=0){
+			PacketBytes<16> pktCallID;
+			if(!reader.Read<PacketLayout<PacketBytes<16> > >(pktCallID)){
+				LOGW("Received packet is too short");
+				return;
+			}
+			if(memcmp(pktCallID.data, callID, 16)!=0){
 				LOGW("Received packet has wrong call id");
 
 				lastError=ERROR_UNKNOWN;
@@ -1273,11 +1378,16 @@ simpleAudioBlock random_id:long random_bytes:string raw_data:string = DecryptedA
 				return;
 			}
 		}
-		ackId=(uint32_t) in.ReadInt32();
-		pseq=(uint32_t) in.ReadInt32();
-		acks=(uint32_t) in.ReadInt32();
+		if(!reader.Read<AudioBlockSeqs>(ackId, pseq, acks)){
+			LOGW("Received packet is too short");
+			return;
+		}
 		if(flags & PFLAG_HAS_PROTO){
-			uint32_t proto=(uint32_t) in.ReadInt32();
+			uint32_t proto;
+			if(!reader.Read<PacketLayout<uint32_t> >(proto)){
+				LOGW("Received packet is too short");
+				return;
+			}
 			if(proto!=PROTOCOL_NAME){
 				LOGW("Received packet uses wrong protocol");
 
@@ -1287,26 +1397,29 @@ simpleAudioBlock random_id:long random_bytes:string raw_data:string = DecryptedA
 			}
 		}
 		if(flags & PFLAG_HAS_EXTRA){
-			uint32_t extraLen=(uint32_t) in.ReadTlLength();
-			in.Seek(in.GetOffset()+extraLen+pad4(extraLen));
+			if(!reader.SkipTlString()){
+				LOGW("Received packet is too short");
+				return;
+			}
 		}
 		if(flags & PFLAG_HAS_DATA){
-			packetInnerLen=in.ReadTlLength();
+			if(!reader.ReadTlLength(packetInnerLen)){
+				LOGW("Received packet is too short");
+				return;
+			}
 		}
 	}else if(tlid==TLID_SIMPLE_AUDIO_BLOCK){
-		in.ReadInt64(); // random id
-		uint32_t randLen=(uint32_t) in.ReadTlLength();
-		in.Seek(in.GetOffset()+randLen+pad4(randLen));
-		packetInnerLen=in.ReadTlLength();
-		type=in.ReadByte();
-		ackId=(uint32_t) in.ReadInt32();
-		pseq=(uint32_t) in.ReadInt32();
-		acks=(uint32_t) in.ReadInt32();
+		if(!reader.ReadTlLength(packetInnerLen) || !reader.Read<SimpleAudioBlockHeader>(type, ackId, pseq, acks)){
+			LOGW("Received packet is too short");
+			return;
+		}
 	}else{
 		LOGW("Received a packet of unknown type %08X", tlid);
 
 		return;
 	}
+	// Everything below reads the payload through the same reader, so a short or corrupt packet is dropped
+	// wherever it ends instead of throwing out of here.
 	if(type==PKT_GROUP_CALL_KEY && didSendGroupCallKey){
 		LOGE("Received group call key after we sent one");
 		return;
@@ -1326,8 +1439,8 @@ simpleAudioBlock random_id:long random_bytes:string raw_data:string = DecryptedA
 		lastRemoteSeq=pseq;
 	}else if(!seqgt(pseq, lastRemoteSeq) && lastRemoteSeq-pseq<32){
 		if(recvPacketTimes[lastRemoteSeq-pseq]!=0){
-			LOGW("Received duplicated packet for seq %u", pseq);
-
+			// expected when the peer sends over two paths at once, so don't spam the log with these
+			recvDuplicateCount++;
 			return;
 		}
 		recvPacketTimes[lastRemoteSeq-pseq]=GetCurrentTime();
@@ -1435,16 +1548,19 @@ simpleAudioBlock random_id:long random_bytes:string raw_data:string = DecryptedA
 			}
 			LogDebugInfo();
 		}
-		peerVersion=(uint32_t) in.ReadInt32();
+		uint32_t version, minVer, flags;
+		if(!reader.Read<InitPayload>(version, minVer, flags)){
+			LOGW("Received init is too short");
+			return;
+		}
+		peerVersion=(int32_t) version;
 		LOGI("Peer version is %d", peerVersion);
-		uint32_t minVer=(uint32_t) in.ReadInt32();
 		if(minVer>PROTOCOL_VERSION || peerVersion<MIN_PROTOCOL_VERSION){
 			lastError=ERROR_INCOMPATIBLE;
 
 			SetState(STATE_FAILED);
 			return;
 		}
-		uint32_t flags=(uint32_t) in.ReadInt32();
 		if(flags & INIT_FLAG_DATA_SAVING_ENABLED){
 			dataSavingRequestedByPeer=true;
 			UpdateDataSavingState();
@@ -1455,19 +1571,13 @@ simpleAudioBlock random_id:long random_bytes:string raw_data:string = DecryptedA
 		}
 
 		unsigned int i;
-		unsigned int numSupportedAudioCodecs=in.ReadByte();
-		for(i=0; i<numSupportedAudioCodecs; i++){
-			if(peerVersion<5)
-				in.ReadByte(); // ignore for now
-			else
-				in.ReadInt32();
-		}
-		unsigned int numSupportedVideoCodecs=in.ReadByte();
-		for(i=0; i<numSupportedVideoCodecs; i++){
-			if(peerVersion<5)
-				in.ReadByte(); // ignore for now
-			else
-				in.ReadInt32();
+		// codec lists are ignored for now
+		size_t codecSize=peerVersion<5 ? 1 : 4;
+		uint8_t numSupportedAudioCodecs, numSupportedVideoCodecs;
+		if(!reader.Read<PacketByte>(numSupportedAudioCodecs) || !reader.Skip(numSupportedAudioCodecs*codecSize)
+		   || !reader.Read<PacketByte>(numSupportedVideoCodecs) || !reader.Skip(numSupportedVideoCodecs*codecSize)){
+			LOGW("Received init is too short");
+			return;
 		}
 
 		unsigned char* buf=outgoingPacketsBufferPool.Get();
@@ -1504,8 +1614,12 @@ simpleAudioBlock random_id:long random_bytes:string raw_data:string = DecryptedA
 		if(!receivedInitAck){
 			receivedInitAck=true;
 			if(packetInnerLen>10){
-				peerVersion=in.ReadInt32();
-				uint32_t minVer=(uint32_t) in.ReadInt32();
+				uint32_t version, minVer;
+				if(!reader.Read<VersionPayload>(version, minVer)){
+					LOGW("Received init ack is too short");
+					return;
+				}
+				peerVersion=(int32_t) version;
 				if(minVer>PROTOCOL_VERSION || peerVersion<MIN_PROTOCOL_VERSION){
 					lastError=ERROR_INCOMPATIBLE;
 
@@ -1518,7 +1632,11 @@ simpleAudioBlock random_id:long random_bytes:string raw_data:string = DecryptedA
 
 			LOGI("peer version from init ack %d", peerVersion);
 
-			unsigned char streamCount=in.ReadByte();
+			uint8_t streamCount;
+			if(!reader.Read<PacketByte>(streamCount)){
+				LOGW("Received init ack is too short");
+				return;
+			}
 			if(streamCount==0)
 				return;
 
@@ -1526,17 +1644,21 @@ simpleAudioBlock random_id:long random_bytes:string raw_data:string = DecryptedA
 			Stream *incomingAudioStream=NULL;
 			for(i=0; i<streamCount; i++){
 				Stream stm;
-				stm.id=in.ReadByte();
-				stm.type=in.ReadByte();
+				uint8_t enabled;
+				bool ok=reader.Read<StreamIdAndType>(stm.id, stm.type);
 				if(peerVersion<5){
-					unsigned char codec=in.ReadByte();
-					if(codec==CODEC_OPUS_OLD)
+					uint8_t codec;
+					ok=ok && reader.Read<PacketByte>(codec);
+					if(ok && codec==CODEC_OPUS_OLD)
 						stm.codec=CODEC_OPUS;
 				}else{
-					stm.codec=(uint32_t) in.ReadInt32();
+					ok=ok && reader.Read<PacketInt32>(stm.codec);
 				}
-				stm.frameDuration=(uint16_t) in.ReadInt16();
-				stm.enabled=in.ReadByte()==1;
+				if(!ok || !reader.Read<StreamDescriptionTail>(stm.frameDuration, enabled)){
+					LOGW("Received init ack is too short");
+					return;
+				}
+				stm.enabled=enabled==1;
 				stm.jitterBuffer=new JitterBuffer(NULL, stm.frameDuration);
 				if(stm.frameDuration>50)
 					stm.jitterBuffer->SetMinPacketCount((uint32_t) ServerConfig::GetSharedInstance()->GetInt("jitter_initial_delay_60", 3));
@@ -1586,23 +1708,30 @@ simpleAudioBlock random_id:long random_bytes:string raw_data:string = DecryptedA
 			peerPreferredRelay=srcEndpoint;
 		}
 		for(i=0;i<count;i++){
-			unsigned char streamID=in.ReadByte();
+			uint8_t streamID, sdlen8;
+			uint16_t sdlen;
+			uint32_t pts;
+			bool ok=reader.Read<PacketByte>(streamID);
 			unsigned char flags=(unsigned char) (streamID & 0xC0);
-			uint16_t sdlen=(uint16_t) (flags & STREAM_DATA_FLAG_LEN16 ? in.ReadInt16() : in.ReadByte());
-			uint32_t pts=(uint32_t) in.ReadInt32();
-			//LOGD("stream data, pts=%d, len=%d, rem=%d", pts, sdlen, in.Remaining());
+			if(flags & STREAM_DATA_FLAG_LEN16){
+				ok=ok && reader.Read<PacketInt16>(sdlen);
+			}else{
+				ok=ok && reader.Read<PacketByte>(sdlen8);
+				sdlen=sdlen8;
+			}
+			if(!ok || !reader.Read<PacketInt32>(pts) || reader.Remaining()<sdlen){
+				LOGW("Received stream data is too short");
+				return;
+			}
+			//LOGD("stream data, pts=%d, len=%d, rem=%d", pts, sdlen, reader.Remaining());
 			audioTimestampIn=pts;
 			if(!audioOutStarted && audioOutput){
 				audioOutput->Start();
 				audioOutStarted=true;
 			}
-			if(in.GetOffset()+sdlen>len){
-				return;
-			}
 			if(incomingStreams.size()>0 && incomingStreams[0].jitterBuffer)
-				incomingStreams[0].jitterBuffer->HandleInput((unsigned char*) (buffer+in.GetOffset()), sdlen, pts);
-			if(i<count-1)
-				in.Seek(in.GetOffset()+sdlen);
+				incomingStreams[0].jitterBuffer->HandleInput((unsigned char*) (buffer+reader.GetOffset()), sdlen, pts);
+			reader.Skip(sdlen);
 		}
 	}
 	if(type==PKT_PING){
@@ -1627,8 +1756,8 @@ simpleAudioBlock random_id:long random_bytes:string raw_data:string = DecryptedA
 		});
 	}
 	if(type==PKT_PONG){
-		if(packetInnerLen>=4){
-			uint32_t pingSeq=(uint32_t) in.ReadInt32();
+		uint32_t pingSeq;
+		if(packetInnerLen>=4 && reader.Read<PacketInt32>(pingSeq)){
 			if(pingSeq==srcEndpoint->lastPingSeq){
 				memmove(&srcEndpoint->rtts[1], srcEndpoint->rtts, sizeof(double)*5);
 				srcEndpoint->rtts[0]=GetCurrentTime()-srcEndpoint->lastPingTime;
@@ -1645,8 +1774,11 @@ simpleAudioBlock random_id:long random_bytes:string raw_data:string = DecryptedA
 		}
 	}
 	if(type==PKT_STREAM_STATE){
-		unsigned char id=in.ReadByte();
-		unsigned char enabled=in.ReadByte();
+		uint8_t id, enabled;
+		if(!reader.Read<StreamIdAndType>(id, enabled)){
+			LOGW("Received stream state is too short");
+			return;
+		}
 		unsigned int i;
 		for(i=0;i<incomingStreams.size();i++){
 			if(incomingStreams[i].id==id){
@@ -1658,8 +1790,12 @@ simpleAudioBlock random_id:long random_bytes:string raw_data:string = DecryptedA
 	}
 	if(type==PKT_LAN_ENDPOINT){
 		LOGV("received lan endpoint");
-		uint32_t peerAddr=(uint32_t) in.ReadInt32();
-		uint16_t peerPort=(uint16_t) in.ReadInt32();
+		uint32_t peerAddr, port;
+		if(!reader.Read<LanEndpointPayload>(peerAddr, port)){
+			LOGW("Received lan endpoint is too short");
+			return;
+		}
+		uint16_t peerPort=(uint16_t) port;
 		MutexGuard m(endpointsMutex);
 		bool found=false;
 		for(std::vector<Endpoint*>::iterator itrtr=endpoints.begin();itrtr!=endpoints.end();++itrtr){
@@ -1682,18 +1818,21 @@ simpleAudioBlock random_id:long random_bytes:string raw_data:string = DecryptedA
 		currentEndpoint=preferredRelay;
 		if(allowP2p)
 			SendPublicEndpointsRequest();
-		if(peerVersion>=2){
-			uint32_t flags=(uint32_t) in.ReadInt32();
+		uint32_t flags;
+		if(peerVersion>=2 && reader.Read<PacketInt32>(flags)){
 			dataSavingRequestedByPeer=(flags & INIT_FLAG_DATA_SAVING_ENABLED)==INIT_FLAG_DATA_SAVING_ENABLED;
 			UpdateDataSavingState();
 			UpdateAudioBitrate();
 		}
 	}
 	if(type==PKT_GROUP_CALL_KEY && !didReceiveGroupCallKey && !didSendGroupCallKey){
-		unsigned char groupKey[256];
-		in.ReadBytes(groupKey, 256);
+		PacketBytes<256> groupKey;
+		if(!reader.Read<PacketLayout<PacketBytes<256> > >(groupKey)){
+			LOGW("Received group call key is too short");
+			return;
+		}
 		if(callbacks.groupCallKeyReceived)
-			callbacks.groupCallKeyReceived(this, groupKey);
+			callbacks.groupCallKeyReceived(this, groupKey.data);
 		didReceiveGroupCallKey=true;
 	}
 	if(type==PKT_REQUEST_GROUP && !didInvokeUpdateCallback){
@@ -1849,12 +1988,8 @@ void VoIPGroupController::ProcessIncomingPacket(NetworkPacket &packet, Endpoint
 	in=BufferInputStream(decrypted, decryptedLen);
 	//LOGD("received packet length: %d", in.ReadInt32());
 
-	BufferOutputStream buf(decryptedLen+32);
-	size_t x=0;
-	buf.WriteBytes(encryptionKey+88+x, 32);
-	buf.WriteBytes(decrypted+4, decryptedLen-4);
 	unsigned char msgKeyLarge[32];
-	crypto.sha256(buf.GetBuffer(), buf.GetLength(), msgKeyLarge);
+	MsgKeyLarge(decrypted+4, decryptedLen-4, 0, msgKeyLarge);
 
 	if(memcmp(msgKey, msgKeyLarge+8, 16)!=0){
 		LOGW("Received packet from user %d has wrong hash", sender->userID);
@@ -1923,7 +2058,7 @@ void VoIPGroupController::ProcessIncomingPacket(NetworkPacket &packet, Endpoint
 			unsigned char sflags=(unsigned char) (streamID & 0xC0);
 			uint16_t sdlen=(uint16_t) (sflags & STREAM_DATA_FLAG_LEN16 ? in.ReadInt16() : in.ReadByte());
 			uint32_t pts=(uint32_t) in.ReadInt32();
-			//LOGD("stream data, pts=%d, len=%d, rem=%d", pts, sdlen, in.Remaining());
+			//LOGD("stream data, pts=%d, len=%d, rem=%d", pts, sdlen, reader.Remaining());
 			audioTimestampIn=pts;
 			/*if(!audioOutStarted && audioOutput){
 				audioOutput->Start();
@@ -2032,15 +2167,24 @@ void VoIPController::RunTickThread(void* arg){
 				SetState(STATE_FAILED);
 			}
 
-			int act=conctl->GetBandwidthControlAction();
-			if(act==TGVOIP_CONCTL_ACT_DECREASE){
-				uint32_t bitrate=encoder->GetBitrate();
-				if(bitrate>8000)
-					encoder->SetBitrate(bitrate<(minAudioBitrate+audioBitrateStepDecr) ? minAudioBitrate : (bitrate-audioBitrateStepDecr));
-			}else if(act==TGVOIP_CONCTL_ACT_INCREASE){
-				uint32_t bitrate=encoder->GetBitrate();
-				if(bitrate<maxBitrate)
-					encoder->SetBitrate(bitrate+audioBitrateStepIncr);
+			if(conctl->IsDelayBased()){
+				// The target moves continuously, round it so the encoder isn't reconfigured on every tick
+				uint32_t bitrate=conctl->GetTargetBitrate()/500*500;
+				if(bitrate<minAudioBitrate)
+					bitrate=minAudioBitrate;
+				if(bitrate!=encoder->GetBitrate())
+					encoder->SetBitrate(bitrate);
+			}else{
+				int act=conctl->GetBandwidthControlAction();
+				if(act==TGVOIP_CONCTL_ACT_DECREASE){
+					uint32_t bitrate=encoder->GetBitrate();
+					if(bitrate>8000)
+						encoder->SetBitrate(bitrate<(minAudioBitrate+audioBitrateStepDecr) ? minAudioBitrate : (bitrate-audioBitrateStepDecr));
+				}else if(act==TGVOIP_CONCTL_ACT_INCREASE){
+					uint32_t bitrate=encoder->GetBitrate();
+					if(bitrate<maxBitrate)
+						encoder->SetBitrate(bitrate+audioBitrateStepIncr);
+				}
 			}
 
 			if(tickCount%10==0 && encoder){
@@ -2048,6 +2192,7 @@ void VoIPController::RunTickThread(void* arg){
 				memmove(sendLossCountHistory+1, sendLossCountHistory, 31*sizeof(uint32_t));
 				sendLossCountHistory[0]=sendLossCount-prevSendLossCount;
 				prevSendLossCount=sendLossCount;
+				// sampled once a second, averaged over the last 10 s
 				double avgSendLossCount=0;
 				for(i=0;i<10;i++){
 					avgSendLossCount+=sendLossCountHistory[i];
@@ -2077,6 +2222,8 @@ void VoIPController::RunTickThread(void* arg){
 					encoder->SetPacketLoss(15);
 				}
 
+				if(multipathEnabled)
+					UpdateMultipathRedundancy(avgSendLossCount);
 			}
 		}
 
@@ -2296,6 +2443,9 @@ void VoIPController::RunTickThread(void* arg){
 		}
 
 
+		if(tickCount%10==0)
+			UpdateTelemetry(startTime);
+
 		if(statsDump && incomingStreams.size()==1){
 			JitterBuffer* jitterBuffer=incomingStreams[0].jitterBuffer;
 			//fprintf(statsDump, "Time\tRTT\tLISeq\tLASeq\tCWnd\tBitrate\tJitter\tJDelay\tAJDelay\n");
@@ -2350,12 +2500,8 @@ void VoIPController::SendPacket(unsigned char *data, size_t len, Endpoint* ep, P
 
 			unsigned char key[32], iv[32], msgKey[16];
 			out.WriteBytes(keyFingerprint, 8);
-			BufferOutputStream buf(len+32);
-			size_t x=isOutgoing ? 0 : 8;
-			buf.WriteBytes(encryptionKey+88+x, 32);
-			buf.WriteBytes(inner.GetBuffer()+4, inner.GetLength()-4);
 			unsigned char msgKeyLarge[32];
-			crypto.sha256(buf.GetBuffer(), buf.GetLength(), msgKeyLarge);
+			MsgKeyLarge(inner.GetBuffer()+4, inner.GetLength()-4, isOutgoing ? 0 : 8, msgKeyLarge);
 			memcpy(msgKey, msgKeyLarge+8, 16);
 			KDF2(msgKey, isOutgoing ? 0 : 8, key, iv);
 			out.WriteBytes(msgKey, 16);
@@ -2608,6 +2754,26 @@ double VoIPController::GetCurrentTime(){
 #endif
 }
 
+double VoIPController::GetCurrentThreadCPUTime(){
+#if defined(__linux__)
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec+(double)ts.tv_nsec/1000000000.0;
+#elif defined(__APPLE__)
+	thread_basic_info_data_t info;
+	mach_msg_type_number_t count=THREAD_BASIC_INFO_COUNT;
+	if(thread_info(pthread_mach_thread_np(pthread_self()), THREAD_BASIC_INFO, (thread_info_t)&info, &count)!=KERN_SUCCESS)
+		return 0;
+	return info.user_time.seconds+info.system_time.seconds+(info.user_time.microseconds+info.system_time.microseconds)/1000000.0;
+#elif defined(_WIN32)
+	FILETIME creationTime, exitTime, kernelTime, userTime;
+	if(!GetThreadTimes(GetCurrentThread(), &creationTime, &exitTime, &kernelTime, &userTime))
+		return 0;
+	uint64_t total=((uint64_t)kernelTime.dwHighDateTime << 32 | kernelTime.dwLowDateTime)+((uint64_t)userTime.dwHighDateTime << 32 | userTime.dwLowDateTime);
+	return total/10000000.0;
+#endif
+}
+
 void VoIPController::SetState(int state){
 	this->state=state;
 	LOGV("Call state changed to %d", state);
@@ -2675,58 +2841,69 @@ void VoIPController::UpdateAudioOutputState(){
 
 void VoIPController::KDF(unsigned char* msgKey, size_t x, unsigned char* aesKey, unsigned char* aesIv){
 	uint8_t sA[SHA1_LENGTH], sB[SHA1_LENGTH], sC[SHA1_LENGTH], sD[SHA1_LENGTH];
-	BufferOutputStream buf(128);
-	buf.WriteBytes(msgKey, 16);
-	buf.WriteBytes(encryptionKey+x, 32);
-	crypto.sha1(buf.GetBuffer(), buf.GetLength(), sA);
-	buf.Reset();
-	buf.WriteBytes(encryptionKey+32+x, 16);
-	buf.WriteBytes(msgKey, 16);
-	buf.WriteBytes(encryptionKey+48+x, 16);
-	crypto.sha1(buf.GetBuffer(), buf.GetLength(), sB);
-	buf.Reset();
-	buf.WriteBytes(encryptionKey+64+x, 32);
-	buf.WriteBytes(msgKey, 16);
-	crypto.sha1(buf.GetBuffer(), buf.GetLength(), sC);
-	buf.Reset();
-	buf.WriteBytes(msgKey, 16);
-	buf.WriteBytes(encryptionKey+96+x, 32);
-	crypto.sha1(buf.GetBuffer(), buf.GetLength(), sD);
-	buf.Reset();
-	buf.WriteBytes(sA, 8);
-	buf.WriteBytes(sB+8, 12);
-	buf.WriteBytes(sC+4, 12);
-	assert(buf.GetLength()==32);
-	memcpy(aesKey, buf.GetBuffer(), 32);
-	buf.Reset();
-	buf.WriteBytes(sA+8, 12);
-	buf.WriteBytes(sB, 8);
-	buf.WriteBytes(sC+16, 4);
-	buf.WriteBytes(sD, 8);
-	assert(buf.GetLength()==32);
-	memcpy(aesIv, buf.GetBuffer(), 32);
+	uint8_t buf[48];
+	memcpy(buf, msgKey, 16);
+	memcpy(buf+16, encryptionKey+x, 32);
+	crypto.sha1(buf, 48, sA);
+	memcpy(buf, encryptionKey+32+x, 16);
+	memcpy(buf+16, msgKey, 16);
+	memcpy(buf+32, encryptionKey+48+x, 16);
+	crypto.sha1(buf, 48, sB);
+	memcpy(buf, encryptionKey+64+x, 32);
+	memcpy(buf+32, msgKey, 16);
+	crypto.sha1(buf, 48, sC);
+	memcpy(buf, msgKey, 16);
+	memcpy(buf+16, encryptionKey+96+x, 32);
+	crypto.sha1(buf, 48, sD);
+	memcpy(aesKey, sA, 8);
+	memcpy(aesKey+8, sB+8, 12);
+	memcpy(aesKey+20, sC+4, 12);
+	memcpy(aesIv, sA+8, 12);
+	memcpy(aesIv+12, sB, 8);
+	memcpy(aesIv+20, sC+16, 4);
+	memcpy(aesIv+24, sD, 8);
 }
 
 void VoIPController::KDF2(unsigned char* msgKey, size_t x, unsigned char *aesKey, unsigned char *aesIv){
 	uint8_t sA[32], sB[32];
-	BufferOutputStream buf(128);
-	buf.WriteBytes(msgKey, 16);
-	buf.WriteBytes(encryptionKey+x, 36);
-	crypto.sha256(buf.GetBuffer(), buf.GetLength(), sA);
-	buf.Reset();
-	buf.WriteBytes(encryptionKey+40+x, 36);
-	buf.WriteBytes(msgKey, 16);
-	crypto.sha256(buf.GetBuffer(), buf.GetLength(), sB);
-	buf.Reset();
-	buf.WriteBytes(sA, 8);
-	buf.WriteBytes(sB+8, 16);
-	buf.WriteBytes(sA+24, 8);
-	memcpy(aesKey, buf.GetBuffer(), 32);
-	buf.Reset();
-	buf.WriteBytes(sB, 8);
-	buf.WriteBytes(sA+8, 16);
-	buf.WriteBytes(sB+24, 8);
-	memcpy(aesIv, buf.GetBuffer(), 32);
+	uint8_t buf[52];
+	memcpy(buf, msgKey, 16);
+	memcpy(buf+16, encryptionKey+x, 36);
+	crypto.sha256(buf, 52, sA);
+	memcpy(buf, encryptionKey+40+x, 36);
+	memcpy(buf+36, msgKey, 16);
+	crypto.sha256(buf, 52, sB);
+	memcpy(aesKey, sA, 8);
+	memcpy(aesKey+8, sB+8, 16);
+	memcpy(aesKey+24, sA+24, 8);
+	memcpy(aesIv, sB, 8);
+	memcpy(aesIv+8, sA+8, 16);
+	memcpy(aesIv+24, sB+24, 8);
+}
+
+// msg_key_large = SHA256(substr(auth_key, 88+x, 32) + plaintext without the length prefix)
+void VoIPController::MsgKeyLarge(unsigned char* data, size_t len, size_t x, unsigned char* out){
+#ifndef TGVOIP_USE_CUSTOM_CRYPTO
+	if(crypto.sha256==tgvoip_openssl_sha256){
+		SHA256_CTX ctx;
+		SHA256_Init(&ctx);
+		SHA256_Update(&ctx, encryptionKey+88+x, 32);
+		SHA256_Update(&ctx, data, len);
+		SHA256_Final(out, &ctx);
+		return;
+	}
+#endif
+	unsigned char buf[1600];
+	if(len+32>sizeof(buf)){
+		BufferOutputStream _buf(len+32);
+		_buf.WriteBytes(encryptionKey+88+x, 32);
+		_buf.WriteBytes(data, len);
+		crypto.sha256(_buf.GetBuffer(), _buf.GetLength(), out);
+		return;
+	}
+	memcpy(buf, encryptionKey+88+x, 32);
+	memcpy(buf+32, data, len);
+	crypto.sha256(buf, len+32, out);
 }
 
 void VoIPController::GetDebugString(char *buffer, size_t len){
@@ -2762,6 +2939,12 @@ void VoIPController::GetDebugString(char *buffer, size_t len){
 		jitterBuffer->GetAverageLateCount(avgLate);
 	else
 		memset(avgLate, 0, 3*sizeof(double));
+	uint32_t dspTimings[TGVOIP_DSP_STAGE_COUNT]={0};
+	uint32_t dspFrames=0;
+	if(echoCanceller)
+		echoCanceller->GetStageTimings(dspTimings, &dspFrames);
+	if(dspFrames==0)
+		dspFrames=1;
 	snprintf(buffer, len,
 			 "Remote endpoints: \n%s"
 					 "Jitter buffer: %d/%.2f | %.1f, %.1f, %.1f\n"
@@ -2771,6 +2954,10 @@ void VoIPController::GetDebugString(char *buffer, size_t len){
 					 "Last sent/ack'd seq: %u/%u\n"
 					 "Last recvd seq: %u\n"
 					 "Send/recv losses: %u/%u (%d%%)\n"
+					 "FEC recovered: %u\n"
+					 "Multipath: %u%%, %u sent, %u dup recvd\n"
+					 "TCP stale audio dropped: %u\n"
+					 "DSP split/NS/AEC/AGC: %u/%u/%u/%u us\n"
 					 "Audio bitrate: %d kbit\n"
 //					 "Packet grouping: %d\n"
 					"Frame size out/in: %d/%d\n"
@@ -2784,6 +2971,10 @@ void VoIPController::GetDebugString(char *buffer, size_t len){
 			 useMTProto2 ? " (MTProto2.0)" : "",
 			 lastSentSeq, lastRemoteAckSeq, lastRemoteSeq,
 			 conctl->GetSendLossCount(), recvLossCount, encoder ? encoder->GetPacketLoss() : 0,
+			 incomingStreams.size()==1 && incomingStreams[0].decoder ? incomingStreams[0].decoder->GetFECRecoveredPacketCount() : 0,
+			 multipathRedundancy, multipathPacketsSent, recvDuplicateCount,
+			 tcpStaleDropCount,
+			 (dspTimings[TGVOIP_DSP_STAGE_ANALYSIS]+dspTimings[TGVOIP_DSP_STAGE_SYNTHESIS])/dspFrames, dspTimings[TGVOIP_DSP_STAGE_NS]/dspFrames, dspTimings[TGVOIP_DSP_STAGE_AEC]/dspFrames, dspTimings[TGVOIP_DSP_STAGE_AGC]/dspFrames,
 			 encoder ? (encoder->GetBitrate()/1000) : 0,
 //			 audioPacketGrouping,
 			 outgoingStreams[0].frameDuration, incomingStreams.size()>0 ? incomingStreams[0].frameDuration : 0,
@@ -2830,6 +3021,59 @@ Endpoint* VoIPController::GetEndpointByType(int type){
 	return NULL;
 }
 
+/**
+ * The endpoint with the lowest RTT other than the current one, counting TCP relays as twice as slow like SendRelayPings does.
+ * Must be called with endpointsMutex held.
+ */
+Endpoint* VoIPController::GetMultipathEndpoint(){
+	Endpoint* best=NULL;
+	double bestRtt=INFINITY;
+	for(std::vector<Endpoint*>::iterator itrtr=endpoints.begin();itrtr!=endpoints.end();++itrtr){
+		Endpoint* e=*itrtr;
+		if(e==currentEndpoint || e->averageRTT==0)
+			continue;
+		if(e->type==Endpoint::TYPE_TCP_RELAY ? !useTCP : !useUDP)
+			continue;
+		double rtt=e->averageRTT*(e->type==Endpoint::TYPE_TCP_RELAY ? 2 : 1);
+		if(rtt<bestRtt){
+			bestRtt=rtt;
+			best=e;
+		}
+	}
+	return best;
+}
+
+void VoIPController::UpdateMultipathRedundancy(double lossRate){
+	if(currentEndpoint!=lastTickEndpoint){
+		if(lastTickEndpoint)
+			lastEndpointSwitchTime=GetCurrentTime();
+		lastTickEndpoint=currentEndpoint;
+	}
+	double jitter=0;
+	if(incomingStreams.size()>0 && incomingStreams[0].jitterBuffer)
+		jitter=incomingStreams[0].jitterBuffer->GetLastMeasuredJitter();
+
+	unsigned int redundancy=multipathRedundancy;
+	if(dataSavingMode || dataSavingRequestedByPeer){
+		redundancy=0;
+	}else if(GetCurrentTime()-lastEndpointSwitchTime<5 || lossRate>=multipathLossThreshold*3){
+		// the old path may still work for a while after a switch and the new one may not yet
+		redundancy=100;
+	}else if(lossRate>=multipathLossThreshold*2){
+		redundancy=50;
+	}else if(lossRate>=multipathLossThreshold || jitter>=multipathJitterThreshold){
+		redundancy=MAX(redundancy, 25);
+	}else if(lossRate<multipathLossThreshold/2 && jitter<multipathJitterThreshold/2){
+		redundancy=0;
+	}
+	if(redundancy>multipathMaxRedundancy)
+		redundancy=multipathMaxRedundancy;
+	if(redundancy!=multipathRedundancy){
+		LOGI("Multipath redundancy %u%% -> %u%% (loss %.1f%%, jitter %.0f ms)", multipathRedundancy, redundancy, lossRate*100, jitter*1000);
+		multipathRedundancy=redundancy;
+	}
+}
+
 
 float VoIPController::GetOutputLevel(){
     if(!audioOutput || !audioOutStarted){
@@ -2907,6 +3151,10 @@ void VoIPController::DebugCtl(int request, int param){
 		if(encoder){
 			encoder->SetBitrate(maxBitrate);
 		}
+		if(conctl->IsDelayBased()){
+			conctl->SetBitrateLimits(minAudioBitrate, maxBitrate);
+			conctl->ResetTargetBitrate(maxBitrate);
+		}
 	}else if(request==2){ // set packet loss
 		if(encoder){
 			encoder->SetPacketLoss(param);
@@ -2949,6 +3197,113 @@ void VoIPController::GetStats(voip_stats_t *stats){
 	memcpy(stats, &this->stats, sizeof(voip_stats_t));
 }
 
+void VoIPController::UpdateTelemetry(double startTime){
+	voip_telemetry_snapshot_t snapshot;
+	memset(&snapshot, 0, sizeof(snapshot));
+	snapshot.time=GetCurrentTime()-startTime;
+	if(conctl){
+		snapshot.rtt=(float)conctl->GetAverageRTT();
+		snapshot.minRTT=(float)conctl->GetMinimumRTT();
+		snapshot.sendLossCount=conctl->GetSendLossCount();
+		snapshot.congestionWindow=(uint32_t)conctl->GetCongestionWindow();
+		snapshot.inflightDataSize=(uint32_t)conctl->GetInflightDataSize();
+	}
+	snapshot.recvLossCount=recvLossCount;
+	if(encoder){
+		snapshot.encoderPacketLoss=(uint32_t)encoder->GetPacketLoss();
+		snapshot.bitrate=encoder->GetBitrate();
+		snapshot.encoderCPUTime=encoder->GetCPUTime();
+	}
+	if(incomingStreams.size()==1){
+		JitterBuffer* jitterBuffer=incomingStreams[0].jitterBuffer;
+		if(jitterBuffer){
+			snapshot.jitter=(float)jitterBuffer->GetLastMeasuredJitter();
+			snapshot.jitterBufferDelay=(float)(jitterBuffer->GetAverageDelay()*incomingStreams[0].frameDuration/1000.0);
+		}
+		if(incomingStreams[0].decoder){
+			snapshot.decoderCPUTime=incomingStreams[0].decoder->GetCPUTime();
+			snapshot.fecRecoveredPackets=incomingStreams[0].decoder->GetFECRecoveredPacketCount();
+		}
+	}
+	snapshot.packetBuffersUsed=outgoingPacketsBufferPool.GetUsedBufferCount();
+	snapshot.packetBuffersHighWater=outgoingPacketsBufferPool.GetHighWaterMark();
+	snapshot.packetBuffersExhausted=outgoingPacketsBufferPool.GetExhaustionCount();
+
+	// Single writer (the tick thread), so a per-slot sequence number is enough for readers to detect a torn
+	// read without ever blocking the writer. It's derived from the sample index, odd while the slot is being
+	// written, so a reader can also tell when the slot has moved on to a newer sample.
+	uint32_t index=telemetryCount.load(std::memory_order_relaxed);
+	TelemetrySlot& slot=telemetry[index%TGVOIP_TELEMETRY_HISTORY_SIZE];
+	slot.seq.store(index*2+1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	slot.snapshot=snapshot;
+	slot.seq.store(index*2+2, std::memory_order_release);
+	telemetryCount.store(index+1, std::memory_order_release);
+
+	MutexGuard m(telemetryDumpMutex);
+	if(telemetryDump)
+		fwrite(&snapshot, sizeof(snapshot), 1, telemetryDump);
+}
+
+// false if the slot no longer holds sample index, or started being overwritten during the copy
+bool VoIPController::ReadTelemetrySlot(uint32_t index, voip_telemetry_snapshot_t *snapshot){
+	TelemetrySlot& slot=telemetry[index%TGVOIP_TELEMETRY_HISTORY_SIZE];
+	uint32_t expected=index*2+2;
+	if(slot.seq.load(std::memory_order_acquire)!=expected)
+		return false;
+	*snapshot=slot.snapshot;
+	std::atomic_thread_fence(std::memory_order_acquire);
+	return slot.seq.load(std::memory_order_relaxed)==expected;
+}
+
+bool VoIPController::GetTelemetrySnapshot(voip_telemetry_snapshot_t *snapshot){
+	// the latest sample is only overwritten TGVOIP_TELEMETRY_HISTORY_SIZE samples later, so this hardly ever retries
+	while(true){
+		uint32_t count=telemetryCount.load(std::memory_order_acquire);
+		if(count==0)
+			return false;
+		if(ReadTelemetrySlot(count-1, snapshot))
+			return true;
+	}
+}
+
+size_t VoIPController::GetTelemetryHistory(voip_telemetry_snapshot_t *snapshots, size_t count){
+	uint32_t total=telemetryCount.load(std::memory_order_acquire);
+	size_t available=MIN(total, TGVOIP_TELEMETRY_HISTORY_SIZE);
+	if(count>available)
+		count=available;
+	uint32_t first=total-(uint32_t)count;
+	size_t written=0;
+	for(size_t i=0;i<count;i++){
+		// the oldest ones may be overwritten while we're at it, leave those out instead of returning newer data in their place
+		if(ReadTelemetrySlot(first+(uint32_t)i, &snapshots[written]))
+			written++;
+	}
+	return written;
+}
+
+void VoIPController::SetTelemetryDumpFilePath(std::string path){
+	// the tick thread writes to the file on every sample
+	MutexGuard m(telemetryDumpMutex);
+	if(telemetryDump){
+		fclose(telemetryDump);
+		telemetryDump=NULL;
+	}
+	telemetryDumpFilePath=path;
+	if(path.empty())
+		return;
+	telemetryDump=fopen(path.c_str(), "wb");
+	if(!telemetryDump){
+		LOGW("Failed to open telemetry dump file %s for writing", path.c_str());
+		return;
+	}
+	uint32_t header[2]={TGVOIP_TELEMETRY_DUMP_MAGIC, (uint32_t)sizeof(voip_telemetry_snapshot_t)};
+	char version[16]={0};
+	strncpy(version, LIBTGVOIP_VERSION, sizeof(version)-1);
+	fwrite(header, sizeof(header), 1, telemetryDump);
+	fwrite(version, sizeof(version), 1, telemetryDump);
+}
+
 #ifdef TGVOIP_USE_AUDIO_SESSION
 void VoIPController::SetAcquireAudioSession(void (^completion)(void (^)())) {
     this->acquireAudioSession = [completion copy];
@@ -3251,11 +3606,13 @@ void VoIPController::StartAudio(){
 	audioInput->Configure(48000, 16, 1);
 	audioOutput=tgvoip::audio::AudioOutput::Create(currentAudioOutput, platformSpecific);
 	audioOutput->Configure(48000, 16, 1);
-	echoCanceller=new EchoCanceller(config.enableAEC, config.enableNS, config.enableAGC);
+	bool fusedCapture=ServerConfig::GetSharedInstance()->GetBoolean("audio_fused_capture", false);
+	echoCanceller=new EchoCanceller(config.enableAEC, config.enableNS, config.enableAGC, fusedCapture);
 	encoder=new OpusEncoder(audioInput);
 	encoder->SetCallback(AudioInputCallback, this);
 	encoder->SetOutputFrameDuration(outgoingAudioStream.frameDuration);
 	encoder->SetEchoCanceller(echoCanceller);
+	encoder->SetFusedCapture(fusedCapture);
 	encoder->Start();
 	if(!micMuted){
 		audioInput->Start();
@@ -3376,12 +3733,8 @@ void VoIPGroupController::SendPacket(unsigned char *data, size_t len, Endpoint *
 
 		unsigned char key[32], iv[32], msgKey[16];
 		out.WriteBytes(keyFingerprint, 8);
-		BufferOutputStream buf(len+32);
-		size_t x=0;
-		buf.WriteBytes(encryptionKey+88+x, 32);
-		buf.WriteBytes(inner.GetBuffer()+4, inner.GetLength()-4);
 		unsigned char msgKeyLarge[32];
-		crypto.sha256(buf.GetBuffer(), buf.GetLength(), msgKeyLarge);
+		MsgKeyLarge(inner.GetBuffer()+4, inner.GetLength()-4, 0, msgKeyLarge);
 		memcpy(msgKey, msgKeyLarge+8, 16);
 		KDF2(msgKey, 0, key, iv);
 		out.WriteBytes(msgKey, 16);
@@ -19,6 +19,7 @@
 #include <vector>
 #include <string>
 #include <map>
+#include <atomic>
 #include "audio/AudioInput.h"
 #include "BlockingQueue.h"
 #include "BufferOutputStream.h"
@@ -74,6 +75,33 @@ struct voip_stats_t{
 };
 typedef struct voip_stats_t voip_stats_t;
 
+/**
+ * One per-second telemetry sample. Only fixed-size fields so that it can be written to a file as is.
+ */
+struct voip_telemetry_snapshot_t{
+	double time; // seconds since the controller was started
+	float rtt;
+	float minRTT;
+	float jitter;
+	float jitterBufferDelay; // seconds
+	uint32_t sendLossCount;
+	uint32_t recvLossCount;
+	uint32_t encoderPacketLoss; // percent
+	uint32_t bitrate;
+	uint32_t congestionWindow;
+	uint32_t inflightDataSize;
+	uint32_t encoderCPUTime; // ms, cumulative for the encoder thread
+	uint32_t decoderCPUTime; // ms, cumulative for the thread that decodes incoming audio
+	uint32_t packetBuffersUsed;
+	uint32_t packetBuffersHighWater;
+	uint32_t packetBuffersExhausted;
+	uint32_t fecRecoveredPackets;
+};
+typedef struct voip_telemetry_snapshot_t voip_telemetry_snapshot_t;
+
+#define TGVOIP_TELEMETRY_HISTORY_SIZE 64
+#define TGVOIP_TELEMETRY_DUMP_MAGIC 0x4D4C4554 // "TELM"
+
 struct voip_crypto_functions_t{
 	void (*rand_bytes)(uint8_t* buffer, size_t length);
 	void (*sha1)(uint8_t* msg, size_t length, uint8_t* output);
@@ -222,6 +250,10 @@ namespace tgvoip{
 		 */
 		double GetAverageRTT();
 		static double GetCurrentTime();
+		/**
+		 * @return CPU time consumed by the calling thread, in seconds
+		 */
+		static double GetCurrentThreadCPUTime();
 		/**
 		 * Use this field to store any of your context data associated with this call
 		 */
@@ -249,6 +281,27 @@ namespace tgvoip{
 		 * @param stats
 		 */
 		void GetStats(voip_stats_t* stats);
+		/**
+		 * Get the most recent telemetry sample. Never blocks, safe to call from any thread.
+		 * @param snapshot
+		 * @return false if no sample was taken yet
+		 */
+		bool GetTelemetrySnapshot(voip_telemetry_snapshot_t* snapshot);
+		/**
+		 * Get up to TGVOIP_TELEMETRY_HISTORY_SIZE most recent telemetry samples, oldest first. Never blocks.
+		 * Samples that get overwritten by newer ones while they're being copied are left out.
+		 * @param snapshots
+		 * @param count
+		 * @return the number of samples written
+		 */
+		size_t GetTelemetryHistory(voip_telemetry_snapshot_t* snapshots, size_t count);
+		/**
+		 * Append every telemetry sample to a binary file: a header of magic, sizeof(voip_telemetry_snapshot_t) and
+		 * LIBTGVOIP_VERSION padded to 16 bytes, followed by raw snapshots. An empty path stops dumping. May be
+		 * called while the call is running.
+		 * @param path
+		 */
+		void SetTelemetryDumpFilePath(std::string path);
 		/**
 		 *
 		 * @return
@@ -409,10 +462,13 @@ namespace tgvoip{
 		void UpdateDataSavingState();
 		void KDF(unsigned char* msgKey, size_t x, unsigned char* aesKey, unsigned char* aesIv);
 		void KDF2(unsigned char* msgKey, size_t x, unsigned char* aesKey, unsigned char* aesIv);
+		void MsgKeyLarge(unsigned char* data, size_t len, size_t x, unsigned char* out);
 		static size_t AudioInputCallback(unsigned char* data, size_t length, void* param);
 		void SendPublicEndpointsRequest();
 		void SendPublicEndpointsRequest(Endpoint& relay);
 		Endpoint* GetEndpointByType(int type);
+		Endpoint* GetMultipathEndpoint();
+		void UpdateMultipathRedundancy(double lossRate);
 		void SendPacketReliably(unsigned char type, unsigned char* data, size_t len, double retryInterval, double timeout);
 		uint32_t GenerateOutSeq();
 		void LogDebugInfo();
@@ -483,6 +539,17 @@ namespace tgvoip{
 		NetworkSocket* udpSocket;
 		NetworkSocket* realUdpSocket;
 		FILE* statsDump;
+		struct TelemetrySlot{
+			std::atomic<uint32_t> seq;
+			voip_telemetry_snapshot_t snapshot;
+		};
+		void UpdateTelemetry(double startTime);
+		bool ReadTelemetrySlot(uint32_t index, voip_telemetry_snapshot_t* snapshot);
+		TelemetrySlot telemetry[TGVOIP_TELEMETRY_HISTORY_SIZE];
+		std::atomic<uint32_t> telemetryCount;
+		std::string telemetryDumpFilePath;
+		FILE* telemetryDump;
+		Mutex telemetryDumpMutex;
 		std::string currentAudioInput;
 		std::string currentAudioOutput;
 		bool useTCP;
@@ -538,6 +605,18 @@ namespace tgvoip{
 		double p2pToRelaySwitchThreshold;
 		double relayToP2pSwitchThreshold;
 		double reconnectingTimeout;
+		bool multipathEnabled;
+		double multipathLossThreshold;
+		double multipathJitterThreshold;
+		unsigned int multipathMaxRedundancy;
+		unsigned int multipathRedundancy; // percentage of audio packets duplicated to the second best endpoint
+		unsigned int multipathCredit;
+		uint32_t multipathPacketsSent;
+		Endpoint* lastTickEndpoint;
+		double lastEndpointSwitchTime;
+		uint32_t recvDuplicateCount;
+		size_t tcpMaxUnsentBytes;
+		uint32_t tcpStaleDropCount;
 
 		/*** platform-specific things **/
 #ifdef __APPLE__
@@ -5,6 +5,7 @@
 //
 
 #include "AudioInput.h"
+#include "AudioInputFile.h"
 #include "../logging.h"
 #if defined(__ANDROID__)
 #include "../os/android/AudioInputAndroid.h"
@@ -20,8 +21,10 @@
 #endif
 #include "../os/windows/AudioInputWASAPI.h"
 #elif defined(__linux__)
+#ifndef TGVOIP_NO_DEVICE_AUDIO
 #include "../os/linux/AudioInputALSA.h"
 #include "../os/linux/AudioInputPulse.h"
+#endif
 #else
 #error "Unsupported operating system"
 #endif
@@ -40,6 +43,10 @@ AudioInput::AudioInput(std::string deviceID) : currentDevice(deviceID){
 }
 
 AudioInput *AudioInput::Create(std::string deviceID, void* platformSpecific){
+#ifdef TGVOIP_USE_FILE_AUDIO
+	if(deviceID.compare(0, 5, "file:")==0)
+		return new AudioInputFile(deviceID.substr(5));
+#endif
 #if defined(__ANDROID__)
 	return new AudioInputAndroid();
 #elif defined(__APPLE__)
@@ -55,6 +62,10 @@ AudioInput *AudioInput::Create(std::string deviceID, void* platformSpecific){
 #endif
 	return new AudioInputWASAPI(deviceID);
 #elif defined(__linux__)
+#ifdef TGVOIP_NO_DEVICE_AUDIO
+	LOGW("in: built without device audio, using a null device instead of %s", deviceID.c_str());
+	return new AudioInputFile("/dev/null");
+#else
 	if(AudioInputPulse::IsAvailable()){
 		AudioInputPulse* aip=new AudioInputPulse(deviceID);
 		if(!aip->IsInitialized())
@@ -65,6 +76,7 @@ AudioInput *AudioInput::Create(std::string deviceID, void* platformSpecific){
 	}
 	return new AudioInputALSA(deviceID);
 #endif
+#endif
 }
 
 
@@ -87,7 +99,7 @@ void AudioInput::EnumerateDevices(std::vector<AudioInputDevice>& devs){
 	}
 #endif
 	AudioInputWASAPI::EnumerateDevices(devs);
-#elif defined(__linux__) && !defined(__ANDROID__)
+#elif defined(__linux__) && !defined(__ANDROID__) && !defined(TGVOIP_NO_DEVICE_AUDIO)
 	if(!AudioInputPulse::IsAvailable() || !AudioInputPulse::EnumerateDevices(devs))
 		AudioInputALSA::EnumerateDevices(devs);
 #endif
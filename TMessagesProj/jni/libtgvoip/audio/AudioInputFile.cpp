@@ -0,0 +1,100 @@
+//
+// libtgvoip is free and unencumbered public domain software.
+// For more information, see http://unlicense.org or the UNLICENSE file
+// you should have received with this source code distribution.
+//
+
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <unistd.h>
+#else
+#include <windows.h>
+#endif
+#include "AudioInputFile.h"
+#include "../logging.h"
+#include "../VoIPController.h"
+
+using namespace tgvoip::audio;
+
+#define BUFFER_SIZE 960
+
+AudioInputFile::AudioInputFile(std::string path) : AudioInput("file:"+path){
+	isRecording=false;
+	thread=NULL;
+	fileSamples=0;
+	file=fopen(path.c_str(), "rb");
+	if(!file){
+		LOGE("Error opening input file %s", path.c_str());
+		failed=true;
+		return;
+	}
+	fseek(file, 0, SEEK_END);
+	fileSamples=(size_t)ftell(file)/2;
+	fseek(file, 0, SEEK_SET);
+}
+
+AudioInputFile::~AudioInputFile(){
+	Stop();
+	if(file)
+		fclose(file);
+}
+
+void AudioInputFile::Configure(uint32_t sampleRate, uint32_t bitsPerSample, uint32_t channels){
+
+}
+
+void AudioInputFile::Start(){
+	if(failed || isRecording)
+		return;
+
+	isRecording=true;
+	thread=new Thread(new MethodPointer<AudioInputFile>(&AudioInputFile::RunThread, this), NULL);
+	thread->SetName("AudioInputFile");
+	thread->Start();
+}
+
+void AudioInputFile::Stop(){
+	if(!isRecording)
+		return;
+
+	isRecording=false;
+	thread->Join();
+	delete thread;
+	thread=NULL;
+}
+
+double AudioInputFile::GetTimelineOrigin(){
+	static double origin=VoIPController::GetCurrentTime();
+	return origin;
+}
+
+void AudioInputFile::RunThread(void* arg){
+	int16_t buffer[BUFFER_SIZE];
+	double origin=GetTimelineOrigin();
+	uint64_t position=(uint64_t)((VoIPController::GetCurrentTime()-origin)*48000);
+	if(fileSamples>0)
+		fseek(file, (long)(position%fileSamples)*2, SEEK_SET);
+	double nextFrameTime=origin+position/48000.0;
+	while(isRecording){
+		size_t read=fread(buffer, 2, BUFFER_SIZE, file);
+		if(read<BUFFER_SIZE){
+			// wrap around so that the call can last longer than the file
+			fseek(file, 0, SEEK_SET);
+			read+=fread(buffer+read, 2, BUFFER_SIZE-read, file);
+			if(read<BUFFER_SIZE)
+				memset(buffer+read, 0, (BUFFER_SIZE-read)*2);
+		}
+		InvokeCallback((unsigned char*)buffer, sizeof(buffer));
+		// pace against an absolute clock so that timing errors don't accumulate
+		nextFrameTime+=BUFFER_SIZE/48000.0;
+		double sleepTime=nextFrameTime-VoIPController::GetCurrentTime();
+		if(sleepTime>0){
+#ifndef _WIN32
+			usleep((useconds_t)(sleepTime*1000000));
+#else
+			Sleep((DWORD)(sleepTime*1000));
+#endif
+		}
+	}
+}
@@ -0,0 +1,50 @@
+//
+// libtgvoip is free and unencumbered public domain software.
+// For more information, see http://unlicense.org or the UNLICENSE file
+// you should have received with this source code distribution.
+//
+
+#ifndef LIBTGVOIP_AUDIOINPUTFILE_H
+#define LIBTGVOIP_AUDIOINPUTFILE_H
+
+#include <stdio.h>
+#include "AudioInput.h"
+#include "../threading.h"
+
+namespace tgvoip{
+namespace audio{
+
+/**
+ * Plays back a raw 48 kHz 16-bit mono PCM file in real time instead of capturing from a device, looping at the end.
+ * Selected by passing "file:/path/to/file.pcm" as the input device ID in builds with TGVOIP_USE_FILE_AUDIO defined.
+ * Meant for reproducible offline measurements.
+ * All file inputs and outputs in the process share one timeline, see GetTimelineOrigin().
+ */
+class AudioInputFile : public AudioInput{
+
+public:
+	AudioInputFile(std::string path);
+	virtual ~AudioInputFile();
+	virtual void Configure(uint32_t sampleRate, uint32_t bitsPerSample, uint32_t channels);
+	virtual void Start();
+	virtual void Stop();
+	/**
+	 * The moment that sample 0 of every file input and output corresponds to, fixed when the first of them starts.
+	 * An input that starts later begins reading from the matching position and an output begins with silence,
+	 * so a recording lines up sample for sample with the file that was played on the other end of a call.
+	 */
+	static double GetTimelineOrigin();
+
+private:
+	void RunThread(void* arg);
+
+	FILE* file;
+	size_t fileSamples;
+	Thread* thread;
+	bool isRecording;
+};
+
+}
+}
+
+#endif //LIBTGVOIP_AUDIOINPUTFILE_H
@@ -5,6 +5,7 @@
 //
 
 #include "AudioOutput.h"
+#include "AudioOutputFile.h"
 #include "../logging.h"
 #include <stdlib.h>
 #if defined(__ANDROID__)
@@ -23,8 +24,10 @@
 #endif
 #include "../os/windows/AudioOutputWASAPI.h"
 #elif defined(__linux__)
+#ifndef TGVOIP_NO_DEVICE_AUDIO
 #include "../os/linux/AudioOutputALSA.h"
 #include "../os/linux/AudioOutputPulse.h"
+#endif
 #else
 #error "Unsupported operating system"
 #endif
@@ -35,6 +38,10 @@ using namespace tgvoip::audio;
 int32_t AudioOutput::estimatedDelay=60;
 
 AudioOutput *AudioOutput::Create(std::string deviceID, void* platformSpecific){
+#ifdef TGVOIP_USE_FILE_AUDIO
+	if(deviceID.compare(0, 5, "file:")==0)
+		return new AudioOutputFile(deviceID.substr(5));
+#endif
 #if defined(__ANDROID__)
 	char sdkNum[PROP_VALUE_MAX];
 	__system_property_get("ro.build.version.sdk", sdkNum);
@@ -55,6 +62,10 @@ AudioOutput *AudioOutput::Create(std::string deviceID, void* platformSpecific){
 #endif
 	return new AudioOutputWASAPI(deviceID);
 #elif defined(__linux__)
+#ifdef TGVOIP_NO_DEVICE_AUDIO
+	LOGW("out: built without device audio, using a null device instead of %s", deviceID.c_str());
+	return new AudioOutputFile("/dev/null");
+#else
 	if(AudioOutputPulse::IsAvailable()){
 		AudioOutputPulse* aop=new AudioOutputPulse(deviceID);
 		if(!aop->IsInitialized())
@@ -65,6 +76,7 @@ AudioOutput *AudioOutput::Create(std::string deviceID, void* platformSpecific){
 	}
 	return new AudioOutputALSA(deviceID);
 #endif
+#endif
 }
 
 AudioOutput::AudioOutput() : currentDevice("default"){
@@ -106,7 +118,7 @@ void AudioOutput::EnumerateDevices(std::vector<AudioOutputDevice>& devs){
 	}
 #endif
 	AudioOutputWASAPI::EnumerateDevices(devs);
-#elif defined(__linux__) && !defined(__ANDROID__)
+#elif defined(__linux__) && !defined(__ANDROID__) && !defined(TGVOIP_NO_DEVICE_AUDIO)
 	if(!AudioOutputPulse::IsAvailable() || !AudioOutputPulse::EnumerateDevices(devs))
 		AudioOutputALSA::EnumerateDevices(devs);
 #endif
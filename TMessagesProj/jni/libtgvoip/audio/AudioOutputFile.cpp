@@ -0,0 +1,92 @@
+//
+// libtgvoip is free and unencumbered public domain software.
+// For more information, see http://unlicense.org or the UNLICENSE file
+// you should have received with this source code distribution.
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#ifndef _WIN32
+#include <unistd.h>
+#else
+#include <windows.h>
+#endif
+#include "AudioOutputFile.h"
+#include "AudioInputFile.h"
+#include "../logging.h"
+#include "../VoIPController.h"
+
+using namespace tgvoip::audio;
+
+#define BUFFER_SIZE 960
+
+AudioOutputFile::AudioOutputFile(std::string path) : AudioOutput("file:"+path){
+	isPlaying=false;
+	thread=NULL;
+	file=fopen(path.c_str(), "wb");
+	if(!file){
+		LOGE("Error opening output file %s", path.c_str());
+		failed=true;
+	}
+}
+
+AudioOutputFile::~AudioOutputFile(){
+	Stop();
+	if(file)
+		fclose(file);
+}
+
+void AudioOutputFile::Configure(uint32_t sampleRate, uint32_t bitsPerSample, uint32_t channels){
+
+}
+
+void AudioOutputFile::Start(){
+	if(failed || isPlaying)
+		return;
+
+	isPlaying=true;
+	thread=new Thread(new MethodPointer<AudioOutputFile>(&AudioOutputFile::RunThread, this), NULL);
+	thread->SetName("AudioOutputFile");
+	thread->Start();
+}
+
+void AudioOutputFile::Stop(){
+	if(!isPlaying)
+		return;
+
+	isPlaying=false;
+	thread->Join();
+	delete thread;
+	thread=NULL;
+}
+
+bool AudioOutputFile::IsPlaying(){
+	return isPlaying;
+}
+
+void AudioOutputFile::RunThread(void* arg){
+	unsigned char buffer[BUFFER_SIZE*2];
+	double origin=AudioInputFile::GetTimelineOrigin();
+	uint64_t position=(uint64_t)((VoIPController::GetCurrentTime()-origin)*48000);
+	// everything before this output was started is silence on the shared timeline
+	memset(buffer, 0, sizeof(buffer));
+	for(uint64_t written=0;written<position;written+=BUFFER_SIZE){
+		fwrite(buffer, 2, (size_t)std::min((uint64_t)BUFFER_SIZE, position-written), file);
+	}
+	double nextFrameTime=origin+position/48000.0;
+	while(isPlaying){
+		InvokeCallback(buffer, sizeof(buffer));
+		fwrite(buffer, 1, sizeof(buffer), file);
+		nextFrameTime+=BUFFER_SIZE/48000.0;
+		double sleepTime=nextFrameTime-VoIPController::GetCurrentTime();
+		if(sleepTime>0){
+#ifndef _WIN32
+			usleep((useconds_t)(sleepTime*1000000));
+#else
+			Sleep((DWORD)(sleepTime*1000));
+#endif
+		}
+	}
+	fflush(file);
+}
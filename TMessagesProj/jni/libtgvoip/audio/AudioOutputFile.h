@@ -0,0 +1,43 @@
+//
+// libtgvoip is free and unencumbered public domain software.
+// For more information, see http://unlicense.org or the UNLICENSE file
+// you should have received with this source code distribution.
+//
+
+#ifndef LIBTGVOIP_AUDIOOUTPUTFILE_H
+#define LIBTGVOIP_AUDIOOUTPUTFILE_H
+
+#include <stdio.h>
+#include "AudioOutput.h"
+#include "../threading.h"
+
+namespace tgvoip{
+namespace audio{
+
+/**
+ * Pulls decoded audio in real time and writes it to a raw 48 kHz 16-bit mono PCM file instead of playing it.
+ * Selected by passing "file:/path/to/file.pcm" as the output device ID in builds with TGVOIP_USE_FILE_AUDIO defined.
+ * The file starts at AudioInputFile::GetTimelineOrigin().
+ */
+class AudioOutputFile : public AudioOutput{
+
+public:
+	AudioOutputFile(std::string path);
+	virtual ~AudioOutputFile();
+	virtual void Configure(uint32_t sampleRate, uint32_t bitsPerSample, uint32_t channels);
+	virtual void Start();
+	virtual void Stop();
+	virtual bool IsPlaying();
+
+private:
+	void RunThread(void* arg);
+
+	FILE* file;
+	Thread* thread;
+	bool isPlaying;
+};
+
+}
+}
+
+#endif //LIBTGVOIP_AUDIOOUTPUTFILE_H
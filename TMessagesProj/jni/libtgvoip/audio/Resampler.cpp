@@ -5,6 +5,13 @@
 #include <math.h>
 #include <string.h>
 #include "Resampler.h"
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define RESAMPLER_USE_NEON
+#elif defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP>=1)
+#include <xmmintrin.h>
+#define RESAMPLER_USE_SSE
+#endif
 
 using namespace tgvoip::audio;
 static const int16_t hann[960]={
@@ -115,3 +122,173 @@ void Resampler::Rescale60To40(int16_t *in, int16_t *out){
 		out[960+i]=(int16_t)(((int32_t)in[1920+i]*hann[i]) >> 15) + (int16_t)(((int32_t)in[1440+i]*hann[959-i]) >> 15);
 	}
 }
+
+// Taps per polyphase branch, must be a multiple of 4 for the vector kernels
+#define POLYPHASE_TAPS 48
+// Input is converted to float and filtered in chunks of this many samples
+#define POLYPHASE_CHUNK 512
+#define POLYPHASE_KAISER_BETA 8.0
+#define POLYPHASE_ROLLOFF 0.92
+
+static unsigned int gcd(unsigned int a, unsigned int b){
+	while(b){
+		unsigned int t=a%b;
+		a=b;
+		b=t;
+	}
+	return a;
+}
+
+static double besselI0(double x){
+	double sum=1.0, term=1.0, halfX=x/2.0;
+	for(int k=1;k<32;k++){
+		term*=halfX/k;
+		sum+=term*term;
+		if(term*term<sum*1e-12)
+			break;
+	}
+	return sum;
+}
+
+PolyphaseResampler::PolyphaseResampler(unsigned int inputRate, unsigned int outputRate){
+	this->inputRate=inputRate;
+	this->outputRate=outputRate;
+	unsigned int div=gcd(inputRate, outputRate);
+	upFactor=outputRate/div;
+	downFactor=inputRate/div;
+
+	// Prototype low-pass at the upsampled rate, cut off just below the lower of the two Nyquist frequencies,
+	// split into upFactor branches. Each branch is stored reversed so that it lines up with the input
+	// history (oldest sample first) and normalized to unity DC gain.
+	filters=(float*)malloc(sizeof(float)*POLYPHASE_TAPS*upFactor);
+	unsigned int protoLen=POLYPHASE_TAPS*upFactor;
+	double center=(protoLen-1)/2.0;
+	double cutoff=POLYPHASE_ROLLOFF*0.5/(upFactor>downFactor ? upFactor : downFactor);
+	double windowNorm=besselI0(POLYPHASE_KAISER_BETA);
+	for(unsigned int p=0;p<upFactor;p++){
+		float* branch=filters+p*POLYPHASE_TAPS;
+		double sum=0.0;
+		for(unsigned int k=0;k<POLYPHASE_TAPS;k++){
+			double m=k*upFactor+p-center;
+			double sinc=m==0.0 ? 1.0 : sin(2.0*M_PI*cutoff*m)/(2.0*M_PI*cutoff*m);
+			double r=2.0*(k*upFactor+p)/(protoLen-1)-1.0;
+			double window=besselI0(POLYPHASE_KAISER_BETA*sqrt(fmax(0.0, 1.0-r*r)))/windowNorm;
+			double c=sinc*window;
+			branch[POLYPHASE_TAPS-1-k]=(float)c;
+			sum+=c;
+		}
+		for(unsigned int k=0;k<POLYPHASE_TAPS;k++){
+			branch[k]=(float)(branch[k]/sum);
+		}
+	}
+	buffer=(float*)malloc(sizeof(float)*(POLYPHASE_TAPS-1+POLYPHASE_CHUNK));
+	Reset();
+}
+
+PolyphaseResampler::~PolyphaseResampler(){
+	free(filters);
+	free(buffer);
+}
+
+void PolyphaseResampler::Reset(){
+	memset(buffer, 0, sizeof(float)*(POLYPHASE_TAPS-1));
+	phase=0;
+	inputOffset=0;
+	pending.clear();
+}
+
+unsigned int PolyphaseResampler::GetInputRate(){
+	return inputRate;
+}
+
+unsigned int PolyphaseResampler::GetOutputRate(){
+	return outputRate;
+}
+
+size_t PolyphaseResampler::GetOutputLength(size_t inLen){
+	// Outputs are produced for every input position in [inputOffset, inLen), stepping by downFactor/upFactor
+	if(inLen<=inputOffset)
+		return pending.size();
+	uint64_t steps=(uint64_t)(inLen-inputOffset)*upFactor-phase;
+	return pending.size()+(size_t)((steps+downFactor-1)/downFactor);
+}
+
+float PolyphaseResampler::DotProduct(const float *a, const float *b, unsigned int len){
+#if defined(RESAMPLER_USE_NEON)
+	float32x4_t acc0=vdupq_n_f32(0.0f);
+	float32x4_t acc1=vdupq_n_f32(0.0f);
+	unsigned int i=0;
+	for(;i+8<=len;i+=8){
+		acc0=vmlaq_f32(acc0, vld1q_f32(a+i), vld1q_f32(b+i));
+		acc1=vmlaq_f32(acc1, vld1q_f32(a+i+4), vld1q_f32(b+i+4));
+	}
+	for(;i<len;i+=4){
+		acc0=vmlaq_f32(acc0, vld1q_f32(a+i), vld1q_f32(b+i));
+	}
+	acc0=vaddq_f32(acc0, acc1);
+	float32x2_t sum=vadd_f32(vget_low_f32(acc0), vget_high_f32(acc0));
+	sum=vpadd_f32(sum, sum);
+	return vget_lane_f32(sum, 0);
+#elif defined(RESAMPLER_USE_SSE)
+	__m128 acc0=_mm_setzero_ps();
+	__m128 acc1=_mm_setzero_ps();
+	unsigned int i=0;
+	for(;i+8<=len;i+=8){
+		acc0=_mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(a+i), _mm_loadu_ps(b+i)));
+		acc1=_mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(a+i+4), _mm_loadu_ps(b+i+4)));
+	}
+	for(;i<len;i+=4){
+		acc0=_mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(a+i), _mm_loadu_ps(b+i)));
+	}
+	acc0=_mm_add_ps(acc0, acc1);
+	acc0=_mm_add_ps(acc0, _mm_movehl_ps(acc0, acc0));
+	acc0=_mm_add_ss(acc0, _mm_shuffle_ps(acc0, acc0, 1));
+	return _mm_cvtss_f32(acc0);
+#else
+	float acc0=0.0f, acc1=0.0f, acc2=0.0f, acc3=0.0f;
+	for(unsigned int i=0;i<len;i+=4){
+		acc0+=a[i]*b[i];
+		acc1+=a[i+1]*b[i+1];
+		acc2+=a[i+2]*b[i+2];
+		acc3+=a[i+3]*b[i+3];
+	}
+	return (acc0+acc1)+(acc2+acc3);
+#endif
+}
+
+size_t PolyphaseResampler::Process(int16_t *in, size_t inLen, int16_t *out, size_t outLen){
+	size_t written=MIN(pending.size(), outLen);
+	if(written>0){
+		memcpy(out, &pending[0], written*sizeof(int16_t));
+		pending.erase(pending.begin(), pending.begin()+written);
+	}
+	float* chunk=buffer+POLYPHASE_TAPS-1;
+	while(inLen>0){
+		size_t len=MIN(inLen, POLYPHASE_CHUNK);
+		for(size_t i=0;i<len;i++){
+			chunk[i]=(float)in[i];
+		}
+		while(inputOffset<len){
+			float sample=DotProduct(filters+phase*POLYPHASE_TAPS, buffer+inputOffset, POLYPHASE_TAPS);
+			if(sample>32767.0f)
+				sample=32767.0f;
+			else if(sample<-32768.0f)
+				sample=-32768.0f;
+			// output that doesn't fit waits for the next call
+			if(written<outLen)
+				out[written++]=(int16_t)lrintf(sample);
+			else
+				pending.push_back((int16_t)lrintf(sample));
+			phase+=downFactor;
+			while(phase>=upFactor){
+				phase-=upFactor;
+				inputOffset++;
+			}
+		}
+		inputOffset-=len;
+		memmove(buffer, buffer+len, sizeof(float)*(POLYPHASE_TAPS-1));
+		in+=len;
+		inLen-=len;
+	}
+	return written;
+}
@@ -7,6 +7,7 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <vector>
 
 namespace tgvoip{ namespace audio{
 	class Resampler{
@@ -17,6 +18,42 @@ namespace tgvoip{ namespace audio{
 		static void Rescale60To80(int16_t* in, int16_t* out);
 		static void Rescale60To40(int16_t* in, int16_t* out);
 	};
+
+	/**
+	 * Windowed-sinc polyphase resampler for arbitrary rational ratios (48000<->44100/16000/8000 etc).
+	 * Unlike the static functions above, it keeps its filter history and phase between calls, so a stream
+	 * may be fed in blocks of any size without discontinuities at block boundaries.
+	 */
+	class PolyphaseResampler{
+	public:
+		PolyphaseResampler(unsigned int inputRate, unsigned int outputRate);
+		~PolyphaseResampler();
+		/**
+		 * Resamples all of the input. Output that doesn't fit into the output buffer is kept and written first
+		 * on the next call, so none of it is lost when the caller's buffer is a bit short.
+		 * @return number of output samples written
+		 */
+		size_t Process(int16_t* in, size_t inLen, int16_t* out, size_t outLen);
+		void Reset();
+		unsigned int GetInputRate();
+		unsigned int GetOutputRate();
+		/**
+		 * @return the exact number of output samples the next Process() call will produce for inLen input samples,
+		 * including the ones left over from the previous call
+		 */
+		size_t GetOutputLength(size_t inLen);
+	private:
+		static float DotProduct(const float* a, const float* b, unsigned int len);
+		unsigned int inputRate;
+		unsigned int outputRate;
+		unsigned int upFactor;
+		unsigned int downFactor;
+		unsigned int phase;
+		float* filters;
+		float* buffer;
+		size_t inputOffset;
+		std::vector<int16_t> pending;
+	};
 }}
 
 #endif //LIBTGVOIP_RESAMPLER_H
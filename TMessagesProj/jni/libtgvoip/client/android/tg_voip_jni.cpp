@@ -450,6 +450,18 @@ extern "C" JNIEXPORT jint Java_org_telegram_messenger_voip_Resampler_convert48to
 	return tgvoip::audio::Resampler::Convert48To44((int16_t *) env->GetDirectBufferAddress(from), (int16_t *) env->GetDirectBufferAddress(to), (size_t) (env->GetDirectBufferCapacity(from)/2), (size_t) (env->GetDirectBufferCapacity(to)/2));
 }
 
+extern "C" JNIEXPORT jlong Java_org_telegram_messenger_voip_Resampler_create(JNIEnv* env, jclass cls, jint inputRate, jint outputRate){
+	return (jlong)(intptr_t) new tgvoip::audio::PolyphaseResampler((unsigned int)inputRate, (unsigned int)outputRate);
+}
+
+extern "C" JNIEXPORT jint Java_org_telegram_messenger_voip_Resampler_process(JNIEnv* env, jclass cls, jlong inst, jobject from, jobject to){
+	return (jint)((tgvoip::audio::PolyphaseResampler*)(intptr_t)inst)->Process((int16_t *) env->GetDirectBufferAddress(from), (size_t) (env->GetDirectBufferCapacity(from)/2), (int16_t *) env->GetDirectBufferAddress(to), (size_t) (env->GetDirectBufferCapacity(to)/2));
+}
+
+extern "C" JNIEXPORT void Java_org_telegram_messenger_voip_Resampler_destroy(JNIEnv* env, jclass cls, jlong inst){
+	delete ((tgvoip::audio::PolyphaseResampler*)(intptr_t)inst);
+}
+
 extern "C" JNIEXPORT jlong Java_org_telegram_messenger_voip_VoIPGroupController_nativeInit(JNIEnv* env, jobject thiz, jint timeDifference){
 	env->GetJavaVM(&sharedJVM);
 	if(!AudioInputAndroid::jniClass){
@@ -28,6 +28,7 @@
         'sources': [
           '<(tgvoip_src_loc)/BlockingQueue.cpp',
           '<(tgvoip_src_loc)/BlockingQueue.h',
+          '<(tgvoip_src_loc)/SPSCQueue.h',
           '<(tgvoip_src_loc)/BufferInputStream.cpp',
           '<(tgvoip_src_loc)/BufferInputStream.h',
           '<(tgvoip_src_loc)/BufferOutputStream.cpp',
@@ -48,6 +49,7 @@
           '<(tgvoip_src_loc)/OpusDecoder.h',
           '<(tgvoip_src_loc)/OpusEncoder.cpp',
           '<(tgvoip_src_loc)/OpusEncoder.h',
+          '<(tgvoip_src_loc)/PacketCodec.h',
           '<(tgvoip_src_loc)/threading.h',
           '<(tgvoip_src_loc)/VoIPController.cpp',
           '<(tgvoip_src_loc)/VoIPController.h',
@@ -55,8 +57,12 @@
           '<(tgvoip_src_loc)/VoIPServerConfig.h',
           '<(tgvoip_src_loc)/audio/AudioInput.cpp',
           '<(tgvoip_src_loc)/audio/AudioInput.h',
+          '<(tgvoip_src_loc)/audio/AudioInputFile.cpp',
+          '<(tgvoip_src_loc)/audio/AudioInputFile.h',
           '<(tgvoip_src_loc)/audio/AudioOutput.cpp',
           '<(tgvoip_src_loc)/audio/AudioOutput.h',
+          '<(tgvoip_src_loc)/audio/AudioOutputFile.cpp',
+          '<(tgvoip_src_loc)/audio/AudioOutputFile.h',
           '<(tgvoip_src_loc)/audio/Resampler.cpp',
           '<(tgvoip_src_loc)/audio/Resampler.h',
           '<(tgvoip_src_loc)/NetworkSocket.cpp',
@@ -89,6 +95,8 @@
           '<(tgvoip_src_loc)/os/darwin/DarwinSpecific.h',
 
           # Linux
+          '<(tgvoip_src_loc)/os/linux/ALSAMmapStream.cpp',
+          '<(tgvoip_src_loc)/os/linux/ALSAMmapStream.h',
           '<(tgvoip_src_loc)/os/linux/AudioInputALSA.cpp',
           '<(tgvoip_src_loc)/os/linux/AudioInputALSA.h',
           '<(tgvoip_src_loc)/os/linux/AudioOutputALSA.cpp',
@@ -23,6 +23,7 @@ using namespace tgvoip::audio;
 AudioInputAudioUnitLegacy::AudioInputAudioUnitLegacy(std::string deviceID) : AudioInput(deviceID){
 	remainingDataSize=0;
 	isRecording=false;
+	resampler=NULL;
 
 	inBufferList.mBuffers[0].mData=malloc(10240);
 	inBufferList.mBuffers[0].mDataByteSize=10240;
@@ -76,6 +77,8 @@ AudioInputAudioUnitLegacy::~AudioInputAudioUnitLegacy(){
 	AudioUnitUninitialize(unit);
 	AudioComponentInstanceDispose(unit);
 	free(inBufferList.mBuffers[0].mData);
+	if(resampler)
+		delete resampler;
 }
 
 void AudioInputAudioUnitLegacy::Configure(uint32_t sampleRate, uint32_t bitsPerSample, uint32_t channels){
@@ -107,7 +110,13 @@ void AudioInputAudioUnitLegacy::HandleBufferCallback(AudioBufferList *ioData){
 		AudioBuffer buf=ioData->mBuffers[i];
 		size_t len=buf.mDataByteSize;
 		if(hardwareSampleRate!=48000){
-			len=tgvoip::audio::Resampler::Convert((int16_t*)buf.mData, (int16_t*)(remainingData+remainingDataSize), buf.mDataByteSize/2, (10240-(buf.mDataByteSize+remainingDataSize))/2, 48000, hardwareSampleRate)*2;
+			// (Re)created here rather than in SetCurrentDevice so that it's only ever touched from the IO thread
+			if(!resampler || (int)resampler->GetInputRate()!=hardwareSampleRate){
+				if(resampler)
+					delete resampler;
+				resampler=new PolyphaseResampler(hardwareSampleRate, 48000);
+			}
+			len=resampler->Process((int16_t*)buf.mData, buf.mDataByteSize/2, (int16_t*)(remainingData+remainingDataSize), (10240-remainingDataSize)/2)*2;
 		}else{
 			assert(remainingDataSize+buf.mDataByteSize<10240);
 			memcpy(remainingData+remainingDataSize, buf.mData, buf.mDataByteSize);
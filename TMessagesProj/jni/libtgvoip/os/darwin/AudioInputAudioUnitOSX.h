@@ -11,6 +11,7 @@
 #import <AudioToolbox/AudioToolbox.h>
 #import <CoreAudio/CoreAudio.h>
 #include "../../audio/AudioInput.h"
+#include "../../audio/Resampler.h"
 
 namespace tgvoip{ namespace audio{
 class AudioInputAudioUnitLegacy : public AudioInput{
@@ -34,6 +35,7 @@ private:
 	AudioUnit unit;
 	AudioBufferList inBufferList;
 	int hardwareSampleRate;
+	PolyphaseResampler* resampler;
 };
 }}
 
@@ -0,0 +1,234 @@
+//
+// libtgvoip is free and unencumbered public domain software.
+// For more information, see http://unlicense.org or the UNLICENSE file
+// you should have received with this source code distribution.
+//
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include "ALSAMmapStream.h"
+#include "../../logging.h"
+
+#define CHECK_DL_ERROR(res, msg) if(!res){LOGE(msg ": %s", dlerror()); return;}
+#define LOAD_FUNCTION(lib, name) {_##name=(typeof(_##name))dlsym(lib, #name); CHECK_DL_ERROR(_##name, "Error getting entry point for " #name);}
+#define CHECK_CONFIG_ERROR(res, msg) if(res<0){LOGW(msg ": %s", _snd_strerror(res)); _snd_pcm_hw_params_free(hw); return false;}
+
+using namespace tgvoip::audio;
+
+ALSAMmapStream::ALSAMmapStream(void* lib, snd_pcm_stream_t stream){
+	this->stream=stream;
+	handle=NULL;
+	periodSize=0;
+	pollFds=NULL;
+	pollFdCount=0;
+	pollTimeout=100;
+	xrunCount=0;
+	loaded=false;
+
+	LOAD_FUNCTION(lib, snd_pcm_hw_params_malloc);
+	LOAD_FUNCTION(lib, snd_pcm_hw_params_free);
+	LOAD_FUNCTION(lib, snd_pcm_hw_params_any);
+	LOAD_FUNCTION(lib, snd_pcm_hw_params_set_access);
+	LOAD_FUNCTION(lib, snd_pcm_hw_params_set_format);
+	LOAD_FUNCTION(lib, snd_pcm_hw_params_set_channels);
+	LOAD_FUNCTION(lib, snd_pcm_hw_params_set_rate);
+	LOAD_FUNCTION(lib, snd_pcm_hw_params_set_period_size_near);
+	LOAD_FUNCTION(lib, snd_pcm_hw_params_set_buffer_size_near);
+	LOAD_FUNCTION(lib, snd_pcm_hw_params_get_period_size);
+	LOAD_FUNCTION(lib, snd_pcm_hw_params);
+	LOAD_FUNCTION(lib, snd_pcm_sw_params_malloc);
+	LOAD_FUNCTION(lib, snd_pcm_sw_params_free);
+	LOAD_FUNCTION(lib, snd_pcm_sw_params_current);
+	LOAD_FUNCTION(lib, snd_pcm_sw_params_set_avail_min);
+	LOAD_FUNCTION(lib, snd_pcm_sw_params_set_start_threshold);
+	LOAD_FUNCTION(lib, snd_pcm_sw_params);
+	LOAD_FUNCTION(lib, snd_pcm_poll_descriptors_count);
+	LOAD_FUNCTION(lib, snd_pcm_poll_descriptors);
+	LOAD_FUNCTION(lib, snd_pcm_poll_descriptors_revents);
+	LOAD_FUNCTION(lib, snd_pcm_avail_update);
+	LOAD_FUNCTION(lib, snd_pcm_mmap_begin);
+	LOAD_FUNCTION(lib, snd_pcm_mmap_commit);
+	LOAD_FUNCTION(lib, snd_pcm_state);
+	LOAD_FUNCTION(lib, snd_pcm_start);
+	LOAD_FUNCTION(lib, snd_pcm_prepare);
+	LOAD_FUNCTION(lib, snd_pcm_drop);
+	LOAD_FUNCTION(lib, snd_pcm_recover);
+	LOAD_FUNCTION(lib, snd_strerror);
+
+	loaded=true;
+}
+
+ALSAMmapStream::~ALSAMmapStream(){
+	if(pollFds)
+		free(pollFds);
+}
+
+bool ALSAMmapStream::Configure(snd_pcm_t* handle, unsigned int periodMs, unsigned int periods){
+	if(!loaded)
+		return false;
+	this->handle=handle;
+
+	snd_pcm_hw_params_t* hw;
+	int res=_snd_pcm_hw_params_malloc(&hw);
+	if(res<0)
+		return false;
+	res=_snd_pcm_hw_params_any(handle, hw);
+	CHECK_CONFIG_ERROR(res, "snd_pcm_hw_params_any failed");
+	res=_snd_pcm_hw_params_set_access(handle, hw, SND_PCM_ACCESS_MMAP_INTERLEAVED);
+	CHECK_CONFIG_ERROR(res, "Device doesn't support mmap access");
+	res=_snd_pcm_hw_params_set_format(handle, hw, SND_PCM_FORMAT_S16);
+	CHECK_CONFIG_ERROR(res, "snd_pcm_hw_params_set_format failed");
+	res=_snd_pcm_hw_params_set_channels(handle, hw, 1);
+	CHECK_CONFIG_ERROR(res, "snd_pcm_hw_params_set_channels failed");
+	res=_snd_pcm_hw_params_set_rate(handle, hw, 48000, 0);
+	CHECK_CONFIG_ERROR(res, "Device doesn't support 48000 Hz");
+	snd_pcm_uframes_t period=48*periodMs;
+	int dir=0;
+	res=_snd_pcm_hw_params_set_period_size_near(handle, hw, &period, &dir);
+	CHECK_CONFIG_ERROR(res, "snd_pcm_hw_params_set_period_size_near failed");
+	snd_pcm_uframes_t bufferSize=period*periods;
+	res=_snd_pcm_hw_params_set_buffer_size_near(handle, hw, &bufferSize);
+	CHECK_CONFIG_ERROR(res, "snd_pcm_hw_params_set_buffer_size_near failed");
+	res=_snd_pcm_hw_params(handle, hw);
+	CHECK_CONFIG_ERROR(res, "snd_pcm_hw_params failed");
+	_snd_pcm_hw_params_get_period_size(hw, &periodSize, &dir);
+	_snd_pcm_hw_params_free(hw);
+
+	snd_pcm_sw_params_t* sw;
+	res=_snd_pcm_sw_params_malloc(&sw);
+	if(res<0)
+		return false;
+	_snd_pcm_sw_params_current(handle, sw);
+	_snd_pcm_sw_params_set_avail_min(handle, sw, periodSize);
+	// playback starts by itself once the whole buffer has been filled, capture is started explicitly
+	_snd_pcm_sw_params_set_start_threshold(handle, sw, stream==SND_PCM_STREAM_PLAYBACK ? bufferSize : 1);
+	res=_snd_pcm_sw_params(handle, sw);
+	_snd_pcm_sw_params_free(sw);
+	if(res<0){
+		LOGW("snd_pcm_sw_params failed: %s", _snd_strerror(res));
+		return false;
+	}
+
+	pollFdCount=_snd_pcm_poll_descriptors_count(handle);
+	if(pollFdCount<=0)
+		return false;
+	if(pollFds)
+		free(pollFds);
+	pollFds=(struct pollfd*)malloc(sizeof(struct pollfd)*pollFdCount);
+	_snd_pcm_poll_descriptors(handle, pollFds, (unsigned int)pollFdCount);
+	pollTimeout=(int)(periodMs*periods*2);
+
+	LOGI("ALSA %s: mmap mode, period %u frames, buffer %u frames", stream==SND_PCM_STREAM_PLAYBACK ? "playback" : "capture", (unsigned int)periodSize, (unsigned int)bufferSize);
+	return true;
+}
+
+bool ALSAMmapStream::Start(){
+	// after Stop() or an unrecovered error the PCM has to be prepared again before it can run
+	if(_snd_pcm_state(handle)!=SND_PCM_STATE_PREPARED){
+		int res=_snd_pcm_prepare(handle);
+		if(res<0){
+			LOGE("snd_pcm_prepare failed: %s", _snd_strerror(res));
+			return false;
+		}
+	}
+	if(stream==SND_PCM_STREAM_PLAYBACK)
+		return true; // starts by itself once the buffer is filled
+	int res=_snd_pcm_start(handle);
+	if(res<0){
+		LOGE("snd_pcm_start failed: %s", _snd_strerror(res));
+		return false;
+	}
+	return true;
+}
+
+void ALSAMmapStream::Stop(){
+	int res=_snd_pcm_drop(handle);
+	if(res<0)
+		LOGW("snd_pcm_drop failed: %s", _snd_strerror(res));
+}
+
+bool ALSAMmapStream::Recover(int err){
+	if(err==-EPIPE){
+		xrunCount++;
+		LOGW("ALSA %s xrun", stream==SND_PCM_STREAM_PLAYBACK ? "playback" : "capture");
+	}
+	int res=_snd_pcm_recover(handle, err, 1);
+	if(res<0){
+		LOGE("snd_pcm_recover failed: %s", _snd_strerror(res));
+		return false;
+	}
+	if(stream==SND_PCM_STREAM_CAPTURE)
+		return Start();
+	return true;
+}
+
+snd_pcm_sframes_t ALSAMmapStream::WaitForFrames(){
+	snd_pcm_state_t state=_snd_pcm_state(handle);
+	if(state==SND_PCM_STATE_XRUN){
+		return Recover(-EPIPE) ? 0 : -EPIPE;
+	}else if(state==SND_PCM_STATE_SUSPENDED){
+		return Recover(-ESTRPIPE) ? 0 : -ESTRPIPE;
+	}
+	snd_pcm_sframes_t avail=_snd_pcm_avail_update(handle);
+	if(avail<0)
+		return Recover((int)avail) ? 0 : avail;
+	// a playback stream that hasn't started yet needs to be filled first
+	if((snd_pcm_uframes_t)avail>=periodSize || (state==SND_PCM_STATE_PREPARED && stream==SND_PCM_STREAM_PLAYBACK))
+		return avail;
+
+	int res=poll(pollFds, (nfds_t)pollFdCount, pollTimeout);
+	if(res<0)
+		return errno==EINTR ? 0 : -errno;
+	if(res==0){
+		LOGW("ALSA %s: poll timed out", stream==SND_PCM_STREAM_PLAYBACK ? "playback" : "capture");
+		return 0;
+	}
+	unsigned short revents=0;
+	_snd_pcm_poll_descriptors_revents(handle, pollFds, (unsigned int)pollFdCount, &revents);
+	if(revents & POLLERR)
+		return 0; // the state check on the next call takes care of it
+	avail=_snd_pcm_avail_update(handle);
+	if(avail<0)
+		return Recover((int)avail) ? 0 : avail;
+	return avail;
+}
+
+snd_pcm_sframes_t ALSAMmapStream::Transfer(int16_t* data, snd_pcm_uframes_t frames){
+	const snd_pcm_channel_area_t* areas;
+	snd_pcm_uframes_t offset;
+	int res=_snd_pcm_mmap_begin(handle, &areas, &offset, &frames);
+	if(res<0)
+		return Recover(res) ? 0 : res;
+	int16_t* devBuffer=(int16_t*)((unsigned char*)areas[0].addr+areas[0].first/8+offset*(areas[0].step/8));
+	if(stream==SND_PCM_STREAM_PLAYBACK)
+		memcpy(devBuffer, data, frames*2);
+	else
+		memcpy(data, devBuffer, frames*2);
+	snd_pcm_sframes_t committed=_snd_pcm_mmap_commit(handle, offset, frames);
+	if(committed<0 || (snd_pcm_uframes_t)committed!=frames)
+		return Recover(committed<0 ? (int)committed : -EPIPE) ? 0 : -EPIPE;
+	return committed;
+}
+
+unsigned int ALSAMmapStream::GetXrunCount(){
+	return xrunCount;
+}
+
+snd_pcm_uframes_t ALSAMmapStream::GetPeriodSize(){
+	return periodSize;
+}
+
+void ALSAMmapStream::SetRealtimePriority(int priority){
+	if(priority<=0)
+		return;
+	struct sched_param param;
+	memset(&param, 0, sizeof(param));
+	param.sched_priority=priority;
+	int res=pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+	if(res!=0)
+		LOGW("Failed to set real-time priority %d: %s", priority, strerror(res));
+}
@@ -0,0 +1,87 @@
+//
+// libtgvoip is free and unencumbered public domain software.
+// For more information, see http://unlicense.org or the UNLICENSE file
+// you should have received with this source code distribution.
+//
+
+#ifndef LIBTGVOIP_ALSAMMAPSTREAM_H
+#define LIBTGVOIP_ALSAMMAPSTREAM_H
+
+#include <alsa/asoundlib.h>
+#include <poll.h>
+#include <stdint.h>
+
+#define DECLARE_ALSA_FUNCTION(name) typeof(name)* _##name
+
+namespace tgvoip{
+namespace audio{
+
+// Low-latency mmap access to an already opened ALSA PCM, shared by AudioInputALSA and AudioOutputALSA.
+// Wakeups come from poll() on the PCM descriptors, so the period size alone sets the latency.
+// There is no native PipeWire backend: on PipeWire systems this runs on top of the pipewire-alsa
+// pcm plugin, and where that plugin refuses mmap access the callers fall back to read/write.
+class ALSAMmapStream{
+public:
+	ALSAMmapStream(void* lib, snd_pcm_stream_t stream);
+	~ALSAMmapStream();
+	bool Configure(snd_pcm_t* handle, unsigned int periodMs, unsigned int periods);
+	// Prepares the PCM if it isn't already and starts capture; playback starts once the buffer is full.
+	bool Start();
+	// Drops pending frames so the PCM doesn't run into an xrun while nobody transfers.
+	void Stop();
+	// Waits until at least one period can be transferred. Returns the number of frames available,
+	// 0 on timeout or after recovering from an xrun, or a negative ALSA error code.
+	snd_pcm_sframes_t WaitForFrames();
+	// Copies up to frames samples to (playback) or from (capture) the device buffer.
+	snd_pcm_sframes_t Transfer(int16_t* data, snd_pcm_uframes_t frames);
+	unsigned int GetXrunCount();
+	snd_pcm_uframes_t GetPeriodSize();
+	static void SetRealtimePriority(int priority);
+
+private:
+	bool Recover(int err);
+
+	DECLARE_ALSA_FUNCTION(snd_pcm_hw_params_malloc);
+	DECLARE_ALSA_FUNCTION(snd_pcm_hw_params_free);
+	DECLARE_ALSA_FUNCTION(snd_pcm_hw_params_any);
+	DECLARE_ALSA_FUNCTION(snd_pcm_hw_params_set_access);
+	DECLARE_ALSA_FUNCTION(snd_pcm_hw_params_set_format);
+	DECLARE_ALSA_FUNCTION(snd_pcm_hw_params_set_channels);
+	DECLARE_ALSA_FUNCTION(snd_pcm_hw_params_set_rate);
+	DECLARE_ALSA_FUNCTION(snd_pcm_hw_params_set_period_size_near);
+	DECLARE_ALSA_FUNCTION(snd_pcm_hw_params_set_buffer_size_near);
+	DECLARE_ALSA_FUNCTION(snd_pcm_hw_params_get_period_size);
+	DECLARE_ALSA_FUNCTION(snd_pcm_hw_params);
+	DECLARE_ALSA_FUNCTION(snd_pcm_sw_params_malloc);
+	DECLARE_ALSA_FUNCTION(snd_pcm_sw_params_free);
+	DECLARE_ALSA_FUNCTION(snd_pcm_sw_params_current);
+	DECLARE_ALSA_FUNCTION(snd_pcm_sw_params_set_avail_min);
+	DECLARE_ALSA_FUNCTION(snd_pcm_sw_params_set_start_threshold);
+	DECLARE_ALSA_FUNCTION(snd_pcm_sw_params);
+	DECLARE_ALSA_FUNCTION(snd_pcm_poll_descriptors_count);
+	DECLARE_ALSA_FUNCTION(snd_pcm_poll_descriptors);
+	DECLARE_ALSA_FUNCTION(snd_pcm_poll_descriptors_revents);
+	DECLARE_ALSA_FUNCTION(snd_pcm_avail_update);
+	DECLARE_ALSA_FUNCTION(snd_pcm_mmap_begin);
+	DECLARE_ALSA_FUNCTION(snd_pcm_mmap_commit);
+	DECLARE_ALSA_FUNCTION(snd_pcm_state);
+	DECLARE_ALSA_FUNCTION(snd_pcm_start);
+	DECLARE_ALSA_FUNCTION(snd_pcm_prepare);
+	DECLARE_ALSA_FUNCTION(snd_pcm_drop);
+	DECLARE_ALSA_FUNCTION(snd_pcm_recover);
+	DECLARE_ALSA_FUNCTION(snd_strerror);
+
+	snd_pcm_t* handle;
+	snd_pcm_stream_t stream;
+	snd_pcm_uframes_t periodSize;
+	struct pollfd* pollFds;
+	int pollFdCount;
+	int pollTimeout;
+	unsigned int xrunCount;
+	bool loaded;
+};
+
+}
+}
+
+#endif //LIBTGVOIP_ALSAMMAPSTREAM_H
@@ -8,9 +8,11 @@
 #include <stdio.h>
 #include <assert.h>
 #include <dlfcn.h>
+#include <algorithm>
 #include "AudioInputALSA.h"
 #include "../../logging.h"
 #include "../../VoIPController.h"
+#include "../../VoIPServerConfig.h"
 
 using namespace tgvoip::audio;
 
@@ -22,6 +24,8 @@ using namespace tgvoip::audio;
 AudioInputALSA::AudioInputALSA(std::string devID){
 	isRecording=false;
 	handle=NULL;
+	mmapStream=NULL;
+	rtPriority=ServerConfig::GetSharedInstance()->GetInt("audio_alsa_rt_priority", 0);
 
 	lib=dlopen("libasound.so.2", RTLD_LAZY);
 	if(!lib)
@@ -45,6 +49,8 @@ AudioInputALSA::AudioInputALSA(std::string devID){
 AudioInputALSA::~AudioInputALSA(){
 	if(handle)
 		_snd_pcm_close(handle);
+	if(mmapStream)
+		delete mmapStream;
 	if(lib)
 		dlclose(lib);
 }
@@ -71,11 +77,43 @@ void AudioInputALSA::Stop(){
 	thread->Join();
 	delete thread;
 	thread=NULL;
+	if(mmapStream){
+		mmapStream->Stop();
+		LOGI("ALSA capture: %u xruns", mmapStream->GetXrunCount());
+	}
 }
 
 void AudioInputALSA::RunThread(void* arg){
 	unsigned char buffer[BUFFER_SIZE*2];
 	snd_pcm_sframes_t frames;
+	ALSAMmapStream::SetRealtimePriority(rtPriority);
+	if(mmapStream){
+		// the device delivers a period at a time, the callback expects BUFFER_SIZE frames
+		size_t bufferOffset=0;
+		if(!mmapStream->Start())
+			return;
+		while(isRecording){
+			snd_pcm_sframes_t avail=mmapStream->WaitForFrames();
+			while(avail>0){
+				frames=mmapStream->Transfer(reinterpret_cast<int16_t*>(buffer)+bufferOffset, std::min((snd_pcm_uframes_t)avail, (snd_pcm_uframes_t)(BUFFER_SIZE-bufferOffset)));
+				if(frames<=0){
+					avail=frames;
+					break;
+				}
+				bufferOffset+=frames;
+				avail-=frames;
+				if(bufferOffset==BUFFER_SIZE){
+					InvokeCallback(buffer, sizeof(buffer));
+					bufferOffset=0;
+				}
+			}
+			if(avail<0){
+				LOGE("ALSA mmap capture failed: %s", _snd_strerror((int)avail));
+				break;
+			}
+		}
+		return;
+	}
 	while(isRecording){
 		frames=_snd_pcm_readi(handle, buffer, BUFFER_SIZE);
 		if (frames < 0){
@@ -103,8 +141,20 @@ void AudioInputALSA::SetCurrentDevice(std::string devID){
 		res=_snd_pcm_open(&handle, "default", SND_PCM_STREAM_CAPTURE, 0);
 	CHECK_ERROR(res, "snd_pcm_open failed");
 
-	res=_snd_pcm_set_params(handle, SND_PCM_FORMAT_S16, SND_PCM_ACCESS_RW_INTERLEAVED, 1, 48000, 1, 100000);
-	CHECK_ERROR(res, "snd_pcm_set_params failed");
+	ServerConfig* config=ServerConfig::GetSharedInstance();
+	if(config->GetBoolean("audio_alsa_mmap", true)){
+		if(!mmapStream)
+			mmapStream=new ALSAMmapStream(lib, SND_PCM_STREAM_CAPTURE);
+		if(!mmapStream->Configure(handle, (unsigned int)config->GetInt("audio_alsa_period_ms", 10), (unsigned int)config->GetInt("audio_alsa_periods", 4))){
+			LOGW("ALSA mmap mode not available for this device, using read/write access");
+			delete mmapStream;
+			mmapStream=NULL;
+		}
+	}
+	if(!mmapStream){
+		res=_snd_pcm_set_params(handle, SND_PCM_FORMAT_S16, SND_PCM_ACCESS_RW_INTERLEAVED, 1, 48000, 1, 100000);
+		CHECK_ERROR(res, "snd_pcm_set_params failed");
+	}
 
 	if(wasRecording){
 		isRecording=true;
@@ -10,6 +10,7 @@
 #include "../../audio/AudioInput.h"
 #include "../../threading.h"
 #include <alsa/asoundlib.h>
+#include "ALSAMmapStream.h"
 
 namespace tgvoip{
 namespace audio{
@@ -37,6 +38,8 @@ private:
 	void* lib;
 
 	snd_pcm_t* handle;
+	ALSAMmapStream* mmapStream;
+	int rtPriority;
 	Thread* thread;
 	bool isRecording;
 };
@@ -7,9 +7,11 @@
 
 #include <assert.h>
 #include <dlfcn.h>
+#include <algorithm>
 #include "AudioOutputALSA.h"
 #include "../../logging.h"
 #include "../../VoIPController.h"
+#include "../../VoIPServerConfig.h"
 
 #define BUFFER_SIZE 960
 #define CHECK_ERROR(res, msg) if(res<0){LOGE(msg ": %s", _snd_strerror(res)); failed=true; return;}
@@ -21,6 +23,8 @@ using namespace tgvoip::audio;
 AudioOutputALSA::AudioOutputALSA(std::string devID){
 	isPlaying=false;
 	handle=NULL;
+	mmapStream=NULL;
+	rtPriority=ServerConfig::GetSharedInstance()->GetInt("audio_alsa_rt_priority", 0);
 
 	lib=dlopen("libasound.so.2", RTLD_LAZY);
 	if(!lib)
@@ -44,6 +48,8 @@ AudioOutputALSA::AudioOutputALSA(std::string devID){
 AudioOutputALSA::~AudioOutputALSA(){
 	if(handle)
 		_snd_pcm_close(handle);
+	if(mmapStream)
+		delete mmapStream;
 	if(lib)
 		dlclose(lib);
 }
@@ -70,6 +76,10 @@ void AudioOutputALSA::Stop(){
 	thread->Join();
 	delete thread;
 	thread=NULL;
+	if(mmapStream){
+		mmapStream->Stop();
+		LOGI("ALSA playback: %u xruns", mmapStream->GetXrunCount());
+	}
 }
 
 bool AudioOutputALSA::IsPlaying(){
@@ -78,6 +88,34 @@ bool AudioOutputALSA::IsPlaying(){
 void AudioOutputALSA::RunThread(void* arg){
 	unsigned char buffer[BUFFER_SIZE*2];
 	snd_pcm_sframes_t frames;
+	ALSAMmapStream::SetRealtimePriority(rtPriority);
+	if(mmapStream){
+		// the callback always produces BUFFER_SIZE frames, hand them to the device a period at a time
+		size_t bufferOffset=BUFFER_SIZE;
+		if(!mmapStream->Start())
+			return;
+		while(isPlaying){
+			snd_pcm_sframes_t avail=mmapStream->WaitForFrames();
+			while(avail>0 && isPlaying){
+				if(bufferOffset==BUFFER_SIZE){
+					InvokeCallback(buffer, sizeof(buffer));
+					bufferOffset=0;
+				}
+				frames=mmapStream->Transfer(reinterpret_cast<int16_t*>(buffer)+bufferOffset, std::min((snd_pcm_uframes_t)avail, (snd_pcm_uframes_t)(BUFFER_SIZE-bufferOffset)));
+				if(frames<=0){
+					avail=frames;
+					break;
+				}
+				bufferOffset+=frames;
+				avail-=frames;
+			}
+			if(avail<0){
+				LOGE("ALSA mmap playback failed: %s", _snd_strerror((int)avail));
+				break;
+			}
+		}
+		return;
+	}
 	while(isPlaying){
 		InvokeCallback(buffer, sizeof(buffer));
 		frames=_snd_pcm_writei(handle, buffer, BUFFER_SIZE);
@@ -105,8 +143,20 @@ void AudioOutputALSA::SetCurrentDevice(std::string devID){
 		res=_snd_pcm_open(&handle, "default", SND_PCM_STREAM_PLAYBACK, 0);
 	CHECK_ERROR(res, "snd_pcm_open failed");
 
-	res=_snd_pcm_set_params(handle, SND_PCM_FORMAT_S16, SND_PCM_ACCESS_RW_INTERLEAVED, 1, 48000, 1, 100000);
-	CHECK_ERROR(res, "snd_pcm_set_params failed");
+	ServerConfig* config=ServerConfig::GetSharedInstance();
+	if(config->GetBoolean("audio_alsa_mmap", true)){
+		if(!mmapStream)
+			mmapStream=new ALSAMmapStream(lib, SND_PCM_STREAM_PLAYBACK);
+		if(!mmapStream->Configure(handle, (unsigned int)config->GetInt("audio_alsa_period_ms", 10), (unsigned int)config->GetInt("audio_alsa_periods", 4))){
+			LOGW("ALSA mmap mode not available for this device, using read/write access");
+			delete mmapStream;
+			mmapStream=NULL;
+		}
+	}
+	if(!mmapStream){
+		res=_snd_pcm_set_params(handle, SND_PCM_FORMAT_S16, SND_PCM_ACCESS_RW_INTERLEAVED, 1, 48000, 1, 100000);
+		CHECK_ERROR(res, "snd_pcm_set_params failed");
+	}
 
 	if(wasPlaying){
 		isPlaying=true;
@@ -13,6 +13,9 @@
 #include <sys/ioctl.h>
 #include <unistd.h>
 #include <netinet/tcp.h>
+#ifdef __linux__
+#include <linux/sockios.h>
+#endif
 #include "../../logging.h"
 #include "../../VoIPController.h"
 #include "../../BufferInputStream.h"
@@ -572,3 +575,18 @@ int NetworkSocketPosix::GetDescriptorFromSocket(NetworkSocket *socket){
 		return GetDescriptorFromSocket(sw->GetWrapped());
 	return 0;
 }
+
+size_t NetworkSocketPosix::GetUnsentBytes(){
+	if(protocol!=PROTO_TCP || fd<0)
+		return 0;
+	int unsent=0;
+#if defined(__APPLE__)
+	socklen_t len=sizeof(unsent);
+	if(getsockopt(fd, SOL_SOCKET, SO_NWRITE, &unsent, &len)!=0)
+		return 0;
+#elif defined(SIOCOUTQ)
+	if(ioctl(fd, SIOCOUTQ, &unsent)!=0)
+		return 0;
+#endif
+	return unsent>0 ? (size_t)unsent : 0;
+}
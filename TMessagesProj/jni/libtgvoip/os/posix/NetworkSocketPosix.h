@@ -50,6 +50,7 @@ public:
 	virtual uint16_t GetConnectedPort();
 
 	virtual void SetTimeouts(int sendTimeout, int recvTimeout);
+	virtual size_t GetUnsentBytes();
 
 protected:
 	virtual void SetMaxPriority();
@@ -0,0 +1,243 @@
+// The decryptedAudioBlock/simpleAudioBlock header and the stream data payload of a libtgvoip packet,
+// built and parsed the way VoIPController does it: once with PacketReader from PacketCodec.h and once with
+// BufferInputStream, which throws std::out_of_range where PacketReader returns false.
+// Shared by packet_codec_test and packet_codec_bench.
+
+#ifndef AUDIO_BLOCK_H
+#define AUDIO_BLOCK_H
+
+#include <stdint.h>
+#include <string.h>
+#include <stdexcept>
+#include <vector>
+#include "../libtgvoip/PacketCodec.h"
+#include "../libtgvoip/BufferInputStream.cpp"
+
+using namespace tgvoip;
+
+#define TLID_DECRYPTED_AUDIO_BLOCK 0xDBF948C1
+#define TLID_SIMPLE_AUDIO_BLOCK 0xCC0D0E76
+#define PFLAG_HAS_DATA 1
+#define PFLAG_HAS_EXTRA 2
+#define PFLAG_HAS_CALL_ID 4
+#define PFLAG_HAS_PROTO 8
+#define PFLAG_HAS_SEQ 16
+#define PFLAG_HAS_RECENT_RECV 32
+#define STREAM_DATA_FLAG_LEN16 0x40
+#define PAD4(x) (4 - (x + (x <= 253 ? 1 : 0)) % 4)
+#define MAX_FRAMES 3
+
+typedef PacketLayout<uint32_t, uint64_t> AudioBlockPrefix;
+typedef PacketLayout<uint32_t, uint32_t, uint32_t> AudioBlockSeqs;
+typedef PacketLayout<uint8_t, uint32_t, uint32_t, uint32_t> SimpleAudioBlockHeader;
+typedef PacketLayout<uint32_t> PacketInt32;
+typedef PacketLayout<uint16_t> PacketInt16;
+typedef PacketLayout<uint8_t> PacketByte;
+
+struct AudioBlock {
+    uint32_t tlid;
+    uint32_t flags;
+    uint8_t type;
+    uint32_t ackId, pseq, acks;
+    uint32_t innerLen;
+    int frameCount;
+    size_t frameOffset[MAX_FRAMES];
+    uint16_t frameLength[MAX_FRAMES];
+    uint32_t pts[MAX_FRAMES];
+
+    bool operator==(const AudioBlock &o) const {
+        if (tlid != o.tlid || type != o.type || ackId != o.ackId || pseq != o.pseq || acks != o.acks || innerLen != o.innerLen || frameCount != o.frameCount) {
+            return false;
+        }
+        for (int i = 0; i < frameCount; i++) {
+            if (frameOffset[i] != o.frameOffset[i] || frameLength[i] != o.frameLength[i] || pts[i] != o.pts[i]) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+static void writeTlLength(std::vector<unsigned char> &out, uint32_t len) {
+    if (len <= 253) {
+        out.push_back((unsigned char) len);
+    } else {
+        out.push_back(254);
+        out.push_back((unsigned char) (len & 0xFF));
+        out.push_back((unsigned char) ((len >> 8) & 0xFF));
+        out.push_back((unsigned char) ((len >> 16) & 0xFF));
+    }
+}
+
+template<typename L, typename... Args> static void append(std::vector<unsigned char> &out, const Args &... args) {
+    size_t offset = out.size();
+    out.resize(offset + L::size);
+    L::WriteUnchecked(&out[offset], args...);
+}
+
+// Writes a packet like WritePacketHeader and SendAudioFrame do, with frameCount audio frames of the given sizes
+static std::vector<unsigned char> buildAudioBlock(bool simple, bool withCallID, uint8_t type, uint32_t seq, int frameCount, const uint16_t *frameLengths) {
+    std::vector<unsigned char> payload;
+    for (int i = 0; i < frameCount; i++) {
+        if (frameLengths[i] > 255) {
+            append<PacketByte>(payload, (uint8_t) (1 | STREAM_DATA_FLAG_LEN16));
+            append<PacketInt16>(payload, frameLengths[i]);
+        } else {
+            append<PacketByte>(payload, (uint8_t) 1);
+            append<PacketByte>(payload, (uint8_t) frameLengths[i]);
+        }
+        append<PacketInt32>(payload, seq * 60 + i);
+        for (uint16_t j = 0; j < frameLengths[i]; j++) {
+            payload.push_back((unsigned char) (j * 7 + i));
+        }
+    }
+
+    std::vector<unsigned char> out;
+    append<AudioBlockPrefix>(out, simple ? TLID_SIMPLE_AUDIO_BLOCK : TLID_DECRYPTED_AUDIO_BLOCK, (uint64_t) seq * 0x9E3779B97F4A7C15ULL);
+    out.push_back(7);
+    for (int i = 0; i < 7; i++) {
+        out.push_back((unsigned char) (seq + i));
+    }
+    if (simple) {
+        writeTlLength(out, (uint32_t) payload.size() + 13);
+        append<SimpleAudioBlockHeader>(out, type, seq - 1, seq, 0xFFFFFFFFU);
+    } else {
+        uint32_t flags = PFLAG_HAS_RECENT_RECV | PFLAG_HAS_SEQ | PFLAG_HAS_DATA | ((uint32_t) type << 24);
+        if (withCallID) {
+            flags |= PFLAG_HAS_CALL_ID | PFLAG_HAS_PROTO;
+        }
+        append<PacketInt32>(out, flags);
+        if (withCallID) {
+            out.insert(out.end(), 16, 0xCA);
+        }
+        append<AudioBlockSeqs>(out, seq - 1, seq, 0xFFFFFFFFU);
+        if (withCallID) {
+            append<PacketInt32>(out, (uint32_t) 0x50567247);
+        }
+        writeTlLength(out, (uint32_t) payload.size());
+    }
+    out.insert(out.end(), payload.begin(), payload.end());
+    return out;
+}
+
+static bool parseWithReader(const unsigned char *buffer, size_t length, int frameCount, AudioBlock &b) {
+    PacketReader reader(buffer, length);
+    uint64_t randomID;
+    b.innerLen = 0;
+    b.frameCount = 0;
+    if (!reader.Read<AudioBlockPrefix>(b.tlid, randomID) || !reader.SkipTlString()) {
+        return false;
+    }
+    if (b.tlid == TLID_DECRYPTED_AUDIO_BLOCK) {
+        if (!reader.Read<PacketInt32>(b.flags)) {
+            return false;
+        }
+        b.type = (uint8_t) (b.flags >> 24);
+        if (!(b.flags & PFLAG_HAS_SEQ && b.flags & PFLAG_HAS_RECENT_RECV)) {
+            return false;
+        }
+        if ((b.flags & PFLAG_HAS_CALL_ID) && !reader.Skip(16)) {
+            return false;
+        }
+        if (!reader.Read<AudioBlockSeqs>(b.ackId, b.pseq, b.acks)) {
+            return false;
+        }
+        uint32_t proto;
+        if ((b.flags & PFLAG_HAS_PROTO) && !reader.Read<PacketInt32>(proto)) {
+            return false;
+        }
+        if ((b.flags & PFLAG_HAS_EXTRA) && !reader.SkipTlString()) {
+            return false;
+        }
+        if ((b.flags & PFLAG_HAS_DATA) && !reader.ReadTlLength(b.innerLen)) {
+            return false;
+        }
+    } else if (b.tlid == TLID_SIMPLE_AUDIO_BLOCK) {
+        if (!reader.ReadTlLength(b.innerLen) || !reader.Read<SimpleAudioBlockHeader>(b.type, b.ackId, b.pseq, b.acks)) {
+            return false;
+        }
+    } else {
+        return false;
+    }
+    for (int i = 0; i < frameCount; i++) {
+        uint8_t streamID, len8;
+        uint16_t len;
+        bool ok = reader.Read<PacketByte>(streamID);
+        if (streamID & STREAM_DATA_FLAG_LEN16) {
+            ok = ok && reader.Read<PacketInt16>(len);
+        } else {
+            ok = ok && reader.Read<PacketByte>(len8);
+            len = len8;
+        }
+        if (!ok || !reader.Read<PacketInt32>(b.pts[i]) || reader.Remaining() < len) {
+            return false;
+        }
+        b.frameOffset[i] = reader.GetOffset();
+        b.frameLength[i] = len;
+        b.frameCount++;
+        reader.Skip(len);
+    }
+    return true;
+}
+
+// The same with BufferInputStream, as ProcessIncomingPacket did before PacketCodec.h
+static bool parseWithStream(unsigned char *buffer, size_t length, int frameCount, AudioBlock &b) {
+    b.innerLen = 0;
+    b.frameCount = 0;
+    try {
+        BufferInputStream in(buffer, length);
+        b.tlid = (uint32_t) in.ReadInt32();
+        in.ReadInt64();
+        uint32_t randLen = (uint32_t) in.ReadTlLength();
+        in.Seek(in.GetOffset() + randLen + PAD4(randLen) % 4);
+        if (b.tlid == TLID_DECRYPTED_AUDIO_BLOCK) {
+            b.flags = (uint32_t) in.ReadInt32();
+            b.type = (uint8_t) (b.flags >> 24);
+            if (!(b.flags & PFLAG_HAS_SEQ && b.flags & PFLAG_HAS_RECENT_RECV)) {
+                return false;
+            }
+            if (b.flags & PFLAG_HAS_CALL_ID) {
+                unsigned char callID[16];
+                in.ReadBytes(callID, 16);
+            }
+            b.ackId = (uint32_t) in.ReadInt32();
+            b.pseq = (uint32_t) in.ReadInt32();
+            b.acks = (uint32_t) in.ReadInt32();
+            if (b.flags & PFLAG_HAS_PROTO) {
+                in.ReadInt32();
+            }
+            if (b.flags & PFLAG_HAS_EXTRA) {
+                uint32_t extraLen = (uint32_t) in.ReadTlLength();
+                in.Seek(in.GetOffset() + extraLen + PAD4(extraLen) % 4);
+            }
+            if (b.flags & PFLAG_HAS_DATA) {
+                b.innerLen = (uint32_t) in.ReadTlLength();
+            }
+        } else if (b.tlid == TLID_SIMPLE_AUDIO_BLOCK) {
+            b.innerLen = (uint32_t) in.ReadTlLength();
+            b.type = in.ReadByte();
+            b.ackId = (uint32_t) in.ReadInt32();
+            b.pseq = (uint32_t) in.ReadInt32();
+            b.acks = (uint32_t) in.ReadInt32();
+        } else {
+            return false;
+        }
+        for (int i = 0; i < frameCount; i++) {
+            unsigned char streamID = in.ReadByte();
+            uint16_t len = (uint16_t) (streamID & STREAM_DATA_FLAG_LEN16 ? in.ReadInt16() : in.ReadByte());
+            b.pts[i] = (uint32_t) in.ReadInt32();
+            if (in.GetOffset() + len > length) {
+                return false;
+            }
+            b.frameOffset[i] = in.GetOffset();
+            b.frameLength[i] = len;
+            b.frameCount++;
+            in.Seek(in.GetOffset() + len);
+        }
+    } catch (std::out_of_range &x) {
+        return false;
+    }
+    return true;
+}
+
+#endif
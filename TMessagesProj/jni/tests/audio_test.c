@@ -0,0 +1,197 @@
+// Checks the waveform builder in audio.c against the original one-shot getWaveform2 algorithm,
+// feeding the PCM in chunks of random size the way the recorder does, and records a tone with the
+// recorder and decodes it back with opusfile, halfway through as well as after it's finished.
+
+#include "../audio.c"
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "host.h"
+
+#define RECORDED_FRAMES 100
+
+static void referenceWaveform(const int16_t *pcm, int length, uint8_t *bytes) {
+    uint16_t samples[WAVEFORM_SAMPLES];
+    memset(samples, 0, sizeof(samples));
+    int sampleRate = length / WAVEFORM_SAMPLES > 1 ? length / WAVEFORM_SAMPLES : 1;
+    uint16_t peakSample = 0;
+    int index = 0;
+    for (int i = 0; i < length; i++) {
+        uint16_t sample = (uint16_t) abs(pcm[i]);
+        if (sample > peakSample) {
+            peakSample = sample;
+        }
+        if (i % sampleRate == 0) {
+            if (index < WAVEFORM_SAMPLES) {
+                samples[index++] = peakSample;
+            }
+            peakSample = 0;
+        }
+    }
+    
+    int64_t sumSamples = 0;
+    for (int i = 0; i < WAVEFORM_SAMPLES; i++) {
+        sumSamples += samples[i];
+    }
+    uint16_t peak = (uint16_t) (sumSamples * 1.8f / WAVEFORM_SAMPLES);
+    if (peak < 2500) {
+        peak = 2500;
+    }
+    
+    memset(bytes, 0, WAVEFORM_BYTES);
+    for (int i = 0; i < WAVEFORM_SAMPLES; i++) {
+        int value = (samples[i] > peak ? peak : samples[i]) * 31 / peak;
+        if (value > 31) {
+            value = 31;
+        }
+        for (int bit = 0; bit < 5; bit++) {
+            if (value & (1 << bit)) {
+                bytes[(i * 5 + bit) / 8] |= 1 << ((i * 5 + bit) % 8);
+            }
+        }
+    }
+}
+
+static void feed(WaveformBuilder *builder, const int16_t *pcm, int length) {
+    int offset = 0;
+    while (offset < length) {
+        int count = 1 + rand() % 3000;
+        if (count > length - offset) {
+            count = length - offset;
+        }
+        waveformFeed(builder, pcm + offset, count);
+        offset += count;
+    }
+}
+
+// Decodes an Ogg Opus file at 48 kHz, returns the sample count or -1 and the RMS of what it decoded
+static int64_t decodeRecording(const char *path, double *rms) {
+    int error;
+    OggOpusFile *file = op_open_file(path, &error);
+    if (!file) {
+        return -1;
+    }
+    int16_t pcm[5760];
+    int64_t count = 0;
+    double energy = 0;
+    int read;
+    while ((read = op_read(file, pcm, 5760, NULL)) > 0) {
+        for (int i = 0; i < read; i++) {
+            energy += (double) pcm[i] * pcm[i];
+        }
+        count += read;
+    }
+    op_free(file);
+    *rms = count > 0 ? sqrt(energy / count) : 0;
+    return read < 0 ? -1 : count;
+}
+
+static int recordingRoundTrip(void) {
+    char path[] = "/tmp/audio_test_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        return 0;
+    }
+    close(fd);
+    
+    OpusRecorder *r = createRecorder(path);
+    if (!r) {
+        unlink(path);
+        return 0;
+    }
+    int16_t frame[960];
+    double rms;
+    int ok = 1;
+    for (int n = 0; n < RECORDED_FRAMES; n++) {
+        for (int i = 0; i < 960; i++) {
+            frame[i] = (int16_t) (8000 * sin(2 * M_PI * 440 * (n * 960 + i) / 16000.0));
+        }
+        // the last frame is short, which ends the stream
+        ok = ok && writeFrame(r, (uint8_t *) frame, n == RECORDED_FRAMES - 1 ? 480 * 2 : 960 * 2);
+        
+        if (n == RECORDED_FRAMES / 2) {
+            // every encoded frame is on disk as soon as the encoder thread is done with it,
+            // so a recording cut off here has to decode up to the frame being encoded
+            while (__atomic_load_n(&r->ringTail, __ATOMIC_ACQUIRE) != r->ringHead) {
+                usleep(1000);
+            }
+            int64_t samples = decodeRecording(path, &rms);
+            if (samples < (int64_t) n * 960 * 3 || rms < 4000) {
+                printf("recorder partial file has %lld samples with rms %.0f after %d frames\n", (long long) samples, rms, n + 1);
+                ok = 0;
+            }
+        }
+    }
+    destroyRecorder(r);
+    
+    int64_t samples = decodeRecording(path, &rms);
+    int64_t expected = ((int64_t) (RECORDED_FRAMES - 1) * 960 + 480) * 3;
+    // the tone is 8000 peak, about 5660 rms
+    if (samples != expected || rms < 4500 || rms > 7000) {
+        printf("recorder file has %lld samples with rms %.0f, expected %lld\n", (long long) samples, rms, (long long) expected);
+        ok = 0;
+    }
+    unlink(path);
+    return ok;
+}
+
+int main(void) {
+    int failures = 0;
+    srand(1);
+    for (int t = 0; t < 2000; t++) {
+        int length = 1 + rand() % 50000;
+        int16_t *pcm = malloc(length * sizeof(int16_t));
+        for (int i = 0; i < length; i++) {
+            pcm[i] = (int16_t) ((rand() % 65536 - 32768) / (1 + rand() % 8));
+        }
+        if (t % 100 == 0) {
+            pcm[rand() % length] = -32768;
+        }
+        
+        uint8_t expected[WAVEFORM_BYTES];
+        uint8_t actual[WAVEFORM_BYTES];
+        referenceWaveform(pcm, length, expected);
+        WaveformBuilder builder;
+        waveformInit(&builder, length);
+        feed(&builder, pcm, length);
+        waveformFinish(&builder, actual);
+        if (memcmp(expected, actual, WAVEFORM_BYTES) != 0) {
+            printf("waveform of %d samples FAILED\n", length);
+            failures++;
+        }
+        free(pcm);
+    }
+    printf("waveform 2000 random recordings %s\n", failures == 0 ? "ok" : "FAILED");
+    
+    // without a known length the builder merges buckets as the recording grows,
+    // a steady tone still has to come out flat
+    int16_t tone[4800];
+    for (int i = 0; i < 4800; i++) {
+        tone[i] = (int16_t) (i % 2 ? 12000 : -12000);
+    }
+    WaveformBuilder builder;
+    waveformInit(&builder, 0);
+    for (int i = 0; i < 77; i++) {
+        waveformFeed(&builder, tone, 4800);
+    }
+    uint8_t bytes[WAVEFORM_BYTES + 1];
+    memset(bytes, 0, sizeof(bytes));
+    waveformFinish(&builder, bytes);
+    // the peak is 1.8 times the mean, so every bar is 31 / 1.8
+    int flat = 1;
+    for (int i = 0; i < WAVEFORM_SAMPLES; i++) {
+        int value = ((bytes[i * 5 / 8] | bytes[i * 5 / 8 + 1] << 8) >> (i * 5 % 8)) & 31;
+        flat = flat && value == 17;
+    }
+    printf("waveform streaming tone %s\n", flat ? "ok" : "FAILED");
+    if (!flat) {
+        failures++;
+    }
+    
+    int recorded = recordingRoundTrip();
+    printf("recorder round trip %s\n", recorded ? "ok" : "FAILED");
+    if (!recorded) {
+        failures++;
+    }
+    return failures != 0;
+}
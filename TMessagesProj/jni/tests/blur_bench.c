@@ -0,0 +1,57 @@
+// Times stackBlur against fastBlur/fastBlurMore, the blurs it replaces, at thumbnail, sticker and
+// full HD sizes. fastBlur and fastBlurMore give up on anything over 150x150, which is reported.
+
+#include "../image.c"
+#include <stdio.h>
+#include <stdlib.h>
+#include "host.h"
+
+typedef int (*BlurFunction)(int width, int height, int stride, void *pixels, int radius);
+
+static int stackBlurDefault(int width, int height, int stride, void *pixels, int radius) {
+    stackBlur(pixels, width, height, stride, radius, STACK_BLUR_MAX_THREADS);
+    return 1;
+}
+
+static int stackBlurSingle(int width, int height, int stride, void *pixels, int radius) {
+    stackBlur(pixels, width, height, stride, radius, 1);
+    return 1;
+}
+
+static void bench(const char *name, BlurFunction blur, uint8_t *pixels, int width, int height, int radius) {
+    int iterations = (int) (200000000LL / ((int64_t) width * height * (radius + 8)));
+    if (iterations < 3) {
+        iterations = 3;
+    }
+    if (!blur(width, height, width * 4, pixels, radius)) {
+        printf("%-16s %4dx%-4d r=%-3d unsupported\n", name, width, height, radius);
+        return;
+    }
+    double start = hostTime();
+    for (int i = 0; i < iterations; i++) {
+        blur(width, height, width * 4, pixels, radius);
+    }
+    double elapsed = (hostTime() - start) / iterations;
+    printf("%-16s %4dx%-4d r=%-3d %9.3f ms %8.1f Mpx/s\n", name, width, height, radius, elapsed * 1000, width * height / elapsed / 1e6);
+}
+
+int main(void) {
+    int sizes[][2] = {{90, 90}, {512, 512}, {1920, 1080}};
+    int radii[] = {3, 7, 15};
+    for (int s = 0; s < 3; s++) {
+        int width = sizes[s][0];
+        int height = sizes[s][1];
+        uint8_t *pixels = malloc((size_t) width * height * 4);
+        srand(s);
+        for (int i = 0; i < width * height * 4; i++) {
+            pixels[i] = (uint8_t) rand();
+        }
+        for (int r = 0; r < 3; r++) {
+            bench(radii[r] <= 3 ? "fastBlur" : "fastBlurMore", radii[r] <= 3 ? fastBlur : fastBlurMore, pixels, width, height, radii[r]);
+            bench("stackBlur", stackBlurDefault, pixels, width, height, radii[r]);
+            bench("stackBlur 1 thr", stackBlurSingle, pixels, width, height, radii[r]);
+        }
+        free(pixels);
+    }
+    return 0;
+}
@@ -0,0 +1,26 @@
+#ifndef HOST_ANDROID_BITMAP_H
+#define HOST_ANDROID_BITMAP_H
+
+#include <jni.h>
+
+#define ANDROID_BITMAP_RESUT_SUCCESS 0
+
+enum {
+    ANDROID_BITMAP_FORMAT_NONE = 0,
+    ANDROID_BITMAP_FORMAT_RGBA_8888 = 1,
+    ANDROID_BITMAP_FORMAT_RGB_565 = 4
+};
+
+typedef struct {
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+    int32_t format;
+    uint32_t flags;
+} AndroidBitmapInfo;
+
+int AndroidBitmap_getInfo(JNIEnv *env, jobject bitmap, AndroidBitmapInfo *info);
+int AndroidBitmap_lockPixels(JNIEnv *env, jobject bitmap, void **pixels);
+int AndroidBitmap_unlockPixels(JNIEnv *env, jobject bitmap);
+
+#endif
@@ -0,0 +1,72 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <android/bitmap.h>
+#include <android/log.h>
+#include "host.h"
+
+static void *getDirectBufferAddress(JNIEnv *env, jobject buffer) {
+    return buffer;
+}
+
+static jint throwNew(JNIEnv *env, jclass class, const char *message) {
+    fprintf(stderr, "exception: %s\n", message);
+    return 0;
+}
+
+static const struct JNINativeInterface hostInterface = {
+    .ThrowNew = throwNew,
+    .GetDirectBufferAddress = getDirectBufferAddress,
+};
+
+static JNIEnv hostInterfacePtr = &hostInterface;
+
+JNIEnv *hostEnv(void) {
+    return &hostInterfacePtr;
+}
+
+double hostTime(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int __android_log_print(int prio, const char *tag, const char *fmt, ...) {
+    if (prio < ANDROID_LOG_WARN) {
+        return 0;
+    }
+    va_list args;
+    va_start(args, fmt);
+    fprintf(stderr, "%s: ", tag);
+    vfprintf(stderr, fmt, args);
+    fputc('\n', stderr);
+    va_end(args);
+    return 0;
+}
+
+int AndroidBitmap_getInfo(JNIEnv *env, jobject bitmap, AndroidBitmapInfo *info) {
+    HostBitmap *b = (HostBitmap *) bitmap;
+    if (b == NULL) {
+        return -1;
+    }
+    memset(info, 0, sizeof(AndroidBitmapInfo));
+    info->width = b->width;
+    info->height = b->height;
+    info->stride = b->stride;
+    info->format = ANDROID_BITMAP_FORMAT_RGBA_8888;
+    return ANDROID_BITMAP_RESUT_SUCCESS;
+}
+
+int AndroidBitmap_lockPixels(JNIEnv *env, jobject bitmap, void **pixels) {
+    HostBitmap *b = (HostBitmap *) bitmap;
+    if (b == NULL) {
+        return -1;
+    }
+    *pixels = b->pixels;
+    return ANDROID_BITMAP_RESUT_SUCCESS;
+}
+
+int AndroidBitmap_unlockPixels(JNIEnv *env, jobject bitmap) {
+    return ANDROID_BITMAP_RESUT_SUCCESS;
+}
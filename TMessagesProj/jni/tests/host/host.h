@@ -0,0 +1,20 @@
+// Host side of the JNI and bitmap APIs for the tests and benchmarks in this directory.
+// Direct buffers and bitmaps are passed as plain pointers in place of jobject.
+
+#ifndef HOST_H
+#define HOST_H
+
+#include <stdint.h>
+#include <jni.h>
+
+typedef struct {
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+    uint8_t *pixels;
+} HostBitmap;
+
+JNIEnv *hostEnv(void);
+double hostTime(void);
+
+#endif
@@ -0,0 +1,65 @@
+// Just enough of jni.h to build the native sources on a desktop host, see ../Makefile.
+// Only the JNIEnv functions used by image.c, video.c and audio.c are declared.
+
+#ifndef HOST_JNI_H
+#define HOST_JNI_H
+
+#include <stdint.h>
+
+typedef uint8_t jboolean;
+typedef int8_t jbyte;
+typedef int16_t jshort;
+typedef int32_t jint;
+typedef int64_t jlong;
+typedef float jfloat;
+typedef double jdouble;
+typedef jint jsize;
+
+typedef void *jobject;
+typedef jobject jclass;
+typedef jobject jstring;
+typedef jobject jarray;
+typedef jarray jobjectArray;
+typedef jarray jbooleanArray;
+typedef jarray jbyteArray;
+typedef jarray jshortArray;
+typedef jarray jintArray;
+typedef struct _jfieldID *jfieldID;
+
+#define JNI_FALSE 0
+#define JNI_TRUE 1
+#define JNI_OK 0
+#define JNI_ABORT 2
+#define JNI_VERSION_1_6 0x00010006
+
+#define JNIEXPORT
+#define JNICALL
+
+struct JNINativeInterface;
+typedef const struct JNINativeInterface *JNIEnv;
+typedef void *JavaVM;
+
+struct JNINativeInterface {
+    jclass (*FindClass)(JNIEnv *, const char *);
+    jobject (*NewGlobalRef)(JNIEnv *, jobject);
+    void (*DeleteLocalRef)(JNIEnv *, jobject);
+    jint (*ThrowNew)(JNIEnv *, jclass, const char *);
+    jfieldID (*GetFieldID)(JNIEnv *, jclass, const char *, const char *);
+    jboolean (*GetBooleanField)(JNIEnv *, jobject, jfieldID);
+    void (*SetIntField)(JNIEnv *, jobject, jfieldID, jint);
+    const char *(*GetStringUTFChars)(JNIEnv *, jstring, jboolean *);
+    void (*ReleaseStringUTFChars)(JNIEnv *, jstring, const char *);
+    jsize (*GetArrayLength)(JNIEnv *, jarray);
+    jobject (*GetObjectArrayElement)(JNIEnv *, jobjectArray, jsize);
+    jbyteArray (*NewByteArray)(JNIEnv *, jsize);
+    jboolean *(*GetBooleanArrayElements)(JNIEnv *, jbooleanArray, jboolean *);
+    jshort *(*GetShortArrayElements)(JNIEnv *, jshortArray, jboolean *);
+    jint *(*GetIntArrayElements)(JNIEnv *, jintArray, jboolean *);
+    void (*ReleaseBooleanArrayElements)(JNIEnv *, jbooleanArray, jboolean *, jint);
+    void (*ReleaseShortArrayElements)(JNIEnv *, jshortArray, jshort *, jint);
+    void (*ReleaseIntArrayElements)(JNIEnv *, jintArray, jint *, jint);
+    void (*SetByteArrayRegion)(JNIEnv *, jbyteArray, jsize, jsize, const jbyte *);
+    void *(*GetDirectBufferAddress)(JNIEnv *, jobject);
+};
+
+#endif
@@ -0,0 +1,270 @@
+// Checks calcCDT and stackBlur from image.c against straightforward reference implementations, and the
+// incremental WebP decoder against a decode of the whole file.
+
+#include <unistd.h>
+
+// report four cores even on a single core host, so the threaded paths are always taken
+static long testSysconf(int name) {
+    return name == _SC_NPROCESSORS_ONLN ? 4 : sysconf(name);
+}
+#define sysconf testSysconf
+
+#include "../image.c"
+#include <stdio.h>
+#include <stdlib.h>
+#include "host.h"
+
+static int failures = 0;
+
+static void check(int ok, const char *name, int width, int height, int extra) {
+    printf("%-10s %5dx%-5d %4d %s\n", name, width, height, extra, ok ? "ok" : "FAILED");
+    if (!ok) {
+        failures++;
+    }
+}
+
+// Contrast limited histogram equalization of channel 2 over a 4x4 grid of tiles, one tile at a time.
+// The CDF starts at the first non-empty bin, so cdfMin is the value of that bin and not of bin 0.
+static void referenceCDT(const uint8_t *bytes, int width, int height, uint8_t *result) {
+    uint32_t tileArea = (uint32_t) (width / PGPhotoEnhanceSegments) * (uint32_t) (height / PGPhotoEnhanceSegments);
+    float limit = 1.25f * tileArea / (float) PGPhotoEnhanceHistogramBins;
+    uint32_t clipLimit = limit < 1 ? 1 : (uint32_t) limit;
+    float scale = 255.0f / (float) tileArea;
+    
+    for (int ty = 0; ty < PGPhotoEnhanceSegments; ty++) {
+        for (int tx = 0; tx < PGPhotoEnhanceSegments; tx++) {
+            uint32_t hist[PGPhotoEnhanceHistogramBins];
+            memset(hist, 0, sizeof(hist));
+            for (int y = 0; y < height; y++) {
+                for (int x = 0; x < width; x++) {
+                    if (y * PGPhotoEnhanceSegments / height == ty && x * PGPhotoEnhanceSegments / width == tx) {
+                        hist[bytes[(y * width + x) * 4 + 2]]++;
+                    }
+                }
+            }
+            
+            uint32_t clipped = 0;
+            for (int j = 0; j < PGPhotoEnhanceHistogramBins; j++) {
+                if (hist[j] > clipLimit) {
+                    clipped += hist[j] - clipLimit;
+                    hist[j] = clipLimit;
+                }
+            }
+            for (int j = 0; j < PGPhotoEnhanceHistogramBins; j++) {
+                hist[j] += clipped / PGPhotoEnhanceHistogramBins + (j < (int) (clipped % PGPhotoEnhanceHistogramBins) ? 1 : 0);
+            }
+            
+            int hMin = PGPhotoEnhanceHistogramBins - 1;
+            for (int j = 0; j < PGPhotoEnhanceHistogramBins; j++) {
+                if (hist[j] != 0) {
+                    hMin = j;
+                    break;
+                }
+            }
+            
+            uint8_t cdfs[PGPhotoEnhanceHistogramBins];
+            uint32_t cdf = 0;
+            for (int j = 0; j < PGPhotoEnhanceHistogramBins; j++) {
+                if (j >= hMin) {
+                    cdf += hist[j];
+                }
+                float value = cdf * scale;
+                cdfs[j] = (uint8_t) (value > 255 ? 255 : value);
+            }
+            
+            uint8_t *out = result + (ty * PGPhotoEnhanceSegments + tx) * 4 * PGPhotoEnhanceHistogramBins;
+            for (int j = 0; j < PGPhotoEnhanceHistogramBins; j++) {
+                out[j * 4] = cdfs[j];
+                out[j * 4 + 1] = cdfs[hMin];
+                out[j * 4 + 2] = cdfs[PGPhotoEnhanceHistogramBins - 1];
+                out[j * 4 + 3] = 255;
+            }
+        }
+    }
+}
+
+static int testCDT(const char *name, uint8_t *bytes, int width, int height) {
+    size_t resultSize = 4 * PGPhotoEnhanceHistogramBins * PGPhotoEnhanceSegments * PGPhotoEnhanceSegments;
+    uint8_t *expected = malloc(resultSize);
+    uint8_t *actual = malloc(resultSize);
+    referenceCDT(bytes, width, height, expected);
+    memset(actual, 0, resultSize);
+    Java_org_telegram_messenger_Utilities_calcCDT(hostEnv(), NULL, bytes, width, height, actual);
+    
+    int minBin = 0;
+    for (int t = 0; t < PGPhotoEnhanceSegments * PGPhotoEnhanceSegments; t++) {
+        minBin = max(minBin, expected[t * 4 * PGPhotoEnhanceHistogramBins + 1]);
+    }
+    int ok = memcmp(expected, actual, resultSize) == 0;
+    check(ok, name, width, height, minBin);
+    free(expected);
+    free(actual);
+    return ok ? minBin : -1;
+}
+
+static void testCDTs(void) {
+    int sizes[][2] = {{4, 4}, {7, 5}, {100, 77}, {601, 999}, {1280, 853}};
+    for (int s = 0; s < 5; s++) {
+        int width = sizes[s][0];
+        int height = sizes[s][1];
+        uint8_t *bytes = malloc((size_t) width * height * 4);
+        
+        srand(s);
+        for (int i = 0; i < width * height * 4; i++) {
+            bytes[i] = (uint8_t) rand();
+        }
+        testCDT("cdt", bytes, width, height);
+        memset(bytes, 255, (size_t) width * height * 4);
+        testCDT("cdt-flat", bytes, width, height);
+        free(bytes);
+    }
+    
+    // every 64x64 tile holds each value from 40 up 18 or 19 times, under the clip limit of 20,
+    // so the bins below 40 stay empty and cdfMin has to be taken from bin 40 instead of bin 0
+    int size = 256;
+    uint8_t *bytes = calloc((size_t) size * size, 4);
+    for (int y = 0; y < size; y++) {
+        for (int x = 0; x < size; x++) {
+            bytes[(y * size + x) * 4 + 2] = (uint8_t) (40 + ((y % 64) * 64 + x % 64) % 216);
+        }
+    }
+    if (testCDT("cdt-hmin", bytes, size, size) == 0) {
+        printf("cdt-hmin   cdfMin is taken from an empty bin\n");
+        failures++;
+    }
+    free(bytes);
+}
+
+// Every output pixel is the triangle weighted mean of the 2 * radius + 1 pixels around it, first along
+// rows and then along columns, with the edge pixels repeated and the same fixed-point rounding.
+static void referenceBlur(uint8_t *pixels, int width, int height, int stride, int radius) {
+    uint32_t weights = (uint32_t) ((radius + 1) * (radius + 1));
+    uint32_t mul = ((1 << 24) + weights - 1) / weights;
+    uint8_t *copy = malloc((size_t) stride * height);
+    
+    for (int pass = 0; pass < 2; pass++) {
+        memcpy(copy, pixels, (size_t) stride * height);
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                for (int c = 0; c < 4; c++) {
+                    uint32_t sum = 0;
+                    for (int i = -radius; i <= radius; i++) {
+                        int sx = pass == 0 ? min(max(x + i, 0), width - 1) : x;
+                        int sy = pass == 1 ? min(max(y + i, 0), height - 1) : y;
+                        sum += copy[sy * stride + sx * 4 + c] * (uint32_t) (radius + 1 - abs(i));
+                    }
+                    pixels[y * stride + x * 4 + c] = (uint8_t) ((sum * mul) >> 24);
+                }
+            }
+        }
+    }
+    free(copy);
+}
+
+static void testBlurs(void) {
+    int cases[][4] = {{1, 1, 0, 1}, {7, 5, 0, 3}, {100, 70, 8, 10}, {130, 3, 4, 50}, {600, 520, 16, 7}, {33, 300, 0, 254}};
+    for (int k = 0; k < 6; k++) {
+        int width = cases[k][0];
+        int height = cases[k][1];
+        int stride = width * 4 + cases[k][2];
+        int radius = cases[k][3];
+        uint8_t *actual = malloc((size_t) stride * height);
+        uint8_t *expected = malloc((size_t) stride * height);
+        
+        srand(k);
+        for (int i = 0; i < stride * height; i++) {
+            actual[i] = (uint8_t) rand();
+        }
+        memcpy(expected, actual, (size_t) stride * height);
+        stackBlur(actual, width, height, stride, radius, STACK_BLUR_MAX_THREADS);
+        referenceBlur(expected, width, height, stride, radius);
+        
+        // the padding at the end of every row has to be left alone as well
+        check(memcmp(expected, actual, (size_t) stride * height) == 0, "stackblur", width, height, radius);
+        free(actual);
+        free(expected);
+    }
+}
+
+// A sticker-like picture: a shaded disc with some noise on a transparent background.
+static uint8_t *makeSticker(int width, int height) {
+    uint8_t *rgba = malloc((size_t) width * height * 4);
+    srand(width * height);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            uint8_t *p = rgba + ((size_t) y * width + x) * 4;
+            float dx = (x - width / 2.0f) / (width / 2.0f);
+            float dy = (y - height / 2.0f) / (height / 2.0f);
+            float d = dx * dx + dy * dy;
+            p[0] = (uint8_t) (x * 255 / width);
+            p[1] = (uint8_t) (y * 255 / height);
+            p[2] = (uint8_t) (128 + rand() % 64);
+            p[3] = d < 0.8f ? 255 : d < 1.0f ? (uint8_t) ((1.0f - d) * 1275) : 0;
+        }
+    }
+    return rgba;
+}
+
+// Feeds the file in a few growing prefixes, the way a download arrives, and checks that the rows are
+// only ever added and that the end result is exactly what a decode of the whole file gives.
+static void testIncrementalWebp(void) {
+    int cases[][4] = {{512, 512, 512, 512}, {512, 512, 256, 256}, {480, 320, 200, 200}, {97, 131, 97, 131}};
+    JNIEnv *env = hostEnv();
+    for (int k = 0; k < 4; k++) {
+        int width = cases[k][0];
+        int height = cases[k][1];
+        HostBitmap expected = {(uint32_t) cases[k][2], (uint32_t) cases[k][3], (uint32_t) cases[k][2] * 4, NULL};
+        HostBitmap actual = expected;
+        expected.pixels = calloc(expected.stride, expected.height);
+        actual.pixels = calloc(actual.stride, actual.height);
+        uint8_t *rgba = makeSticker(width, height);
+        uint8_t *webp = NULL;
+        size_t size = WebPEncodeRGBA(rgba, width, height, width * 4, 80, &webp);
+        
+        int ok = size != 0 && Java_org_telegram_messenger_Utilities_loadWebpImage(env, NULL, (jobject) &expected, (jobject) webp, (jint) size, NULL, 1);
+        jlong decoder = Java_org_telegram_messenger_Utilities_createWebpDecoder(env, NULL, (jobject) &actual);
+        ok = ok && decoder != 0;
+        int rows = 0;
+        for (size_t len = 0; ok && len < size;) {
+            len += size / 7 + 1;
+            if (len > size) {
+                len = size;
+            }
+            int ready = Java_org_telegram_messenger_Utilities_updateWebpDecoder(env, NULL, decoder, (jobject) &actual, (jobject) webp, (jint) len);
+            ok = ready >= rows && ready <= (int) actual.height && (len < size || ready == (int) actual.height);
+            rows = ready;
+        }
+        Java_org_telegram_messenger_Utilities_destroyWebpDecoder(env, NULL, decoder);
+        check(ok && memcmp(expected.pixels, actual.pixels, (size_t) actual.stride * actual.height) == 0, "webp inc", width, height, (int) actual.width);
+        
+        // a broken header is reported, a broken body must not take more rows than the bitmap has
+        uint8_t *broken = malloc(size);
+        memcpy(broken, webp, size);
+        broken[0] ^= 0xFF;
+        decoder = Java_org_telegram_messenger_Utilities_createWebpDecoder(env, NULL, (jobject) &actual);
+        ok = Java_org_telegram_messenger_Utilities_updateWebpDecoder(env, NULL, decoder, (jobject) &actual, (jobject) broken, (jint) size) == -1;
+        Java_org_telegram_messenger_Utilities_destroyWebpDecoder(env, NULL, decoder);
+        memcpy(broken, webp, size);
+        for (size_t i = 64; i < size; i += 13) {
+            broken[i] ^= 0x5A;
+        }
+        decoder = Java_org_telegram_messenger_Utilities_createWebpDecoder(env, NULL, (jobject) &actual);
+        rows = Java_org_telegram_messenger_Utilities_updateWebpDecoder(env, NULL, decoder, (jobject) &actual, (jobject) broken, (jint) size);
+        ok = ok && rows >= -1 && rows <= (int) actual.height;
+        Java_org_telegram_messenger_Utilities_destroyWebpDecoder(env, NULL, decoder);
+        check(ok, "webp bad", width, height, (int) actual.width);
+        
+        free(broken);
+        free(webp);
+        free(rgba);
+        free(expected.pixels);
+        free(actual.pixels);
+    }
+}
+
+int main(void) {
+    testCDTs();
+    testBlurs();
+    testIncrementalWebp();
+    return failures != 0;
+}
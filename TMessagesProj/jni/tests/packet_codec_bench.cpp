@@ -0,0 +1,46 @@
+// Parse throughput of the audio block header and stream data of a libtgvoip packet with PacketReader, which
+// checks the length once per fixed-size layout, and with BufferInputStream, which checks it on every field.
+
+#include "audio_block.h"
+#include <stdio.h>
+#include <time.h>
+
+#define ITERATIONS 10000000
+
+// keeps the parsed values alive so the loops aren't optimized away
+static volatile uint32_t sink;
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench(const char *name, bool simple, bool withCallID, int frameCount, const uint16_t *frameLengths) {
+    std::vector<unsigned char> packet = buildAudioBlock(simple, withCallID, 4, 1000, frameCount, frameLengths);
+    AudioBlock block;
+    uint32_t sum = 0;
+    double start = now();
+    for (int i = 0; i < ITERATIONS; i++) {
+        parseWithReader(packet.data(), packet.size(), frameCount, block);
+        sum += block.pts[0];
+    }
+    double reader = (now() - start) / ITERATIONS * 1e9;
+    start = now();
+    for (int i = 0; i < ITERATIONS; i++) {
+        parseWithStream(packet.data(), packet.size(), frameCount, block);
+        sum += block.pts[0];
+    }
+    double stream = (now() - start) / ITERATIONS * 1e9;
+    sink = sum;
+    printf("%-22s %4zu bytes %6.1f ns PacketReader %6.1f ns BufferInputStream %5.2fx\n", name, packet.size(), reader, stream, stream / reader);
+}
+
+int main(void) {
+    uint16_t voice[] = {60};
+    uint16_t redundant[] = {60, 60, 60};
+    bench("simpleAudioBlock", true, false, 1, voice);
+    bench("simpleAudioBlock x3", true, false, 3, redundant);
+    bench("decryptedAudioBlock", false, true, 1, voice);
+    return 0;
+}
@@ -0,0 +1,105 @@
+// Fuzz-style tests for PacketReader from libtgvoip's PacketCodec.h on the packets VoIPController parses
+// with it: audio block headers followed by one to three stream data frames. Every truncation of a valid
+// packet has to be rejected, and packets with random bytes overwritten have to parse exactly like the old
+// BufferInputStream code parses them, which throws where PacketReader returns false. Each packet sits
+// in a buffer of exactly its size and the test is built with AddressSanitizer, so a read past the end fails.
+
+#include "audio_block.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define CORRUPTED_PACKETS 200000
+
+struct Shape {
+    bool simple;
+    bool withCallID;
+    int frameCount;
+    uint16_t frameLengths[MAX_FRAMES];
+};
+
+static const Shape shapes[] = {
+    {true, false, 1, {60}},
+    {true, false, 1, {300}},
+    {true, false, 3, {20, 254, 256}},
+    {false, true, 1, {0}},
+    {false, true, 1, {120}},
+    {false, false, 2, {80, 400}},
+    {false, false, 3, {1, 2, 3}},
+};
+
+static bool parseBoth(const std::vector<unsigned char> &packet, size_t length, int frameCount, bool &agree) {
+    unsigned char *buffer = (unsigned char *) malloc(length > 0 ? length : 1);
+    memcpy(buffer, packet.data(), length);
+    AudioBlock fromReader, fromStream;
+    bool readerOk = parseWithReader(buffer, length, frameCount, fromReader);
+    bool streamOk = parseWithStream(buffer, length, frameCount, fromStream);
+    agree = readerOk == streamOk && (!readerOk || fromReader == fromStream);
+    for (int i = 0; readerOk && i < fromReader.frameCount; i++) {
+        agree = agree && fromReader.frameOffset[i] + fromReader.frameLength[i] <= length;
+    }
+    free(buffer);
+    return readerOk;
+}
+
+int main(void) {
+    int failures = 0;
+    int shapeCount = sizeof(shapes) / sizeof(shapes[0]);
+
+    bool ok = true;
+    for (int s = 0; s < shapeCount; s++) {
+        const Shape &shape = shapes[s];
+        std::vector<unsigned char> packet = buildAudioBlock(shape.simple, shape.withCallID, 4, 1000 + s, shape.frameCount, shape.frameLengths);
+        AudioBlock block;
+        bool agree;
+        ok = ok && parseBoth(packet, packet.size(), shape.frameCount, agree) && agree;
+        ok = ok && parseWithReader(packet.data(), packet.size(), shape.frameCount, block);
+        ok = ok && block.type == 4 && block.pseq == (uint32_t) (1000 + s) && block.ackId == (uint32_t) (999 + s) && block.frameCount == shape.frameCount;
+        for (int i = 0; ok && i < shape.frameCount; i++) {
+            ok = block.frameLength[i] == shape.frameLengths[i] && block.pts[i] == (uint32_t) ((1000 + s) * 60 + i)
+                 && (shape.frameLengths[i] == 0 || packet[block.frameOffset[i]] == (unsigned char) i);
+        }
+    }
+    printf("packet codec valid packets %s\n", ok ? "ok" : "FAILED");
+    failures += !ok;
+
+    ok = true;
+    int truncations = 0;
+    for (int s = 0; s < shapeCount; s++) {
+        const Shape &shape = shapes[s];
+        std::vector<unsigned char> packet = buildAudioBlock(shape.simple, shape.withCallID, 4, 1000 + s, shape.frameCount, shape.frameLengths);
+        for (size_t length = 0; length < packet.size(); length++) {
+            bool agree;
+            if (parseBoth(packet, length, shape.frameCount, agree) || !agree) {
+                printf("packet codec shape %d accepted truncation to %zu of %zu bytes\n", s, length, packet.size());
+                ok = false;
+            }
+            truncations++;
+        }
+    }
+    printf("packet codec %d truncated packets %s\n", truncations, ok ? "ok" : "FAILED");
+    failures += !ok;
+
+    ok = true;
+    int accepted = 0;
+    srand(1);
+    for (int n = 0; n < CORRUPTED_PACKETS; n++) {
+        const Shape &shape = shapes[rand() % shapeCount];
+        std::vector<unsigned char> packet = buildAudioBlock(shape.simple, shape.withCallID, (uint8_t) (rand() % 16), (uint32_t) rand(), shape.frameCount, shape.frameLengths);
+        // most of what matters is in the header, so aim most of the damage there
+        int mutations = 1 + rand() % 4;
+        for (int i = 0; i < mutations; i++) {
+            size_t range = rand() % 2 ? std::min(packet.size(), (size_t) 64) : packet.size();
+            packet[rand() % range] = (unsigned char) rand();
+        }
+        size_t length = rand() % 4 ? packet.size() : rand() % (packet.size() + 1);
+        bool agree;
+        accepted += parseBoth(packet, length, shape.frameCount, agree);
+        if (!agree) {
+            printf("packet codec corrupted packet %d parsed differently\n", n);
+            ok = false;
+        }
+    }
+    printf("packet codec %d corrupted packets, %d still parse, %s\n", CORRUPTED_PACKETS, accepted, ok ? "ok" : "FAILED");
+    failures += !ok;
+    return failures != 0;
+}
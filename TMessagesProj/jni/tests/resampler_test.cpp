@@ -0,0 +1,110 @@
+// Regression tests for tgvoip::audio::PolyphaseResampler: the SNR of resampled sines at the rates calls
+// use, that feeding a stream in blocks of any size gives the same output as one call, that output which
+// doesn't fit into a short buffer comes out on the next call, and that GetOutputLength is exact.
+
+#include "../libtgvoip/audio/Resampler.cpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <vector>
+
+using namespace tgvoip::audio;
+
+#define SECONDS 2
+#define SETTLE_SAMPLES 256
+#define MIN_SNR_DB 75.0
+
+static std::vector<int16_t> sine(unsigned int rate, double frequency, size_t length) {
+    std::vector<int16_t> pcm(length);
+    for (size_t i = 0; i < length; i++) {
+        pcm[i] = (int16_t) lrint(16000.0 * sin(2.0 * M_PI * frequency * i / rate));
+    }
+    return pcm;
+}
+
+static std::vector<int16_t> resample(PolyphaseResampler &resampler, std::vector<int16_t> &in, const std::vector<size_t> &blocks) {
+    std::vector<int16_t> out(resampler.GetOutputLength(in.size()) + 16);
+    size_t read = 0, written = 0;
+    for (size_t b = 0; read < in.size(); b++) {
+        size_t len = std::min(blocks[b % blocks.size()], in.size() - read);
+        written += resampler.Process(&in[read], len, &out[written], out.size() - written);
+        read += len;
+    }
+    out.resize(written);
+    return out;
+}
+
+// Fits a sine of the known frequency with any phase and amplitude and returns its power over the residual's
+static double snr(const std::vector<int16_t> &pcm, unsigned int rate, double frequency) {
+    double ss = 0, sc = 0, cc = 0, ys = 0, yc = 0;
+    for (size_t i = SETTLE_SAMPLES; i < pcm.size() - SETTLE_SAMPLES; i++) {
+        double s = sin(2.0 * M_PI * frequency * i / rate), c = cos(2.0 * M_PI * frequency * i / rate);
+        ss += s * s;
+        sc += s * c;
+        cc += c * c;
+        ys += pcm[i] * s;
+        yc += pcm[i] * c;
+    }
+    double det = ss * cc - sc * sc;
+    double a = (ys * cc - yc * sc) / det, b = (yc * ss - ys * sc) / det;
+    double signal = 0, noise = 0;
+    for (size_t i = SETTLE_SAMPLES; i < pcm.size() - SETTLE_SAMPLES; i++) {
+        double fit = a * sin(2.0 * M_PI * frequency * i / rate) + b * cos(2.0 * M_PI * frequency * i / rate);
+        signal += fit * fit;
+        noise += (pcm[i] - fit) * (pcm[i] - fit);
+    }
+    return 10.0 * log10(signal / noise);
+}
+
+int main(void) {
+    int failures = 0;
+    unsigned int rates[][2] = {{48000, 44100}, {44100, 48000}, {48000, 16000}, {16000, 48000}, {48000, 8000}, {8000, 48000}};
+    double frequencies[] = {440.0, 1000.0, 3000.0};
+    std::vector<size_t> oneBlock(1, SIZE_MAX);
+    srand(1);
+    std::vector<size_t> randomBlocks;
+    for (int i = 0; i < 100; i++) {
+        randomBlocks.push_back(1 + rand() % 1500);
+    }
+
+    for (int r = 0; r < 6; r++) {
+        unsigned int inRate = rates[r][0], outRate = rates[r][1];
+        for (int f = 0; f < 3; f++) {
+            std::vector<int16_t> in = sine(inRate, frequencies[f], inRate * SECONDS);
+            PolyphaseResampler resampler(inRate, outRate);
+            std::vector<int16_t> out = resample(resampler, in, oneBlock);
+            double db = snr(out, outRate, frequencies[f]);
+            bool ok = db >= MIN_SNR_DB;
+            printf("resampler %5u -> %5u %4.0f Hz SNR %5.1f dB %s\n", inRate, outRate, frequencies[f], db, ok ? "ok" : "FAILED");
+            failures += !ok;
+        }
+
+        std::vector<int16_t> in = sine(inRate, 1000.0, inRate * SECONDS);
+        PolyphaseResampler whole(inRate, outRate);
+        size_t expected = whole.GetOutputLength(in.size());
+        std::vector<int16_t> reference = resample(whole, in, oneBlock);
+        bool ok = reference.size() == expected;
+
+        // random block sizes have to give exactly the same samples as one call
+        PolyphaseResampler blocks(inRate, outRate);
+        ok = ok && resample(blocks, in, randomBlocks) == reference;
+
+        // hand out one sample less than the block needs every time, the rest has to come out on the next call
+        PolyphaseResampler shortOut(inRate, outRate);
+        std::vector<int16_t> carried(reference.size() + 16);
+        size_t written = 0;
+        size_t block = inRate / 50;
+        for (size_t read = 0; read < in.size(); read += block) {
+            size_t len = std::min(block, in.size() - read);
+            size_t need = shortOut.GetOutputLength(len);
+            size_t room = need > 0 ? need - 1 : 0;
+            written += shortOut.Process(&in[read], len, &carried[written], room);
+        }
+        written += shortOut.Process(NULL, 0, &carried[written], carried.size() - written);
+        carried.resize(written);
+        ok = ok && carried == reference;
+        printf("resampler %5u -> %5u blocks and short output buffers %s\n", inRate, outRate, ok ? "ok" : "FAILED");
+        failures += !ok;
+    }
+    return failures != 0;
+}
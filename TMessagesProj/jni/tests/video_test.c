@@ -0,0 +1,86 @@
+// Checks that the banded convertVideoFrame/convertVideoFrameStrided write exactly what a single
+// libyuv call over the whole frame writes, padding and untouched bytes included.
+
+#include <unistd.h>
+
+// report four cores even on a single core host, so frames are always split into bands
+static long testSysconf(int name) {
+    return name == _SC_NPROCESSORS_ONLN ? 4 : sysconf(name);
+}
+#define sysconf testSysconf
+
+#include "../video.c"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "host.h"
+
+static int failures = 0;
+
+static void referenceConvert(const uint8_t *src, int srcStride, uint8_t *dest, int semiPlanar, int swap, int width, int height, int yStride, int uvStride, int firstChromaOffset, int secondChromaOffset) {
+    uint8_t *first = dest + firstChromaOffset;
+    uint8_t *second = dest + secondChromaOffset;
+    if (semiPlanar) {
+        if (!swap) {
+            ARGBToNV21(src, srcStride, dest, yStride, first, uvStride, width, height);
+        } else {
+            ARGBToNV12(src, srcStride, dest, yStride, first, uvStride, width, height);
+        }
+    } else if (!swap) {
+        ARGBToI420(src, srcStride, dest, yStride, second, uvStride, first, uvStride, width, height);
+    } else {
+        ARGBToI420(src, srcStride, dest, yStride, first, uvStride, second, uvStride, width, height);
+    }
+}
+
+static void check(int ok, const char *name, int width, int height, int format, int swap) {
+    printf("%-8s %5dx%-5d format %2d swap %d %s\n", name, width, height, format, swap, ok ? "ok" : "FAILED");
+    if (!ok) {
+        failures++;
+    }
+}
+
+int main(void) {
+    int sizes[][2] = {{1920, 1080}, {1280, 720}, {854, 480}, {1919, 1081}, {641, 479}, {176, 144}};
+    int formats[] = {COLOR_FormatYUV420Planar, COLOR_FormatYUV420SemiPlanar};
+    for (int s = 0; s < 6; s++) {
+        int width = sizes[s][0];
+        int height = sizes[s][1];
+        int halfWidth = (width + 1) / 2;
+        int halfHeight = (height + 1) / 2;
+        uint8_t *src = malloc((size_t) width * height * 4);
+        srand(s);
+        for (int i = 0; i < width * height * 4; i++) {
+            src[i] = (uint8_t) rand();
+        }
+        
+        for (int f = 0; f < 2; f++) {
+            int semiPlanar = isSemiPlanarYUV(formats[f]);
+            for (int swap = 0; swap < 2; swap++) {
+                int padding = (s % 2) * width * 16;
+                size_t size = (size_t) width * height + halfWidth * halfHeight * 2 + padding * 2 + 64;
+                uint8_t *expected = calloc(1, size);
+                uint8_t *actual = calloc(1, size);
+                referenceConvert(src, width * 4, expected, semiPlanar, swap, width, height, width, semiPlanar ? halfWidth * 2 : halfWidth, width * height + padding, width * height + halfWidth * halfHeight + padding * 5 / 4);
+                Java_org_telegram_messenger_Utilities_convertVideoFrame(hostEnv(), NULL, src, actual, formats[f], width, height, padding, swap);
+                check(memcmp(expected, actual, size) == 0, "padding", width, height, formats[f], swap);
+                free(expected);
+                free(actual);
+                
+                int stride = (width + 63) & ~63;
+                int sliceHeight = (height + 15) & ~15;
+                int uvStride = semiPlanar ? (stride + 1) / 2 * 2 : (stride + 1) / 2;
+                size = (size_t) stride * sliceHeight + uvStride * ((sliceHeight + 1) / 2) * 2;
+                expected = calloc(1, size);
+                actual = calloc(1, size);
+                referenceConvert(src, width * 4, expected, semiPlanar, swap, width, height, stride, uvStride, stride * sliceHeight, stride * sliceHeight + uvStride * ((sliceHeight + 1) / 2));
+                Java_org_telegram_messenger_Utilities_convertVideoFrameStrided(hostEnv(), NULL, src, width * 4, actual, formats[f], width, height, stride, sliceHeight, swap);
+                check(memcmp(expected, actual, size) == 0, "strided", width, height, formats[f], swap);
+                free(expected);
+                free(actual);
+            }
+        }
+        free(src);
+    }
+    return failures != 0;
+}
@@ -0,0 +1,554 @@
+// Offline call benchmark: two VoIPControllers talk through an in-process reflector on 127.0.0.1 while
+// NetworkSocketSimulator adds delay, jitter, loss and reordering to both of their sockets. Each side
+// plays the same source PCM and records what it hears, then both recordings are compared with the source.
+//
+// Reported per direction:
+// - mouth-to-ear latency, found by lining the recording up with the source (all file devices share one timeline)
+// - jitter buffer delay, RTT and bitrate from the controller telemetry
+// - the mean log-spectral distance in dB to the source over steady speech frames, and the share of those
+//   frames that are more than IMPAIRED_LSD dB off, which is where losses and concealment show up
+// - a MOS estimate from the ITU-T G.107 E-model with the measured latency and impaired frames as its inputs
+// CPU is getrusage() over the established part of the call, split evenly between the two calls.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+#include <VoIPController.h>
+#include <VoIPServerConfig.h>
+#include <audio/AudioInputFile.h>
+
+using namespace tgvoip;
+
+#define SAMPLE_RATE 48000
+#define SOURCE_SECONDS 10
+#define ENVELOPE_HOP 48
+#define MAX_LATENCY_MS 1000
+#define FRAME_SIZE 1024
+#define FRAME_HOP 480
+#define BANDS 18
+#define ALIGN_WINDOW SAMPLE_RATE
+#define ALIGN_DRIFT_MS 100
+#define SETTLE_SECONDS 2.0
+#define SPEECH_ENERGY (500.0 * 500.0)
+#define IMPAIRED_LSD 10.0
+#define TLID_UDP_REFLECTOR_SELF_INFO 0xc01572c7
+
+static const char *usage =
+    "usage: voip_loopback [-d delay_ms] [-j jitter_ms] [-l loss_%%] [-r reorder_%%] [-t seconds] [-i source.pcm] [-o dir] [-p] [-f]\n"
+    "  the network conditions apply to each socket in each direction, so every packet goes through them twice\n"
+    "  -i takes raw 48 kHz 16-bit mono PCM, a synthetic speech-like signal is used otherwise\n"
+    "  -p enables echo cancellation, noise suppression and gain control\n"
+    "  -f processes and encodes captured audio on the capture thread (audio_fused_capture)\n";
+
+// A reflector that pairs up the two sockets using the same peer tag and answers UDP pings, which is all
+// the controller needs from a relay when p2p is off.
+
+typedef struct {
+    int fd;
+    uint16_t port;
+    volatile int running;
+    sockaddr_in peers[2];
+    int peerCount;
+} Reflector;
+
+static void *runReflector(void *arg) {
+    Reflector *r = (Reflector *) arg;
+    unsigned char buf[1500];
+    while (r->running) {
+        sockaddr_in from;
+        socklen_t fromLen = sizeof(from);
+        ssize_t len = recvfrom(r->fd, buf, sizeof(buf), 0, (sockaddr *) &from, &fromLen);
+        if (len < 32) {
+            continue;
+        }
+        int index = -1;
+        for (int a = 0; a < r->peerCount; a++) {
+            if (r->peers[a].sin_port == from.sin_port && r->peers[a].sin_addr.s_addr == from.sin_addr.s_addr) {
+                index = a;
+            }
+        }
+        if (index < 0 && r->peerCount < 2) {
+            index = r->peerCount++;
+            r->peers[index] = from;
+        }
+        static const unsigned char special[12] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+        if (memcmp(buf + 16, special, 12) == 0) {
+            int32_t kind;
+            memcpy(&kind, buf + 28, 4);
+            if (kind == -2 && len >= 40) {
+                unsigned char reply[16 + 12 + 4 + 4 + 8 + 16 + 4];
+                uint32_t tlid = TLID_UDP_REFLECTOR_SELF_INFO;
+                int32_t date = (int32_t) time(NULL);
+                int32_t port = ntohs(from.sin_port);
+                memset(reply, 0, sizeof(reply));
+                memcpy(reply, buf, 16 + 12);
+                memcpy(reply + 28, &tlid, 4);
+                memcpy(reply + 32, &date, 4);
+                memcpy(reply + 36, buf + 32, 8);
+                reply[16 + 12 + 4 + 4 + 8 + 10] = reply[16 + 12 + 4 + 4 + 8 + 11] = 0xFF;
+                memcpy(reply + 16 + 12 + 4 + 4 + 8 + 12, &from.sin_addr.s_addr, 4);
+                memcpy(reply + 16 + 12 + 4 + 4 + 8 + 16, &port, 4);
+                sendto(r->fd, reply, sizeof(reply), 0, (sockaddr *) &from, fromLen);
+            }
+            continue;
+        }
+        if (index >= 0 && r->peerCount == 2) {
+            sendto(r->fd, buf, (size_t) len, 0, (sockaddr *) &r->peers[1 - index], sizeof(sockaddr_in));
+        }
+    }
+    return NULL;
+}
+
+static int startReflector(Reflector *r, pthread_t *thread) {
+    memset(r, 0, sizeof(Reflector));
+    r->fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addrLen = sizeof(addr);
+    if (r->fd < 0 || bind(r->fd, (sockaddr *) &addr, sizeof(addr)) != 0 || getsockname(r->fd, (sockaddr *) &addr, &addrLen) != 0) {
+        return 0;
+    }
+    // wake up now and then to notice that the benchmark is over
+    timeval timeout = {0, 100000};
+    setsockopt(r->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    r->port = ntohs(addr.sin_port);
+    r->running = 1;
+    return pthread_create(thread, NULL, runReflector, r) == 0;
+}
+
+// Syllable-like bursts of a few harmonics with random pitch, length and pauses, so that the envelope has
+// a single clear match when the recording is lined up with it.
+static std::vector<int16_t> makeSource() {
+    std::vector<int16_t> pcm(SOURCE_SECONDS * SAMPLE_RATE, 0);
+    uint32_t seed = 12345;
+    size_t pos = SAMPLE_RATE / 4;
+    while (pos < pcm.size()) {
+        seed = seed * 1664525 + 1013904223;
+        size_t length = (size_t) (SAMPLE_RATE * (0.08 + (seed >> 8) % 220 / 1000.0));
+        seed = seed * 1664525 + 1013904223;
+        double pitch = 100 + (seed >> 8) % 150;
+        seed = seed * 1664525 + 1013904223;
+        double formant = 500 + (seed >> 8) % 2000;
+        double phase[12] = {0};
+        for (size_t i = 0; i < length && pos + i < pcm.size(); i++) {
+            double t = (double) i / length;
+            double envelope = sin(M_PI * t) * 6000;
+            double f0 = pitch * (1.1 - 0.2 * t);
+            double sample = 0;
+            for (int k = 0; k < 12; k++) {
+                double f = f0 * (k + 1);
+                phase[k] += 2 * M_PI * f / SAMPLE_RATE;
+                sample += sin(phase[k]) / (1 + fabs(f - formant) / 300) / (k + 1);
+            }
+            pcm[pos + i] = (int16_t) (envelope * sample);
+        }
+        seed = seed * 1664525 + 1013904223;
+        pos += length + (size_t) (SAMPLE_RATE * (0.05 + (seed >> 8) % 350 / 1000.0));
+    }
+    return pcm;
+}
+
+static std::vector<int16_t> readPcm(const char *path) {
+    std::vector<int16_t> pcm;
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        return pcm;
+    }
+    int16_t buf[4096];
+    size_t read;
+    while ((read = fread(buf, 2, 4096, f)) > 0) {
+        pcm.insert(pcm.end(), buf, buf + read);
+    }
+    fclose(f);
+    return pcm;
+}
+
+static void writePcm(const char *path, const std::vector<int16_t> &pcm) {
+    FILE *f = fopen(path, "wb");
+    if (f) {
+        fwrite(pcm.data(), 2, pcm.size(), f);
+        fclose(f);
+    }
+}
+
+static std::vector<double> envelope(const std::vector<int16_t> &pcm, size_t start, size_t count, bool loop) {
+    std::vector<double> env(count / ENVELOPE_HOP);
+    for (size_t h = 0; h < env.size(); h++) {
+        double energy = 0;
+        for (size_t i = 0; i < ENVELOPE_HOP; i++) {
+            size_t index = start + h * ENVELOPE_HOP + i;
+            double s = loop ? pcm[index % pcm.size()] : (index < pcm.size() ? pcm[index] : 0);
+            energy += s * s;
+        }
+        env[h] = sqrt(energy / ENVELOPE_HOP);
+    }
+    return env;
+}
+
+// The lag in samples between minLag and maxLag at which the recorded envelope correlates best with the
+// source, or -1 if nothing matches well enough.
+static long findLag(const std::vector<int16_t> &source, const std::vector<int16_t> &recording, size_t start, size_t count, long minLag, long maxLag) {
+    std::vector<double> src = envelope(source, start, count, true);
+    std::vector<double> rec = envelope(recording, start + minLag, count + maxLag - minLag, false);
+    double best = -2;
+    long bestLag = -1;
+    for (size_t lag = 0; lag + src.size() <= rec.size(); lag++) {
+        double sx = 0, sy = 0, sxx = 0, syy = 0, sxy = 0;
+        size_t n = src.size();
+        for (size_t i = 0; i < n; i++) {
+            double x = src[i], y = rec[i + lag];
+            sx += x;
+            sy += y;
+            sxx += x * x;
+            syy += y * y;
+            sxy += x * y;
+        }
+        double denominator = sqrt((n * sxx - sx * sx) * (n * syy - sy * sy));
+        double r = denominator > 0 ? (n * sxy - sx * sy) / denominator : 0;
+        if (r > best) {
+            best = r;
+            bestLag = minLag + (long) lag * ENVELOPE_HOP;
+        }
+    }
+    return best > 0.3 ? bestLag : -1;
+}
+
+static void fft(double *re, double *im, int n) {
+    for (int i = 1, j = 0; i < n; i++) {
+        int bit = n >> 1;
+        for (; j & bit; bit >>= 1) {
+            j ^= bit;
+        }
+        j ^= bit;
+        if (i < j) {
+            double t = re[i]; re[i] = re[j]; re[j] = t;
+            t = im[i]; im[i] = im[j]; im[j] = t;
+        }
+    }
+    for (int len = 2; len <= n; len <<= 1) {
+        double angle = -2 * M_PI / len;
+        for (int i = 0; i < n; i += len) {
+            for (int k = 0; k < len / 2; k++) {
+                double wr = cos(angle * k), wi = sin(angle * k);
+                double xr = re[i + k + len / 2] * wr - im[i + k + len / 2] * wi;
+                double xi = re[i + k + len / 2] * wi + im[i + k + len / 2] * wr;
+                re[i + k + len / 2] = re[i + k] - xr;
+                im[i + k + len / 2] = im[i + k] - xi;
+                re[i + k] += xr;
+                im[i + k] += xi;
+            }
+        }
+    }
+}
+
+static double frameEnergy(const std::vector<int16_t> &pcm, size_t start) {
+    double energy = 0;
+    for (size_t i = 0; i < FRAME_SIZE; i++) {
+        double s = pcm[(start + i) % pcm.size()];
+        energy += s * s;
+    }
+    return energy / FRAME_SIZE;
+}
+
+// Energies in bands spaced evenly on a log scale between 100 Hz and 7 kHz.
+static void bandEnergies(const std::vector<int16_t> &pcm, size_t start, bool loop, double *bands) {
+    double re[FRAME_SIZE], im[FRAME_SIZE];
+    for (int i = 0; i < FRAME_SIZE; i++) {
+        size_t index = start + i;
+        double s = loop ? pcm[index % pcm.size()] : (index < pcm.size() ? pcm[index] : 0);
+        re[i] = s * (0.5 - 0.5 * cos(2 * M_PI * i / FRAME_SIZE));
+        im[i] = 0;
+    }
+    fft(re, im, FRAME_SIZE);
+    for (int b = 0; b < BANDS; b++) {
+        int from = (int) (100 * pow(70.0, (double) b / BANDS) * FRAME_SIZE / SAMPLE_RATE);
+        int to = (int) (100 * pow(70.0, (double) (b + 1) / BANDS) * FRAME_SIZE / SAMPLE_RATE);
+        bands[b] = 1;
+        for (int k = from; k <= to; k++) {
+            bands[b] += re[k] * re[k] + im[k] * im[k];
+        }
+    }
+}
+
+typedef struct {
+    double latency;
+    double lsd;
+    double impaired;
+} Quality;
+
+// Log-spectral distance between the source and the recording over frames with speech. The jitter buffer
+// changes the delay as it adapts, so every second of the recording is lined up with the source on its own,
+// and the latency is the average of those.
+static int measureQuality(const std::vector<int16_t> &source, const std::vector<int16_t> &recording, size_t start, size_t count, Quality *q) {
+    long maxLag = MAX_LATENCY_MS * SAMPLE_RATE / 1000;
+    long drift = ALIGN_DRIFT_MS * SAMPLE_RATE / 1000;
+    long callLag = findLag(source, recording, start, count, 0, maxLag);
+    if (callLag < 0) {
+        return 0;
+    }
+    memset(q, 0, sizeof(Quality));
+    int frames = 0, windows = 0;
+    double srcBands[BANDS], recBands[BANDS];
+    for (size_t window = start; window + ALIGN_WINDOW <= start + count; window += ALIGN_WINDOW) {
+        long lag = findLag(source, recording, window, ALIGN_WINDOW, std::max(0L, callLag - drift), callLag + drift);
+        if (lag < 0) {
+            lag = callLag;
+        }
+        q->latency += lag;
+        windows++;
+        for (size_t pos = window; pos < window + ALIGN_WINDOW; pos += FRAME_HOP) {
+            // only steady speech: pauses say nothing, and around onsets and decaying tails the codec
+            // alone already smears the spectrum by a frame or so
+            double energy = frameEnergy(source, pos);
+            if (energy < SPEECH_ENERGY || frameEnergy(source, pos - FRAME_HOP * 2) < energy / 10 || frameEnergy(source, pos + FRAME_HOP * 2) < energy / 10) {
+                continue;
+            }
+            bandEnergies(source, pos, true, srcBands);
+            bandEnergies(recording, pos + lag, false, recBands);
+            // bands more than 40 dB below the loudest one are inaudible next to it, whatever the codec puts there
+            double floor = 0;
+            for (int b = 0; b < BANDS; b++) {
+                floor = std::max(floor, srcBands[b] * 1e-4);
+            }
+            double sum = 0;
+            for (int b = 0; b < BANDS; b++) {
+                double d = 10 * log10(std::max(srcBands[b], floor) / std::max(recBands[b], floor));
+                sum += d * d;
+            }
+            double lsd = sqrt(sum / BANDS);
+            q->lsd += lsd;
+            if (lsd > IMPAIRED_LSD) {
+                q->impaired++;
+            }
+            frames++;
+        }
+    }
+    q->latency = q->latency / windows * 1000 / SAMPLE_RATE;
+    if (frames > 0) {
+        q->lsd /= frames;
+        q->impaired = q->impaired * 100 / frames;
+    }
+    return 1;
+}
+
+// ITU-T G.107 E-model with default values for everything but the one-way delay and the packet loss,
+// codec impairment Ie=0 and a packet loss robustness of Bpl=20 for random loss.
+static double estimateMOS(double delayMs, double lossPercent) {
+    double id = 0.024 * delayMs + (delayMs > 177.3 ? 0.11 * (delayMs - 177.3) : 0);
+    double ie = 95 * lossPercent / (lossPercent + 20);
+    double r = 93.2 - id - ie;
+    if (r <= 0) {
+        return 1;
+    }
+    if (r >= 100) {
+        return 4.5;
+    }
+    return 1 + 0.035 * r + 7e-6 * r * (r - 60) * (100 - r);
+}
+
+typedef struct {
+    volatile int state;
+    double establishedTime;
+} CallState;
+
+static CallState callStates[2];
+static VoIPController *controllers[2];
+
+static void onStateChanged(VoIPController *controller, int state) {
+    for (int a = 0; a < 2; a++) {
+        if (controllers[a] == controller) {
+            if (state == STATE_ESTABLISHED && callStates[a].state != STATE_ESTABLISHED) {
+                callStates[a].establishedTime = VoIPController::GetCurrentTime();
+            }
+            callStates[a].state = state;
+        }
+    }
+}
+
+static double cpuTime() {
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+int main(int argc, char **argv) {
+    int delay = 30, jitter = 10;
+    double loss = 1, reorder = 0, duration = 20;
+    const char *sourcePath = NULL;
+    std::string dir = ".";
+    bool processing = false, fused = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "d:j:l:r:t:i:o:pf")) != -1) {
+        switch (opt) {
+            case 'd': delay = atoi(optarg); break;
+            case 'j': jitter = atoi(optarg); break;
+            case 'l': loss = atof(optarg); break;
+            case 'r': reorder = atof(optarg); break;
+            case 't': duration = atof(optarg); break;
+            case 'i': sourcePath = optarg; break;
+            case 'o': dir = optarg; break;
+            case 'p': processing = true; break;
+            case 'f': fused = true; break;
+            default:
+                fprintf(stderr, usage);
+                return 2;
+        }
+    }
+    if (duration < SETTLE_SECONDS + 2) {
+        fprintf(stderr, "the call has to last at least %.0f seconds\n", SETTLE_SECONDS + 2);
+        return 2;
+    }
+
+    std::vector<int16_t> source;
+    std::string sourceFile = dir + "/loopback_source.pcm";
+    if (sourcePath) {
+        source = readPcm(sourcePath);
+        sourceFile = sourcePath;
+    } else {
+        source = makeSource();
+        writePcm(sourceFile.c_str(), source);
+    }
+    if (source.size() < SAMPLE_RATE) {
+        fprintf(stderr, "need at least a second of source audio in %s\n", sourceFile.c_str());
+        return 1;
+    }
+
+    char value[32];
+    std::map<std::string, std::string> config;
+    snprintf(value, sizeof(value), "%d", delay);
+    config["sim_net_delay"] = value;
+    snprintf(value, sizeof(value), "%d", jitter);
+    config["sim_net_jitter"] = value;
+    snprintf(value, sizeof(value), "%f", loss / 100);
+    config["sim_net_loss"] = value;
+    snprintf(value, sizeof(value), "%f", reorder / 100);
+    config["sim_net_reorder"] = value;
+    config["audio_fused_capture"] = fused ? "true" : "false";
+    ServerConfig::GetSharedInstance()->Update(config);
+
+    Reflector reflector;
+    pthread_t reflectorThread;
+    if (!startReflector(&reflector, &reflectorThread)) {
+        fprintf(stderr, "can't start the reflector\n");
+        return 1;
+    }
+
+    char key[256];
+    unsigned char peerTag[16];
+    srand(1);
+    for (int i = 0; i < 256; i++) {
+        key[i] = (char) rand();
+    }
+    for (int i = 0; i < 16; i++) {
+        peerTag[i] = (unsigned char) rand();
+    }
+    IPv4Address relayV4("127.0.0.1");
+    IPv6Address relayV6;
+    std::vector<Endpoint> endpoints;
+    endpoints.push_back(Endpoint(1, reflector.port, relayV4, relayV6, Endpoint::TYPE_UDP_RELAY, peerTag));
+
+    voip_config_t cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.init_timeout = 30;
+    cfg.recv_timeout = 20;
+    cfg.enableAEC = cfg.enableNS = cfg.enableAGC = processing;
+
+    std::string recordings[2] = {dir + "/loopback_a.pcm", dir + "/loopback_b.pcm"};
+    VoIPController::Callbacks callbacks;
+    memset(&callbacks, 0, sizeof(callbacks));
+    callbacks.connectionStateChanged = onStateChanged;
+    for (int a = 0; a < 2; a++) {
+        controllers[a] = new VoIPController();
+        controllers[a]->SetCallbacks(callbacks);
+        controllers[a]->SetConfig(&cfg);
+        controllers[a]->SetCurrentAudioInput("file:" + sourceFile);
+        controllers[a]->SetCurrentAudioOutput("file:" + recordings[a]);
+        controllers[a]->SetEncryptionKey(key, a == 0);
+        controllers[a]->SetRemoteEndpoints(endpoints, false, 65);
+    }
+    double startTime = VoIPController::GetCurrentTime();
+    for (int a = 0; a < 2; a++) {
+        controllers[a]->Start();
+        controllers[a]->Connect();
+    }
+    while (callStates[0].state != STATE_ESTABLISHED || callStates[1].state != STATE_ESTABLISHED) {
+        if (callStates[0].state == STATE_FAILED || callStates[1].state == STATE_FAILED || VoIPController::GetCurrentTime() - startTime > cfg.init_timeout) {
+            fprintf(stderr, "the call didn't get established\n");
+            return 1;
+        }
+        usleep(10000);
+    }
+
+    double establishedTime = VoIPController::GetCurrentTime();
+    double cpuStart = cpuTime();
+    double jitterBufferDelay[2] = {0, 0}, rtt[2] = {0, 0}, bitrate[2] = {0, 0};
+    voip_telemetry_snapshot_t first[2], last[2];
+    int samples = 0;
+    while (VoIPController::GetCurrentTime() - establishedTime < duration) {
+        usleep(1000000);
+        for (int a = 0; a < 2; a++) {
+            controllers[a]->GetTelemetrySnapshot(&last[a]);
+            if (samples == 0) {
+                first[a] = last[a];
+            }
+            jitterBufferDelay[a] += last[a].jitterBufferDelay;
+            rtt[a] += last[a].rtt;
+            bitrate[a] += last[a].bitrate;
+        }
+        samples++;
+    }
+    double cpu = cpuTime() - cpuStart;
+    double callTime = VoIPController::GetCurrentTime() - establishedTime;
+    for (int a = 0; a < 2; a++) {
+        controllers[a]->Stop();
+    }
+    reflector.running = 0;
+    pthread_join(reflectorThread, NULL);
+    close(reflector.fd);
+
+    printf("network     %d ms delay, %d ms jitter, %.1f%% loss, %.1f%% reordering on each socket, each way\n", delay, jitter, loss, reorder);
+    printf("call        %.1f s, established after %.2f s%s%s\n", callTime, establishedTime - startTime,
+           processing ? ", with AEC/NS/AGC" : "", fused ? ", fused capture" : "");
+    printf("%-10s %8s %9s %8s %10s %8s %9s %6s\n", "direction", "latency", "jb delay", "rtt", "bitrate", "lsd", "impaired", "mos");
+    // the recordings start at the shared timeline origin, which is when the first device started
+    size_t start = (size_t) ((establishedTime - audio::AudioInputFile::GetTimelineOrigin() + SETTLE_SECONDS) * SAMPLE_RATE);
+    size_t count = (size_t) ((callTime - SETTLE_SECONDS - 1) * SAMPLE_RATE);
+    int result = 0;
+    for (int a = 0; a < 2; a++) {
+        // controller a records what the other one sends
+        std::vector<int16_t> recording = readPcm(recordings[a].c_str());
+        char name[16];
+        snprintf(name, sizeof(name), "%s", a == 0 ? "B -> A" : "A -> B");
+        Quality q;
+        if (!measureQuality(source, recording, start, count, &q)) {
+            printf("%-10s no match between %s and the source\n", name, recordings[a].c_str());
+            result = 1;
+            continue;
+        }
+        printf("%-10s %5.0f ms %6.0f ms %5.0f ms %5.1f kbps %5.2f dB %8.1f%% %6.2f\n", name, q.latency,
+               jitterBufferDelay[a] / samples * 1000, rtt[1 - a] / samples * 1000, bitrate[1 - a] / samples / 1000,
+               q.lsd, q.impaired, estimateMOS(q.latency, q.impaired));
+    }
+    printf("cpu         %.1f%% of a core per call (encoder %u ms, decoder %u ms per call over %.0f s)\n",
+           cpu / callTime * 100 / 2,
+           (last[0].encoderCPUTime - first[0].encoderCPUTime + last[1].encoderCPUTime - first[1].encoderCPUTime) / 2,
+           (last[0].decoderCPUTime - first[0].decoderCPUTime + last[1].decoderCPUTime - first[1].decoderCPUTime) / 2,
+           callTime);
+    for (int a = 0; a < 2; a++) {
+        delete controllers[a];
+    }
+    return result;
+}
@@ -0,0 +1,88 @@
+// Times loadWebpImage decoding a sticker and a photo into a bitmap of the full size and of half the
+// size, where libwebp scales while decoding. Also times the same files fed to the incremental
+// decoder in 32 KB steps, the chunk size stickers are downloaded in. The bitmap column is the memory
+// the decoded image takes, which is what the scaled decode saves; libwebp still decodes every
+// macroblock and rescales afterwards, so it is not faster.
+
+#include "../image.c"
+#include <stdio.h>
+#include <stdlib.h>
+#include "host.h"
+
+#define DOWNLOAD_CHUNK (32 * 1024)
+
+static uint8_t *makePicture(int width, int height, int alpha) {
+    uint8_t *rgba = malloc((size_t) width * height * 4);
+    srand(width + height);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            uint8_t *p = rgba + ((size_t) y * width + x) * 4;
+            float dx = (x - width / 2.0f) / (width / 2.0f);
+            float dy = (y - height / 2.0f) / (height / 2.0f);
+            p[0] = (uint8_t) (x * 255 / width);
+            p[1] = (uint8_t) (y * 255 / height);
+            p[2] = (uint8_t) ((x ^ y) + rand() % 32);
+            p[3] = !alpha || dx * dx + dy * dy < 1.0f ? 255 : 0;
+        }
+    }
+    return rgba;
+}
+
+static double decodeFull(JNIEnv *env, HostBitmap *bitmap, uint8_t *webp, size_t size) {
+    double start = hostTime();
+    Java_org_telegram_messenger_Utilities_loadWebpImage(env, NULL, (jobject) bitmap, (jobject) webp, (jint) size, NULL, 1);
+    return hostTime() - start;
+}
+
+static double decodeIncremental(JNIEnv *env, HostBitmap *bitmap, uint8_t *webp, size_t size) {
+    double start = hostTime();
+    jlong decoder = Java_org_telegram_messenger_Utilities_createWebpDecoder(env, NULL, (jobject) bitmap);
+    for (size_t len = DOWNLOAD_CHUNK; ; len += DOWNLOAD_CHUNK) {
+        Java_org_telegram_messenger_Utilities_updateWebpDecoder(env, NULL, decoder, (jobject) bitmap, (jobject) webp, (jint) (len < size ? len : size));
+        if (len >= size) {
+            break;
+        }
+    }
+    Java_org_telegram_messenger_Utilities_destroyWebpDecoder(env, NULL, decoder);
+    return hostTime() - start;
+}
+
+typedef double (*DecodeFunction)(JNIEnv *env, HostBitmap *bitmap, uint8_t *webp, size_t size);
+
+static void bench(const char *name, DecodeFunction decode, uint8_t *webp, size_t size, int width, int height, int scale) {
+    JNIEnv *env = hostEnv();
+    HostBitmap bitmap = {(uint32_t) (width / scale), (uint32_t) (height / scale), (uint32_t) (width / scale) * 4, NULL};
+    bitmap.pixels = malloc((size_t) bitmap.stride * bitmap.height);
+    int iterations = (int) (100000000LL / ((int64_t) width * height));
+    if (iterations < 5) {
+        iterations = 5;
+    }
+    decode(env, &bitmap, webp, size);
+    double elapsed = 0;
+    for (int i = 0; i < iterations; i++) {
+        elapsed += decode(env, &bitmap, webp, size);
+    }
+    elapsed /= iterations;
+    printf("%-12s %4dx%-4d %5zu KB to %4dx%-4d %8.3f ms %6u KB bitmap\n", name, width, height, size / 1024, bitmap.width, bitmap.height,
+           elapsed * 1000, bitmap.stride * bitmap.height / 1024);
+    free(bitmap.pixels);
+}
+
+int main(void) {
+    int sizes[][3] = {{512, 512, 1}, {1280, 960, 0}};
+    for (int s = 0; s < 2; s++) {
+        int width = sizes[s][0];
+        int height = sizes[s][1];
+        uint8_t *rgba = makePicture(width, height, sizes[s][2]);
+        uint8_t *webp = NULL;
+        size_t size = WebPEncodeRGBA(rgba, width, height, width * 4, 80, &webp);
+        const char *name = sizes[s][2] ? "sticker" : "photo";
+        bench(name, decodeFull, webp, size, width, height, 1);
+        bench(name, decodeFull, webp, size, width, height, 2);
+        bench("incremental", decodeIncremental, webp, size, width, height, 1);
+        bench("incremental", decodeIncremental, webp, size, width, height, 2);
+        free(webp);
+        free(rgba);
+    }
+    return 0;
+}
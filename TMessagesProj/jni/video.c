@@ -1,5 +1,7 @@
 #include <jni.h>
 #include <libyuv.h>
+#include <pthread.h>
+#include <unistd.h>
 #include <utils.h>
 
 enum COLOR_FORMATTYPE {
@@ -66,6 +68,163 @@ int isSemiPlanarYUV(int colorFormat) {
     }
 }
 
+// Where the planes of a YUV 4:2:0 frame live in the destination buffer. Offsets are from the
+// start of the buffer. For planar frames the first chroma plane is V unless swap is set,
+// for semi-planar frames swap selects NV12 instead of NV21.
+typedef struct {
+    int yStride;
+    int uvStride;
+    int firstChromaOffset;
+    int secondChromaOffset;
+    int semiPlanar;
+    int swap;
+} FrameLayout;
+
+typedef struct {
+    const uint8_t *src;
+    int srcStride;
+    uint8_t *dest;
+    FrameLayout layout;
+    int width;
+    int height;
+    int bandHeight;
+    int bandsCount;
+} ConvertJob;
+
+// Frames are converted in bands of even height, so every band starts on a chroma row. Bands are
+// handed out to a few persistent threads and the calling thread, one frame at a time.
+#define CONVERT_MAX_THREADS 3
+#define CONVERT_MIN_THREADED_PIXELS (640 * 480)
+
+static pthread_once_t convertPoolOnce = PTHREAD_ONCE_INIT;
+static pthread_mutex_t convertLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t convertPoolLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t convertPoolCond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t convertDoneCond = PTHREAD_COND_INITIALIZER;
+static int convertThreadsCount = 0;
+static ConvertJob *convertJob = 0;
+static int convertNextBand = 0;
+static int convertBandsDone = 0;
+
+static void convertBand(ConvertJob *job, int band) {
+    int y = band * job->bandHeight;
+    int height = min(job->bandHeight, job->height - y);
+    const FrameLayout *layout = &job->layout;
+    const uint8_t *src = job->src + y * job->srcStride;
+    uint8_t *destY = job->dest + y * layout->yStride;
+    uint8_t *firstChroma = job->dest + layout->firstChromaOffset + y / 2 * layout->uvStride;
+    
+    if (layout->semiPlanar) {
+        if (!layout->swap) {
+            ARGBToNV21(src, job->srcStride, destY, layout->yStride, firstChroma, layout->uvStride, job->width, height);
+        } else {
+            ARGBToNV12(src, job->srcStride, destY, layout->yStride, firstChroma, layout->uvStride, job->width, height);
+        }
+    } else {
+        uint8_t *secondChroma = job->dest + layout->secondChromaOffset + y / 2 * layout->uvStride;
+        if (!layout->swap) {
+            ARGBToI420(src, job->srcStride, destY, layout->yStride, secondChroma, layout->uvStride, firstChroma, layout->uvStride, job->width, height);
+        } else {
+            ARGBToI420(src, job->srcStride, destY, layout->yStride, firstChroma, layout->uvStride, secondChroma, layout->uvStride, job->width, height);
+        }
+    }
+}
+
+static int takeBand(ConvertJob *job) {
+    int band = -1;
+    pthread_mutex_lock(&convertPoolLock);
+    if (convertJob == job && convertNextBand < job->bandsCount) {
+        band = convertNextBand++;
+    }
+    pthread_mutex_unlock(&convertPoolLock);
+    return band;
+}
+
+static void finishBand(ConvertJob *job) {
+    pthread_mutex_lock(&convertPoolLock);
+    if (++convertBandsDone == job->bandsCount) {
+        pthread_cond_signal(&convertDoneCond);
+    }
+    pthread_mutex_unlock(&convertPoolLock);
+}
+
+static void *convertThread(void *arg) {
+    while (1) {
+        pthread_mutex_lock(&convertPoolLock);
+        while (convertJob == 0 || convertNextBand >= convertJob->bandsCount) {
+            pthread_cond_wait(&convertPoolCond, &convertPoolLock);
+        }
+        ConvertJob *job = convertJob;
+        int band = convertNextBand++;
+        pthread_mutex_unlock(&convertPoolLock);
+        
+        convertBand(job, band);
+        finishBand(job);
+    }
+    return 0;
+}
+
+static void startConvertPool() {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int count = (int) min(CONVERT_MAX_THREADS, cores - 1);
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for (int a = 0; a < count; a++) {
+        pthread_t thread;
+        if (pthread_create(&thread, &attr, convertThread, NULL) != 0) {
+            break;
+        }
+        convertThreadsCount++;
+    }
+    pthread_attr_destroy(&attr);
+}
+
+static void convertFrame(const uint8_t *src, int srcStride, uint8_t *dest, const FrameLayout *layout, int width, int height) {
+    ConvertJob job;
+    job.src = src;
+    job.srcStride = srcStride;
+    job.dest = dest;
+    job.layout = *layout;
+    job.width = width;
+    job.height = height;
+    
+    pthread_once(&convertPoolOnce, startConvertPool);
+    if (convertThreadsCount == 0 || width * height < CONVERT_MIN_THREADED_PIXELS) {
+        job.bandHeight = height;
+        job.bandsCount = 1;
+        convertBand(&job, 0);
+        return;
+    }
+    
+    // a couple of bands per thread evens out threads that get scheduled late
+    int bands = (convertThreadsCount + 1) * 2;
+    job.bandHeight = ((height + bands - 1) / bands + 1) & ~1;
+    job.bandsCount = (height + job.bandHeight - 1) / job.bandHeight;
+    
+    pthread_mutex_lock(&convertLock);
+    pthread_mutex_lock(&convertPoolLock);
+    convertJob = &job;
+    convertNextBand = 0;
+    convertBandsDone = 0;
+    pthread_cond_broadcast(&convertPoolCond);
+    pthread_mutex_unlock(&convertPoolLock);
+    
+    int band;
+    while ((band = takeBand(&job)) >= 0) {
+        convertBand(&job, band);
+        finishBand(&job);
+    }
+    
+    pthread_mutex_lock(&convertPoolLock);
+    while (convertBandsDone < job.bandsCount) {
+        pthread_cond_wait(&convertDoneCond, &convertPoolLock);
+    }
+    convertJob = 0;
+    pthread_mutex_unlock(&convertPoolLock);
+    pthread_mutex_unlock(&convertLock);
+}
+
 JNIEXPORT int Java_org_telegram_messenger_Utilities_convertVideoFrame(JNIEnv *env, jclass class, jobject src, jobject dest, int destFormat, int width, int height, int padding, int swap) {
     if (!src || !dest || !destFormat) {
         return 0;
@@ -77,33 +236,44 @@ JNIEXPORT int Java_org_telegram_messenger_Utilities_convertVideoFrame(JNIEnv *en
     int half_width = (width + 1) / 2;
     int half_height = (height + 1) / 2;
     
-    if (!isSemiPlanarYUV(destFormat)) {
-        if (!swap) {
-            ARGBToI420(srcBuff, width * 4,
-                       destBuff, width,
-                       destBuff + width * height + half_width * half_height + padding * 5 / 4, half_width,
-                       destBuff + width * height + padding, half_width,
-                       width, height);
-        } else {
-            ARGBToI420(srcBuff, width * 4,
-                       destBuff, width,
-                       destBuff + width * height + padding, half_width,
-                       destBuff + width * height + half_width * half_height + padding * 5 / 4, half_width,
-                       width, height);
-        }
-    } else {
-        if (!swap) {
-            ARGBToNV21(srcBuff, width * 4,
-                       destBuff, width,
-                       destBuff + width * height + padding, half_width * 2,
-                       width, height);
-        } else {
-            ARGBToNV12(srcBuff, width * 4,
-                       destBuff, width,
-                       destBuff + width * height + padding, half_width * 2,
-                       width, height);
-        }
+    FrameLayout layout;
+    layout.yStride = width;
+    layout.semiPlanar = isSemiPlanarYUV(destFormat);
+    layout.uvStride = layout.semiPlanar ? half_width * 2 : half_width;
+    layout.firstChromaOffset = width * height + padding;
+    layout.secondChromaOffset = width * height + half_width * half_height + padding * 5 / 4;
+    layout.swap = swap;
+    
+    convertFrame((const uint8_t *) srcBuff, width * 4, (uint8_t *) destBuff, &layout, width, height);
+    
+    return 1;
+}
+
+// Same as convertVideoFrame, but for encoders that report their input layout as a row stride and
+// a slice height (the number of rows the luma plane is padded to).
+JNIEXPORT int Java_org_telegram_messenger_Utilities_convertVideoFrameStrided(JNIEnv *env, jclass class, jobject src, jint srcStride, jobject dest, jint destFormat, jint width, jint height, jint stride, jint sliceHeight, jint swap) {
+    if (!src || !dest || !destFormat) {
+        return 0;
     }
     
+    uint8_t *srcBuff = (*env)->GetDirectBufferAddress(env, src);
+    uint8_t *destBuff = (*env)->GetDirectBufferAddress(env, dest);
+    if (!srcBuff || !destBuff) {
+        return 0;
+    }
+    
+    stride = max(stride, width);
+    sliceHeight = max(sliceHeight, height);
+    
+    FrameLayout layout;
+    layout.yStride = stride;
+    layout.semiPlanar = isSemiPlanarYUV(destFormat);
+    layout.uvStride = layout.semiPlanar ? (stride + 1) / 2 * 2 : (stride + 1) / 2;
+    layout.firstChromaOffset = stride * sliceHeight;
+    layout.secondChromaOffset = layout.firstChromaOffset + layout.uvStride * ((sliceHeight + 1) / 2);
+    layout.swap = swap;
+    
+    convertFrame(srcBuff, srcStride > 0 ? srcStride : width * 4, destBuff, &layout, width, height);
+    
     return 1;
 }
@@ -229,6 +229,14 @@ public class FileLoadOperation {
         return currentType;
     }
 
+    public File getPartialFile() {
+        return encryptFile ? null : cacheFileTemp;
+    }
+
+    public int getDownloadedBytes() {
+        return downloadedBytes;
+    }
+
     public String getFileName() {
         if (location != null) {
             return location.volume_id + "_" + location.local_id + "." + ext;
@@ -27,6 +27,7 @@ public class FileLoader {
         void fileDidLoaded(String location, File finalFile, int type);
         void fileDidFailedLoad(String location, int state);
         void fileLoadProgressChanged(String location, float progress);
+        void filePartLoaded(String location, File partialFile, int loadedBytes);
     }
 
     public static final int MEDIA_DIR_IMAGE = 0;
@@ -463,6 +464,10 @@ public class FileLoader {
                     public void didChangedLoadProgress(FileLoadOperation operation, float progress) {
                         if (delegate != null) {
                             delegate.fileLoadProgressChanged(finalFileName, progress);
+                            File partialFile = operation.getPartialFile();
+                            if (partialFile != null) {
+                                delegate.filePartLoaded(finalFileName, partialFile, operation.getDownloadedBytes());
+                            }
                         }
                     }
                 };
@@ -631,7 +631,18 @@ public class ImageLoader {
                         return;
                     }
                 }
-                AnimatedFileDrawable fileDrawable = new AnimatedFileDrawable(cacheImage.finalFilePath, cacheImage.filter != null && cacheImage.filter.equals("d"));
+                int maxSide = 0;
+                if (cacheImage.filter != null) {
+                    String args[] = cacheImage.filter.split("_");
+                    if (args.length >= 2) {
+                        try {
+                            maxSide = (int) (Math.max(Float.parseFloat(args[0]), Float.parseFloat(args[1])) * AndroidUtilities.density);
+                        } catch (NumberFormatException ignore) {
+
+                        }
+                    }
+                }
+                AnimatedFileDrawable fileDrawable = new AnimatedFileDrawable(cacheImage.finalFilePath, cacheImage.filter != null && cacheImage.filter.equals("d"), maxSide);
                 Thread.interrupted();
                 onPostExecute(fileDrawable);
             } else {
@@ -643,7 +654,7 @@ public class ImageLoader {
                 boolean canDeleteFile = true;
                 boolean useNativeWebpLoaded = false;
 
-                if (Build.VERSION.SDK_INT < 19) {
+                if (Build.VERSION.SDK_INT < 19 || cacheImage.selfThumb) {
                     RandomAccessFile randomAccessFile = null;
                     try {
                         randomAccessFile = new RandomAccessFile(cacheFileFinal, "r");
@@ -675,7 +686,18 @@ public class ImageLoader {
 
                 if (cacheImage.selfThumb) {
                     int blurType = 0;
+                    float w_filter = 0;
+                    float h_filter = 0;
                     if (cacheImage.filter != null) {
+                        String args[] = cacheImage.filter.split("_");
+                        if (args.length >= 2) {
+                            try {
+                                w_filter = Float.parseFloat(args[0]) * AndroidUtilities.density;
+                                h_filter = Float.parseFloat(args[1]) * AndroidUtilities.density;
+                            } catch (NumberFormatException ignore) {
+
+                            }
+                        }
                         if (cacheImage.filter.contains("b2")) {
                             blurType = 3;
                         } else if (cacheImage.filter.contains("b1")) {
@@ -700,18 +722,20 @@ public class ImageLoader {
                             opts.inPurgeable = true;
                         }
 
+                        boolean previewDecoded = false;
                         if (useNativeWebpLoaded) {
-                            RandomAccessFile file = new RandomAccessFile(cacheFileFinal, "r");
-                            ByteBuffer buffer = file.getChannel().map(FileChannel.MapMode.READ_ONLY, 0, cacheFileFinal.length());
-
-                            BitmapFactory.Options bmOptions = new BitmapFactory.Options();
-                            bmOptions.inJustDecodeBounds = true;
-                            Utilities.loadWebpImage(null, buffer, buffer.limit(), bmOptions, true);
-                            image = Bitmaps.createBitmap(bmOptions.outWidth, bmOptions.outHeight, Bitmap.Config.ARGB_8888);
-
-                            Utilities.loadWebpImage(image, buffer, buffer.limit(), null, !opts.inPurgeable);
-                            file.close();
-                        } else {
+                            int blurRadius = 0;
+                            if (blurType == 1) {
+                                blurRadius = 3;
+                            } else if (blurType == 2) {
+                                blurRadius = 1;
+                            } else if (blurType == 3) {
+                                blurRadius = 17;
+                            }
+                            image = loadWebpPreview(cacheFileFinal, w_filter, h_filter, blurRadius);
+                            previewDecoded = image != null;
+                        }
+                        if (!previewDecoded) {
                             if (opts.inPurgeable) {
                                 RandomAccessFile f = new RandomAccessFile(cacheFileFinal, "r");
                                 int len = (int) f.length();
@@ -741,7 +765,7 @@ public class ImageLoader {
                             if (cacheFileFinal.length() == 0 || cacheImage.filter == null) {
                                 cacheFileFinal.delete();
                             }
-                        } else {
+                        } else if (!previewDecoded) {
                             if (blurType == 1) {
                                 if (image.getConfig() == Bitmap.Config.ARGB_8888) {
                                     Utilities.blurBitmap(image, 3, opts.inPurgeable ? 0 : 1, image.getWidth(), image.getHeight(), image.getRowBytes());
@@ -888,16 +912,7 @@ public class ImageLoader {
                         }
                         if (image == null) {
                             if (useNativeWebpLoaded) {
-                                RandomAccessFile file = new RandomAccessFile(cacheFileFinal, "r");
-                                ByteBuffer buffer = file.getChannel().map(FileChannel.MapMode.READ_ONLY, 0, cacheFileFinal.length());
-
-                                BitmapFactory.Options bmOptions = new BitmapFactory.Options();
-                                bmOptions.inJustDecodeBounds = true;
-                                Utilities.loadWebpImage(null, buffer, buffer.limit(), bmOptions, true);
-                                image = Bitmaps.createBitmap(bmOptions.outWidth, bmOptions.outHeight, Bitmap.Config.ARGB_8888);
-
-                                Utilities.loadWebpImage(image, buffer, buffer.limit(), null, !opts.inPurgeable);
-                                file.close();
+                                image = loadWebpFile(cacheFileFinal, w_filter, h_filter, !opts.inPurgeable);
                             } else {
                                 if (opts.inPurgeable) {
                                     RandomAccessFile f = new RandomAccessFile(cacheFileFinal, "r");
@@ -1019,6 +1034,7 @@ public class ImageLoader {
         protected String httpUrl;
         protected HttpImageTask httpTask;
         protected CacheOutTask cacheTask;
+        protected PartialWebpDecoder partialDecoder;
 
         protected ArrayList<ImageReceiver> imageReceiverArray = new ArrayList<>();
         protected ArrayList<String> keys = new ArrayList<>();
@@ -1096,6 +1112,7 @@ public class ImageLoader {
                     httpTask.cancel(true);
                     httpTask = null;
                 }
+                destroyPartialDecoder();
                 if (url != null) {
                     imageLoadingByUrl.remove(url);
                 }
@@ -1137,6 +1154,7 @@ public class ImageLoader {
                 imageLoadingByTag.remove(imageReceiver.getTag(selfThumb));
             }
             imageReceiverArray.clear();
+            destroyPartialDecoder();
             if (url != null) {
                 imageLoadingByUrl.remove(url);
             }
@@ -1144,6 +1162,91 @@ public class ImageLoader {
                 imageLoadingByKeys.remove(key);
             }
         }
+
+        public void destroyPartialDecoder() {
+            if (partialDecoder != null) {
+                final PartialWebpDecoder decoder = partialDecoder;
+                partialDecoder = null;
+                cacheOutQueue.postRunnable(new Runnable() {
+                    @Override
+                    public void run() {
+                        decoder.destroy();
+                    }
+                });
+            }
+        }
+    }
+
+    // Decodes a WebP sticker while it is still being downloaded, so that the rows which already arrived
+    // can be shown before the whole file is there. Only used on cacheOutQueue, at the size of the final image.
+    private class PartialWebpDecoder {
+        private float maxWidth;
+        private float maxHeight;
+        private long ptr;
+        private Bitmap bitmap;
+        private BitmapDrawable drawable;
+        private boolean finished;
+
+        public PartialWebpDecoder(String filter) {
+            if (filter != null) {
+                String args[] = filter.split("_");
+                if (args.length >= 2) {
+                    try {
+                        maxWidth = Float.parseFloat(args[0]) * AndroidUtilities.density;
+                        maxHeight = Float.parseFloat(args[1]) * AndroidUtilities.density;
+                    } catch (NumberFormatException ignore) {
+
+                    }
+                }
+            }
+        }
+
+        public BitmapDrawable update(File path, int loadedBytes) {
+            if (finished) {
+                return null;
+            }
+            RandomAccessFile file = null;
+            try {
+                file = new RandomAccessFile(path, "r");
+                int len = (int) Math.min(loadedBytes, file.length());
+                ByteBuffer buffer = file.getChannel().map(FileChannel.MapMode.READ_ONLY, 0, len);
+                if (bitmap == null) {
+                    bitmap = createWebpBitmap(buffer, len, maxWidth, maxHeight);
+                    ptr = Utilities.createWebpDecoder(bitmap);
+                    if (ptr == 0) {
+                        destroy();
+                        return null;
+                    }
+                    drawable = new BitmapDrawable(bitmap);
+                }
+                int rows = Utilities.updateWebpDecoder(ptr, bitmap, buffer, len);
+                if (rows < 0) {
+                    destroy();
+                    return null;
+                }
+                return rows > 0 ? drawable : null;
+            } catch (Throwable e) {
+                FileLog.e(e);
+                destroy();
+                return null;
+            } finally {
+                if (file != null) {
+                    try {
+                        file.close();
+                    } catch (Exception e) {
+                        FileLog.e(e);
+                    }
+                }
+            }
+        }
+
+        public void destroy() {
+            finished = true;
+            if (ptr != 0) {
+                Utilities.destroyWebpDecoder(ptr);
+                ptr = 0;
+            }
+        }
     }
 
     private static volatile ImageLoader Instance = null;
@@ -1269,6 +1372,13 @@ public class ImageLoader {
                 });
             }
 
+            @Override
+            public void filePartLoaded(final String location, final File partialFile, final int loadedBytes) {
+                if (location.endsWith(".webp")) {
+                    ImageLoader.this.filePartLoaded(location, partialFile, loadedBytes);
+                }
+            }
+
             @Override
             public void fileLoadProgressChanged(final String location, final float progress) {
                 fileProgresses.put(location, progress);
@@ -2040,6 +2150,7 @@ public class ImageLoader {
                     return;
                 }
                 imageLoadingByUrl.remove(location);
+                img.destroyPartialDecoder();
                 ArrayList<CacheOutTask> tasks = new ArrayList<>();
                 for (int a = 0; a < img.imageReceiverArray.size(); a++) {
                     String key = img.keys.get(a);
@@ -2075,6 +2186,47 @@ public class ImageLoader {
         });
     }
 
+    private void filePartLoaded(final String location, final File partialFile, final int loadedBytes) {
+        imageLoadQueue.postRunnable(new Runnable() {
+            @Override
+            public void run() {
+                CacheImage img = imageLoadingByUrl.get(location);
+                if (img == null || img.selfThumb || img.animatedFile || img.encryptionKeyPath != null || img.imageReceiverArray.isEmpty()) {
+                    return;
+                }
+                if (img.partialDecoder == null) {
+                    img.partialDecoder = new PartialWebpDecoder(img.filter);
+                }
+                final PartialWebpDecoder decoder = img.partialDecoder;
+                final ArrayList<ImageReceiver> imageReceivers = new ArrayList<>();
+                final ArrayList<String> keys = new ArrayList<>();
+                for (int a = 0; a < img.imageReceiverArray.size(); a++) {
+                    if (!img.thumbs.get(a)) {
+                        imageReceivers.add(img.imageReceiverArray.get(a));
+                        keys.add(img.keys.get(a));
+                    }
+                }
+                cacheOutQueue.postRunnable(new Runnable() {
+                    @Override
+                    public void run() {
+                        final BitmapDrawable drawable = decoder.update(partialFile, loadedBytes);
+                        if (drawable == null) {
+                            return;
+                        }
+                        AndroidUtilities.runOnUIThread(new Runnable() {
+                            @Override
+                            public void run() {
+                                for (int a = 0; a < imageReceivers.size(); a++) {
+                                    imageReceivers.get(a).setPartialImageByKey(drawable, keys.get(a));
+                                }
+                            }
+                        });
+                    }
+                });
+            }
+        });
+    }
+
     private void fileDidFailedLoad(final String location, int canceled) {
         if (canceled == 1) {
             return;
@@ -2173,6 +2325,71 @@ public class ImageLoader {
         });
     }
 
+    private static Bitmap createWebpBitmap(ByteBuffer buffer, int len, float maxWidth, float maxHeight) {
+        BitmapFactory.Options bmOptions = new BitmapFactory.Options();
+        bmOptions.inJustDecodeBounds = true;
+        Utilities.loadWebpImage(null, buffer, len, bmOptions, true);
+        int w = bmOptions.outWidth;
+        int h = bmOptions.outHeight;
+        if (maxWidth != 0 && maxHeight != 0) {
+            float scaleFactor = Math.max(w / maxWidth, h / maxHeight);
+            if (scaleFactor > 1) {
+                w = Math.max(1, (int) (w / scaleFactor));
+                h = Math.max(1, (int) (h / scaleFactor));
+            }
+        }
+        return Bitmaps.createBitmap(w, h, Bitmap.Config.ARGB_8888);
+    }
+
+    private static Bitmap loadWebpFile(File path, float maxWidth, float maxHeight, boolean unpin) throws Exception {
+        RandomAccessFile file = new RandomAccessFile(path, "r");
+        try {
+            ByteBuffer buffer = file.getChannel().map(FileChannel.MapMode.READ_ONLY, 0, path.length());
+            Bitmap image = createWebpBitmap(buffer, buffer.limit(), maxWidth, maxHeight);
+            Utilities.loadWebpImage(image, buffer, buffer.limit(), null, unpin);
+            return image;
+        } finally {
+            file.close();
+        }
+    }
+
+    private static Bitmap loadWebpPreview(File path, float maxWidth, float maxHeight, int blurRadius) {
+        RandomAccessFile file = null;
+        Bitmap image = null;
+        try {
+            file = new RandomAccessFile(path, "r");
+            ByteBuffer buffer = file.getChannel().map(FileChannel.MapMode.READ_ONLY, 0, path.length());
+
+            BitmapFactory.Options bmOptions = new BitmapFactory.Options();
+            bmOptions.inJustDecodeBounds = true;
+            Utilities.loadWebpImage(null, buffer, buffer.limit(), bmOptions, true);
+            image = createWebpBitmap(buffer, buffer.limit(), maxWidth, maxHeight);
+            // the blur radii are picked for the thumb as it is stored, keep the look when it is shrunk
+            if (blurRadius > 0 && image.getWidth() < bmOptions.outWidth) {
+                blurRadius = Math.max(1, blurRadius * image.getWidth() / bmOptions.outWidth);
+            }
+            if (!Utilities.decodePreview(buffer, buffer.limit(), image, blurRadius, 0)) {
+                image.recycle();
+                image = null;
+            }
+        } catch (Throwable e) {
+            FileLog.e(e);
+            if (image != null) {
+                image.recycle();
+                image = null;
+            }
+        } finally {
+            if (file != null) {
+                try {
+                    file.close();
+                } catch (Exception e) {
+                    FileLog.e(e);
+                }
+            }
+        }
+        return image;
+    }
+
     public static Bitmap loadBitmap(String path, Uri uri, float maxWidth, float maxHeight, boolean useMaxScale) {
         BitmapFactory.Options bmOptions = new BitmapFactory.Options();
         bmOptions.inJustDecodeBounds = true;
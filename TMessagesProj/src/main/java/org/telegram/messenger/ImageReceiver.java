@@ -70,6 +70,7 @@ public class ImageReceiver implements NotificationCenter.NotificationCenterDeleg
     private Drawable currentImage;
     private Drawable currentThumb;
     private Drawable staticThumb;
+    private BitmapDrawable partialImage;
     private boolean allowStartAnimation = true;
     private boolean allowDecodeSingleFrame;
 
@@ -180,6 +181,7 @@ public class ImageReceiver implements NotificationCenter.NotificationCenterDeleg
             currentThumbLocation = null;
             currentSize = 0;
             currentImage = null;
+            partialImage = null;
             bitmapShader = null;
             bitmapShaderThumb = null;
             crossfadeShader = null;
@@ -279,6 +281,7 @@ public class ImageReceiver implements NotificationCenter.NotificationCenterDeleg
 
         currentThumbKey = thumbKey;
         currentKey = key;
+        partialImage = null;
         currentExt = ext;
         currentImageLocation = fileLocation;
         currentHttpUrl = httpUrl;
@@ -406,6 +409,7 @@ public class ImageReceiver implements NotificationCenter.NotificationCenterDeleg
         for (int a = 0; a < 3; a++) {
             recycleBitmap(null, a);
         }
+        partialImage = null;
         if (needsQualityThumb) {
             NotificationCenter.getInstance().removeObserver(this, NotificationCenter.messageThumbGenerated);
         }
@@ -742,10 +746,16 @@ public class ImageReceiver implements NotificationCenter.NotificationCenterDeleg
                     drawDrawable(canvas, drawable, (int) (overrideAlpha * 255), customShader != null ? customShader : (isThumb ? bitmapShaderThumb : bitmapShader));
                 }
 
+                drawPartialImage(canvas);
                 checkAlphaAnimation(animationNotReady && crossfadeWithThumb);
                 return true;
             } else if (staticThumb != null) {
                 drawDrawable(canvas, staticThumb, 255, null);
+                drawPartialImage(canvas);
+                checkAlphaAnimation(animationNotReady);
+                return true;
+            } else if (partialImage != null) {
+                drawPartialImage(canvas);
                 checkAlphaAnimation(animationNotReady);
                 return true;
             } else {
@@ -757,6 +767,12 @@ public class ImageReceiver implements NotificationCenter.NotificationCenterDeleg
         return false;
     }
 
+    private void drawPartialImage(Canvas canvas) {
+        if (partialImage != null && currentImage == null) {
+            drawDrawable(canvas, partialImage, (int) (overrideAlpha * 255), null);
+        }
+    }
+
     public void setManualAlphaAnimator(boolean value) {
         manualAlphaAnimator = value;
     }
@@ -1079,6 +1095,22 @@ public class ImageReceiver implements NotificationCenter.NotificationCenterDeleg
         return param;
     }
 
+    // Rows of an image that is still being downloaded, drawn over the thumb until the image itself is set.
+    protected boolean setPartialImageByKey(BitmapDrawable bitmap, String key) {
+        if (bitmap == null || key == null || currentImage != null || currentKey == null || !key.equals(currentKey)) {
+            return false;
+        }
+        partialImage = bitmap;
+        if (parentView != null) {
+            if (invalidateAll) {
+                parentView.invalidate();
+            } else {
+                parentView.invalidate(imageX, imageY, imageX + imageW, imageY + imageH);
+            }
+        }
+        return true;
+    }
+
     protected boolean setImageBitmapByKey(BitmapDrawable bitmap, String key, boolean thumb, boolean memCache) {
         if (bitmap == null || key == null) {
             return false;
@@ -1091,6 +1123,7 @@ public class ImageReceiver implements NotificationCenter.NotificationCenterDeleg
                 ImageLoader.getInstance().incrementUseCount(currentKey);
             }
             currentImage = bitmap;
+            partialImage = null;
             if (roundRadius != 0 && bitmap instanceof BitmapDrawable) {
                 if (bitmap instanceof AnimatedFileDrawable) {
                     ((AnimatedFileDrawable) bitmap).setRoundRadius(roundRadius);
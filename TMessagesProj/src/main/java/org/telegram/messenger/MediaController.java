@@ -93,17 +93,18 @@ import java.util.concurrent.Semaphore;
 
 public class MediaController implements AudioManager.OnAudioFocusChangeListener, NotificationCenter.NotificationCenterDelegate, SensorEventListener {
 
-    private native int startRecord(String path);
-    private native int writeFrame(ByteBuffer frame, int len);
-    private native void stopRecord();
-    private native int openOpusFile(String path);
-    private native int seekOpusFile(float position);
     private native int isOpusFile(String path);
-    private native void closeOpusFile();
-    private native void readOpusFile(ByteBuffer buffer, int capacity, int[] args);
-    private native long getTotalPcmDuration();
     public native byte[] getWaveform(String path);
     public native byte[] getWaveform2(short[] array, int length);
+    private native long createOpusRecorder(String path);
+    private native int writeOpusRecorderFrame(long recorder, ByteBuffer frame, int len);
+    private native byte[] getOpusRecorderWaveform(long recorder);
+    private native void destroyOpusRecorder(long recorder);
+    private native long createOpusPlayer(String path, boolean decodeAhead);
+    private native void readOpusPlayer(long player, ByteBuffer buffer, int capacity, int[] args);
+    private native int seekOpusPlayer(long player, float position);
+    private native long getOpusPlayerPcmDuration(long player);
+    private native void destroyOpusPlayer(long player);
 
     public static int[] readArgs = new int[3];
 
@@ -393,6 +394,9 @@ public class MediaController implements AudioManager.OnAudioFocusChangeListener,
     private MessageObject playingMessageObject;
     private int playerBufferSize = 0;
     private boolean decodingFinished = false;
+    private long opusPlayer;
+    private long preloadedOpusPlayer;
+    private String preloadedOpusPath;
     private long currentTotalPcmDuration;
     private long lastPlayPcm;
     private int ignoreFirstProgress = 0;
@@ -419,6 +423,7 @@ public class MediaController implements AudioManager.OnAudioFocusChangeListener,
     private boolean currentAspectRatioFrameLayoutReady;
 
     private AudioRecord audioRecorder;
+    private long opusRecorder;
     private TLRPC.TL_document recordingAudio;
     private File recordingAudioFile;
     private long recordStartTime;
@@ -496,6 +501,7 @@ public class MediaController implements AudioManager.OnAudioFocusChangeListener,
                     final double amplitude = Math.sqrt(sum / len / 2);
                     final ByteBuffer finalBuffer = buffer;
                     final boolean flush = len != buffer.capacity();
+                    final long recorder = opusRecorder;
                     if (len != 0) {
                         fileEncodingQueue.postRunnable(new Runnable() {
                             @Override
@@ -508,7 +514,7 @@ public class MediaController implements AudioManager.OnAudioFocusChangeListener,
                                     }
                                     fileBuffer.put(finalBuffer);
                                     if (fileBuffer.position() == fileBuffer.limit() || flush) {
-                                        if (writeFrame(fileBuffer, !flush ? fileBuffer.limit() : finalBuffer.position()) != 0) {
+                                        if (writeOpusRecorderFrame(recorder, fileBuffer, !flush ? fileBuffer.limit() : finalBuffer.position()) != 0) {
                                             fileBuffer.rewind();
                                             recordTimeCount += fileBuffer.limit() / 2 / 16;
                                         }
@@ -1898,7 +1904,7 @@ public class MediaController implements AudioManager.OnAudioFocusChangeListener,
                         }
                     }
                     if (buffer != null) {
-                        readOpusFile(buffer.buffer, playerBufferSize, readArgs);
+                        readOpusPlayer(opusPlayer, buffer.buffer, playerBufferSize, readArgs);
                         buffer.size = readArgs[0];
                         buffer.pcmOffset = readArgs[1];
                         buffer.finished = readArgs[2];
@@ -2339,6 +2345,7 @@ public class MediaController implements AudioManager.OnAudioFocusChangeListener,
                     FileLog.e(e);
                 }
                 audioTrackPlayer = null;
+                releaseOpusPlayer();
             }
         } else if (videoPlayer != null) {
             currentAspectRatioFrameLayout = null;
@@ -2426,7 +2433,7 @@ public class MediaController implements AudioManager.OnAudioFocusChangeListener,
         fileDecodingQueue.postRunnable(new Runnable() {
             @Override
             public void run() {
-                seekOpusFile(progress);
+                seekOpusPlayer(opusPlayer, progress);
                 synchronized (playerSync) {
                     freePlayerBuffers.addAll(usedPlayerBuffers);
                     usedPlayerBuffers.clear();
@@ -2612,6 +2619,7 @@ public class MediaController implements AudioManager.OnAudioFocusChangeListener,
                             FileLog.e(e);
                         }
                         audioTrackPlayer = null;
+                        releaseOpusPlayer();
                     }
                 } else if (videoPlayer != null) {
                     currentAspectRatioFrameLayout = null;
@@ -2690,6 +2698,43 @@ public class MediaController implements AudioManager.OnAudioFocusChangeListener,
         if (cacheFile != null && cacheFile != file && !cacheFile.exists()) {
             FileLoader.getInstance().loadFile(nextAudio.getDocument(), false, 0);
         }
+        if (exist && nextAudio.isVoice()) {
+            preloadOpusPlayer(cacheFile.getAbsolutePath());
+        }
+    }
+
+    private void preloadOpusPlayer(final String path) {
+        fileDecodingQueue.postRunnable(new Runnable() {
+            @Override
+            public void run() {
+                if (path.equals(preloadedOpusPath)) {
+                    return;
+                }
+                if (preloadedOpusPlayer != 0) {
+                    destroyOpusPlayer(preloadedOpusPlayer);
+                    preloadedOpusPlayer = 0;
+                    preloadedOpusPath = null;
+                }
+                if (isOpusFile(path) == 1) {
+                    preloadedOpusPlayer = createOpusPlayer(path, true);
+                    if (preloadedOpusPlayer != 0) {
+                        preloadedOpusPath = path;
+                    }
+                }
+            }
+        });
+    }
+
+    private void releaseOpusPlayer() {
+        fileDecodingQueue.postRunnable(new Runnable() {
+            @Override
+            public void run() {
+                if (opusPlayer != 0) {
+                    destroyOpusPlayer(opusPlayer);
+                    opusPlayer = 0;
+                }
+            }
+        });
     }
 
     private void checkIsNextMusicFileDownloaded() {
@@ -3058,7 +3103,19 @@ public class MediaController implements AudioManager.OnAudioFocusChangeListener,
                     fileDecodingQueue.postRunnable(new Runnable() {
                         @Override
                         public void run() {
-                            result[0] = openOpusFile(cacheFile.getAbsolutePath()) != 0;
+                            String path = cacheFile.getAbsolutePath();
+                            if (opusPlayer != 0) {
+                                destroyOpusPlayer(opusPlayer);
+                            }
+                            if (path.equals(preloadedOpusPath)) {
+                                opusPlayer = preloadedOpusPlayer;
+                                preloadedOpusPlayer = 0;
+                                preloadedOpusPath = null;
+                            } else {
+                                opusPlayer = createOpusPlayer(path, true);
+                            }
+                            currentTotalPcmDuration = getOpusPlayerPcmDuration(opusPlayer);
+                            result[0] = opusPlayer != 0;
                             semaphore.release();
                         }
                     });
@@ -3067,8 +3124,6 @@ public class MediaController implements AudioManager.OnAudioFocusChangeListener,
                     if (!result[0]) {
                         return false;
                     }
-                    currentTotalPcmDuration = getTotalPcmDuration();
-
                     audioTrackPlayer = new AudioTrack(useFrontSpeaker ? AudioManager.STREAM_VOICE_CALL : AudioManager.STREAM_MUSIC, 48000, AudioFormat.CHANNEL_OUT_MONO, AudioFormat.ENCODING_PCM_16BIT, playerBufferSize, AudioTrack.MODE_STREAM);
                     audioTrackPlayer.setStereoVolume(1.0f, 1.0f);
                     audioTrackPlayer.setPlaybackPositionUpdateListener(new AudioTrack.OnPlaybackPositionUpdateListener() {
@@ -3088,6 +3143,7 @@ public class MediaController implements AudioManager.OnAudioFocusChangeListener,
                     if (audioTrackPlayer != null) {
                         audioTrackPlayer.release();
                         audioTrackPlayer = null;
+                        releaseOpusPlayer();
                         isPaused = false;
                         playingMessageObject = null;
                         downloadingCurrentMessage = false;
@@ -3183,7 +3239,7 @@ public class MediaController implements AudioManager.OnAudioFocusChangeListener,
                     try {
                         if (playingMessageObject != null && playingMessageObject.audioProgress != 0) {
                             lastPlayPcm = (long) (currentTotalPcmDuration * playingMessageObject.audioProgress);
-                            seekOpusFile(playingMessageObject.audioProgress);
+                            seekOpusPlayer(opusPlayer, playingMessageObject.audioProgress);
                         }
                     } catch (Exception e) {
                         FileLog.e(e);
@@ -3238,6 +3294,7 @@ public class MediaController implements AudioManager.OnAudioFocusChangeListener,
                 synchronized (playerObjectSync) {
                     audioTrackPlayer.release();
                     audioTrackPlayer = null;
+                    releaseOpusPlayer();
                 }
             } else if (videoPlayer != null) {
                 currentAspectRatioFrameLayout = null;
@@ -3440,7 +3497,8 @@ public class MediaController implements AudioManager.OnAudioFocusChangeListener,
                 recordingAudioFile = new File(FileLoader.getInstance().getDirectory(FileLoader.MEDIA_DIR_CACHE), FileLoader.getAttachFileName(recordingAudio));
 
                 try {
-                    if (startRecord(recordingAudioFile.getAbsolutePath()) == 0) {
+                    opusRecorder = createOpusRecorder(recordingAudioFile.getAbsolutePath());
+                    if (opusRecorder == 0) {
                         AndroidUtilities.runOnUIThread(new Runnable() {
                             @Override
                             public void run() {
@@ -3463,7 +3521,8 @@ public class MediaController implements AudioManager.OnAudioFocusChangeListener,
                 } catch (Exception e) {
                     FileLog.e(e);
                     recordingAudio = null;
-                    stopRecord();
+                    destroyOpusRecorder(opusRecorder);
+                    opusRecorder = 0;
                     recordingAudioFile.delete();
                     recordingAudioFile = null;
                     try {
@@ -3536,13 +3595,16 @@ public class MediaController implements AudioManager.OnAudioFocusChangeListener,
     }
 
     private void stopRecordingInternal(final int send) {
+        final long recorder = opusRecorder;
+        opusRecorder = 0;
         if (send != 0) {
             final TLRPC.TL_document audioToSend = recordingAudio;
             final File recordingAudioFileToSend = recordingAudioFile;
             fileEncodingQueue.postRunnable(new Runnable() {
                 @Override
                 public void run() {
-                    stopRecord();
+                    final byte[] waveform = getOpusRecorderWaveform(recorder);
+                    destroyOpusRecorder(recorder);
                     AndroidUtilities.runOnUIThread(new Runnable() {
                         @Override
                         public void run() {
@@ -3550,7 +3612,7 @@ public class MediaController implements AudioManager.OnAudioFocusChangeListener,
                             audioToSend.size = (int) recordingAudioFileToSend.length();
                             TLRPC.TL_documentAttributeAudio attributeAudio = new TLRPC.TL_documentAttributeAudio();
                             attributeAudio.voice = true;
-                            attributeAudio.waveform = getWaveform2(recordSamples, recordSamples.length);
+                            attributeAudio.waveform = waveform != null ? waveform : getWaveform2(recordSamples, recordSamples.length);
                             if (attributeAudio.waveform != null) {
                                 attributeAudio.flags |= 4;
                             }
@@ -3569,6 +3631,13 @@ public class MediaController implements AudioManager.OnAudioFocusChangeListener,
                     });
                 }
             });
+        } else if (recorder != 0) {
+            fileEncodingQueue.postRunnable(new Runnable() {
+                @Override
+                public void run() {
+                    destroyOpusRecorder(recorder);
+                }
+            });
         }
         try {
             if (audioRecorder != null) {
@@ -4664,6 +4733,10 @@ public class MediaController implements AudioManager.OnAudioFocusChangeListener,
                                 }
                             }
 
+                            // rows the luma plane is padded to; the qcom chroma alignment is not a whole
+                            // number of rows, so those encoders keep the padding based layout
+                            int sliceHeight = padding % resultWidth == 0 ? resultHeight + padding / resultWidth : 0;
+
                             extractor.selectTrack(videoIndex);
                             if (startTime > 0) {
                                 extractor.seekTo(startTime, MediaExtractor.SEEK_TO_PREVIOUS_SYNC);
@@ -4870,7 +4943,11 @@ public class MediaController implements AudioManager.OnAudioFocusChangeListener,
                                                             ByteBuffer rgbBuf = outputSurface.getFrame();
                                                             ByteBuffer yuvBuf = encoderInputBuffers[inputBufIndex];
                                                             yuvBuf.clear();
-                                                            Utilities.convertVideoFrame(rgbBuf, yuvBuf, colorFormat, resultWidth, resultHeight, padding, swapUV);
+                                                            if (sliceHeight != 0) {
+                                                                Utilities.convertVideoFrameStrided(rgbBuf, resultWidth * 4, yuvBuf, colorFormat, resultWidth, resultHeight, resultWidth, sliceHeight, swapUV);
+                                                            } else {
+                                                                Utilities.convertVideoFrame(rgbBuf, yuvBuf, colorFormat, resultWidth, resultHeight, padding, swapUV);
+                                                            }
                                                             encoder.queueInputBuffer(inputBufIndex, 0, bufferSize, info.presentationTimeUs, 0);
                                                         } else {
                                                             FileLog.e("input buffer not available");
@@ -48,9 +48,15 @@ public class Utilities {
     public native static int pinBitmap(Bitmap bitmap);
     public native static void unpinBitmap(Bitmap bitmap);
     public native static void blurBitmap(Object bitmap, int radius, int unpin, int width, int height, int stride);
+    public native static void stackBlurBitmap(Bitmap bitmap, int radius);
     public native static void calcCDT(ByteBuffer hsvBuffer, int width, int height, ByteBuffer buffer);
     public native static boolean loadWebpImage(Bitmap bitmap, ByteBuffer buffer, int len, BitmapFactory.Options options, boolean unpin);
+    public native static long createWebpDecoder(Bitmap bitmap);
+    public native static int updateWebpDecoder(long ptr, Bitmap bitmap, ByteBuffer buffer, int len);
+    public native static void destroyWebpDecoder(long ptr);
+    public native static boolean decodePreview(ByteBuffer buffer, int len, Bitmap bitmap, int blurRadius, int roundRadius);
     public native static int convertVideoFrame(ByteBuffer src, ByteBuffer dest, int destFormat, int width, int height, int padding, int swap);
+    public native static int convertVideoFrameStrided(ByteBuffer src, int srcStride, ByteBuffer dest, int destFormat, int width, int height, int stride, int sliceHeight, int swap);
     private native static void aesIgeEncryption(ByteBuffer buffer, byte[] key, byte[] iv, boolean encrypt, int offset, int length);
     public native static void aesCtrDecryption(ByteBuffer buffer, byte[] key, byte[] iv, int offset, int length);
     public native static void aesCtrDecryptionByteArray(byte[] buffer, byte[] key, byte[] iv, int offset, int length, int n);
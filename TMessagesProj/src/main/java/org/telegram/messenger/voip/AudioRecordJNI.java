@@ -168,13 +168,14 @@ public class AudioRecordJNI {
 		thread = new Thread(new Runnable() {
 			@Override
 			public void run() {
+				long resampler=needResampling ? Resampler.create(44100, 48000) : 0;
 				while (running) {
 					try {
 						if(!needResampling){
 							audioRecord.read(buffer, 960*2);
 						}else{
 							audioRecord.read(tmpBuf, 882*2);
-							Resampler.convert44to48(tmpBuf, buffer);
+							Resampler.process(resampler, tmpBuf, buffer);
 						}
 						if (!running) {
 							audioRecord.stop();
@@ -185,6 +186,8 @@ public class AudioRecordJNI {
 						FileLog.e(e);
 					}
 				}
+				if(resampler!=0)
+					Resampler.destroy(resampler);
 				Log.i("tg-voip", "audiotrack thread exits");
 			}
 		});
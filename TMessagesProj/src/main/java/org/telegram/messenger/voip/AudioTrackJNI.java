@@ -98,13 +98,14 @@ public class AudioTrackJNI{
 				}
 				ByteBuffer tmp48=needResampling ? ByteBuffer.allocateDirect(960*2) : null;
 				ByteBuffer tmp44=needResampling ? ByteBuffer.allocateDirect(882*2) : null;
+				long resampler=needResampling ? Resampler.create(48000, 44100) : 0;
 				while (running) {
 					try {
 						if(needResampling){
 							nativeCallback(buffer);
 							tmp48.rewind();
 							tmp48.put(buffer);
-							Resampler.convert48to44(tmp48, tmp44);
+							Resampler.process(resampler, tmp48, tmp44);
 							tmp44.rewind();
 							tmp44.get(buffer, 0, 882*2);
 							audioTrack.write(buffer, 0, 882*2);
@@ -120,6 +121,8 @@ public class AudioTrackJNI{
 						FileLog.e(e);
 					}
 				}
+				if(resampler!=0)
+					Resampler.destroy(resampler);
 				Log.i("tg-voip", "audiotrack thread exits");
 			}
 		});
@@ -9,4 +9,9 @@ import java.nio.ByteBuffer;
 public class Resampler{
 	public static native int convert44to48(ByteBuffer from, ByteBuffer to);
 	public static native int convert48to44(ByteBuffer from, ByteBuffer to);
+
+	// Stateful polyphase resampler, keeps filter history between calls. Not thread-safe, use one per stream.
+	public static native long create(int inputRate, int outputRate);
+	public static native int process(long inst, ByteBuffer from, ByteBuffer to);
+	public static native void destroy(long inst);
 }
@@ -24,6 +24,7 @@ import android.os.Looper;
 import android.view.View;
 
 import org.telegram.messenger.AndroidUtilities;
+import org.telegram.messenger.BuildVars;
 import org.telegram.messenger.FileLog;
 
 import java.io.File;
@@ -33,14 +34,14 @@ import java.util.concurrent.TimeUnit;
 
 public class AnimatedFileDrawable extends BitmapDrawable implements Animatable {
 
-    private static native int createDecoder(String src, int[] params);
+    private static native int createDecoder(String src, int[] params, int maxSide);
     private static native void destroyDecoder(int ptr);
     private static native int getVideoFrame(int ptr, Bitmap bitmap, int[] params);
 
     private long lastFrameTime;
     private int lastTimeStamp;
     private int invalidateAfter = 50;
-    private final int[] metaData = new int[4];
+    private final int[] metaData = new int[5];
     private Runnable loadFrameTask;
     private Bitmap renderingBitmap;
     private Bitmap nextRenderingBitmap;
@@ -50,6 +51,7 @@ public class AnimatedFileDrawable extends BitmapDrawable implements Animatable {
     private boolean decodeSingleFrame;
     private boolean singleFrameDecoded;
     private File path;
+    private int maxDecodeSide;
     private boolean recycleWithSecond;
 
     private long lastFrameDecodeTime;
@@ -93,8 +95,7 @@ public class AnimatedFileDrawable extends BitmapDrawable implements Animatable {
         @Override
         public void run() {
             if (destroyWhenDone && nativePtr != 0) {
-                destroyDecoder(nativePtr);
-                nativePtr = 0;
+                releaseDecoder();
             }
             if (nativePtr == 0) {
                 if (renderingBitmap != null) {
@@ -132,7 +133,7 @@ public class AnimatedFileDrawable extends BitmapDrawable implements Animatable {
         public void run() {
             if (!isRecycled) {
                 if (!decoderCreated && nativePtr == 0) {
-                    nativePtr = createDecoder(path.getAbsolutePath(), metaData);
+                    nativePtr = createDecoder(path.getAbsolutePath(), metaData, maxDecodeSide);
                     decoderCreated = true;
                 }
                 try {
@@ -171,9 +172,14 @@ public class AnimatedFileDrawable extends BitmapDrawable implements Animatable {
     };
 
     public AnimatedFileDrawable(File file, boolean createDecoder) {
+        this(file, createDecoder, 0);
+    }
+
+    public AnimatedFileDrawable(File file, boolean createDecoder, int maxSide) {
         path = file;
+        maxDecodeSide = maxSide;
         if (createDecoder) {
-            nativePtr = createDecoder(file.getAbsolutePath(), metaData);
+            nativePtr = createDecoder(file.getAbsolutePath(), metaData, maxDecodeSide);
             decoderCreated = true;
         }
     }
@@ -205,8 +211,7 @@ public class AnimatedFileDrawable extends BitmapDrawable implements Animatable {
         isRecycled = true;
         if (loadFrameTask == null) {
             if (nativePtr != 0) {
-                destroyDecoder(nativePtr);
-                nativePtr = 0;
+                releaseDecoder();
             }
             if (renderingBitmap != null) {
                 renderingBitmap.recycle();
@@ -221,6 +226,14 @@ public class AnimatedFileDrawable extends BitmapDrawable implements Animatable {
         }
     }
 
+    private void releaseDecoder() {
+        if (BuildVars.DEBUG_VERSION && metaData[4] != 0) {
+            FileLog.d("animation " + path + " had no frame ready " + metaData[4] + " times");
+        }
+        destroyDecoder(nativePtr);
+        nativePtr = 0;
+    }
+
     protected static void runOnUiThread(Runnable task) {
         if (Looper.myLooper() == uiHandler.getLooper()) {
             task.run();
@@ -418,7 +431,7 @@ public class AnimatedFileDrawable extends BitmapDrawable implements Animatable {
     }
 
     public AnimatedFileDrawable makeCopy() {
-        AnimatedFileDrawable drawable = new AnimatedFileDrawable(path, false);
+        AnimatedFileDrawable drawable = new AnimatedFileDrawable(path, false, maxDecodeSide);
         drawable.metaData[0] = metaData[0];
         drawable.metaData[1] = metaData[1];
         return drawable;